@@ -0,0 +1,631 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/statvfs.h>
+#include <ueye.h>
+
+#include "archive.h"
+#include "camera.h"
+#include "lens_adapter.h"
+#include "commands.h"
+#include "pipeline.h"
+#include "perf.h"
+
+// FITS files are made of blocks of this many bytes, 36 header cards each
+#define FITS_BLOCK      2880
+#define FITS_CARD       80
+// room for the header cards we write
+#define FITS_HEADER     (2*FITS_BLOCK)
+
+// how images are archived (set with --archive)
+int archive_format = ARCHIVE_FITS;
+// archive one in this many images, as well as every auto-focusing image (set
+// with --save-every)
+int archive_every = 1;
+// stop archiving once this much has been written (0 for no limit) [MB] (set
+// with --disk-budget)
+double archive_budget_mb = 0;
+// jobs free to take an image and jobs waiting for the archiver, in order,
+// protected by archive_lock
+struct archive_job archive_jobs[ARCHIVE_SLOTS];
+struct archive_job * free_jobs[ARCHIVE_SLOTS];
+int num_free_jobs = 0;
+struct archive_job * pending_jobs[ARCHIVE_SLOTS];
+int pending_head = 0, num_pending_jobs = 0;
+int archiver_closed = 0;
+// (bool) the budget is used up, so nothing more is archived
+int archive_full = 0;
+pthread_mutex_t archive_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t archive_ready = PTHREAD_COND_INITIALIZER;
+pthread_t archive_thread_id;
+int archiver_started = 0;
+// images offered that the decimation could leave out (solving stage only),
+// and images skipped because the archiver was behind (under archive_lock)
+int archive_decimation = 0;
+int archive_skipped = 0;
+// bytes written, and whether the disk is too full to write (archiver only)
+double archived_bytes = 0;
+int archive_low_disk = 0;
+
+/* Function to get the archiving format with the given name.
+** Input: The name (none, fits, or bmp).
+** Output: The format, or -1 if there is no format with that name.
+*/
+int parseArchiveFormat(char * name) {
+    if (strcmp(name, "none") == 0) {
+        return ARCHIVE_NONE;
+    } else if (strcmp(name, "fits") == 0) {
+        return ARCHIVE_FITS;
+    } else if (strcmp(name, "bmp") == 0) {
+        return ARCHIVE_BMP;
+    }
+
+    return -1;
+}
+
+/* Helper function to add a card to a FITS header. Strings (values starting
+** with a quote) go right after the '= ', anything else is right-justified in
+** the value field.
+** Input: The header, the number of cards in it so far, the keyword, the value
+** as it should appear, and the comment.
+** Output: None (void).
+*/
+void addCard(char * header, int * num_cards, const char * key,
+             const char * value, const char * comment) {
+    char card[FITS_CARD + 1];
+    int len;
+
+    if (*num_cards >= FITS_HEADER/FITS_CARD - 1) {
+        return;
+    }
+
+    len = snprintf(card, sizeof(card), (value[0] == '\'') ? "%-8.8s= %-20s"
+                                                          : "%-8.8s= %20s",
+                   key, value);
+    if (comment[0] != '\0' && len < FITS_CARD) {
+        len += snprintf(card + len, sizeof(card) - len, " / %s", comment);
+    }
+    if (len > FITS_CARD) {
+        len = FITS_CARD;
+    }
+
+    memcpy(header + (*num_cards)*FITS_CARD, card, len);
+    (*num_cards)++;
+}
+
+/* Helper functions to add a card with a number or logical value */
+void addRealCard(char * header, int * num_cards, const char * key,
+                 double value, const char * comment) {
+    char str[32];
+    snprintf(str, sizeof(str), "%.12G", value);
+    // a real value needs a point (or an exponent) to be read as one
+    if (strpbrk(str, ".EN") == NULL) {
+        strcat(str, ".0");
+    }
+    addCard(header, num_cards, key, str, comment);
+}
+
+void addIntCard(char * header, int * num_cards, const char * key, int value,
+                const char * comment) {
+    char str[32];
+    snprintf(str, sizeof(str), "%d", value);
+    addCard(header, num_cards, key, str, comment);
+}
+
+void addBoolCard(char * header, int * num_cards, const char * key, int value,
+                 const char * comment) {
+    addCard(header, num_cards, key, value ? "T" : "F", comment);
+}
+
+/* Function to make the FITS header of an archived image: the image itself,
+** the telemetry that went with it, and (if it solved) its TAN projection.
+** Image rows are written top first, so FITS row 1 is the top of the image.
+** Input: The job and where to write the header (FITS_HEADER bytes).
+** Output: The size of the header, a whole number of FITS blocks [bytes].
+*/
+size_t makeFitsHeader(struct archive_job * job, char * header) {
+    char str[32];
+    int n = 0;
+
+    memset(header, ' ', FITS_HEADER);
+    addBoolCard(header, &n, "SIMPLE", 1, "conforms to FITS");
+    addIntCard(header, &n, "BITPIX", 8, "unsigned 8-bit pixels");
+    addIntCard(header, &n, "NAXIS", 2, "");
+    addIntCard(header, &n, "NAXIS1", job->geometry.width, "[px]");
+    addIntCard(header, &n, "NAXIS2", job->geometry.height,
+               "[px] (row 1 is the top)");
+    // where the image is on the sensor, in the conventions of most camera
+    // control programs (the corner is in binned pixels from 0)
+    addIntCard(header, &n, "XBINNING", job->geometry.factor, "");
+    addIntCard(header, &n, "YBINNING", job->geometry.factor, "");
+    addBoolCard(header, &n, "SUBSAMP", job->geometry.subsample,
+                "subsampled rather than binned");
+    addIntCard(header, &n, "XORGSUBF", job->geometry.x, "AOI corner [px]");
+    addIntCard(header, &n, "YORGSUBF", job->geometry.y, "AOI corner [px]");
+    strftime(str, sizeof(str), "'%Y-%m-%dT%H:%M:%S'", &job->tm_info);
+    addCard(header, &n, "DATE-OBS", str, "start of the exposure (UTC)");
+    addRealCard(header, &n, "EXPTIME", job->exposure_time/1000.0, "[sec]");
+    addIntCard(header, &n, "FOCUS", job->focus_position, "lens focus position");
+    addIntCard(header, &n, "APERTURE", job->aperture, "lens aperture");
+    addBoolCard(header, &n, "AUTOFOC", job->auto_focus,
+                "taken while auto-focusing");
+    addIntCard(header, &n, "NBLOBS", job->blob_count, "blobs found");
+    addRealCard(header, &n, "SITELAT", job->astrom.latitude, "[deg]");
+    addRealCard(header, &n, "SITELONG", job->astrom.longitude, "[deg]");
+    addRealCard(header, &n, "SITEELEV", job->astrom.hm, "[m]");
+    addBoolCard(header, &n, "SOLVED", job->wcs.valid,
+                "Astrometry solved this image");
+
+    if (job->wcs.valid) {
+        addRealCard(header, &n, "RA_OBS", job->astrom.ra,
+                    "observed RA of the center [deg]");
+        addRealCard(header, &n, "DEC_OBS", job->astrom.dec,
+                    "observed DEC of the center [deg]");
+        addRealCard(header, &n, "ALT", job->astrom.alt, "[deg]");
+        addRealCard(header, &n, "AZ", job->astrom.az, "[deg]");
+        addRealCard(header, &n, "FIELDROT", job->astrom.fr, "[deg]");
+        addRealCard(header, &n, "IMAGEROT", job->astrom.ir, "[deg]");
+        addRealCard(header, &n, "PIXSCALE", job->astrom.ps, "[arcsec/px]");
+        addIntCard(header, &n, "WCSAXES", 2, "");
+        addCard(header, &n, "RADESYS", "'ICRS'", "");
+        addCard(header, &n, "CTYPE1", "'RA---TAN'", "");
+        addCard(header, &n, "CTYPE2", "'DEC--TAN'", "");
+        addCard(header, &n, "CUNIT1", "'deg'", "");
+        addCard(header, &n, "CUNIT2", "'deg'", "");
+        addRealCard(header, &n, "CRVAL1", job->wcs.crval[0], "");
+        addRealCard(header, &n, "CRVAL2", job->wcs.crval[1], "");
+        // FITS pixels count from 1, and its rows from the top, but the
+        // solution is in blob coordinates (y = height - row), so the second
+        // axis is flipped
+        addRealCard(header, &n, "CRPIX1", job->wcs.crpix[0] + 1, "");
+        addRealCard(header, &n, "CRPIX2",
+                    job->geometry.height + 1 - job->wcs.crpix[1], "");
+        addRealCard(header, &n, "CD1_1", job->wcs.cd[0][0], "");
+        addRealCard(header, &n, "CD1_2", -job->wcs.cd[0][1], "");
+        addRealCard(header, &n, "CD2_1", job->wcs.cd[1][0], "");
+        addRealCard(header, &n, "CD2_2", -job->wcs.cd[1][1], "");
+    }
+    memcpy(header + n*FITS_CARD, "END", 3);
+    n++;
+
+    return ((n*FITS_CARD + FITS_BLOCK - 1)/FITS_BLOCK)*FITS_BLOCK;
+}
+
+/* Function to make the header of a BMP (the rows are stored top first, and
+** both camera widths, and so every AOI width checkGeometry() allows, are a
+** multiple of 4, so they need no padding).
+** Input: Where to write the header and palette, and the image geometry.
+** Output: The size of the header and palette [bytes].
+*/
+size_t makeBmpHeader(char * header, const struct camera_geometry * geometry) {
+    struct bmp_header bmp = {0};
+    size_t size = sizeof(bmp) + 4*256;
+
+    bmp.type = 0x4d42;
+    bmp.file_size = size + geometry->width*geometry->height;
+    bmp.offset = size;
+    bmp.info_size = 40;
+    bmp.width = geometry->width;
+    bmp.height = -geometry->height;
+    bmp.planes = 1;
+    bmp.bits = 8;
+    bmp.image_size = geometry->width*geometry->height;
+    bmp.colors_used = 256;
+    memcpy(header, &bmp, sizeof(bmp));
+
+    for (int i = 0; i < 256; i++) {
+        unsigned char entry[4] = {i, i, i, 0};
+        memcpy(header + sizeof(bmp) + 4*i, entry, 4);
+    }
+
+    return size;
+}
+
+/* Helper function to write out every byte of a set of buffers.
+** Input: The file and the buffers (which get used up).
+** Output: A flag indicating everything was written or not.
+*/
+int writeFully(int fd, struct iovec * iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        while (count > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return 1;
+}
+
+/* Function to write one archived image with a single batched write, as long
+** as that stays within the budget and leaves enough room on the disk.
+** Input: The job.
+** Output: A flag indicating the image was written (1), left out (0), or there
+** was an error (-1).
+*/
+int writeArchiveFile(struct archive_job * job) {
+    static char padding[FITS_BLOCK] = {0};
+    char header[FITS_HEADER];
+    char path[300];
+    const char * extension;
+    struct iovec iov[3];
+    struct statvfs disk;
+    struct timespec lap;
+    size_t size, image_size = job->geometry.width*job->geometry.height;
+    int count = 0, fd;
+
+    if (archive_format == ARCHIVE_FITS) {
+        extension = "fits";
+        iov[count].iov_base = header;
+        iov[count++].iov_len = makeFitsHeader(job, header);
+        iov[count].iov_base = job->image;
+        iov[count++].iov_len = image_size;
+        // the data is padded out to a whole block with zeros
+        if (image_size % FITS_BLOCK != 0) {
+            iov[count].iov_base = padding;
+            iov[count++].iov_len = FITS_BLOCK - image_size % FITS_BLOCK;
+        }
+    } else {
+        extension = "bmp";
+        iov[count].iov_base = header;
+        iov[count++].iov_len = makeBmpHeader(header, &job->geometry);
+        iov[count].iov_base = job->image;
+        iov[count++].iov_len = image_size;
+    }
+
+    size = 0;
+    for (int i = 0; i < count; i++) {
+        size += iov[i].iov_len;
+    }
+
+    if (archive_budget_mb > 0 &&
+        archived_bytes + size > archive_budget_mb*1024*1024) {
+        printf("(*) Archived %.1f MB, and the next image would go over the "
+               "%.0f MB disk\nbudget, so no more images will be saved.\n",
+               archived_bytes/(1024*1024), archive_budget_mb);
+        pthread_mutex_lock(&archive_lock);
+        archive_full = 1;
+        pthread_mutex_unlock(&archive_lock);
+        return 0;
+    }
+
+    if (statvfs(ARCHIVE_DIR, &disk) == 0) {
+        double free_bytes = (double) disk.f_bavail*disk.f_frsize;
+        if (free_bytes - size < ARCHIVE_MIN_FREE_MB*1024.0*1024.0) {
+            if (!archive_low_disk) {
+                printf("(*) Less than %d MB free on the disk, so images are "
+                       "not being saved.\n", ARCHIVE_MIN_FREE_MB);
+                archive_low_disk = 1;
+            }
+            return 0;
+        }
+        archive_low_disk = 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &lap);
+    snprintf(path, sizeof(path), "%s.%s", job->name, extension);
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        fprintf(stderr, "Error opening %s to save the image: %s.\n", path,
+                strerror(errno));
+        return -1;
+    }
+
+    if (writeFully(fd, iov, count) != 1) {
+        fprintf(stderr, "Error saving image to %s: %s.\n", path,
+                strerror(errno));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    close(fd);
+    perfLap(PERF_SAVE, &lap);
+    archived_bytes += size;
+
+    printf("Saved image to \"%s\"\n", path);
+
+    return 1;
+}
+
+/* Helper function to read an 8-bit FITS image into a camera-sized buffer.
+** Input: The open file, its name, the buffer, and the geometry to fill in (from
+** the size of the image and the cards we write about the readout).
+** Output: A flag indicating the image was read successfully or not.
+*/
+int readFitsImage(FILE * fptr, char * path, char * image,
+                  struct camera_geometry * geometry) {
+    char card[FITS_CARD + 1] = {0};
+    int bitpix = 0, width = 0, height = 0, num_cards = 0, ended = 0;
+
+    geometry->factor = 1;
+    geometry->subsample = 0;
+    geometry->x = geometry->y = 0;
+    while (!ended && fread(card, 1, FITS_CARD, fptr) == FITS_CARD) {
+        num_cards++;
+        if (strncmp(card, "END     ", 8) == 0) {
+            ended = 1;
+        } else if (strncmp(card, "BITPIX  =", 9) == 0) {
+            bitpix = atoi(card + 10);
+        } else if (strncmp(card, "NAXIS1  =", 9) == 0) {
+            width = atoi(card + 10);
+        } else if (strncmp(card, "NAXIS2  =", 9) == 0) {
+            height = atoi(card + 10);
+        } else if (strncmp(card, "XBINNING=", 9) == 0) {
+            geometry->factor = atoi(card + 10);
+        } else if (strncmp(card, "SUBSAMP =", 9) == 0) {
+            geometry->subsample = (strchr(card + 10, 'T') != NULL);
+        } else if (strncmp(card, "XORGSUBF=", 9) == 0) {
+            geometry->x = atoi(card + 10);
+        } else if (strncmp(card, "YORGSUBF=", 9) == 0) {
+            geometry->y = atoi(card + 10);
+        }
+    }
+
+    if (!ended || bitpix != 8 || width < 1 || width > CAMERA_WIDTH ||
+        height < 1 || height > CAMERA_HEIGHT || geometry->factor < 1) {
+        fprintf(stderr, "%s is not an 8-bit FITS image of at most %dx%d.\n",
+                path, CAMERA_WIDTH, CAMERA_HEIGHT);
+        return -1;
+    }
+    geometry->width = geometry->stride = width;
+    geometry->height = height;
+
+    // the data starts at the next block
+    long data = ((num_cards*FITS_CARD + FITS_BLOCK - 1)/FITS_BLOCK)*FITS_BLOCK;
+    if (fseek(fptr, data, SEEK_SET) != 0 ||
+        fread(image, 1, width*height, fptr) != (size_t) (width*height)) {
+        fprintf(stderr, "%s is cut off.\n", path);
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Helper function to read an 8-bit BMP (ours, or one the camera saved, which
+** has its rows stored bottom first) into a camera-sized buffer.
+** Input: The open file, its name, the buffer, and the geometry to fill in (a
+** BMP does not say where on the sensor it is from, so it is taken to start at
+** the corner and not to be binned).
+** Output: A flag indicating the image was read successfully or not.
+*/
+int readBmpImage(FILE * fptr, char * path, char * image,
+                 struct camera_geometry * geometry) {
+    struct bmp_header bmp;
+    int stride, height;
+
+    if (fread(&bmp, sizeof(bmp), 1, fptr) != 1 || bmp.type != 0x4d42 ||
+        bmp.bits != 8 || bmp.compression != 0 ||
+        bmp.width < 1 || bmp.width > CAMERA_WIDTH ||
+        bmp.height == 0 || abs(bmp.height) > CAMERA_HEIGHT) {
+        fprintf(stderr, "%s is not an 8-bit BMP of at most %dx%d.\n", path,
+                CAMERA_WIDTH, CAMERA_HEIGHT);
+        return -1;
+    }
+
+    // rows are padded out to 4 bytes
+    stride = (bmp.width + 3) & ~3;
+    height = abs(bmp.height);
+    for (int j = 0; j < height; j++) {
+        int row = (bmp.height < 0) ? j : height - 1 - j;
+        if (fseek(fptr, bmp.offset + (long) j*stride, SEEK_SET) != 0 ||
+            fread(image + row*bmp.width, 1, bmp.width, fptr) !=
+            (size_t) bmp.width) {
+            fprintf(stderr, "%s is cut off.\n", path);
+            return -1;
+        }
+    }
+
+    geometry->factor = 1;
+    geometry->subsample = 0;
+    geometry->x = geometry->y = 0;
+    geometry->width = geometry->stride = bmp.width;
+    geometry->height = height;
+
+    return 1;
+}
+
+/* Function to load an archived image (FITS or BMP, going by the extension)
+** without the camera, as it came off the sensor: the top row first.
+** Input: The path, a buffer of CAMERA_WIDTH*CAMERA_HEIGHT bytes, and the
+** geometry to fill in with the image's readout geometry.
+** Output: A flag indicating the image was loaded successfully or not.
+*/
+int loadArchivedImage(char * path, char * image,
+                      struct camera_geometry * geometry) {
+    const char * extension = strrchr(path, '.');
+    FILE * fptr;
+    int ret;
+
+    if (extension == NULL || (strcmp(extension, ".fits") != 0 &&
+                              strcmp(extension, ".fit") != 0 &&
+                              strcmp(extension, ".bmp") != 0)) {
+        fprintf(stderr, "%s is not a FITS or BMP image.\n", path);
+        return -1;
+    }
+
+    if ((fptr = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Could not open %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (strcmp(extension, ".bmp") == 0) {
+        ret = readBmpImage(fptr, path, image, geometry);
+    } else {
+        ret = readFitsImage(fptr, path, image, geometry);
+    }
+    fclose(fptr);
+
+    return ret;
+}
+
+/* Function for the archiver thread: writes the queued images in order until
+** the archiver is stopped and the queue is empty.
+** Input: None.
+** Output: None (void pointer).
+*/
+void * archiveImages() {
+    for (;;) {
+        struct archive_job * job;
+
+        pthread_mutex_lock(&archive_lock);
+        while (num_pending_jobs == 0 && !archiver_closed) {
+            pthread_cond_wait(&archive_ready, &archive_lock);
+        }
+        if (num_pending_jobs == 0) {
+            pthread_mutex_unlock(&archive_lock);
+            break;
+        }
+        job = pending_jobs[pending_head];
+        pending_head = (pending_head + 1) % ARCHIVE_SLOTS;
+        num_pending_jobs--;
+        pthread_mutex_unlock(&archive_lock);
+
+        writeArchiveFile(job);
+
+        pthread_mutex_lock(&archive_lock);
+        free_jobs[num_free_jobs++] = job;
+        pthread_mutex_unlock(&archive_lock);
+    }
+
+    return NULL;
+}
+
+/* Function to allocate the archive slots and start the archiver thread.
+** Input: None.
+** Output: A flag indicating the archiver started successfully (or is not
+** needed) or not.
+*/
+int startArchiver() {
+    if (archive_format == ARCHIVE_NONE) {
+        return 1;
+    }
+
+    num_free_jobs = 0;
+    for (int i = 0; i < ARCHIVE_SLOTS; i++) {
+        memset(&archive_jobs[i], 0, sizeof(struct archive_job));
+        archive_jobs[i].image = malloc(CAMERA_WIDTH*CAMERA_HEIGHT);
+        if (archive_jobs[i].image == NULL) {
+            fprintf(stderr, "Error allocating archive image: %s.\n",
+                    strerror(errno));
+            return -1;
+        }
+        free_jobs[num_free_jobs++] = &archive_jobs[i];
+    }
+
+    if (pthread_create(&archive_thread_id, NULL, archiveImages, NULL) != 0) {
+        fprintf(stderr, "Error creating archiver thread: %s.\n",
+                strerror(errno));
+        return -1;
+    }
+    archiver_started = 1;
+
+    return 1;
+}
+
+/* Function to queue the output image of a frame for archiving, unless the
+** decimation leaves it out. Called from the solving stage, so it only copies
+** the image and what goes in its header; if every slot is waiting to be
+** written, the image is skipped.
+** Input: The frame, the path to save it under (without the extension), and
+** whether it must be archived regardless of the decimation (auto-focusing
+** images).
+** Output: A flag indicating the image was queued (1) or left out (0).
+*/
+int archiveFrame(struct frame * frame, char * name, int always) {
+    struct archive_job * job = NULL;
+
+    if (!archiver_started) {
+        return 0;
+    }
+
+    if (!always && archive_decimation++ % archive_every != 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&archive_lock);
+    if (!archive_full && num_free_jobs > 0) {
+        job = free_jobs[--num_free_jobs];
+    } else if (!archive_full) {
+        archive_skipped++;
+    }
+    pthread_mutex_unlock(&archive_lock);
+
+    if (job == NULL) {
+        if (verbose && !archive_full) {
+            printf("Archiver is behind, so not saving this image (%d skipped "
+                   "so far).\n", archive_skipped);
+        }
+        return 0;
+    }
+
+    job->geometry = frame->geometry;
+    memcpy(job->image, frame->output,
+           frame->geometry.width*frame->geometry.height);
+    snprintf(job->name, sizeof(job->name), "%s", name);
+    job->auto_focus = always;
+    job->blob_count = frame->blob_count;
+    job->tm_info = frame->tm_info;
+    job->astrom = all_astro_params;
+    job->wcs = last_wcs;
+    // auto-focusing images are not solved, so the last solution is not theirs
+    if (always) {
+        job->wcs.valid = 0;
+    }
+    job->exposure_time = frame->camera.exposure_time;
+    job->focus_position = frame->camera.focus_position;
+    job->aperture = frame->camera.current_aperture;
+
+    pthread_mutex_lock(&archive_lock);
+    pending_jobs[(pending_head + num_pending_jobs) % ARCHIVE_SLOTS] = job;
+    num_pending_jobs++;
+    pthread_cond_signal(&archive_ready);
+    pthread_mutex_unlock(&archive_lock);
+
+    return 1;
+}
+
+/* Function to write out the images still queued, stop the archiver thread,
+** and free the slots.
+** Input: None.
+** Output: None (void).
+*/
+void stopArchiver() {
+    if (!archiver_started) {
+        return;
+    }
+
+    pthread_mutex_lock(&archive_lock);
+    archiver_closed = 1;
+    pthread_cond_signal(&archive_ready);
+    pthread_mutex_unlock(&archive_lock);
+    pthread_join(archive_thread_id, NULL);
+    archiver_started = 0;
+
+    if (verbose) {
+        printf("\n> Archived %.1f MB of images (%d skipped while the archiver "
+               "was behind).\n", archived_bytes/(1024*1024), archive_skipped);
+    }
+
+    for (int i = 0; i < ARCHIVE_SLOTS; i++) {
+        free(archive_jobs[i].image);
+        archive_jobs[i].image = NULL;
+    }
+}
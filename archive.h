@@ -0,0 +1,69 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "astrometry.h"
+#include "pipeline.h"
+
+// how archived images are written (set with --archive)
+#define ARCHIVE_NONE         0   // not at all
+#define ARCHIVE_FITS         1   // FITS, with the solution and telemetry in the
+                                 // header
+#define ARCHIVE_BMP          2   // 8-bit grayscale BMP, as the camera used to
+// images that can wait to be written at once; past that, images are skipped
+// rather than holding up the solving stage
+#define ARCHIVE_SLOTS        4
+// never let archiving take the free space on the disk below this [MB]
+#define ARCHIVE_MIN_FREE_MB  1024
+#define ARCHIVE_DIR          "/home/blast/Desktop/blastcam/BMPs/"
+
+#pragma pack(push, 1)
+/* File and info headers of a BMP, followed by a 256-entry gray palette */
+struct bmp_header {
+    uint16_t type;              // 'BM'
+    uint32_t file_size;
+    uint32_t reserved;
+    uint32_t offset;            // of the pixels from the start of the file
+    uint32_t info_size;
+    int32_t width;
+    int32_t height;             // negative: the rows are stored top first
+    uint16_t planes;
+    uint16_t bits;
+    uint32_t compression;
+    uint32_t image_size;
+    int32_t x_ppm;
+    int32_t y_ppm;
+    uint32_t colors_used;
+    uint32_t colors_important;
+};
+#pragma pack(pop)
+
+/* One image waiting to be written, with everything that goes in its header */
+struct archive_job {
+    char * image;               // copy of the image
+    struct camera_geometry geometry; // of the image (which has no row padding)
+    char name[256];             // path without the extension
+    int auto_focus;             // (bool) taken while auto-focusing
+    int blob_count;
+    struct tm tm_info;          // when the exposure was started
+    struct astrometry astrom;   // telemetry once the image was solved
+    struct wcs_solution wcs;
+    double exposure_time;       // [msec]
+    int focus_position;
+    int aperture;
+};
+
+extern int archive_format;
+extern int archive_every;
+extern double archive_budget_mb;
+
+int parseArchiveFormat(char * name);
+int startArchiver();
+int archiveFrame(struct frame * frame, char * name, int always);
+void stopArchiver();
+int loadArchivedImage(char * path, char * image,
+                      struct camera_geometry * geometry);
+
+#endif
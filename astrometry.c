@@ -1,6 +1,11 @@
 #include <stdlib.h>
 #include <math.h>
 #include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <astrometry/os-features.h>
 #include <astrometry/engine.h>
 #include <astrometry/solver.h>
@@ -19,6 +24,11 @@
 #include "astrometry.h"
 #include "lens_adapter.h"
 #include "commands.h"
+#include "obslog.h"
+#include "perf.h"
+#include "pipeline.h"
+#include "observer.h"
+#include "propagate.h"
 
 #define _USE_MATH_DEFINES
 /* Longitude and latitude constants (deg) */
@@ -27,8 +37,41 @@
 #define backyard_hm    75.03
 
 engine_t * engine = NULL;
-solver_t * solver = NULL;
-int solver_timelimit;
+// number of solvers the selected index files are split between, each running
+// on its own thread
+int num_solvers = 1;
+solver_t * solvers[MAX_SOLVERS] = {NULL};
+struct solver_timer solver_timers[MAX_SOLVERS];
+pthread_t solver_thread_ids[MAX_SOLVERS];
+// the first solver to find a solution (-1 for none yet), protected by 
+// solve_lock
+pthread_mutex_t solve_lock = PTHREAD_MUTEX_INITIALIZER;
+int solve_winner = -1;
+// if 1, solve around the last solution instead of over the whole sky
+int tracking_mode = 0;
+// how far the field center may move between solutions in tracking mode (deg)
+double track_radius = 1.0;
+// failed tracking solves in a row before falling back to a full solve
+int track_max_failures = 3;
+// most blobs (the brightest) the solver is given, or 0 for all of them
+int max_solve_blobs = 0;
+// the solve stages of the current field: stage k adds the blobs from 
+// stage_end[k - 1] up to stage_end[k] (from the brightest)
+int stage_end[MAX_SOLVE_STAGES];
+int num_stages = 0;
+// last solution, which tracking solves search around
+struct tracking_seed track_seed = {0};
+// projection of the last solve, or of the last solution propagated from it
+// (read by the solving stage right after it)
+struct wcs_solution last_wcs = {0};
+// where the pointing in all_astro_params came from
+struct solution_status solution = {0};
+// our own read-only mappings of the index files, which keep their pages in
+// memory for the solver's mappings of the same files
+struct index_mapping * index_maps = NULL;
+int num_index_maps = 0;
+// which solver each index is attached to right now (-1 for none)
+int * index_solver = NULL;
 
 /* Astrometry parameters global structure, accessible from commands.c as well */
 struct astrometry all_astro_params = {
@@ -47,12 +90,14 @@ struct astrometry all_astro_params = {
 	.az = 0,
 };
 
-/* Function to decrement a counter for tracking Astrometry timeout.
-** Input: The pointer to the counter.
+/* Function to decrement a counter for tracking Astrometry timeout. A solver 
+** also times out as soon as another solver has found a solution.
+** Input: The pointer to the solver's timer.
 ** Output: If the counter has reached zero yet (or not).
 */
 time_t timeout(void * arg) {
-	int * counter = (int *) arg;
+	struct solver_timer * timer = (struct solver_timer *) arg;
+	int * counter = &(timer->counter);
 
 	if (*(counter) != 0) {
 		if (verbose) {
@@ -76,6 +121,13 @@ time_t timeout(void * arg) {
 		*counter = 0;
 	}
 
+	// no use searching once another solver has the answer
+	pthread_mutex_lock(&solve_lock);
+	if (solve_winner != -1 && solve_winner != timer->solver) {
+		*counter = 0;
+	}
+	pthread_mutex_unlock(&solve_lock);
+
 	return (*counter != 0);
 }
 
@@ -86,7 +138,6 @@ time_t timeout(void * arg) {
 */
 int initAstrometry() {
 	engine = engine_new();
-	solver = solver_new();
 
 	if (engine_parse_config_file(engine, 
 	                             "/usr/local/astrometry/etc/astrometry.cfg")) {
@@ -94,14 +145,146 @@ int initAstrometry() {
 		return -1;
 	}
 
-	// set solver timeout
-	solver_timelimit = (int) all_astro_params.timelimit;
-	solver->timer_callback = timeout;
-	solver->userdata = &solver_timelimit;
+	// set solver timeouts
+	for (int k = 0; k < num_solvers; k++) {
+		solvers[k] = solver_new();
+		solver_timers[k].counter = (int) all_astro_params.timelimit;
+		solver_timers[k].solver = k;
+		solvers[k]->timer_callback = timeout;
+		solvers[k]->userdata = &solver_timers[k];
+	}
+
+	return loadIndexes();
+}
+
+/* Function to load every index file named in the configuration file, map it
+** into memory, and read in all of its pages, so that no solve (not even the
+** first one) waits on index I/O. The indexes stay attached to the solvers 
+** until we close Astrometry.
+** Input: None.
+** Output: Flag indicating the indexes were loaded successfully or not.
+*/
+int loadIndexes() {
+	struct timespec load_start, load_end;
+	int num_indexes = (int) pl_size((*engine).indexes);
+	long page_size = sysconf(_SC_PAGESIZE);
+	double mapped = 0, resident = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &load_start);
+
+	index_maps = calloc(num_indexes, sizeof(struct index_mapping));
+	index_solver = calloc(num_indexes, sizeof(int));
+	if (num_indexes > 0 && (index_maps == NULL || index_solver == NULL)) {
+		fprintf(stderr, "Error allocating index mappings: %s.\n", 
+		        strerror(errno));
+		return -1;
+	}
+	num_index_maps = num_indexes;
+
+	for (int i = 0; i < num_indexes; i++) {
+		index_t * index = (index_t *) pl_get((*engine).indexes, i);
+		struct stat st;
+		int fd;
+
+		// the engine only reads the headers of the indexes, so load the rest
+		if (index_reload(index)) {
+			printf("Could not load index file %s.\n", index->indexname);
+			return -1;
+		}
+
+		index_solver[i] = -1;
+
+		if (index->indexfn == NULL || 
+		    (fd = open(index->indexfn, O_RDONLY)) == -1) {
+			// the solvers get the index, it just might not be in memory yet
+			continue;
+		}
+
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void * addr = mmap(NULL, st.st_size, PROT_READ, 
+			                   MAP_SHARED | MAP_POPULATE, fd, 0);
+			if (addr != MAP_FAILED) {
+				size_t num_pages = (st.st_size + page_size - 1)/page_size;
+				unsigned char * in_core = malloc(num_pages);
+
+				index_maps[i].addr = addr;
+				index_maps[i].length = st.st_size;
+				madvise(addr, st.st_size, MADV_WILLNEED);
+				mapped += st.st_size;
+
+				if (in_core != NULL && mincore(addr, st.st_size, in_core) == 0) {
+					for (size_t p = 0; p < num_pages; p++) {
+						resident += (in_core[p] & 1)*page_size;
+					}
+				}
+				free(in_core);
+			} else {
+				fprintf(stderr, "Could not map index file %s: %s.\n", 
+				        index->indexfn, strerror(errno));
+			}
+		}
+		close(fd);
+	}
+
+	// start off with every index attached
+	char selected[num_indexes + 1];
+	memset(selected, 1, num_indexes);
+	attachIndexes(selected);
+
+	clock_gettime(CLOCK_MONOTONIC, &load_end);
+	printf("(*) Loaded %d index files in %.1f msec (%.1f MB mapped, %.1f MB "
+	       "resident).\n", num_indexes,
+	       (load_end.tv_sec - load_start.tv_sec)*1e3 + 
+	       (load_end.tv_nsec - load_start.tv_nsec)*1e-6, 
+	       mapped/(1024.0*1024.0), resident/(1024.0*1024.0));
 
 	return 1;
 }
 
+/* Function to attach exactly the selected indexes to the solvers. The selected
+** indexes are dealt out to the solvers in turn, so that each one gets a share
+** of every scale. A solver's list is only rebuilt when its share changes 
+** (going in or out of tracking, or tracking onto other indexes); the indexes 
+** themselves stay loaded.
+** Input: Which indexes to attach (one flag per index in the engine).
+** Output: The number of indexes attached.
+*/
+int attachIndexes(char * selected) {
+	int num_indexes = (int) pl_size((*engine).indexes);
+	int owner[num_indexes + 1];
+	int changed[MAX_SOLVERS] = {0};
+	int num_attached = 0;
+
+	for (int i = 0; i < num_indexes; i++) {
+		owner[i] = selected[i] ? (num_attached++ % num_solvers) : -1;
+		if (owner[i] != index_solver[i]) {
+			if (owner[i] != -1) {
+				changed[owner[i]] = 1;
+			}
+			if (index_solver[i] != -1) {
+				changed[index_solver[i]] = 1;
+			}
+		}
+	}
+
+	for (int k = 0; k < num_solvers; k++) {
+		if (!changed[k]) {
+			continue;
+		}
+
+		solver_clear_indexes(solvers[k]);
+		for (int i = 0; i < num_indexes; i++) {
+			if (owner[i] == k) {
+				solver_add_index(solvers[k], 
+				                 (index_t *) pl_get((*engine).indexes, i));
+			}
+		}
+	}
+	memcpy(index_solver, owner, num_indexes*sizeof(int));
+
+	return num_attached;
+}
+
 /* Function to close astrometry.
 ** Input: None.
 ** Output: None (void).
@@ -110,63 +293,253 @@ void closeAstrometry() {
 	if (verbose) {
 		printf("> Closing Astrometry...\n");
 	}
+	for (int k = 0; k < num_solvers; k++) {
+		solver_clear_indexes(solvers[k]);
+	}
+	for (int i = 0; i < num_index_maps; i++) {
+		if (index_maps[i].addr != NULL) {
+			munmap(index_maps[i].addr, index_maps[i].length);
+		}
+	}
+	free(index_maps);
+	free(index_solver);
+	index_maps = NULL;
+	index_solver = NULL;
+	num_index_maps = 0;
+
 	engine_free(engine);
-	solver_free(solver);
+	for (int k = 0; k < num_solvers; k++) {
+		solver_free(solvers[k]);
+		solvers[k] = NULL;
+	}
+}
+
+/* Function to set up a solver for the next field.
+** Input: The solver, whether this is a tracking solve, and the readout geometry
+** of the image.
+** Output: None (void).
+*/
+void configureSolver(solver_t * solver, int tracking,
+                     const struct camera_geometry * geometry) {
+	// binned (or subsampled) pixels see factor times as much of the sky
+	if (tracking) {
+		solver->funits_lower = track_seed.ps*geometry->factor*
+		                       (1.0 - TRACK_PS_MARGIN);
+		solver->funits_upper = track_seed.ps*geometry->factor*
+		                       (1.0 + TRACK_PS_MARGIN);
+		solver_set_radec(solver, track_seed.ra, track_seed.dec, track_radius);
+	} else {
+		solver->funits_lower = MIN_PS*geometry->factor;
+		solver->funits_upper = MAX_PS*geometry->factor;
+		solver_clear_radec(solver);
+	}
+
+	// disallow tiny quads
+	solver->quadsize_min = 0.1*MIN(geometry->width - 2*CAMERA_MARGIN,
+	                               geometry->height - 2*CAMERA_MARGIN);
+
+	// set parity which can speed up x2 (the parity of the optics does not 
+	// change, so tracking solves only try the one we last solved with)
+	solver->parity = tracking ? track_seed.parity : PARITY_BOTH; 
+	
+	// sets the odds ratio we will accept (logodds parameter)
+	solver_set_keep_logodds(solver, log(all_astro_params.logodds));  
+
+	solver->logratio_totune = log(1e6);
+	solver->logratio_toprint = log(1e6);
+	solver->distance_from_quad_bonus = 1;
+	solver->quit_now = FALSE;
+
+	solver_set_field_bounds(solver, 0, geometry->width - 2*CAMERA_MARGIN, 0,
+	                        geometry->height - 2*CAMERA_MARGIN);
+}
+
+/* Function to run one solver on the current field, unless another solver has
+** already solved it. The solver goes through the solve stages in turn, each 
+** only trying the quads with at least one of the blobs the stage adds, so a 
+** field that solves from its brightest blobs does not wait on all the quads of
+** a crowded field. The timeout counts across all the stages. The first solver 
+** to find a solution becomes the winner.
+** Input: The index of the solver.
+** Output: None (void).
+*/
+void runSolver(int k) {
+	for (int stage = 0; stage < num_stages; stage++) {
+		pthread_mutex_lock(&solve_lock);
+		int solved = (solve_winner != -1);
+		pthread_mutex_unlock(&solve_lock);
+
+		if (solved || solver_timers[k].counter == 0) {
+			return;
+		}
+
+		solvers[k]->startobj = (stage == 0) ? 0 : stage_end[stage - 1];
+		solvers[k]->endobj = stage_end[stage];
+		solver_run(solvers[k]);
+
+		if ((*solvers[k]).best_match_solves) {
+			pthread_mutex_lock(&solve_lock);
+			if (solve_winner == -1) {
+				solve_winner = k;
+				// the other solvers would only notice at their next timeout()
+				// call, up to a second away, so tell them to stop now
+				for (int other = 0; other < num_solvers; other++) {
+					if (other != k) {
+						solvers[other]->quit_now = TRUE;
+					}
+				}
+				if (verbose) {
+					printf("(*) Solved with the brightest %d blobs.\n", 
+					       stage_end[stage]);
+				}
+			}
+			pthread_mutex_unlock(&solve_lock);
+			return;
+		}
+	}
+}
+
+/* Function for the threads of the second solver onwards.
+** Input: The pointer to the index of the solver.
+** Output: None (void).
+*/
+void * solverThread(void * arg) {
+	runSolver(*((int *) arg));
+	return NULL;
+}
+
+/* Helper function to find the pointing of an image from its projection: the
+** field center, pixel scale and field rotation, and from them (at the middle
+** of the exposure) the observed place and image rotation. Fills in the
+** telemetry, and keeps the projection for the archived image.
+** Input: The projection (in blob coordinates), the readout geometry of the
+** image, the time it was taken, and where to store the field center (ICRS).
+** Output: A flag indicating the pointing could be found or not.
+*/
+static int observeSolution(tan_t * wcs, const struct camera_geometry * geometry,
+                           struct tm * tm_info, double * ra, double * dec) {
+	struct timespec lap;
+	double fr, ps, ir, exposure;
+	// for apportioning Julian dates
+	double d1, d2;
+	// 'ob' means observed (observed frame versus ICRS frame)
+	struct observed_place place;
+	struct observer_site site;
+
+	tan_pixelxy2radec(wcs, (geometry->width - 2*CAMERA_MARGIN - 1)/2.0,
+	                  (geometry->height - 2*CAMERA_MARGIN - 1)/2.0, ra, dec);
+
+	// calculate pixel scale and field rotation
+	ps = tan_pixel_scale(wcs);
+	fr = tan_get_orientation(wcs);
+
+	// calculate Julian date
+	clock_gettime(CLOCK_MONOTONIC, &lap);
+	if (iauDtf2d("UTC", tm_info->tm_year + 1900, tm_info->tm_mon + 1,
+	                    tm_info->tm_mday, tm_info->tm_hour, tm_info->tm_min,
+						(double) tm_info->tm_sec, &d1, &d2) != 0) {
+		printf("Julian date not properly calculated.\n");
+		return -1;
+	}
+
+	// calculate AltAz (at the middle of the exposure) from the context the
+	// observer thread keeps, which only needs the Earth rotation angle
+	// brought up to date
+	site.latitude = all_astro_params.latitude;
+	site.longitude = all_astro_params.longitude;
+	site.hm = all_astro_params.hm;
+	pthread_mutex_lock(&camera_params_lock);
+	exposure = all_camera_params.exposure_time;
+	pthread_mutex_unlock(&camera_params_lock);
+	if (observeField(*ra, *dec, d1, d2 + exposure/(2000.0*3600.0*24.0),
+	                 &site, &place) != 1) {
+		printf("Review preceding Julian date calculation; dubious year or "
+		       "unacceptable date passed to AltAz calculation.\n");
+		return -1;
+	}
+
+	// calculate parallactic angle and add it to field rotation to get image
+	// rotation
+	ir = place.pa*(180.0/M_PI) - fr;
+	perfLap(PERF_ALTAZ, &lap);
+
+	// update astro struct with telemetry
+	all_astro_params.ir = ir;
+	all_astro_params.ra = place.rob*(180.0/M_PI);
+	all_astro_params.dec = place.dob*(180.0/M_PI);
+	all_astro_params.alt = 90.0 - (place.zob*(180.0/M_PI));
+	all_astro_params.az = place.aob*(180.0/M_PI);
+	all_astro_params.fr = fr;
+	all_astro_params.ps = ps;
+
+	// and the archived image gets its projection
+	last_wcs.valid = 1;
+	memcpy(last_wcs.crval, wcs->crval, sizeof(last_wcs.crval));
+	memcpy(last_wcs.crpix, wcs->crpix, sizeof(last_wcs.crpix));
+	memcpy(last_wcs.cd, wcs->cd, sizeof(last_wcs.cd));
+
+	return 1;
 }
 
 /* Function for solving for pointing location on the sky.
 ** Input: x coordinates of the stars (star_x), y coordinates of the stars 
-** (star_y), magnitudes of the stars (star_mags), the number of blobs, timing 
-** structure, and the observing file name.
+** (star_y), magnitudes of the stars (star_mags), sorted from the brightest 
+** (as findBlobs() leaves them), the number of blobs, the readout geometry of
+** the image, timing
+** structure, and the observing log record to fill in with the solution.
 ** Output: the status of finding a solution or not (sol_status).
 */
 int lostInSpace(double * star_x, double * star_y, double * star_mags, unsigned 
-				num_blobs, struct tm * tm_info, char * datafile) {
+				num_blobs, const struct camera_geometry * geometry,
+				struct tm * tm_info, struct obs_record * record) {
 	int sol_status;
 	// timers for astrometry
 	struct timespec astrom_tp_beginning, astrom_tp_end; 
 	double hprange, start, end, astrom_time;
-	double ra, dec, fr, ps, ir;
-	// for apportioning Julian dates
-	double d1, d2;
-	// 'ob' means observed (observed frame versus ICRS frame)
-	double aob, zob, hob, dob, rob, eo;
-	FILE * fptr;
+	double ra, dec;
 
-	// reset solver timeout
-	solver_timelimit = (int) all_astro_params.timelimit;
+	// reset solver timeouts
+	for (int k = 0; k < num_solvers; k++) {
+		solver_timers[k].counter = (int) all_astro_params.timelimit;
+	}
 	if (verbose) {
 		printf("(*) Astrometry timeout is %i cycles.\n", 
-	           *((int *) solver->userdata));
+	           solver_timers[0].counter);
 	}
 
-	// set up solver configuration
-	solver->funits_lower = MIN_PS;
-	solver->funits_upper = MAX_PS;
-	
-	// set max number of sources
-	solver->endobj = num_blobs;
-
-	// disallow tiny quads
-	solver->quadsize_min = 0.1*MIN(CAMERA_WIDTH - 2*CAMERA_MARGIN, 
-	                               CAMERA_HEIGHT - 2*CAMERA_MARGIN);
+	// solve around the last solution if we have one we can trust
+	int tracking = tracking_mode && track_seed.valid;
 
-	// set parity which can speed up x2
-	solver->parity = PARITY_BOTH; 
-	
-	// sets the odds ratio we will accept (logodds parameter)
-	solver_set_keep_logodds(solver, log(all_astro_params.logodds));  
+	// set up solver configuration
+	for (int k = 0; k < num_solvers; k++) {
+		configureSolver(solvers[k], tracking, geometry);
+	}
+	if (tracking && verbose) {
+		printf("(*) Tracking solve within %.2f deg of RA %f, DEC %f.\n", 
+		       track_radius, track_seed.ra, track_seed.dec);
+	}
 
-	solver->logratio_totune = log(1e6);
-	solver->logratio_toprint = log(1e6);
-	solver->distance_from_quad_bonus = 1;
+	// only the brightest blobs (up to the budget) go to the solver, in stages
+	unsigned num_field = num_blobs;
+	if (max_solve_blobs > 0 && num_field > (unsigned) max_solve_blobs) {
+		num_field = max_solve_blobs;
+	}
+	int stages[MAX_SOLVE_STAGES - 1] = {SOLVE_STAGE_1, SOLVE_STAGE_2};
+	num_stages = 0;
+	for (int i = 0; i < MAX_SOLVE_STAGES - 1; i++) {
+		if ((unsigned) stages[i] < num_field) {
+			stage_end[num_stages++] = stages[i];
+		}
+	}
+	stage_end[num_stages++] = num_field;
 
 	// figure out the index file range to search in
-	hprange = arcsec2dist(MAX_PS*hypot(CAMERA_WIDTH - 2*CAMERA_MARGIN, 
-	                                   CAMERA_HEIGHT - 2*CAMERA_MARGIN)/2.0);
+	hprange = arcsec2dist(MAX_PS*geometry->factor*
+	                      hypot(geometry->width - 2*CAMERA_MARGIN,
+	                            geometry->height - 2*CAMERA_MARGIN)/2.0);
 
 	// make list of stars
-	starxy_t * field = starxy_new(num_blobs, 1, 0);
+	starxy_t * field = starxy_new(num_field, 1, 0);
 
 	// start timer for astrometry 
 	if (clock_gettime(CLOCK_REALTIME, &astrom_tp_beginning) == -1) {
@@ -176,77 +549,88 @@ int lostInSpace(double * star_x, double * star_y, double * star_mags, unsigned
 	starxy_set_x_array(field, star_x);
 	starxy_set_y_array(field, star_y);
 	starxy_set_flux_array(field, star_mags);
-	starxy_sort_by_flux(field);
-
-	solver_set_field(solver, field);
-	solver_set_field_bounds(solver, 0, CAMERA_WIDTH - 2*CAMERA_MARGIN, 0, 
-	                        CAMERA_HEIGHT - 2*CAMERA_MARGIN);
 
-	// add index files
-	for (int i = 0; i < (int) pl_size((*engine).indexes); i++) {
+	// select index files (when tracking, only those covering the sky around 
+	// the last solution, where any star in the field could be)
+	char selected[num_index_maps + 1];
+	for (int i = 0; i < num_index_maps; i++) {
 		index_t * index = (index_t *) pl_get((*engine).indexes, i);
-		solver_add_index(solver, index);
-		index_reload(index);
+		selected[i] = !tracking || 
+		              index_is_within_range(index, track_seed.ra, 
+		                                    track_seed.dec, 
+		                                    track_radius + dist2deg(hprange));
+	}
+	int num_indexes = attachIndexes(selected);
+
+	// only solvers with a share of the indexes run (the first one always does)
+	int num_running = MAX(1, MIN(num_solvers, num_indexes));
+	int threaded[MAX_SOLVERS] = {0};
+
+	if (verbose) {
+		printf("(*) Solving with %d of %d index files on %d solver(s).\n", 
+		       num_indexes, (int) pl_size((*engine).indexes), num_running);
+	}
+
+	// every solver gets its own copy of the field to own and clean up
+	solver_set_field(solvers[0], field);
+	for (int k = 1; k < num_running; k++) {
+		solver_set_field(solvers[k], starxy_copy(field));
+	}
+	solver_log_params(solvers[0]);
+
+	struct timespec lap;
+	clock_gettime(CLOCK_MONOTONIC, &lap);
+	solve_winner = -1;
+	for (int k = 1; k < num_running; k++) {
+		if (pthread_create(&solver_thread_ids[k], NULL, solverThread, 
+		                   &(solver_timers[k].solver)) == 0) {
+			threaded[k] = 1;
+		} else {
+			fprintf(stderr, "Error creating solver thread: %s.\n", 
+			        strerror(errno));
+		}
 	}
 
-	solver_log_params(solver);
-	solver_run(solver);
+	// run the first solver here, and any that did not get a thread after it
+	for (int k = 0; k < num_running; k++) {
+		if (!threaded[k]) {
+			runSolver(k);
+		}
+	}
+	for (int k = 1; k < num_running; k++) {
+		if (threaded[k]) {
+			pthread_join(solver_thread_ids[k], NULL);
+		}
+	}
+
+	perfLap(PERF_SOLVE, &lap);
 
 	// solution status should be 0 since we have yet to achieve a solution 
 	sol_status = 0;
-	if ((*solver).best_match_solves) {
-		double pscale;
-		tan_t * wcs;
-
-		// get World Coordinate System data (wcs)
-		wcs = &((*solver).best_match.wcstan);
-		tan_pixelxy2radec(wcs, (CAMERA_WIDTH - 2*CAMERA_MARGIN - 1)/2.0, 
-		                       (CAMERA_HEIGHT - 2*CAMERA_MARGIN - 1)/2.0, &ra, 
-							   &dec);
-		
-		// calculate pixel scale and field rotation
-		ps = tan_pixel_scale(wcs);
-		fr = tan_get_orientation(wcs); 
-
-		// calculate Julian date
-		if (iauDtf2d("UTC", tm_info->tm_year + 1900, tm_info->tm_mon + 1, 
-		                    tm_info->tm_mday, tm_info->tm_hour, tm_info->tm_min,
-							(double) tm_info->tm_sec, &d1, &d2) != 0) {
-			printf("Julian date not properly calculated.\n");
-			return sol_status;
-		}
+	last_wcs.valid = 0;
+	if (solve_winner != -1) {
+		tan_t * wcs = &((*solvers[solve_winner]).best_match.wcstan);
 
-		// calculate AltAz
-		if (iauAtco13(ra*(M_PI/180.0), dec*(M_PI/180.0), 0.0, 0.0, 0.0, 0.0, d1,
-		              d2 + (all_camera_params.exposure_time/(2000.0*3600.0*24.0)), 
-					  dut1, all_astro_params.longitude*(M_PI/180.0), 
-					  all_astro_params.latitude*(M_PI/180.0), 
-					  all_astro_params.hm, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-				      &aob, &zob, &hob, &dob, &rob, &eo) != 0) {
-			printf("Review preceding Julian date calculation; dubious year or "
-			       "unacceptable date passed to AltAz calculation.\n");
-			return sol_status;
+		if (verbose && num_running > 1) {
+			printf("(*) Solver %d of %d found the solution.\n", 
+			       solve_winner + 1, num_running);
 		}
 
-		// calculate parallactic angle and add it to field rotation to get image
-		// rotation
-		ir = (iauHd2pa(hob, dob, 
-		               all_astro_params.latitude*(M_PI/180.0)))*(180.0/M_PI) - fr;
+		// get World Coordinate System data (wcs), and the pointing from it
+		// (without which the image is left unsolved, like any other)
+		if (observeSolution(wcs, geometry, tm_info, &ra, &dec) == 1) {
+			sol_status = 1;
+		}
+	}
+	if (sol_status == 1) {
+		solver_t * solver = solvers[solve_winner];
+		double pscale;
 
 		// end timer
 		if (clock_gettime(CLOCK_REALTIME, &astrom_tp_end) == -1) {
         	fprintf(stderr, "Error ending timer: %s.\n", strerror(errno));
     	}
 
-		// update astro struct with telemetry
-		all_astro_params.ir = ir;
-		all_astro_params.ra = rob*(180.0/M_PI);
-		all_astro_params.dec = dob*(180.0/M_PI);
-		all_astro_params.alt = 90.0 - (zob*(180.0/M_PI));
-		all_astro_params.az = aob*(180.0/M_PI); 
-		all_astro_params.fr = fr;
-		all_astro_params.ps = ps;
-
     	printf("\n+---------------------------------------------------------+\n");
 		printf("|\t\tTelemetry\t\t\t\t  |\n");
 		printf("|---------------------------------------------------------|\n");
@@ -271,35 +655,117 @@ int lostInSpace(double * star_x, double * star_y, double * star_mags, unsigned
     	astrom_time = end - start;
 		printf("(*) Astrometry solved in %f msec.\n", astrom_time*1e-6);
 
-		// write astrometry solution to data.txt file
-		if (verbose) {
-			printf("> Writing Astrometry solution to data file...\n");
-		}
+		// fill in the solution for the observing log
+		(*record).solved = 1;
+		(*record).ra_observed = all_astro_params.ra;
+		(*record).ra = ra;
+		(*record).dec_observed = all_astro_params.dec;
+		(*record).dec = dec;
+		(*record).fr = all_astro_params.fr;
+		(*record).ps = all_astro_params.ps;
+		(*record).alt = all_astro_params.alt;
+		(*record).az = all_astro_params.az;
+		(*record).ir = all_astro_params.ir;
+		(*record).astrometry_time = astrom_time*1e-6;
+
+		// we achieved a solution! the next tracking solve centers on it
+		track_seed.valid = 1;
+		track_seed.ra = ra;
+		track_seed.dec = dec;
+		track_seed.ps = all_astro_params.ps/geometry->factor;
+		track_seed.parity = (*solver).best_match.parity;
+		track_seed.failures = 0;
+
+		// and the pointing is Astrometry's own
+		solution.source = SOLUTION_SOLVED;
+		solution.matches = 0;
+		solution.rms = 0;
+		solution.frames_since_solve = 0;
+	} else if (tracking && ++track_seed.failures >= track_max_failures) {
+		// we have probably slewed away from the last solution
+		printf("(*) %d tracking solves failed in a row, going back to full "
+		       "solves.\n", track_seed.failures);
+		track_seed.valid = 0;
+	}
+	if (sol_status != 1) {
+		// the telemetry still has the last pointing we found
+		solution.source = SOLUTION_NONE;
+		solution.frames_since_solve++;
+	}
+	// clean everything up and return the status (the indexes stay attached)
+	for (int k = 0; k < num_running; k++) {
+		solver_cleanup_field(solvers[k]);
+	}
 
-    	if ((fptr = fopen(datafile, "a")) == NULL) {
-    	    fprintf(stderr, "Could not open observing file: %s.\n", 
-			        strerror(errno));
-    	    return sol_status;
-    	}
+	return sol_status;
+}
 
-		if (fprintf(fptr, "%i|%lf|%lf|%lf|%lf|%lf|%lf|%.15f|%.15f|%lf|%f", num_blobs, 
-		            all_astro_params.ra, ra, all_astro_params.dec, dec,
-					all_astro_params.fr, all_astro_params.ps, 
-					all_astro_params.alt, all_astro_params.az, 
-					all_astro_params.ir, astrom_time*1e-6) < 0) {
-			fprintf(stderr, "Error writing solution to observing file: %s.\n", 
-			        strerror(errno));
-		}		
-		fflush(fptr);
-		fclose(fptr);
+/* Function to move the last solution with the stars, rather than solve the
+** image: the rotation and shift of the blobs since the previous image carry
+** the projection of the last solution to this image, and with it, its
+** pointing.
+** Input: How the blobs moved since the previous image, the readout geometry of
+** the image, the time it was taken, and the observing log record to fill in
+** with the solution.
+** Output: A flag indicating the solution could be propagated (there is one to
+** propagate, and its pointing could be found) or not.
+*/
+int propagateSolution(const struct image_motion * motion,
+                      const struct camera_geometry * geometry,
+                      struct tm * tm_info, struct obs_record * record) {
+	double c = cos(motion->rotation), s = sin(motion->rotation);
+	double ra, dec;
+	tan_t wcs;
+
+	if (!last_wcs.valid) {
+		return -1;
+	}
 
+	// a star at p in the previous image is at R p + t in this one, so this
+	// image's projection has its reference pixel at R crpix + t, and its
+	// matrix turned back by R (cd R^-1)
+	memset(&wcs, 0, sizeof(wcs));
+	memcpy(wcs.crval, last_wcs.crval, sizeof(wcs.crval));
+	wcs.crpix[0] = c*last_wcs.crpix[0] - s*last_wcs.crpix[1] + motion->dx;
+	wcs.crpix[1] = s*last_wcs.crpix[0] + c*last_wcs.crpix[1] + motion->dy;
+	for (int i = 0; i < 2; i++) {
+		wcs.cd[i][0] = c*last_wcs.cd[i][0] - s*last_wcs.cd[i][1];
+		wcs.cd[i][1] = s*last_wcs.cd[i][0] + c*last_wcs.cd[i][1];
+	}
+	wcs.imagew = geometry->width - 2*CAMERA_MARGIN;
+	wcs.imageh = geometry->height - 2*CAMERA_MARGIN;
 
-		// we achieved a solution!
-		sol_status = 1;
-	} 
-	// clean everything up and return the status
-	solver_cleanup_field(solver);
-	solver_clear_indexes(solver);
+	if (observeSolution(&wcs, geometry, tm_info, &ra, &dec) != 1) {
+		last_wcs.valid = 0;
+		return -1;
+	}
 
-	return sol_status;
+	// tracking solves search around where the stars have taken us
+	if (track_seed.valid) {
+		track_seed.ra = ra;
+		track_seed.dec = dec;
+	}
+
+	solution.source = SOLUTION_PROPAGATED;
+	solution.matches = motion->matches;
+	solution.rms = motion->rms;
+	solution.frames_since_solve++;
+
+	// fill in the solution for the observing log (Astrometry did not solve
+	// this image, so solved stays 0)
+	(*record).ra_observed = all_astro_params.ra;
+	(*record).ra = ra;
+	(*record).dec_observed = all_astro_params.dec;
+	(*record).dec = dec;
+	(*record).fr = all_astro_params.fr;
+	(*record).ps = all_astro_params.ps;
+	(*record).alt = all_astro_params.alt;
+	(*record).az = all_astro_params.az;
+	(*record).ir = all_astro_params.ir;
+
+	printf("(*) Propagated the solution of %d images ago: RA %lf, DEC %lf, "
+	       "IR %lf deg.\n", solution.frames_since_solve, ra, dec,
+	       all_astro_params.ir);
+
+	return 1;
 }
@@ -1,12 +1,37 @@
 #ifndef ASTROMETRY_H
 #define ASTROMETRY_H
 
+// pixel scale search range around the last solution when tracking
+#define TRACK_PS_MARGIN  0.02
+// most solvers the index files can be split between
+#define MAX_SOLVERS      16
+// a solve first tries quads of the brightest this many blobs, then of this 
+// many, and then of all the blobs the solver is given
+#define SOLVE_STAGE_1    20
+#define SOLVE_STAGE_2    50
+#define MAX_SOLVE_STAGES 3
+// where the pointing of the last image came from
+#define SOLUTION_NONE       0
+#define SOLUTION_SOLVED     1   // Astrometry solved the image
+#define SOLUTION_PROPAGATED 2   // moved from the last solution with the stars
+
+struct obs_record;
+struct camera_geometry;
+struct image_motion;
+
 int initAstrometry();
+int loadIndexes();
+int attachIndexes(char * selected);
 void closeAstrometry();
 int lostInSpace(double * star_x, double * star_y, double * star_mags, 
-                unsigned num_blobs, struct tm * tm_info, char * datafile);
+                unsigned num_blobs, const struct camera_geometry * geometry,
+                struct tm * tm_info, struct obs_record * record);
+int propagateSolution(const struct image_motion * motion,
+                      const struct camera_geometry * geometry,
+                      struct tm * tm_info, struct obs_record * record);
 
-/* Astrometry parameters and solutions struct */
+/* Astrometry parameters and solutions struct (its size is part of the
+** telemetry layout) */
 #pragma pack(push, 1)
 struct astrometry {
     double timelimit;
@@ -27,6 +52,54 @@ struct astrometry {
 };
 #pragma pack(pop)
 
+/* Where the telemetry's pointing came from */
+#pragma pack(push, 1)
+struct solution_status {
+    int source;                 // SOLUTION_*
+    int matches;                // blobs matched with the previous image, if
+                                // propagated
+    double rms;                 // residual of the matched blobs [px]
+    int frames_since_solve;     // images since Astrometry last solved one
+};
+#pragma pack(pop)
+
+/* Read-only mapping of an index file */
+struct index_mapping {
+    void * addr;
+    size_t length;
+};
+
+/* Timeout counter of one solver */
+struct solver_timer {
+    int counter;                // timeout cycles left
+    int solver;                 // which solver this is
+};
+
+/* Last solution, for tracking solves to search around */
+struct tracking_seed {
+    int valid;                  // (bool) there is a solution to track from
+    double ra;                  // field center RA (deg, ICRS)
+    double dec;                 // field center DEC (deg, ICRS)
+    double ps;                  // pixel scale of sensor pixels [arcsec/px]
+    int parity;                 // parity of the solution
+    int failures;               // failed tracking solves since then
+};
+
+/* TAN projection of the last solve, for the headers of archived images */
+struct wcs_solution {
+    int valid;                  // (bool) the last solve succeeded
+    double crval[2];            // RA and DEC of the reference pixel (deg, ICRS)
+    double crpix[2];            // reference pixel (image coordinates from 0)
+    double cd[2][2];            // pixel-to-sky matrix [deg/px]
+};
+
 extern struct astrometry all_astro_params;
+extern struct wcs_solution last_wcs;
+extern struct solution_status solution;
+extern int num_solvers;
+extern int tracking_mode;
+extern double track_radius;
+extern int track_max_failures;
+extern int max_solve_blobs;
 
 #endif 
\ No newline at end of file
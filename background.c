@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "background.h"
+#include "workers.h"
+#include "commands.h"
+
+/* Shared by the backgroundStripe() tasks */
+struct background_job {
+    const float * image;        // filtered image
+    const unsigned char * mask;
+    int w;                      // image width [px]
+    int dx, dy;                 // pixel of each decimation cell sampled
+    double gain;                // weight of this frame's estimates
+    double mean, sigma;         // of the whole image
+    struct background_model * bg;
+};
+
+/* Helper function to find the k-th smallest of some samples (quickselect). The
+** samples are reordered.
+** Input: The samples, how many there are, and k.
+** Output: The k-th smallest sample.
+*/
+static float selectSample(float * a, int n, int k) {
+    int lo = 0, hi = n - 1;
+
+    while (lo < hi) {
+        float pivot = a[(lo + hi)/2];
+        int i = lo, j = hi;
+
+        while (i <= j) {
+            while (a[i] < pivot) i++;
+            while (a[j] > pivot) j--;
+            if (i <= j) {
+                float t = a[i];
+                a[i++] = a[j];
+                a[j--] = t;
+            }
+        }
+
+        if (k <= j) {
+            hi = j;
+        } else if (k >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+
+    return a[k];
+}
+
+/* Helper function to find the sigma-clipped median and noise of a tile.
+** Input: The samples, space for their deviations, and how many there are.
+** Output: A flag indicating there were enough samples or not. The median and
+** noise (1.4826 times the median absolute deviation) are stored in level and
+** noise.
+*/
+static int clippedStats(float * samples, float * deviations, int n,
+                        float * level, float * noise) {
+    float median = 0, sigma = 0;
+
+    if (n < BACKGROUND_MIN_SAMPLES) {
+        return -1;
+    }
+
+    for (int clip = 0; clip < BACKGROUND_CLIPS; clip++) {
+        int kept = 0;
+
+        median = selectSample(samples, n, n/2);
+        for (int k = 0; k < n; k++) {
+            deviations[k] = fabsf(samples[k] - median);
+        }
+        sigma = 1.4826*selectSample(deviations, n, n/2);
+
+        // stars and the edges of the moon are what get clipped
+        for (int k = 0; k < n; k++) {
+            if (fabsf(samples[k] - median) <= BACKGROUND_CLIP_SIGMA*sigma) {
+                samples[kept++] = samples[k];
+            }
+        }
+        if (kept == n || kept < BACKGROUND_MIN_SAMPLES) {
+            break;
+        }
+        n = kept;
+    }
+
+    *level = median;
+    *noise = sigma;
+
+    return 1;
+}
+
+/* Stripe task for updateBackground(): estimates the tiles of one row of tiles
+** from this frame's samples and blends them into the model.
+** Input: The row of tiles, the worker running it, and the background job.
+** Output: None (void).
+*/
+static void backgroundStripe(int ty, int worker, void * arg) {
+    struct background_job * job = arg;
+    struct background_model * bg = job->bg;
+    float * samples = bg->samples[worker];
+    int ya = bg->y0 + ty*bg->tile;
+    int yb = (ya + bg->tile < bg->y1) ? ya + bg->tile : bg->y1;
+
+    for (int tx = 0; tx < bg->nx; tx++) {
+        int xa = bg->x0 + tx*bg->tile;
+        int xb = (xa + bg->tile < bg->x1) ? xa + bg->tile : bg->x1;
+        int t = tx + ty*bg->nx;
+        float level, noise;
+        int n = 0;
+
+        for (int y = ya + job->dy; y < yb; y += BACKGROUND_DECIMATE) {
+            for (int x = xa + job->dx; x < xb; x += BACKGROUND_DECIMATE) {
+                if (job->mask[x + y*job->w]) {
+                    samples[n++] = job->image[x + y*job->w];
+                }
+            }
+        }
+
+        if (clippedStats(samples, bg->deviations[worker], n, &level,
+                         &noise) != 1) {
+            level = job->mean;
+            noise = job->sigma;
+        }
+        if (noise <= 0) {
+            // a flat (or saturated) tile
+            noise = job->sigma;
+        }
+
+        bg->level[t] += job->gain*(level - bg->level[t]);
+        bg->noise[t] += job->gain*(noise - bg->noise[t]);
+    }
+}
+
+/* Helper function to set up the tiles of the model for a region and tile size
+** (keeping the model if they are the same as before).
+** Input: The model, the region [x0, x1) by [y0, y1) and the tile size.
+** Output: A flag indicating the model could be set up or not.
+*/
+static int setBackgroundTiles(struct background_model * bg, int x0, int y0,
+                              int x1, int y1, int tile) {
+    int capacity = (tile + BACKGROUND_DECIMATE - 1)/BACKGROUND_DECIMATE;
+    int nx = (x1 - x0 + tile - 1)/tile, ny = (y1 - y0 + tile - 1)/tile;
+
+    if (bg->level != NULL && tile == bg->tile && x0 == bg->x0 &&
+        y0 == bg->y0 && x1 == bg->x1 && y1 == bg->y1) {
+        return 1;
+    }
+
+    freeBackground(bg);
+    capacity *= capacity;
+    bg->level = calloc(nx*ny, sizeof(float));
+    bg->noise = calloc(nx*ny, sizeof(float));
+    bg->threshold = calloc(nx*ny, sizeof(float));
+    bg->cx = calloc(nx, sizeof(int));
+    bg->cy = calloc(ny, sizeof(int));
+    bg->column = calloc(x1, sizeof(int));
+    bg->inv_span = calloc(nx, sizeof(float));
+    int ok = (bg->level && bg->noise && bg->threshold && bg->cx && bg->cy &&
+              bg->column && bg->inv_span);
+    for (int k = 0; k < MAX_WORKERS && ok; k++) {
+        bg->samples[k] = malloc(capacity*sizeof(float));
+        bg->deviations[k] = malloc(capacity*sizeof(float));
+        bg->rows[k] = malloc(nx*sizeof(float));
+        ok = (bg->samples[k] && bg->deviations[k] && bg->rows[k]);
+    }
+    if (!ok) {
+        fprintf(stderr, "Error allocating background tiles: %s.\n",
+                strerror(errno));
+        freeBackground(bg);
+        return -1;
+    }
+
+    bg->tile = tile;
+    bg->nx = nx;
+    bg->ny = ny;
+    bg->x0 = x0;
+    bg->y0 = y0;
+    bg->x1 = x1;
+    bg->y1 = y1;
+    for (int tx = 0; tx < nx; tx++) {
+        int xa = x0 + tx*tile, xb = (xa + tile < x1) ? xa + tile : x1;
+        bg->cx[tx] = (xa + xb)/2;
+    }
+    for (int ty = 0; ty < ny; ty++) {
+        int ya = y0 + ty*tile, yb = (ya + tile < y1) ? ya + tile : y1;
+        bg->cy[ty] = (ya + yb)/2;
+    }
+    for (int tx = 0; tx + 1 < nx; tx++) {
+        bg->inv_span[tx] = 1.0f/(bg->cx[tx + 1] - bg->cx[tx]);
+    }
+    for (int x = x0, tx = 0; x < x1; x++) {
+        while (tx + 1 < nx && x >= bg->cx[tx + 1]) tx++;
+        bg->column[x] = tx;
+    }
+
+    return 1;
+}
+
+/* Function to update the tiled background model from a filtered image, from
+** one decimated pass over it.
+** Input: The model, the filtered image and its mask, the image width (w), the
+** region the statistics cover ([x0, x1) by [y0, y1)), the tile size, the
+** number of sigma above the background blobs must be, and the mean and sigma
+** of the whole region.
+** Output: A flag indicating the model is ready for backgroundThresholds() or
+** not.
+*/
+int updateBackground(struct background_model * bg, const float * image,
+                     const unsigned char * mask, int w, int x0, int y0, int x1,
+                     int y1, int tile, float n_sigma, double mean,
+                     double sigma) {
+    struct background_job job;
+    int phase = bg->frames++ % (BACKGROUND_DECIMATE*BACKGROUND_DECIMATE);
+
+    if (tile < MIN_BACKGROUND_TILE) tile = MIN_BACKGROUND_TILE;
+    if (tile > MAX_BACKGROUND_TILE) tile = MAX_BACKGROUND_TILE;
+    if (x1 <= x0 || y1 <= y0 || !(sigma >= 0) ||
+        setBackgroundTiles(bg, x0, y0, x1, y1, tile) != 1) {
+        return -1;
+    }
+
+    job.bg = bg;
+    job.image = image;
+    job.mask = mask;
+    job.w = w;
+    job.dx = phase % BACKGROUND_DECIMATE;
+    job.dy = phase / BACKGROUND_DECIMATE;
+    job.mean = mean;
+    job.sigma = sigma;
+    // the model is only blended with frames like the one it came from: a new
+    // exposure, filter setting or the moon coming into view replaces it
+    job.gain = (bg->valid && fabs(mean - bg->mean) <= sigma) ? BACKGROUND_GAIN
+                                                           : 1.0;
+    runStripes(backgroundStripe, &job, bg->ny);
+    bg->valid = 1;
+    bg->mean = mean;
+
+    for (int t = 0; t < bg->nx*bg->ny; t++) {
+        bg->threshold[t] = bg->level[t] + n_sigma*bg->noise[t];
+    }
+
+    if (verbose) {
+        float lo = bg->level[0], hi = bg->level[0];
+        for (int t = 1; t < bg->nx*bg->ny; t++) {
+            if (bg->level[t] < lo) lo = bg->level[t];
+            if (bg->level[t] > hi) hi = bg->level[t];
+        }
+        printf("Background of %d x %d tiles: level %.3f to %.3f.\n", bg->nx,
+               bg->ny, lo, hi);
+    }
+
+    return 1;
+}
+
+/* Function to get ready to look up the blob thresholds of one row of the
+** image: interpolates the thresholds at the tile centres to the row. Safe to
+** run on different rows at once (by different workers).
+** Input: The model, the row (j) and the worker scanning it.
+** Output: The lowest threshold in the row, which most pixels are below.
+*/
+float backgroundRow(struct background_model * bg, int j, int worker) {
+    float * row = bg->rows[worker];
+    float lowest;
+    int ty = 0;
+    float fy = 0;
+
+    // the two rows of tiles the row is between (the outer ones beyond them)
+    if (j >= bg->cy[bg->ny - 1]) {
+        ty = bg->ny - 1;
+    } else if (j > bg->cy[0]) {
+        while (j >= bg->cy[ty + 1]) ty++;
+        fy = (float) (j - bg->cy[ty])/(bg->cy[ty + 1] - bg->cy[ty]);
+    }
+    const float * above = bg->threshold + ty*bg->nx;
+    const float * below = (ty + 1 < bg->ny) ? above + bg->nx : above;
+
+    lowest = row[0] = above[0] + fy*(below[0] - above[0]);
+    for (int tx = 1; tx < bg->nx; tx++) {
+        row[tx] = above[tx] + fy*(below[tx] - above[tx]);
+        if (row[tx] < lowest) {
+            lowest = row[tx];
+        }
+    }
+
+    return lowest;
+}
+
+/* Function to look up the blob threshold of a pixel in the row of the last
+** backgroundRow(), interpolated between the tile centres (and constant beyond
+** the outer ones).
+** Input: The model, the column (x, from x0 to x1 - 1 of the last
+** updateBackground()) and the worker scanning the row.
+** Output: The threshold.
+*/
+float backgroundThreshold(const struct background_model * bg, int x,
+                          int worker) {
+    const float * row = bg->rows[worker];
+    int tx = bg->column[x];
+
+    if (x <= bg->cx[tx] || tx + 1 == bg->nx) {
+        return row[tx];
+    }
+
+    return row[tx] + (row[tx + 1] - row[tx])*(x - bg->cx[tx])*
+                     bg->inv_span[tx];
+}
+
+/* Function to free the background model.
+** Input: The model.
+** Output: None (void).
+*/
+void freeBackground(struct background_model * bg) {
+    free(bg->level);
+    free(bg->noise);
+    free(bg->threshold);
+    free(bg->cx);
+    free(bg->cy);
+    free(bg->column);
+    free(bg->inv_span);
+    bg->level = bg->noise = bg->threshold = bg->inv_span = NULL;
+    bg->cx = bg->cy = bg->column = NULL;
+    for (int k = 0; k < MAX_WORKERS; k++) {
+        free(bg->samples[k]);
+        free(bg->deviations[k]);
+        free(bg->rows[k]);
+        bg->samples[k] = bg->deviations[k] = bg->rows[k] = NULL;
+    }
+    bg->tile = bg->nx = bg->ny = 0;
+    bg->valid = 0;
+}
@@ -0,0 +1,62 @@
+#ifndef BACKGROUND_H
+#define BACKGROUND_H
+
+#include "workers.h"
+
+// how the blob threshold is found (blob_params.background_mode; a command
+// with 0 leaves it as it is)
+#define BACKGROUND_GLOBAL     1   // mean + n_sigma*sigma of the whole image
+#define BACKGROUND_TILED      2   // clipped median + n_sigma*MAD noise of tiles,
+                                  // interpolated between the tile centres (the
+                                  // noise leaves out the stars, so n_sigma wants
+                                  // to be larger than for the global sigma)
+// tile sizes (blob_params.background_tile) [px]
+#define BACKGROUND_TILE       128
+#define MIN_BACKGROUND_TILE   16
+#define MAX_BACKGROUND_TILE   512
+// every this many pixels (each way) of a tile are sampled in a frame, starting
+// at a different pixel every frame
+#define BACKGROUND_DECIMATE   8
+// samples further than this many sigma from the median are clipped, at most
+// this many times per tile
+#define BACKGROUND_CLIP_SIGMA 3.0
+#define BACKGROUND_CLIPS      3
+// tiles with fewer unmasked samples than this use the global mean and sigma
+#define BACKGROUND_MIN_SAMPLES 16
+// weight of a frame's estimate against the model kept from earlier frames
+#define BACKGROUND_GAIN       0.5
+
+/* The model one camera keeps from frame to frame: the tiles cover [x0, x1) by
+** [y0, y1), and each has a level (clipped median), a noise (1.4826 MAD) and
+** the threshold made of them, with its centre at (cx, cy) */
+struct background_model {
+    int tile, nx, ny;
+    int x0, y0, x1, y1;
+    float * level, * noise, * threshold;
+    int * cx, * cy;
+    // the column of tiles each pixel column is right of, and 1/the distance
+    // to the next column of tiles
+    int * column;
+    float * inv_span;
+    // (bool) whether the model holds estimates, and the mean of the image it
+    // was last updated from
+    int valid;
+    double mean;
+    unsigned int frames;
+    // per-worker space for the samples of a tile and their deviations
+    float * samples[MAX_WORKERS];
+    float * deviations[MAX_WORKERS];
+    // per-worker thresholds at the tile centres of the row being scanned
+    float * rows[MAX_WORKERS];
+};
+
+int updateBackground(struct background_model * bg, const float * image,
+                     const unsigned char * mask, int w, int x0, int y0, int x1,
+                     int y1, int tile, float n_sigma, double mean,
+                     double sigma);
+float backgroundRow(struct background_model * bg, int j, int worker);
+float backgroundThreshold(const struct background_model * bg, int x,
+                          int worker);
+void freeBackground(struct background_model * bg);
+
+#endif
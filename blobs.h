@@ -0,0 +1,62 @@
+#ifndef BLOBS_H
+#define BLOBS_H
+
+#include <time.h>
+
+#include "camera.h"
+#include "workers.h"
+#include "boxcar.h"
+#include "hotpix.h"
+#include "background.h"
+
+/* Blob candidates found in one stripe of an image, in scanning order */
+struct blob_candidates {
+    int * x;                    // candidate x coordinates [px]
+    int * y;                    // candidate y coordinates [px]
+    double * mags;              // candidate magnitudes
+    int count;                  // number of candidates
+    int alloc;                  // allocated length of the arrays
+};
+
+/* Everything findBlobs() keeps from one image of a camera to the next: its
+** working space (sized for that camera's sensor), its hot pixel map and
+** background model, and the blobs it last found. With no state of its own
+** outside the context, findBlobs() is re-entrant: images with different
+** contexts can be processed on different threads at the same time (the worker
+** pool takes their jobs in turn). Capture and solving are still one camera's */
+struct blob_context {
+    int width, height;          // of the sensor (the largest image) [px]
+    unsigned char * mask;
+    // images whose rows are further apart than their width, packed
+    char * packed_image;
+    // filtered images, and the filtered image narrowed for the peak scan
+    // (half the memory traffic)
+    double * ic, * ic2;
+    float * icf;
+    struct boxcar_scratch filter_scratch[MAX_WORKERS];
+    struct blob_candidates candidates[NUM_STRIPES];
+    // blob grid (first blob in each cell, and each blob's neighbours in its
+    // cell) and min-heap of blob magnitudes for merging the candidates
+    int * grid_head;
+    int grid_alloc;
+    int blob_next[MAX_BLOBS], blob_prev[MAX_BLOBS], blob_cell[MAX_BLOBS];
+    int blob_heap[MAX_BLOBS], blob_heap_pos[MAX_BLOBS];
+    // order of the blobs being sorted, and space to reorder them in
+    int sort_order[MAX_BLOBS];
+    double sort_scratch[MAX_BLOBS];
+    int hot_pixels_loaded;      // (bool) the static map has been read
+    struct hot_pixel_map hot_pixels;
+    struct background_model background;
+    double level;               // mean level of the last image
+    // the blobs of the last image, brightest first (y from the bottom)
+    double star_x[MAX_BLOBS], star_y[MAX_BLOBS], star_mags[MAX_BLOBS];
+    int blob_count;
+    // when centroiding them started and finished
+    struct timespec centroid_start, centroid_end;
+    // median half-flux diameter of the brightest of them [px] (NAN if too few
+    // of them could be measured), and how many were measured
+    double hfd;
+    int hfd_count;
+};
+
+#endif
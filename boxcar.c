@@ -0,0 +1,473 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "boxcar.h"
+
+// if 1, every filtered image is compared against the reference filter
+int boxcar_check = 0;
+
+/* Kernel for one output row of the vertical pass: slides the column sums down
+** a row (adding the row entering the box, subtracting the row leaving it), then
+** divides the sums by the pixel counts.
+** Input: The column sums and counts (cs, cn), the sums and counts of the rows
+** entering (as, an) and leaving (ss, sn) the box, the output row, and the
+** number of columns.
+** Output: The number of columns where the box held no unmasked pixels (their
+** output is left for the caller to fill in).
+*/
+typedef int (* vertical_kernel)(int32_t * cs, int32_t * cn,
+                                const int32_t * as, const int32_t * an,
+                                const int32_t * ss, const int32_t * sn,
+                                double * out, int ncols);
+
+static int verticalStepScalar(int32_t * cs, int32_t * cn, const int32_t * as,
+                              const int32_t * an, const int32_t * ss,
+                              const int32_t * sn, double * out, int ncols) {
+    int empty = 0;
+
+    for (int k = 0; k < ncols; k++) {
+        cs[k] += as[k] - ss[k];
+        cn[k] += an[k] - sn[k];
+        if (cn[k] > 0) {
+            out[k] = (double) cs[k] / (double) cn[k];
+        } else {
+            empty++;
+        }
+    }
+
+    return empty;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static int verticalStepAVX2(int32_t * cs, int32_t * cn, const int32_t * as,
+                            const int32_t * an, const int32_t * ss,
+                            const int32_t * sn, double * out, int ncols) {
+    const __m256i zero = _mm256_setzero_si256();
+    int empty = 0;
+    int k = 0;
+
+    for (; k + 8 <= ncols; k += 8) {
+        __m256i s = _mm256_loadu_si256((__m256i *) (cs + k));
+        __m256i n = _mm256_loadu_si256((__m256i *) (cn + k));
+        s = _mm256_add_epi32(s, _mm256_sub_epi32(
+                _mm256_loadu_si256((__m256i *) (as + k)),
+                _mm256_loadu_si256((__m256i *) (ss + k))));
+        n = _mm256_add_epi32(n, _mm256_sub_epi32(
+                _mm256_loadu_si256((__m256i *) (an + k)),
+                _mm256_loadu_si256((__m256i *) (sn + k))));
+        _mm256_storeu_si256((__m256i *) (cs + k), s);
+        _mm256_storeu_si256((__m256i *) (cn + k), n);
+
+        // int32 -> double is exact and the division is correctly rounded, so
+        // this matches the scalar (double) s/n bit for bit
+        __m256d lo = _mm256_div_pd(
+            _mm256_cvtepi32_pd(_mm256_castsi256_si128(s)),
+            _mm256_cvtepi32_pd(_mm256_castsi256_si128(n)));
+        __m256d hi = _mm256_div_pd(
+            _mm256_cvtepi32_pd(_mm256_extracti128_si256(s, 1)),
+            _mm256_cvtepi32_pd(_mm256_extracti128_si256(n, 1)));
+        _mm256_storeu_pd(out + k, lo);
+        _mm256_storeu_pd(out + k + 4, hi);
+
+        int zeros = _mm256_movemask_ps(_mm256_castsi256_ps(
+            _mm256_cmpeq_epi32(n, zero)));
+        empty += __builtin_popcount(zeros);
+    }
+
+    return empty + verticalStepScalar(cs + k, cn + k, as + k, an + k, ss + k,
+                                      sn + k, out + k, ncols - k);
+}
+#elif defined(__aarch64__)
+static int verticalStepNEON(int32_t * cs, int32_t * cn, const int32_t * as,
+                            const int32_t * an, const int32_t * ss,
+                            const int32_t * sn, double * out, int ncols) {
+    const int32x4_t zero = vdupq_n_s32(0);
+    int empty = 0;
+    int k = 0;
+
+    for (; k + 4 <= ncols; k += 4) {
+        int32x4_t s = vsubq_s32(vld1q_s32(as + k), vld1q_s32(ss + k));
+        int32x4_t n = vsubq_s32(vld1q_s32(an + k), vld1q_s32(sn + k));
+        s = vaddq_s32(vld1q_s32(cs + k), s);
+        n = vaddq_s32(vld1q_s32(cn + k), n);
+        vst1q_s32(cs + k, s);
+        vst1q_s32(cn + k, n);
+
+        float64x2_t lo = vdivq_f64(vcvtq_f64_s64(vmovl_s32(vget_low_s32(s))),
+                                   vcvtq_f64_s64(vmovl_s32(vget_low_s32(n))));
+        float64x2_t hi = vdivq_f64(vcvtq_f64_s64(vmovl_s32(vget_high_s32(s))),
+                                   vcvtq_f64_s64(vmovl_s32(vget_high_s32(n))));
+        vst1q_f64(out + k, lo);
+        vst1q_f64(out + k + 2, hi);
+
+        // each lane of the comparison is all ones (-1) where the count is zero
+        empty -= vaddvq_s32(vreinterpretq_s32_u32(vceqq_s32(n, zero)));
+    }
+
+    return empty + verticalStepScalar(cs + k, cn + k, as + k, an + k, ss + k,
+                                      sn + k, out + k, ncols - k);
+}
+#endif
+
+/* Helper function to pick the fastest vertical kernel this CPU supports.
+** Input: None.
+** Output: The kernel.
+*/
+static vertical_kernel chooseVerticalKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        return verticalStepAVX2;
+    }
+#elif defined(__aarch64__)
+    return verticalStepNEON;
+#endif
+    return verticalStepScalar;
+}
+
+static vertical_kernel vertical_step = NULL;
+static pthread_once_t vertical_once = PTHREAD_ONCE_INIT;
+
+/* Helper function for the horizontal pass over one image row: a running sum of
+** the unmasked pixels (and a running count of them) in a box 2*r_f + 1 wide.
+** Input: The image bytes (ib), the mask, the image width (w), the row (j), the
+** column bounds (i0, i1), the radius, and where to store the sums and counts
+** (one entry per column from i0 + r_f to i1 - r_f - 1).
+** Output: None (void).
+*/
+static void horizontalSums(char * ib, unsigned char * mask, int w, int j,
+                           int i0, int i1, int r_f, int32_t * hs,
+                           int32_t * hn) {
+    int ncols = i1 - i0 - 2*r_f;
+    int32_t s = 0, n = 0;
+    char * p = ib + j*w;
+    unsigned char * m = mask + j*w;
+
+    for (int i = i0; i < i0 + 2*r_f + 1; i++) {
+        n += m[i];
+        s += p[i]*m[i];
+    }
+
+    int idx = i0 + r_f;
+    for (int k = 0; k < ncols - 1; k++) {
+        hs[k] = s;
+        hn[k] = n;
+        s += m[idx + r_f + 1]*p[idx + r_f + 1] - m[idx - r_f]*p[idx - r_f];
+        n += m[idx + r_f + 1] - m[idx - r_f];
+        idx++;
+    }
+
+    hs[ncols - 1] = s;
+    hn[ncols - 1] = n;
+}
+
+/* Helper function to pick the vertical kernel once for every thread */
+static void setVerticalKernel() {
+    vertical_step = chooseVerticalKernel();
+}
+
+/* Function to filter some of the rows of an image with the boxcar filter. Each
+** output pixel is the mean of the unmasked pixels in the (2*r_f + 1)^2 box
+** around it. Both passes are running sums, so the cost per pixel does not
+** depend on r_f: the horizontal sums of the last 2*r_f + 2 rows are kept in a
+** ring and the box sum of every column is slid down one row at a time. Sums
+** and counts are 32-bit, which is exact for any radius that fits in the image.
+** The rows r_f above and below [ja, jb) are read, so stripes of one image can
+** be filtered at the same time, each with its own scratch space.
+** Input: The image bytes (ib), the mask, the image width (w), the image border
+** indices (i0, j0, i1, j1), the filter radius, the output rows [ja, jb), the
+** output image, and the scratch space.
+** Output: The number of pixels whose box is fully masked. These are set to NaN
+** for fillBoxcarGaps().
+*/
+int boxcarFilterRows(char * ib, unsigned char * mask, int w, int i0, int j0,
+                     int i1, int j1, int r_f, int ja, int jb,
+                     double * filtered_image, struct boxcar_scratch * scratch) {
+    int ncols = i1 - i0 - 2*r_f;
+    int nrows = 2*r_f + 2;
+    int empty = 0;
+
+    // only pixels more than r_f from the border are filtered
+    if (ja < j0 + r_f) ja = j0 + r_f;
+    if (jb > j1 - r_f) jb = j1 - r_f;
+    if (ncols <= 0 || ja >= jb) {
+        return 0;
+    }
+
+    pthread_once(&vertical_once, setVerticalKernel);
+
+    if (ncols > scratch->col_alloc) {
+        scratch->col_alloc = ncols;
+        scratch->col_s = realloc(scratch->col_s, ncols*sizeof(int32_t));
+        scratch->col_n = realloc(scratch->col_n, ncols*sizeof(int32_t));
+    }
+
+    if (nrows*ncols > scratch->ring_alloc) {
+        scratch->ring_alloc = nrows*ncols;
+        scratch->ring_s = realloc(scratch->ring_s,
+                                  scratch->ring_alloc*sizeof(int32_t));
+        scratch->ring_n = realloc(scratch->ring_n,
+                                  scratch->ring_alloc*sizeof(int32_t));
+    }
+
+    int32_t * ring_s = scratch->ring_s, * ring_n = scratch->ring_n;
+    int32_t * col_s = scratch->col_s, * col_n = scratch->col_n;
+    // ring slots are counted from the first row of the first box
+    int top = ja - r_f;
+
+    // box sums for the first output row
+    memset(col_s, 0, ncols*sizeof(int32_t));
+    memset(col_n, 0, ncols*sizeof(int32_t));
+    for (int j = top; j < top + 2*r_f + 1; j++) {
+        int32_t * hs = ring_s + (j - top)*ncols;
+        int32_t * hn = ring_n + (j - top)*ncols;
+        horizontalSums(ib, mask, w, j, i0, i1, r_f, hs, hn);
+        for (int k = 0; k < ncols; k++) {
+            col_s[k] += hs[k];
+            col_n[k] += hn[k];
+        }
+    }
+
+    for (int j = ja; j < jb; j++) {
+        int32_t * as, * an, * ss, * sn;
+
+        if (j == ja) {
+            // the box is already in place, so add and subtract the same row
+            as = ss = ring_s;
+            an = sn = ring_n;
+        } else {
+            // the entering row takes the ring slot of the row that left the
+            // box one step ago
+            int enter = ((j + r_f - top) % nrows)*ncols;
+            int leave = ((j - r_f - 1 - top) % nrows)*ncols;
+            as = ring_s + enter;
+            an = ring_n + enter;
+            ss = ring_s + leave;
+            sn = ring_n + leave;
+            horizontalSums(ib, mask, w, j + r_f, i0, i1, r_f, as, an);
+        }
+
+        double * out = filtered_image + i0 + r_f + j*w;
+        int row_empty = vertical_step(col_s, col_n, as, an, ss, sn, out,
+                                      ncols);
+        if (row_empty > 0) {
+            for (int k = 0; k < ncols; k++) {
+                if (col_n[k] == 0) {
+                    out[k] = NAN;
+                }
+            }
+            empty += row_empty;
+        }
+    }
+
+    return empty;
+}
+
+/* Function to give every pixel boxcarFilterRows() could not filter (its box
+** was fully masked) the value of the pixel before it. This has to run over the
+** whole image in order once all of its rows are filtered.
+** Input: The image width (w), the image border indices (i0, j0, i1, j1), the
+** filter radius, and the filtered image.
+** Output: None (void).
+*/
+void fillBoxcarGaps(int w, int i0, int j0, int i1, int j1, int r_f,
+                    double * filtered_image) {
+    double last_ds = 0;
+
+    for (int j = j0 + r_f; j < j1 - r_f; j++) {
+        for (int i = i0 + r_f; i < i1 - r_f; i++) {
+            double * ds = &filtered_image[i + j*w];
+            if (isnan(*ds)) {
+                *ds = last_ds;
+            } else {
+                last_ds = *ds;
+            }
+        }
+    }
+}
+
+/* Function to process the image with a filter to reduce noise (the whole image
+** on the calling thread; see boxcarFilterRows()).
+** Input: The image bytes (ib), the mask, the image width (w), the image border
+** indices (i0, j0, i1, j1), the filter radius, the output image, and the
+** caller's scratch space.
+** Output: None (void). Pixels more than r_f from the border are written; a
+** pixel whose box is fully masked gets the previous pixel's value.
+*/
+void boxcarFilterImage(char * ib, unsigned char * mask, int w, int i0, int j0,
+                       int i1, int j1, int r_f, double * filtered_image,
+                       struct boxcar_scratch * scratch) {
+    if (boxcarFilterRows(ib, mask, w, i0, j0, i1, j1, r_f, j0, j1,
+                         filtered_image, scratch) > 0) {
+        fillBoxcarGaps(w, i0, j0, i1, j1, r_f, filtered_image);
+    }
+}
+
+/* Function to free the scratch space of boxcarFilterRows().
+** Input: The scratch space.
+** Output: None (void).
+*/
+void freeBoxcarScratch(struct boxcar_scratch * scratch) {
+    free(scratch->ring_s);
+    free(scratch->ring_n);
+    free(scratch->col_s);
+    free(scratch->col_n);
+    memset(scratch, 0, sizeof(struct boxcar_scratch));
+}
+
+/* Function to filter an image the way boxcarFilterImage() did before it used
+** running sums in both directions (the vertical pass is O(r_f) per pixel). It
+** is kept as the reference for checkBoxcarFilter(). The per-column counts are
+** chars, so the result is only meaningful for r_f < 64.
+** Input: Same as boxcarFilterImage(), but for the scratch space.
+** Output: A flag indicating the image was filtered (1) or its working space
+** could not be allocated (-1).
+*/
+int boxcarFilterReference(char * ib, unsigned char * mask, int w, int i0,
+                          int j0, int i1, int j1, int r_f,
+                          double * filtered_image) {
+    // it only runs for checkBoxcarFilter(), so it allocates its working
+    // space for each image
+    char * nc = malloc(w*j1);
+    uint64_t * ibc1 = malloc(w*j1*sizeof(uint64_t));
+
+    if (nc == NULL || ibc1 == NULL) {
+        fprintf(stderr, "Error allocating reference filter: %s.\n",
+                strerror(errno));
+        free(nc);
+        free(ibc1);
+        return -1;
+    }
+
+    int b = r_f;
+    int64_t isx;
+    int s, n;
+    double ds, dn;
+    double last_ds = 0;
+
+    for (int j = j0; j < j1; j++) {
+        n = 0;
+        isx = 0;
+        for (int i = i0; i < i0 + 2*r_f + 1; i++) {
+            n += mask[i + j*w];
+            isx += ib[i + j*w]*mask[i + j*w];
+        }
+
+        int idx = w*j + i0 + r_f;
+
+        for (int i = r_f + i0; i < i1 - r_f - 1; i++) {
+            ibc1[idx] = isx;
+            nc[idx] = n;
+            isx = isx + mask[idx + r_f + 1]*ib[idx + r_f + 1] -
+                  mask[idx - r_f]*ib[idx - r_f];
+            n = n + mask[idx + r_f + 1] - mask[idx - r_f];
+            idx++;
+        }
+
+        ibc1[idx] = isx;
+        nc[idx] = n;
+    }
+
+    for (int j = j0+b; j < j1-b; j++) {
+        for (int i = i0+b; i < i1-b; i++) {
+            n = s = 0;
+            for (int jp =- r_f; jp <= r_f; jp++) {
+                int idx = i + (j+jp)*w;
+                s += ibc1[idx];
+                n += nc[idx];
+            }
+            ds = s;
+            dn = n;
+            if (dn > 0.0) {
+                ds /= dn;
+                last_ds = ds;
+            } else {
+                ds = last_ds;
+            }
+            filtered_image[i + j*w] = ds;
+        }
+    }
+
+    free(nc);
+    free(ibc1);
+    return 1;
+}
+
+/* Function to check an image filtered by boxcarFilterImage() against the
+** reference filter, bit for bit.
+** Input: The arguments boxcarFilterImage() was called with, including the
+** image it filtered and scratch space to filter it again with.
+** Output: A flag indicating the two filters agree (1) or not (-1).
+*/
+int checkBoxcarFilter(char * ib, unsigned char * mask, int w, int i0, int j0,
+                      int i1, int j1, int r_f, double * filtered_image,
+                      struct boxcar_scratch * scratch) {
+    double * reference = malloc(w*j1*sizeof(double));
+    struct timespec start, mid, end;
+    int mismatches = 0, first_i = 0, first_j = 0;
+
+    if (reference == NULL) {
+        fprintf(stderr, "Error allocating reference filtered image: %s.\n",
+                strerror(errno));
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (boxcarFilterReference(ib, mask, w, i0, j0, i1, j1, r_f,
+                              reference) < 1) {
+        free(reference);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &mid);
+    // time the running-sum filter again on the same input for comparison
+    boxcarFilterImage(ib, mask, w, i0, j0, i1, j1, r_f, filtered_image,
+                      scratch);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (int j = j0 + r_f; j < j1 - r_f; j++) {
+        for (int i = i0 + r_f; i < i1 - r_f; i++) {
+            int idx = i + j*w;
+            if (memcmp(&reference[idx], &filtered_image[idx],
+                       sizeof(double)) != 0) {
+                if (mismatches == 0) {
+                    first_i = i;
+                    first_j = j;
+                }
+                mismatches++;
+            }
+        }
+    }
+
+    printf("(*) Boxcar check (r = %d): reference %.2f msec, running sum %.2f "
+           "msec, ", r_f,
+           (mid.tv_sec - start.tv_sec)*1e3 + (mid.tv_nsec - start.tv_nsec)*1e-6,
+           (end.tv_sec - mid.tv_sec)*1e3 + (end.tv_nsec - mid.tv_nsec)*1e-6);
+
+    if (mismatches > 0) {
+        printf("%d pixels differ (first at [%d, %d]: %.17g vs. %.17g).\n",
+               mismatches, first_i, first_j, reference[first_i + first_j*w],
+               filtered_image[first_i + first_j*w]);
+        if (r_f >= 64) {
+            printf("(*) The reference filter's counts overflow for radii of 64 "
+                   "or more.\n");
+        }
+        free(reference);
+        return -1;
+    }
+
+    printf("outputs match.\n");
+    free(reference);
+    return 1;
+}
@@ -0,0 +1,32 @@
+#ifndef BOXCAR_H
+#define BOXCAR_H
+
+#include <stdint.h>
+
+/* Per-thread working space of boxcarFilterRows() (start zeroed) */
+struct boxcar_scratch {
+    int32_t * ring_s, * ring_n;  // horizontal sums/counts of the rows in a box
+    int32_t * col_s, * col_n;    // box sums/counts of every column
+    int ring_alloc, col_alloc;
+};
+
+extern int boxcar_check;
+
+int boxcarFilterRows(char * ib, unsigned char * mask, int w, int i0, int j0,
+                     int i1, int j1, int r_f, int ja, int jb,
+                     double * filtered_image, struct boxcar_scratch * scratch);
+void fillBoxcarGaps(int w, int i0, int j0, int i1, int j1, int r_f,
+                    double * filtered_image);
+void freeBoxcarScratch(struct boxcar_scratch * scratch);
+
+void boxcarFilterImage(char * ib, unsigned char * mask, int w, int i0, int j0,
+                       int i1, int j1, int r_f, double * filtered_image,
+                       struct boxcar_scratch * scratch);
+int boxcarFilterReference(char * ib, unsigned char * mask, int w, int i0,
+                          int j0, int i1, int j1, int r_f,
+                          double * filtered_image);
+int checkBoxcarFilter(char * ib, unsigned char * mask, int w, int i0, int j0,
+                      int i1, int j1, int r_f, double * filtered_image,
+                      struct boxcar_scratch * scratch);
+
+#endif
@@ -0,0 +1,763 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <ueye.h>
+
+#include "broadcast.h"
+#include "camera.h"
+#include "commands.h"
+#include "pipeline.h"
+#include "perf.h"
+
+// number of clients connected right now
+int num_clients = 0;
+struct subscriber subscribers[MAX_CLIENTS];
+// sent in place of the image when a message has no frame
+char blank_image[CAMERA_WIDTH*CAMERA_HEIGHT];
+// the latest message, the subscribers' pending messages and generations, and
+// the message reference counts, all protected by broadcast_lock
+struct broadcast_msg * latest_msg = NULL;
+int num_published = 0;
+int broadcaster_stopping = 0;
+pthread_mutex_t broadcast_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t broadcast_done = PTHREAD_COND_INITIALIZER;
+// epoll set of the server socket, the client sockets, and the wake-up event
+int epoll_fd = -1, wake_fd = -1, server_fd = -1;
+int broadcaster_started = 0;
+pthread_t broadcast_thread_id;
+size_t command_size;
+uint32_t command_version, telemetry_version;
+command_handler on_commands;
+
+/* Helper function to drop a reference to a message, freeing it (and its copy
+** of the frame) with the last one. Called with broadcast_lock held.
+** Input: The message.
+** Output: None (void).
+*/
+void releaseMsg(struct broadcast_msg * msg) {
+    if (--msg->refs > 0) {
+        return;
+    }
+
+    if (msg->frame != NULL) {
+        freeFrame(msg->frame);
+        free(msg->frame);
+    }
+    for (int p = 0; p < msg->num_payloads; p++) {
+        free(msg->payloads[p].data);
+    }
+    free(msg->telemetry);
+    free(msg);
+}
+
+/* Helper function to change which events we wait for on a client socket.
+** Input: The client, and whether to wait for room to write as well.
+** Output: None (void).
+*/
+void watchClient(struct subscriber * sub, int want_out) {
+    struct epoll_event event = {0};
+
+    if (sub->want_out == want_out) {
+        return;
+    }
+
+    event.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+    event.data.ptr = sub;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sub->fd, &event) == -1) {
+        fprintf(stderr, "Error watching client %s: %s.\n", sub->ip_addr,
+                strerror(errno));
+    }
+    sub->want_out = want_out;
+}
+
+/* Helper function to get what goes out to a client after the telemetry of a
+** message: the image itself, or the message's encoding for the client's
+** subscription, which is made the first time a client needs it.
+** Input: The client, which has just started on the message.
+** Output: A flag indicating there is something to send or not.
+*/
+int prepareBody(struct subscriber * sub) {
+    struct broadcast_msg * msg = sub->sending;
+    char * image = (msg->frame != NULL) ? msg->frame->output : blank_image;
+    struct stream_payload * payload = NULL;
+
+    if (sub->subscription.stream == STREAM_FULL) {
+        // the AOI of the frame, with its size in the telemetry
+        sub->body = image;
+        sub->body_size = (msg->frame != NULL) ?
+            msg->frame->geometry.width*msg->frame->geometry.height :
+            CAMERA_WIDTH*CAMERA_HEIGHT;
+        return 1;
+    }
+
+    for (int p = 0; p < msg->num_payloads; p++) {
+        if (msg->payloads[p].subscription.stream == sub->subscription.stream &&
+            msg->payloads[p].subscription.arg == sub->subscription.arg) {
+            payload = &msg->payloads[p];
+        }
+    }
+
+    if (payload == NULL) {
+        // there is one slot per client, so this never runs out
+        payload = &msg->payloads[msg->num_payloads];
+        if (encodeStream(msg->frame, image, &sub->subscription, payload) < 1) {
+            return -1;
+        }
+        msg->num_payloads++;
+    }
+
+    sub->body = payload->data;
+    sub->body_size = payload->size;
+    return 1;
+}
+
+/* Function to disconnect a client and let go of the messages it held.
+** Input: The client.
+** Output: None (void).
+*/
+void dropClient(struct subscriber * sub) {
+    printf("Client %s dropped the connection (%d messages sent, publish-to-"
+           "wire latency %.1f msec mean, %.1f msec max).\n", sub->ip_addr,
+           sub->num_sent,
+           (sub->num_sent > 0) ? sub->latency_sum/sub->num_sent : 0.0,
+           sub->latency_max);
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sub->fd, NULL);
+    close(sub->fd);
+
+    pthread_mutex_lock(&broadcast_lock);
+    if (sub->sending != NULL) {
+        releaseMsg(sub->sending);
+    }
+    if (sub->pending != NULL) {
+        releaseMsg(sub->pending);
+    }
+    sub->sending = NULL;
+    sub->pending = NULL;
+    sub->fd = -1;
+    num_clients--;
+    // anyone waiting on this client to be sent a message can stop waiting
+    pthread_cond_broadcast(&broadcast_done);
+    pthread_mutex_unlock(&broadcast_lock);
+
+    free(sub->cmd_buf);
+    sub->cmd_buf = NULL;
+}
+
+/* Function to write as much of a client's messages to its socket as it will
+** take without blocking. A client that falls behind skips to the newest
+** message once it is done with the one it is on.
+** Input: The client.
+** Output: A flag indicating the client is still connected or should be dropped.
+*/
+int sendToClient(struct subscriber * sub) {
+    // a new client gets nothing until we know what it wants
+    if (!sub->subscribed) {
+        return 1;
+    }
+
+    while (1) {
+        struct broadcast_msg * msg;
+        struct iovec iov[2];
+        struct msghdr header = {0};
+        struct timespec now;
+        size_t total;
+        ssize_t ret;
+        int num_iov = 0;
+
+        if (sub->sending == NULL) {
+            pthread_mutex_lock(&broadcast_lock);
+            sub->sending = sub->pending;
+            sub->pending = NULL;
+            pthread_mutex_unlock(&broadcast_lock);
+
+            if (sub->sending == NULL) {
+                watchClient(sub, 0);
+                return 1;
+            }
+            sub->sent = 0;
+            clock_gettime(CLOCK_MONOTONIC, &sub->progress);
+            if (prepareBody(sub) < 1) {
+                return -1;
+            }
+        }
+
+        // the telemetry and then the image (straight from the frame) or the
+        // encoding the client subscribed to
+        msg = sub->sending;
+        total = msg->telemetry_size + sub->body_size;
+        if (sub->sent < msg->telemetry_size) {
+            iov[num_iov].iov_base = msg->telemetry + sub->sent;
+            iov[num_iov].iov_len = msg->telemetry_size - sub->sent;
+            num_iov++;
+            iov[num_iov].iov_base = sub->body;
+            iov[num_iov].iov_len = sub->body_size;
+            num_iov++;
+        } else {
+            size_t offset = sub->sent - msg->telemetry_size;
+            iov[num_iov].iov_base = sub->body + offset;
+            iov[num_iov].iov_len = sub->body_size - offset;
+            num_iov++;
+        }
+        header.msg_iov = iov;
+        header.msg_iovlen = num_iov;
+
+        ret = sendmsg(sub->fd, &header, MSG_NOSIGNAL);
+        if (ret == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // wait for the client to make room
+                watchClient(sub, 1);
+                return 1;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error sending to client %s: %s.\n", sub->ip_addr,
+                    strerror(errno));
+            return -1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        sub->progress = now;
+        sub->sent += ret;
+        if (sub->sent < total) {
+            continue;
+        }
+
+        // the whole message is out
+        double latency = msecBetween(&msg->published, &now);
+        sub->num_sent++;
+        sub->latency_sum += latency;
+        if (latency > sub->latency_max) {
+            sub->latency_max = latency;
+        }
+        recordPerf(PERF_SEND, latency);
+
+        if (verbose) {
+            printf("(*) Telemetry and image sent to client %s %.1f msec after "
+                   "they were published.\n", sub->ip_addr, latency);
+        }
+
+        pthread_mutex_lock(&broadcast_lock);
+        sub->done_generation = msg->generation;
+        releaseMsg(msg);
+        pthread_cond_broadcast(&broadcast_done);
+        pthread_mutex_unlock(&broadcast_lock);
+        sub->sending = NULL;
+    }
+}
+
+/* Helper function to check the header of a client's command message once it
+** is all in, and to clear the commands for it.
+** Input: The client.
+** Output: A flag indicating the header is good or the client should be
+** dropped.
+*/
+int checkCommandHeader(struct subscriber * sub) {
+    struct message_header * header = &sub->cmd_header;
+
+    if (memcmp(header->magic, COMMAND_MAGIC, sizeof(header->magic)) != 0) {
+        printf("Client %s sent commands without a header. Dropping it.\n",
+               sub->ip_addr);
+        return -1;
+    }
+    if (header->size > MAX_COMMAND_SIZE) {
+        printf("Client %s sent %u bytes of commands (at most %d). Dropping "
+               "it.\n", sub->ip_addr, header->size, MAX_COMMAND_SIZE);
+        return -1;
+    }
+
+    // the commands only ever grow at the end, so whatever an older client
+    // leaves out stays 0 (unchanged), and what a newer one adds is skipped
+    if ((header->version != command_version || header->size != command_size)
+        && !sub->warned_format) {
+        printf("Client %s sends version %u commands (%u bytes), we take "
+               "version %u (%lu bytes).\n", sub->ip_addr, header->version,
+               header->size, command_version, command_size);
+        sub->warned_format = 1;
+    }
+    memset(sub->cmd_buf, 0, command_size);
+
+    return 1;
+}
+
+/* Function to read whatever a client has sent, handing on every whole command
+** message.
+** Input: The client.
+** Output: A flag indicating the client is still connected or should be dropped.
+*/
+int receiveFromClient(struct subscriber * sub) {
+    const size_t header_size = sizeof(struct message_header);
+    char skipped[256];
+
+    while (1) {
+        char * dest;
+        size_t want;
+
+        // the header, then as much of the commands as we take, then the rest
+        if (sub->cmd_got < header_size) {
+            dest = (char *) &sub->cmd_header + sub->cmd_got;
+            want = header_size - sub->cmd_got;
+        } else {
+            size_t body_got = sub->cmd_got - header_size;
+
+            if (body_got < command_size) {
+                dest = sub->cmd_buf + body_got;
+                want = sub->cmd_header.size < command_size ?
+                       sub->cmd_header.size - body_got :
+                       command_size - body_got;
+            } else {
+                dest = skipped;
+                want = sub->cmd_header.size - body_got;
+                if (want > sizeof(skipped)) {
+                    want = sizeof(skipped);
+                }
+            }
+        }
+
+        ssize_t ret = recv(sub->fd, dest, want, 0);
+        if (ret == 0) {
+            return -1;
+        } else if (ret == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error receiving from client %s: %s.\n",
+                    sub->ip_addr, strerror(errno));
+            return -1;
+        }
+
+        sub->cmd_got += ret;
+        if (sub->cmd_got == header_size && checkCommandHeader(sub) < 1) {
+            return -1;
+        }
+        if (sub->cmd_got == header_size + sub->cmd_header.size) {
+            on_commands(sub->cmd_buf, sub->ip_addr, &sub->subscription);
+            sub->cmd_got = 0;
+
+            if (!sub->subscribed) {
+                sub->subscribed = 1;
+                if (sendToClient(sub) < 1) {
+                    return -1;
+                }
+            }
+        }
+    }
+}
+
+/* Function to accept a new client, which is sent the latest message as soon
+** as it sends its first commands (or after COMMAND_WAIT_SEC).
+** Input: None.
+** Output: None (void).
+*/
+void acceptClient() {
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    struct epoll_event event = {0};
+    struct subscriber * sub = NULL;
+    int fd;
+
+    if ((fd = accept(server_fd, (struct sockaddr *) &address, &length)) == -1) {
+        printf("New client did not connect.\n");
+        return;
+    }
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (subscribers[i].fd == -1) {
+            sub = &subscribers[i];
+            break;
+        }
+    }
+
+    if (sub == NULL) {
+        printf("Turning away client %s, already serving %d clients.\n",
+               inet_ntoa(address.sin_addr), MAX_CLIENTS);
+        close(fd);
+        return;
+    }
+
+    // the slot is filled in whole under the lock, so broadcast() never sees
+    // it half made (it takes any slot without an fd of -1 for a client)
+    struct subscriber client = {0};
+    client.fd = fd;
+    inet_ntop(AF_INET, &address.sin_addr, client.ip_addr, INET_ADDRSTRLEN);
+    if ((client.cmd_buf = malloc(command_size)) == NULL) {
+        fprintf(stderr, "Error allocating buffer for new client: %s.\n",
+                strerror(errno));
+        close(fd);
+        return;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    event.events = EPOLLIN;
+    event.data.ptr = sub;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        fprintf(stderr, "Error watching new client: %s.\n", strerror(errno));
+        free(client.cmd_buf);
+        close(fd);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &client.progress);
+
+    pthread_mutex_lock(&broadcast_lock);
+    client.pending = latest_msg;
+    if (latest_msg != NULL) {
+        latest_msg->refs++;
+        client.done_generation = latest_msg->generation - 1;
+    } else {
+        client.done_generation = num_published;
+    }
+    *sub = client;
+    num_clients++;
+    pthread_mutex_unlock(&broadcast_lock);
+
+    printf("Client %s connected (%d connected now).\n", sub->ip_addr,
+           num_clients);
+}
+
+/* Function for the broadcaster thread: accepts clients, receives their
+** commands, and writes every published message out to them.
+** Input: None.
+** Output: None (void).
+*/
+void * broadcastMessages() {
+    struct epoll_event events[MAX_CLIENTS + 2];
+
+    while (1) {
+        struct timespec now;
+        int num_events, stopping;
+
+        pthread_mutex_lock(&broadcast_lock);
+        stopping = broadcaster_stopping;
+        pthread_mutex_unlock(&broadcast_lock);
+        if (stopping) {
+            break;
+        }
+
+        num_events = epoll_wait(epoll_fd, events, MAX_CLIENTS + 2, 1000);
+        if (num_events == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error waiting on clients: %s.\n", strerror(errno));
+            break;
+        }
+
+        for (int e = 0; e < num_events; e++) {
+            struct subscriber * sub = events[e].data.ptr;
+
+            if (events[e].data.ptr == &server_fd) {
+                acceptClient();
+            } else if (events[e].data.ptr == &wake_fd) {
+                // something was published, so start everyone on it
+                uint64_t count;
+                if (read(wake_fd, &count, sizeof(count)) == -1 &&
+                    errno != EAGAIN) {
+                    fprintf(stderr, "Error reading broadcast event: %s.\n",
+                            strerror(errno));
+                }
+                for (int i = 0; i < MAX_CLIENTS; i++) {
+                    if (subscribers[i].fd != -1 &&
+                        sendToClient(&subscribers[i]) < 1) {
+                        dropClient(&subscribers[i]);
+                    }
+                }
+            } else if (sub->fd != -1) {
+                if ((events[e].events & (EPOLLERR | EPOLLHUP)) ||
+                    ((events[e].events & EPOLLIN) &&
+                     receiveFromClient(sub) < 1) ||
+                    ((events[e].events & EPOLLOUT) && sendToClient(sub) < 1)) {
+                    dropClient(sub);
+                }
+            }
+        }
+
+        // a client still on a message CLIENT_MAX_BEHIND older than the latest
+        // one is too slow to keep up, even skipping messages
+        pthread_mutex_lock(&broadcast_lock);
+        int latest = num_published;
+        pthread_mutex_unlock(&broadcast_lock);
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (subscribers[i].fd != -1 && subscribers[i].sending != NULL &&
+                latest - subscribers[i].sending->generation >
+                CLIENT_MAX_BEHIND) {
+                printf("Client %s is more than %d messages behind.\n",
+                       subscribers[i].ip_addr, CLIENT_MAX_BEHIND);
+                dropClient(&subscribers[i]);
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (subscribers[i].fd != -1 && !subscribers[i].subscribed &&
+                msecBetween(&subscribers[i].progress, &now) >
+                COMMAND_WAIT_SEC*1000.0) {
+                printf("User %s did not send any commands. Send telemetry and "
+                       "camera settings back anyway.\n", 
+                       subscribers[i].ip_addr);
+                subscribers[i].subscribed = 1;
+                if (sendToClient(&subscribers[i]) < 1) {
+                    dropClient(&subscribers[i]);
+                }
+            }
+        }
+
+        // a client that stops reading would hold its frames forever
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (subscribers[i].fd != -1 && subscribers[i].sending != NULL &&
+                msecBetween(&subscribers[i].progress, &now) >
+                CLIENT_STALL_SEC*1000.0) {
+                printf("Client %s has not read anything in %d sec.\n",
+                       subscribers[i].ip_addr, CLIENT_STALL_SEC);
+                dropClient(&subscribers[i]);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Function to start the broadcaster thread on a listening server socket.
+** Input: The socket, the size and version of the command messages clients
+** send, the version of the telemetry we send, and what to do with each
+** command message.
+** Output: A flag indicating the broadcaster started successfully or not.
+*/
+int startBroadcaster(int listen_fd, size_t size, uint32_t cmd_version,
+                     uint32_t tel_version, command_handler handler) {
+    struct epoll_event event = {0};
+
+    server_fd = listen_fd;
+    command_size = size;
+    command_version = cmd_version;
+    telemetry_version = tel_version;
+    on_commands = handler;
+    broadcaster_stopping = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        subscribers[i].fd = -1;
+    }
+
+    if ((epoll_fd = epoll_create1(0)) == -1) {
+        fprintf(stderr, "Error creating epoll set: %s.\n", strerror(errno));
+        return -1;
+    }
+
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+        fprintf(stderr, "Error creating broadcast event: %s.\n",
+                strerror(errno));
+        return -1;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = &server_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event) == -1) {
+        fprintf(stderr, "Error watching server socket: %s.\n", strerror(errno));
+        return -1;
+    }
+
+    event.data.ptr = &wake_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) == -1) {
+        fprintf(stderr, "Error watching broadcast event: %s.\n",
+                strerror(errno));
+        return -1;
+    }
+
+    if (pthread_create(&broadcast_thread_id, NULL, broadcastMessages,
+                       NULL) != 0) {
+        fprintf(stderr, "Error creating broadcaster thread: %s.\n",
+                strerror(errno));
+        return -1;
+    }
+    broadcaster_started = 1;
+
+    return 1;
+}
+
+/* Helper function to copy what clients are sent of a frame (its geometry,
+** filtered image and blobs), so the frame can go back to the pool while the
+** clients are still being sent it.
+** Input: The frame.
+** Output: The copy (to be let go of with freeFrame() and free()), or NULL if
+** it could not be allocated.
+*/
+struct frame * copyFrame(struct frame * frame) {
+    struct frame * copy = calloc(1, sizeof(struct frame));
+    size_t image_size = frame->geometry.width*frame->geometry.height;
+    size_t blobs_size = sizeof(double)*frame->blob_count;
+
+    if (copy == NULL) {
+        return NULL;
+    }
+    copy->geometry = frame->geometry;
+    copy->blob_count = copy->blobs_alloc = frame->blob_count;
+    // one extra blob each, so there is something to allocate without blobs
+    copy->output = malloc(image_size);
+    copy->star_x = malloc(blobs_size + sizeof(double));
+    copy->star_y = malloc(blobs_size + sizeof(double));
+    copy->star_mags = malloc(blobs_size + sizeof(double));
+    if (copy->output == NULL || copy->star_x == NULL || copy->star_y == NULL ||
+        copy->star_mags == NULL) {
+        freeFrame(copy);
+        free(copy);
+        return NULL;
+    }
+
+    memcpy(copy->output, frame->output, image_size);
+    memcpy(copy->star_x, frame->star_x, blobs_size);
+    memcpy(copy->star_y, frame->star_y, blobs_size);
+    memcpy(copy->star_mags, frame->star_mags, blobs_size);
+
+    return copy;
+}
+
+/* Function to publish a telemetry snapshot and frame to every client. It never
+** waits on the clients: the broadcaster thread writes the message out, and a
+** client still busy with an older message gets this one after it (unless a
+** newer one comes first).
+** Input: The frame whose image goes out (copied, so the caller can release it
+** straight away, or NULL for a blank image), and the telemetry to copy
+** (which goes out behind a header with its version and size).
+** Output: The generation of the message, for waitForBroadcast(), or -1 if it
+** could not be published.
+*/
+int broadcast(struct frame * frame, void * telemetry, size_t telemetry_size) {
+    struct broadcast_msg * msg, * prev;
+    struct message_header header;
+    uint64_t one = 1;
+    int generation;
+
+    msg = malloc(sizeof(struct broadcast_msg));
+    if (msg == NULL ||
+        (msg->telemetry = malloc(sizeof(header) + telemetry_size)) == NULL) {
+        fprintf(stderr, "Error allocating broadcast message: %s.\n",
+                strerror(errno));
+        free(msg);
+        return -1;
+    }
+    msg->frame = NULL;
+    if (frame != NULL && (msg->frame = copyFrame(frame)) == NULL) {
+        fprintf(stderr, "Error copying frame for broadcast: %s.\n",
+                strerror(errno));
+        free(msg->telemetry);
+        free(msg);
+        return -1;
+    }
+
+    memcpy(header.magic, TELEMETRY_MAGIC, sizeof(header.magic));
+    header.version = telemetry_version;
+    header.size = telemetry_size;
+    memcpy(msg->telemetry, &header, sizeof(header));
+    memcpy(msg->telemetry + sizeof(header), telemetry, telemetry_size);
+    msg->telemetry_size = sizeof(header) + telemetry_size;
+    msg->num_payloads = 0;
+    clock_gettime(CLOCK_MONOTONIC, &msg->published);
+
+    pthread_mutex_lock(&broadcast_lock);
+    generation = msg->generation = ++num_published;
+    msg->refs = 1;
+    prev = latest_msg;
+    latest_msg = msg;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (subscribers[i].fd == -1) {
+            continue;
+        }
+        // a message the client has yet to start on is skipped
+        if (subscribers[i].pending != NULL) {
+            releaseMsg(subscribers[i].pending);
+        }
+        subscribers[i].pending = msg;
+        msg->refs++;
+    }
+    if (prev != NULL) {
+        releaseMsg(prev);
+    }
+    pthread_mutex_unlock(&broadcast_lock);
+
+    if (wake_fd != -1 && write(wake_fd, &one, sizeof(one)) == -1) {
+        fprintf(stderr, "Error waking broadcaster: %s.\n", strerror(errno));
+    }
+
+    return generation;
+}
+
+/* Function to wait until every connected client has been sent a message at
+** least as new as the given one (clients that drop out are not waited on).
+** Input: The generation of the message.
+** Output: None (void).
+*/
+void waitForBroadcast(int generation) {
+    int behind;
+
+    pthread_mutex_lock(&broadcast_lock);
+    do {
+        behind = 0;
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (subscribers[i].fd != -1 &&
+                subscribers[i].done_generation < generation) {
+                behind = 1;
+            }
+        }
+
+        if (behind && !broadcaster_stopping) {
+            if (verbose) {
+                printf("> Waiting for data to send to clients...\n");
+            }
+            pthread_cond_wait(&broadcast_done, &broadcast_lock);
+        }
+    } while (behind && !broadcaster_stopping);
+    pthread_mutex_unlock(&broadcast_lock);
+}
+
+/* Function to stop the broadcaster thread, disconnect every client, and let go
+** of all messages (and so the frames they held).
+** Input: None.
+** Output: None (void).
+*/
+void stopBroadcaster() {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&broadcast_lock);
+    broadcaster_stopping = 1;
+    pthread_cond_broadcast(&broadcast_done);
+    pthread_mutex_unlock(&broadcast_lock);
+
+    if (!broadcaster_started) {
+        return;
+    }
+
+    if (write(wake_fd, &one, sizeof(one)) == -1) {
+        fprintf(stderr, "Error waking broadcaster: %s.\n", strerror(errno));
+    }
+    pthread_join(broadcast_thread_id, NULL);
+    broadcaster_started = 0;
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (subscribers[i].fd != -1) {
+            dropClient(&subscribers[i]);
+        }
+    }
+
+    pthread_mutex_lock(&broadcast_lock);
+    if (latest_msg != NULL) {
+        releaseMsg(latest_msg);
+        latest_msg = NULL;
+    }
+    pthread_mutex_unlock(&broadcast_lock);
+
+    close(epoll_fd);
+    close(wake_fd);
+    epoll_fd = -1;
+    wake_fd = -1;
+}
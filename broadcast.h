@@ -0,0 +1,98 @@
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "stream.h"
+
+// most clients the broadcaster serves at once
+#define MAX_CLIENTS       16
+// a client that has not taken one message in this long is dropped [sec]
+#define CLIENT_STALL_SEC  10
+// a client that is still writing out a message this many messages older than
+// the latest one is dropped (so at most this many and one images are held)
+#define CLIENT_MAX_BEHIND 8
+// how long a new client has to send its first commands (and subscription)
+// before we send it the full image anyway [sec]
+#define COMMAND_WAIT_SEC  3
+// magic of the header before every command message and every telemetry
+#define COMMAND_MAGIC     "BCMD"
+#define TELEMETRY_MAGIC   "BCTL"
+// largest command message a client may send (past our own, it is skipped)
+#define MAX_COMMAND_SIZE  4096
+
+struct frame;
+
+#pragma pack(push, 1)
+/* Goes before every command message a client sends and every telemetry we
+** send, so either end can tell which layout follows. Both only ever grow at
+** the end: a shorter message than ours is zero-filled (0 = unchanged), and
+** whatever a longer one has past ours is skipped. */
+struct message_header {
+    char magic[4];              // COMMAND_MAGIC or TELEMETRY_MAGIC
+    uint32_t version;           // layout of the message
+    uint32_t size;              // bytes of the message after the header (the
+                                // telemetry only, not the image after it)
+};
+#pragma pack(pop)
+
+/* Called on the broadcaster thread with every whole command message a client
+** sends, the address of the client, and its subscription, which the handler 
+** can change (it must not block for long) */
+typedef void (* command_handler)(void * commands, char * ip_addr,
+                                 struct subscription * subscription);
+
+/* Telemetry snapshot and the image it goes with, written as they are to every
+** client that is subscribed when it is published */
+struct broadcast_msg {
+    char * telemetry;           // header and copy of the telemetry
+    size_t telemetry_size;      // (including the header)
+    struct frame * frame;       // copy of the image and blobs (or NULL)
+    struct timespec published;  // when it was published (CLOCK_MONOTONIC)
+    int generation;             // count of messages published before this one
+    int refs;                   // the latest pointer and the clients using it
+    // encodings of the frame made so far, one per kind of subscription (only
+    // touched by the broadcaster thread)
+    struct stream_payload payloads[MAX_CLIENTS];
+    int num_payloads;
+};
+
+/* One connected client */
+struct subscriber {
+    int fd;                         // socket (-1 for an unused slot)
+    char ip_addr[INET_ADDRSTRLEN];
+    struct subscription subscription;
+    int subscribed;                 // (bool) it has sent commands, or had its
+                                    // chance to
+    struct broadcast_msg * sending; // message being written out (or NULL)
+    char * body;                    // what goes out after its telemetry
+    size_t body_size;
+    size_t sent;                    // bytes of the message written so far
+    struct timespec progress;       // when we last wrote any of it (or when
+                                    // the client connected)
+    struct broadcast_msg * pending; // newest message we have yet to start on
+    int done_generation;            // generation of the last message sent
+    int want_out;                   // (bool) we wait for room in the socket
+    struct message_header cmd_header; // of the command message coming in
+    char * cmd_buf;                 // partly received command message
+    size_t cmd_got;                 // bytes of it so far (with the header)
+    int warned_format;              // (bool) we said its commands differ
+                                    // from ours
+    // publish-to-wire latency of the messages written out to this client
+    int num_sent;
+    double latency_sum, latency_max;
+};
+
+extern int num_clients;
+
+int startBroadcaster(int listen_fd, size_t command_size,
+                     uint32_t command_version, uint32_t telemetry_version,
+                     command_handler handler);
+int broadcast(struct frame * frame, void * telemetry, size_t telemetry_size);
+void waitForBroadcast(int generation);
+void stopBroadcaster();
+
+#endif
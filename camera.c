@@ -7,15 +7,67 @@
 #include <ueye.h>
 #include <stdbool.h>
 #include <pthread.h>  
+#include <stdatomic.h>
 
 #include "camera.h"
 #include "astrometry.h"
 #include "commands.h"
 #include "lens_adapter.h"
 #include "matrix.h"
-
-void merge(double A[], int p, int q, int r, double X[],double Y[]);
-void part(double A[], int p, int r, double X[], double Y[]);
+#include "params.h"
+#include "pipeline.h"
+#include "boxcar.h"
+#include "workers.h"
+#include "centroid.h"
+#include "broadcast.h"
+#include "archive.h"
+#include "obslog.h"
+#include "perf.h"
+#include "hotpix.h"
+#include "background.h"
+#include "blobs.h"
+#include "propagate.h"
+#include "stack.h"
+#include "live.h"
+
+
+/* Shared by the makeMask() stripe tasks */
+struct mask_job {
+    struct blob_context * ctx;
+    char * ib;                  // image bytes
+    int w;                      // image width [px]
+    int i0, j0, i1, j1;         // pixels to check (inside the masked border)
+    int spike_limit;
+    int dynamic_hot_pixels;     // (bool) search for dynamic hot pixels
+    int hot_pixels[NUM_STRIPES];
+    int transitions[NUM_STRIPES]; // pixels joining or leaving the tracked map
+};
+/* Shared by the centroiding stripe tasks */
+struct centroid_job {
+    struct blob_context * ctx;
+    char * input_buffer;        // raw image
+    int w, h;                   // image dimensions [px]
+    double * star_x, * star_y, * star_mags;
+    int blob_count;
+};
+/* Shared by the findBlobs() stripe tasks */
+struct blob_job {
+    struct blob_context * ctx;
+    char * input_buffer;        // raw image
+    char * output_buffer;       // image to return to clients (may be NULL)
+    int w;                      // image width [px]
+    int i0, j0, i1, j1;         // image border indices
+    int b;                      // border excluded from statistics and blobs
+    // filter settings, read once so every stripe uses the same ones
+    int r_smooth, high_pass_filter, r_high_pass_filter, filter_return_image;
+    double mean;                // mean of the filtered image
+    double threshold;           // pixels above this can be blobs
+    int tiled;                  // (bool) thresholds from the tiled background
+    // per-stripe results
+    int empty_smooth[NUM_STRIPES], empty_hp[NUM_STRIPES];
+    double sx[NUM_STRIPES], sx2[NUM_STRIPES], sx_raw[NUM_STRIPES];
+    int num_pix[NUM_STRIPES];
+};
 
 // 1-254 are possible IDs. Command-line argument from user with ./commands
 HIDS camera_handle;          
@@ -27,11 +79,35 @@ SENSORINFO sensorInfo;
 
 // global variables
 int send_data = 0;
+// (bool) an exposure is under way, which lens commands wait out
 int taking_image = 0;
+pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t image_taken = PTHREAD_COND_INITIALIZER;
 int default_focus_photos = 3;
-int buffer_num, shutting_down, mem_id;
-char * memory, * waiting_mem, * mem_starting_ptr;
-unsigned char * mask;
+int buffer_num, shutting_down;
+char * memory, * waiting_mem;
+// ring of camera memory buffers the driver captures into (image sequence)
+char * ring_mem[MAX_FRAMES] = {NULL};
+int ring_id[MAX_FRAMES];
+// number of buffers in the ring and whether the sensor runs freely (1) or is
+// software-triggered for every frame (0); set from the command line
+int num_camera_buffers = 6;
+int continuous_capture = 0;
+// readout geometry of the images being captured (the whole sensor unless the
+// command line or a user asks for an AOI, binning or subsampling), and the one
+// a user asked for, which the capture stage switches to before its next image
+struct camera_geometry camera_geometry = {
+    .factor = 1,
+    .subsample = 0,
+    .x = 0,
+    .y = 0,
+    .width = CAMERA_WIDTH,
+    .height = CAMERA_HEIGHT,
+    .stride = CAMERA_WIDTH,
+};
+struct camera_geometry requested_geometry;
+int geometry_requested = 0;
+pthread_mutex_t geometry_lock = PTHREAD_MUTEX_INITIALIZER;
 // for printing camera errors
 const char * cam_error;
 // 'curr' = current, 'pc' = pixel clock, 'fps' = frames per sec, 
@@ -41,7 +117,18 @@ int curr_pc, curr_color_mode, curr_ext_trig, curr_trig_delay, curr_master_gain;
 int curr_red_gain, curr_green_gain, curr_blue_gain, curr_gamma, curr_gain_boost;
 unsigned int curr_timeout;
 int bl_offset, bl_mode;
-int prev_dynamic_hp;
+// auto-focusing state shared by the capture and solving stages of the pipeline
+int af_photo = 0, num_focus_pos;
+int * blob_mags = NULL;
+FILE * af_file = NULL;
+char af_filename[256];
+// what the blob-finding stage keeps from frame to frame for this camera
+struct blob_context camera_blobs;
+// and for finding blobs in the stack of its last few exposures
+struct blob_context stack_blobs;
+struct frame_stack camera_stack;
+// the blobs of the last image the solving stage saw, to match the next with
+struct blob_reference previous_blobs;
 
 /* Blob parameters global structure (defined in camera.h) */
 struct blob_params all_blob_params = {
@@ -56,6 +143,8 @@ struct blob_params all_blob_params = {
     .unique_star_spacing = 15,    
     .make_static_hp_mask = 0,     
     .use_static_hp_mask = 0,       
+    .background_mode = BACKGROUND_GLOBAL,
+    .background_tile = BACKGROUND_TILE,
 };
 
 /* Helper function to determine if a year is a leap year (2020 is a leap year).
@@ -75,35 +164,39 @@ int isLeapYear(int year) {
 }
 
 /* Helper function to test blob-finding parameters.
-** Input: None.
-** Output: None (void). Prints current blob-finding parameters to the terminal.
+** Input: The parameters.
+** Output: None (void). Prints the blob-finding parameters to the terminal.
 **/
-void verifyBlobParams() {
+void verifyBlobParams(const struct blob_params * params) {
     printf("\n+---------------------------------------------------------+\n");
     printf("|\t\tBlob-finding parameters\t\t\t  |\n");
     printf("|---------------------------------------------------------|\n");
     printf("|\tall_blob_params.spike_limit is: %d\t\t  |\n", 
-           all_blob_params.spike_limit);
+           params->spike_limit);
     printf("|\tall_blob_params.dynamic_hot_pixels is: %d\t  |\n", 
-           all_blob_params.dynamic_hot_pixels);
+           params->dynamic_hot_pixels);
     printf("|\tall_blob_params.centroid_search_border is: %d\t  |\n", 
-           all_blob_params.centroid_search_border);
+           params->centroid_search_border);
     printf("|\tall_blob_params.high_pass_filter is: %d\t\t  |\n", 
-           all_blob_params.high_pass_filter);
+           params->high_pass_filter);
     printf("|\tall_blob_params.r_smooth is: %d\t\t\t  |\n", 
-           all_blob_params.r_smooth);
+           params->r_smooth);
     printf("|\tall_blob_params.filter_return_image is: %d\t  |\n", 
-           all_blob_params.filter_return_image);
+           params->filter_return_image);
     printf("|\tall_blob_params.r_high_pass_filter is: %d\t  |\n", 
-           all_blob_params.r_high_pass_filter);
+           params->r_high_pass_filter);
     printf("|\tall_blob_params.n_sigma is: %.2f\t\t  |\n", 
-           all_blob_params.n_sigma);
+           params->n_sigma);
     printf("|\tall_blob_params.unique_star_spacing is: %d\t  |\n", 
-           all_blob_params.unique_star_spacing);
+           params->unique_star_spacing);
     printf("|\tall_blob_params.make_static_hp_mask is: %i\t  |\n", 
-           all_blob_params.make_static_hp_mask);
+           params->make_static_hp_mask);
     printf("|\tall_blob_params.use_static_hp_mask is: %i\t  |\n", 
-           all_blob_params.use_static_hp_mask);
+           params->use_static_hp_mask);
+    printf("|\tall_blob_params.background_mode is: %i\t\t  |\n", 
+           params->background_mode);
+    printf("|\tall_blob_params.background_tile is: %i\t\t  |\n", 
+           params->background_tile);
     printf("+---------------------------------------------------------+\n\n");
 }
 
@@ -119,12 +212,13 @@ const char * printCameraError() {
     return last_error_str;
 }
 
-/* Function to initialize the camera and its various parameters.
+/* Function to initialize the camera and its various parameters (Astrometry
+** is initialized alongside, see startAstrometry()).
 ** Input: None.
 ** Output: A flag indicating successful camera initialization or not.
 */
 int initCamera() {
-    double min_exposure, max_exposure;
+    double min_exposure, max_exposure, exposure;
     unsigned int enable = 1;   
 
     // load the camera parameters
@@ -140,10 +234,13 @@ int initCamera() {
         return -1; 
     }
 
-    // set exposure time based on struct field
+    // set exposure time based on struct field (the lens adapter starts up
+    // meanwhile, and uses the struct too)
+    pthread_mutex_lock(&camera_params_lock);
+    exposure = all_camera_params.exposure_time;
+    pthread_mutex_unlock(&camera_params_lock);
     if (is_Exposure(camera_handle, IS_EXPOSURE_CMD_SET_EXPOSURE, 
-                   (void *) &all_camera_params.exposure_time, sizeof(double)) 
-                   != IS_SUCCESS) {
+                   (void *) &exposure, sizeof(double)) != IS_SUCCESS) {
         cam_error = printCameraError();
         printf("Unable to set default exposure: %s.\n", cam_error);
         return -1;
@@ -173,13 +270,19 @@ int initCamera() {
         printf("|\tCurrent exposure time: %f msec\t\t  |\n|\tMin possible "
                "exposure: %f msec\t\t  |\n|\tMax possible exposure: %f "
                "msec\t  |\n", curr_exposure, min_exposure, max_exposure);
+        printf("|\tcentroid_mode is: %s\t\t\t  |\n",
+               centroidModeName(centroid_mode));
         printf("+---------------------------------------------------------+\n");
     }
 
-    // initialize astrometry
-    if (initAstrometry() < 0) {
-        return -1;
-    }
+    // the blob-finding stage's working space for this camera's sensor
+    initBlobContext(&camera_blobs, CAMERA_WIDTH, CAMERA_HEIGHT, STATIC_HP_MASK,
+                    STATIC_HP_SIDECAR);
+    // the stack leaves out the hot pixels of each exposure, so its blob
+    // context has no static map of its own
+    initBlobContext(&stack_blobs, CAMERA_WIDTH, CAMERA_HEIGHT, NULL, NULL);
+    stack_blobs.hot_pixels_loaded = 1;
+    initFrameStack(&camera_stack, CAMERA_WIDTH, CAMERA_HEIGHT);
 
     // set how images are saved
 	setSaveImage();
@@ -209,8 +312,20 @@ void closeCamera() {
     }
     
     // don't close a camera that doesn't exist yet!
-    if ((mem_starting_ptr != NULL) && (camera_handle <= 254)) { 
-        is_FreeImageMem(camera_handle, mem_starting_ptr, mem_id);
+    if ((ring_mem[0] != NULL) && (camera_handle <= 254)) { 
+        if (continuous_capture) {
+            is_StopLiveVideo(camera_handle, IS_WAIT);
+            is_DisableEvent(camera_handle, IS_SET_EVENT_FRAME);
+            is_ExitEvent(camera_handle, IS_SET_EVENT_FRAME);
+        }
+
+        is_ClearSequence(camera_handle);
+        for (int i = 0; i < num_camera_buffers; i++) {
+            if (ring_mem[i] != NULL) {
+                is_FreeImageMem(camera_handle, ring_mem[i], ring_id[i]);
+                ring_mem[i] = NULL;
+            }
+        }
         is_ExitCamera(camera_handle);
     }
 }
@@ -422,25 +537,43 @@ int loadCamera() {
               ((double) sensorInfo.wPixelSize)/100.0);
     }
  	
-    // allocate camera memory
+    // allocate a ring of camera memory buffers and add them to the image 
+    // sequence, so the driver can capture into one buffer while the pipeline 
+    // still holds (locks) the earlier ones
 	color_depth = 8; 
-	if (is_AllocImageMem(camera_handle, sensorInfo.nMaxWidth, 
-                         sensorInfo.nMaxHeight, color_depth, &mem_starting_ptr, 
-                         &mem_id) != IS_SUCCESS) {
-    // if (is_AllocImageMem(camera_handle, CAMERA_WIDTH, 
-    //                      CAMERA_HEIGHT, color_depth, &mem_starting_ptr, 
-    //                      &mem_id) != IS_SUCCESS) {
-		cam_error = printCameraError();
-        printf("Error allocating image memory: %s.\n", cam_error);
-        return -1;
-	}
+    for (int i = 0; i < num_camera_buffers; i++) {
+        if (is_AllocImageMem(camera_handle, sensorInfo.nMaxWidth, 
+                             sensorInfo.nMaxHeight, color_depth, &ring_mem[i], 
+                             &ring_id[i]) != IS_SUCCESS) {
+            cam_error = printCameraError();
+            printf("Error allocating image memory: %s.\n", cam_error);
+            return -1;
+        }
 
-    // set memory for image (make memory pointer active)
-	if (is_SetImageMem(camera_handle, mem_starting_ptr, mem_id) != IS_SUCCESS) {
-        cam_error = printCameraError();
-        printf("Error setting image memory: %s.\n", cam_error);
+        if (is_AddToSequence(camera_handle, ring_mem[i], ring_id[i]) 
+            != IS_SUCCESS) {
+            cam_error = printCameraError();
+            printf("Error adding image memory to sequence: %s.\n", cam_error);
+            return -1;
+        }
+    }
+
+    if (verbose) {
+        printf("|\tImage sequence buffers: %i\t\t\t  |\n", 
+               num_camera_buffers);
+    }
+
+    // read out the AOI, binning or subsampling asked for on the command line
+    if (applyGeometry(&camera_geometry) < 0) {
         return -1;
     }
+    if (verbose) {
+        printf("|\tReadout: %i x %i px at (%i, %i), %s %i\t  |\n",
+               camera_geometry.width, camera_geometry.height,
+               camera_geometry.x, camera_geometry.y,
+               camera_geometry.subsample ? "subsampled" : "binned",
+               camera_geometry.factor);
+    }
 
     // get image memory
 	if (is_GetImageMem(camera_handle, &active_mem_loc) != IS_SUCCESS) {
@@ -474,8 +607,9 @@ int loadCamera() {
     }
 
     // set trigger to software mode (call is_FreezeVideo to take single picture 
-    // in single frame mode)
-	if (is_SetExternalTrigger(camera_handle, IS_SET_TRIGGER_SOFTWARE) 
+    // in single frame mode), or let the sensor run freely in continuous mode
+	if (is_SetExternalTrigger(camera_handle, (continuous_capture) ? 
+                              IS_SET_TRIGGER_OFF : IS_SET_TRIGGER_SOFTWARE) 
         != IS_SUCCESS) {
         cam_error = printCameraError();
         printf("Error setting external trigger mode: %s.\n", cam_error);
@@ -490,529 +624,1153 @@ int loadCamera() {
     return 1;
 }
 
-/* Function to establish the parameters for saving images taken by the camera.
-** Input: None.
-** Output: None (void).
-*/
-void setSaveImage() {
-    ImageFileParams.pwchFileName = L"save1.bmp";
-    ImageFileParams.pnImageID = NULL;
-    ImageFileParams.ppcImageMem = NULL;
-    ImageFileParams.nQuality = 80;
-    ImageFileParams.nFileType = IS_IMG_BMP;
-}
-
-/* Function to mask hot pixels accordinging to static and dynamic maps.
-** Input: The image bytes (ib), the image border indices (i0, j0, i1, j1), rest 
-** are 0.
-** Output: None (void). Makes the dynamic and static hot pixel masks for the 
-** Star Camera image.
+/* Function to check a readout geometry, filling in the width (or height) of an
+** AOI given as 0 with the rest of the sensor. The AOI is in pixels after
+** binning or subsampling, and its corner and size go in steps of AOI_STEP
+** (except where it reaches the edge of the sensor).
+** Input: The geometry.
+** Output: A flag indicating the camera can be set to the geometry or not.
 */
-void makeMask(char * ib, int i0, int j0, int i1, int j1, int x0, int y0, 
-              bool subframe) {
-    static int first_time = 1;
-    static int * x_p = NULL, * y_p = NULL;
-    static int num_p = 0, num_alloc = 0;
+int checkGeometry(struct camera_geometry * geometry) {
+    int factor = geometry->factor;
 
-    if (first_time) {
-        mask = calloc(CAMERA_WIDTH*CAMERA_HEIGHT, 1);
-        x_p = calloc(100, sizeof(int));
-        y_p = calloc(100, sizeof(int));
-        num_alloc = 100;
+    if (factor != 1 && factor != 2 && factor != 4) {
+        printf("Invalid binning or subsampling factor %d. Choose 1, 2, or "
+               "4.\n", factor);
+        return -1;
     }
 
-    // load static hot pixel mask
-    if (first_time || all_blob_params.make_static_hp_mask) {
-        // read from file with bright pixel coordinates in it
-        FILE * f = fopen(STATIC_HP_MASK, "r");
-        int i, j;
-        num_p = 0;
+    int max_width = CAMERA_WIDTH/factor, max_height = CAMERA_HEIGHT/factor;
+    if (geometry->width == 0) {
+        geometry->width = max_width - geometry->x;
+    }
+    if (geometry->height == 0) {
+        geometry->height = max_height - geometry->y;
+    }
 
-        if (f) {
-            if (verbose) {
-                printf("\n+---------------------------------------------------------+\n");
-                printf("|\t\tLoading static hot pixel map...\t\t  |\n");
-                printf("|---------------------------------------------------------|\n");
-            }
+    if (geometry->x < 0 || geometry->y < 0 ||
+        geometry->width < MIN_AOI_SIZE || geometry->height < MIN_AOI_SIZE ||
+        geometry->x + geometry->width > max_width ||
+        geometry->y + geometry->height > max_height) {
+        printf("Invalid AOI %d x %d at (%d, %d). It has to be at least %d px "
+               "each way and\nfit in the %d x %d px sensor.\n",
+               geometry->width, geometry->height, geometry->x, geometry->y,
+               MIN_AOI_SIZE, max_width, max_height);
+        return -1;
+    }
 
-            char * line = NULL;
-            size_t len = 0;
-            int read = 0;
+    if (geometry->x % AOI_STEP || geometry->y % AOI_STEP ||
+        (geometry->width % AOI_STEP &&
+         geometry->x + geometry->width != max_width) ||
+        (geometry->height % AOI_STEP &&
+         geometry->y + geometry->height != max_height)) {
+        printf("Invalid AOI %d x %d at (%d, %d). Its corner and size have to "
+               "be multiples\nof %d px.\n", geometry->width, geometry->height,
+               geometry->x, geometry->y, AOI_STEP);
+        return -1;
+    }
 
-            // read every line in the file
-            while ((read = getline(&line, &len, f)) != -1) {
-                sscanf(line, "%d,%d\n", &i, &j);
+    geometry->subsample = (geometry->subsample != 0);
+    geometry->stride = geometry->width;
 
-                if (num_p >= num_alloc) {
-                    num_alloc += 100;
-                    x_p = realloc(x_p, sizeof(int) * num_alloc);
-                    y_p = realloc(y_p, sizeof(int) * num_alloc);
-                }
+    return 1;
+}
 
-                x_p[num_p] = i;
-                // map y coordinate to image in memory from Kst blob
-                y_p[num_p] = CAMERA_HEIGHT - j; 
+/* Function to ask the capture stage to switch to a readout geometry before its
+** next image.
+** Input: The geometry.
+** Output: A flag indicating the geometry was valid (and will be used) or not.
+*/
+int requestGeometry(struct camera_geometry * geometry) {
+    if (checkGeometry(geometry) < 0) {
+        return -1;
+    }
 
-                if (verbose) {
-                    printf("|\tCoordinates read from hp file: [%4i, %4i]\t  |\n", 
-                           i, j);
-                }
+    // users send the geometry with every command, and changing it stops a
+    // sensor running freely, so only a different one is passed on
+    pthread_mutex_lock(&geometry_lock);
+    struct camera_geometry * last = geometry_requested ? &requested_geometry :
+                                                         &camera_geometry;
+    if (geometry->factor != last->factor ||
+        geometry->subsample != last->subsample ||
+        geometry->x != last->x || geometry->y != last->y ||
+        geometry->width != last->width || geometry->height != last->height) {
+        requested_geometry = *geometry;
+        geometry_requested = 1;
+    }
+    pthread_mutex_unlock(&geometry_lock);
 
-                num_p++;
-            }
-            
-            if (verbose) {
-                printf("+---------------------------------------------------------+\n");
-            }
+    return 1;
+}
 
-            fflush(f);
-            fclose(f);
-            free(line);
-        }
+/* Function to set the sensor to a readout geometry. The driver writes the AOI
+** into the top left of the (full-sensor) ring buffers, so the rows of an image
+** are as far apart as the rows of the buffers.
+** Input: The geometry (checked by checkGeometry()), which gets the AOI the
+** camera settled on and the stride of the images.
+** Output: A flag indicating successful setting of the geometry or not.
+*/
+int applyGeometry(struct camera_geometry * geometry) {
+    int binning = IS_BINNING_DISABLE, subsampling = IS_SUBSAMPLING_DISABLE;
+    int mem_width, mem_height, bits, pitch;
+    double exposure;
+    IS_RECT aoi;
+
+    if (geometry->factor == 2 && geometry->subsample) {
+        subsampling = IS_SUBSAMPLING_2X_VERTICAL | IS_SUBSAMPLING_2X_HORIZONTAL;
+    } else if (geometry->factor == 4 && geometry->subsample) {
+        subsampling = IS_SUBSAMPLING_4X_VERTICAL | IS_SUBSAMPLING_4X_HORIZONTAL;
+    } else if (geometry->factor == 2) {
+        binning = IS_BINNING_2X_VERTICAL | IS_BINNING_2X_HORIZONTAL;
+    } else if (geometry->factor == 4) {
+        binning = IS_BINNING_4X_VERTICAL | IS_BINNING_4X_HORIZONTAL;
+    }
+
+    // turn the other one off first (the camera does not do both at once)
+    if (is_SetSubSampling(camera_handle, subsampling) != IS_SUCCESS ||
+        is_SetBinning(camera_handle, binning) != IS_SUCCESS) {
+        cam_error = printCameraError();
+        printf("Error setting %s by %d: %s.\n",
+               geometry->subsample ? "subsampling" : "binning",
+               geometry->factor, cam_error);
+        return -1;
+    }
 
-        // do not want to recreate hp mask automatically, so set field to 0
-        all_blob_params.make_static_hp_mask = 0;
-        // no longer the first time we are running
-        first_time = 0;
+    aoi.s32X = geometry->x;
+    aoi.s32Y = geometry->y;
+    aoi.s32Width = geometry->width;
+    aoi.s32Height = geometry->height;
+    if (is_AOI(camera_handle, IS_AOI_IMAGE_SET_AOI, (void *) &aoi,
+               sizeof(aoi)) != IS_SUCCESS) {
+        cam_error = printCameraError();
+        printf("Error setting AOI: %s.\n", cam_error);
+        return -1;
+    }
+    // the camera may have rounded the AOI to its own steps
+    if (is_AOI(camera_handle, IS_AOI_IMAGE_GET_AOI, (void *) &aoi,
+               sizeof(aoi)) != IS_SUCCESS) {
+        cam_error = printCameraError();
+        printf("Error getting AOI: %s.\n", cam_error);
+        return -1;
     }
+    geometry->x = aoi.s32X;
+    geometry->y = aoi.s32Y;
+    geometry->width = aoi.s32Width;
+    geometry->height = aoi.s32Height;
 
-    int i, j;
-    int p0, p1, p2, p3, p4;
-    int a, b;
-    
-    int cutoff = all_blob_params.spike_limit*100.0;
+    if (is_InquireImageMem(camera_handle, ring_mem[0], ring_id[0], &mem_width,
+                           &mem_height, &bits, &pitch) != IS_SUCCESS) {
+        cam_error = printCameraError();
+        printf("Error getting image memory pitch: %s.\n", cam_error);
+        return -1;
+    }
+    geometry->stride = pitch;
 
-    for (i = i0; i < i1; i++) {
-        mask[i + CAMERA_WIDTH*j0] = mask[i + (j1-1)*CAMERA_WIDTH] = 0;
+    if (geometry->x < 0 || geometry->y < 0 ||
+        geometry->x + geometry->width > CAMERA_WIDTH/geometry->factor ||
+        geometry->y + geometry->height > CAMERA_HEIGHT/geometry->factor ||
+        geometry->stride < geometry->width) {
+        printf("The camera gave an AOI of %d x %d px at (%d, %d) with rows of "
+               "%d bytes,\nwhich does not fit the readout.\n",
+               geometry->width, geometry->height, geometry->x, geometry->y,
+               geometry->stride);
+        return -1;
     }
 
-    for (j = j0; j < j1; j++) {
-        mask[i0 + j*CAMERA_WIDTH] = mask[i1 - 1 + j*CAMERA_WIDTH] = 0;
+    // the exposure range depends on the readout, so set the exposure again
+    pthread_mutex_lock(&camera_params_lock);
+    exposure = all_camera_params.exposure_time;
+    pthread_mutex_unlock(&camera_params_lock);
+    if (is_Exposure(camera_handle, IS_EXPOSURE_CMD_SET_EXPOSURE,
+                    (void *) &exposure, sizeof(double)) != IS_SUCCESS) {
+        cam_error = printCameraError();
+        printf("Error setting exposure after changing the readout: %s.\n",
+               cam_error);
+        return -1;
     }
 
-    i0++;
-    j0++;
-    i1--;
-    j1--;
-  
-    if (all_blob_params.dynamic_hot_pixels) {
-        int nhp = 0;
+    return 1;
+}
 
-        for (j = j0; j < j1; j++) {
-            for (i = i0; i < i1; i++) {
-                // pixels left/right, above/below
-                p0 = 100*ib[i + j*CAMERA_WIDTH]/cutoff;
-                p1 = ib[i - 1 + (j)*CAMERA_WIDTH];
-                p2 = ib[i + 1 + (j)*CAMERA_WIDTH];
-                p3 = ib[i + (j+1)*CAMERA_WIDTH];
-                p4 = ib[i + (j-1)*CAMERA_WIDTH];
-                a = p1 + p2 + p3 + p4 + 4;
-                // pixels on diagonal (upper left/right, lower left/right)
-                p1 = ib[i - 1 + (j-1)*CAMERA_WIDTH];
-                p2 = ib[i + 1 + (j+1)*CAMERA_WIDTH];
-                p3 = ib[i - 1 + (j+1)*CAMERA_WIDTH];
-                p4 = ib[i + 1 + (j-1)*CAMERA_WIDTH];
-                b = p1 + p2 + p3 + p4 + 4;
-                mask[i + j*CAMERA_WIDTH] = ((p0 < a) && (p0 < b));
-                if (p0 > a || p0 > b) nhp++;
-            }
-        }
+/* Function to switch to the readout geometry a user asked for, if they asked
+** for one since the last image. A sensor running freely is stopped and started
+** again around the change.
+** Input: Whether the sensor is running freely right now.
+** Output: A flag indicating the sensor is ready for the next image or not.
+*/
+int switchGeometry(int running) {
+    struct camera_geometry geometry;
 
-        if (verbose) {
-            printf("\n(*) Number of hot pixels found: %d.\n\n", nhp);
-        }
-    } else {
-        for (j = j0; j < j1; j++) {
-            for (i = i0; i < i1; i++) {
-                mask[i + j*CAMERA_WIDTH] = 1;
-            }
-        }
-    }
+    pthread_mutex_lock(&geometry_lock);
+    int requested = geometry_requested;
+    geometry = requested_geometry;
+    geometry_requested = 0;
+    pthread_mutex_unlock(&geometry_lock);
 
-    if (all_blob_params.use_static_hp_mask) {
-        if (verbose) {
-            printf("+---------------------------------------------------------+\n");
-            printf("|\t\tMasking %d pixels...\t\t\t  |\n", num_p);
-            printf("|---------------------------------------------------------|\n");
-        }
+    if (!requested) {
+        return 1;
+    }
 
-        for (int i = 0; i < num_p; i++) {
-            // set all static hot pixels to 0
-            if (verbose) {
-                printf("|\tCoordinates going into mask: [%4i, %4i]\t  |\n", 
-                       x_p[i], CAMERA_HEIGHT - y_p[i]);
-            }
+    if (running && is_StopLiveVideo(camera_handle, IS_WAIT) != IS_SUCCESS) {
+        cam_error = printCameraError();
+        printf("Error stopping capture to change the readout: %s.\n",
+               cam_error);
+        return -1;
+    }
 
-            int ind = CAMERA_WIDTH * y_p[i] + x_p[i];
-            mask[ind] = 0;
+    if (applyGeometry(&geometry) < 0) {
+        // go back to the one we had
+        printf("Keeping the readout of %d x %d px.\n", camera_geometry.width,
+               camera_geometry.height);
+        if (applyGeometry(&camera_geometry) < 0) {
+            return -1;
         }
+    } else {
+        pthread_mutex_lock(&geometry_lock);
+        camera_geometry = geometry;
+        pthread_mutex_unlock(&geometry_lock);
+        printf("(*) Now reading out %d x %d px at (%d, %d), %s %d.\n",
+               geometry.width, geometry.height, geometry.x, geometry.y,
+               geometry.subsample ? "subsampled" : "binned", geometry.factor);
+    }
 
-        if (verbose) {
-            printf("+---------------------------------------------------------+\n");
-        }
+    if (running && is_CaptureVideo(camera_handle, IS_DONT_WAIT) != IS_SUCCESS) {
+        cam_error = printCameraError();
+        printf("Error restarting capture after changing the readout: %s.\n",
+               cam_error);
+        return -1;
     }
+
+    return 1;
 }
 
-/* Function to process the image with a filter to reduce noise.
-** Input:
-** Output:
+/* Function to start the sensor running freely for continuous capture.
+** Input: None.
+** Output: A flag indicating successful start of the live video or not.
 */
-void boxcarFilterImage(char * ib, int i0, int j0, int i1, int j1, int r_f, 
-                       double * filtered_image) {
-    static int first_time = 1;
-    static char * nc = NULL;
-    static uint64_t * ibc1 = NULL;
-
-    if (first_time) {
-        nc = calloc(CAMERA_WIDTH*CAMERA_HEIGHT, 1);
-        ibc1 = calloc(CAMERA_WIDTH*CAMERA_HEIGHT, sizeof(uint64_t));
-        first_time = 0;
+int startContinuousCapture() {
+    if (is_EnableEvent(camera_handle, IS_SET_EVENT_FRAME) != IS_SUCCESS) {
+        cam_error = printCameraError();
+        printf("Error enabling frame event: %s.\n", cam_error);
+        return -1;
     }
 
-    int b = r_f;
-    int64_t isx;
-    int s, n;
-    double ds, dn;
-    double last_ds = 0;
+    if (is_CaptureVideo(camera_handle, IS_DONT_WAIT) != IS_SUCCESS) {
+        cam_error = printCameraError();
+        printf("Error starting continuous capture: %s.\n", cam_error);
+        return -1;
+    }
 
-    for (int j = j0; j < j1; j++) {
-        n = 0;
-        isx = 0;
-        for (int i = i0; i < i0 + 2*r_f + 1; i++) {
-            n += mask[i + j*CAMERA_WIDTH];
-            isx += ib[i + j*CAMERA_WIDTH]*mask[i + j*CAMERA_WIDTH];
-        }
+    return 1;
+}
 
-        int idx = CAMERA_WIDTH*j + i0 + r_f;
+/* Function to wait for the driver to finish writing the next exposure into the
+** ring when the sensor is running freely.
+** Input: None.
+** Output: A flag indicating a new image arrived or not.
+*/
+int waitForNextImage() {
+    int timeout;
 
-        for (int i = r_f + i0; i < i1 - r_f - 1; i++) {
-            ibc1[idx] = isx;
-            nc[idx] = n;
-            isx = isx + mask[idx + r_f + 1]*ib[idx + r_f + 1] - 
-                  mask[idx - r_f]*ib[idx - r_f];
-            n = n + mask[idx + r_f + 1] - mask[idx - r_f];
-            idx++;
-        }
+    // allow for the whole exposure plus readout before giving up
+    pthread_mutex_lock(&camera_params_lock);
+    timeout = (int) all_camera_params.exposure_time + 1000;
+    pthread_mutex_unlock(&camera_params_lock);
 
-        ibc1[idx] = isx;
-        nc[idx] = n;
+    if (is_WaitEvent(camera_handle, IS_SET_EVENT_FRAME, timeout) != IS_SUCCESS) {
+        cam_error = printCameraError();
+        printf("Timed out waiting for new image: %s.\n", cam_error);
+        return -1;
     }
 
-    for (int j = j0+b; j < j1-b; j++) {
-        for (int i = i0+b; i < i1-b; i++) {
-            n = s = 0;
-            for (int jp =- r_f; jp <= r_f; jp++) {
-                int idx = i + (j+jp)*CAMERA_WIDTH;
-                s += ibc1[idx];
-                n += nc[idx];
-            }
-            ds = s;
-            dn = n;
-            if (dn > 0.0) {
-                ds /= dn;
-                last_ds = ds;
-            } else {
-                ds = last_ds;
-            }
-            filtered_image[i + j*CAMERA_WIDTH] = ds;
+    return 1;
+}
+
+/* Function to establish the parameters for saving images taken by the camera.
+** Input: None.
+** Output: None (void).
+*/
+void setSaveImage() {
+    ImageFileParams.pwchFileName = L"save1.bmp";
+    ImageFileParams.pnImageID = NULL;
+    ImageFileParams.ppcImageMem = NULL;
+    ImageFileParams.nQuality = 80;
+    ImageFileParams.nFileType = IS_IMG_BMP;
+}
+
+/* Stripe task for makeMask(): marks the dynamic hot pixels in a stripe (or 
+** unmasks all of its pixels if dynamic hot pixels are off).
+** Input: The stripe, the worker running it, and the mask job.
+** Output: None (void). Counts the stripe's hot pixels.
+*/
+void maskStripe(int stripe, int worker, void * arg) {
+    struct mask_job * job = arg;
+    unsigned char * mask = job->ctx->mask;
+    int ja, jb;
+    int nhp = 0, transitions = 0;
+
+    stripeRows(stripe, NUM_STRIPES, job->j0, job->j1, &ja, &jb);
+
+    for (int j = ja; j < jb; j++) {
+        if (job->dynamic_hot_pixels) {
+            nhp += maskHotPixelRow(&job->ctx->hot_pixels, job->ib, mask,
+                                   job->w, j, job->i0, job->i1,
+                                   job->spike_limit, &transitions);
+        } else {
+            memset(mask + job->i0 + j*job->w, 1, job->i1 - job->i0);
         }
     }
+
+    job->hot_pixels[stripe] = nhp;
+    job->transitions[stripe] = transitions;
 }
 
-/* Function to find the blobs in an image.
-** Inputs: The original image prior to processing (input_biffer), the dimensions
-** of the image (w & h) pointers to arrays for the x coordinates, y coordinates,
-** and magnitudes (pixel values) of the blobs, and an array for the bytes of the
-** image after processing (masking, filtering, et cetera).
-** Output: the number of blobs detected in the image.
+/* Function to mask hot pixels accordinging to static and dynamic maps.
+** Input: The blob context, the image bytes (ib), the readout geometry of the
+** image, the blob-finding parameters, and the image border indices (i0, j0,
+** i1, j1).
+** Output: None (void). Makes the dynamic and static hot pixel masks for the 
+** Star Camera image.
 */
-int findBlobs(char * input_buffer, int w, int h, double ** star_x, 
-              double ** star_y, double ** star_mags, char * output_buffer) { 
-    static int first_time = 1;
-    static double * ic = NULL, * ic2 = NULL;
-    static int num_blobs_alloc = 0;
+void makeMask(struct blob_context * ctx, char * ib,
+              const struct camera_geometry * geometry,
+              const struct blob_params * params, int i0, int j0, int i1,
+              int j1) {
+    unsigned char * mask = ctx->mask;
+    int w = geometry->width;
 
-    // allocate the proper amount of storage space to start
-    if (first_time) {
-        ic = calloc(CAMERA_WIDTH*CAMERA_HEIGHT, sizeof(double));
-        ic2 = calloc(CAMERA_WIDTH*CAMERA_HEIGHT, sizeof(double));
-        first_time = 0;
+    if (!ctx->hot_pixels_loaded) {
+        // the static map is made once (and kept up to date by the tracker and 
+        // make_static_hp_mask), not read again for every frame
+        loadHotPixelMap(&ctx->hot_pixels);
+        ctx->hot_pixels_loaded = 1;
     }
-  
-    // we use half-width internally, but the API gives us full width.
-    int x_size = w/2;
-    int y_size = h/2;
 
-    int j0, j1, i0, i1;
-    // extra image border
-    int b = 0;
+    int i, j;
+    struct mask_job job;
 
-    j0 = i0 = 0;
-    j1 = h;
-    i1 = w;
-    
-    b = all_blob_params.centroid_search_border;
+    // the static map is of the whole sensor, so it needs to know which of its
+    // pixels are in the image
+    setHotPixelGeometry(&ctx->hot_pixels, geometry);
 
-    // if we want to make a new hot pixel mask
-    if (all_blob_params.make_static_hp_mask) {
-        if (verbose) {
-            printf("**************************** Making static hot pixel map..."
-                   "****************************\n");
-        }
+    for (i = i0; i < i1; i++) {
+        mask[i + w*j0] = mask[i + (j1-1)*w] = 0;
+    }
 
-        // make a file and write bright pixel coordinates to it
-        FILE * f = fopen(STATIC_HP_MASK, "w"); 
-
-        for (int yp = 0; yp < CAMERA_HEIGHT; yp++) {
-            for (int xp = 0; xp < CAMERA_WIDTH; xp++) {
-                // index in the array where we are
-                int ind = CAMERA_WIDTH*yp + xp; 
-                // check pixel value to see if it's above hot pixel threshold
-                if (input_buffer[ind] > all_blob_params.make_static_hp_mask) {
-                    int i = xp;
-                    // make this agree with blob coordinates in Kst
-                    int j = CAMERA_HEIGHT - yp; 
-                    fprintf(f, "%d,%d\n", i, j);
-                    if (verbose) {
-                        printf("Value of pixel (should be > %i): %d | "
-                               "Coordinates: [%d, %d]\n", 
-                               all_blob_params.make_static_hp_mask, 
-                               input_buffer[ind], i, j);
-                    }
-                }
+    for (j = j0; j < j1; j++) {
+        mask[i0 + j*w] = mask[i1 - 1 + j*w] = 0;
+    }
+
+    job.ctx = ctx;
+    job.ib = ib;
+    job.w = w;
+    job.i0 = i0 + 1;
+    job.j0 = j0 + 1;
+    job.i1 = i1 - 1;
+    job.j1 = j1 - 1;
+    job.spike_limit = params->spike_limit;
+    job.dynamic_hot_pixels = params->dynamic_hot_pixels;
+    runStripes(maskStripe, &job, NUM_STRIPES);
+
+    if (job.dynamic_hot_pixels) {
+        int nhp = 0;
+        for (int s = 0; s < NUM_STRIPES; s++) {
+            nhp += job.hot_pixels[s];
+            // the tracked map is shared between the stripes, so the tracker's
+            // changes to it are made here
+            if (job.transitions[s]) {
+                int ja, jb;
+                stripeRows(s, NUM_STRIPES, job.j0, job.j1, &ja, &jb);
+                updateTrackedHotPixels(&ctx->hot_pixels, w, ja, jb, job.i0,
+                                       job.i1);
             }
         }
 
-        fflush(f);
-        fclose(f);
+        if (verbose) {
+            printf("\n(*) Number of hot pixels found: %d.\n\n", nhp);
+        }
+    }
+
+    if (params->use_static_hp_mask) {
+        applyHotPixelMap(&ctx->hot_pixels, mask);
     }
+    finishHotPixelFrame(&ctx->hot_pixels);
+}
+
+/* Stripe task for findBlobs(): low-pass (and high-pass) filters the rows of a
+** stripe. The filters read r_smooth (and r_high_pass_filter) rows past either
+** end of the stripe.
+** Input: The stripe, the worker running it, and the blob job.
+** Output: None (void). Counts the pixels whose filter box was fully masked.
+*/
+void filterStripe(int stripe, int worker, void * arg) {
+    struct blob_job * job = arg;
+    struct blob_context * ctx = job->ctx;
+    int ja, jb;
 
-    makeMask(input_buffer, i0, j0, i1, j1, 0, 0, 0);
+    stripeRows(stripe, NUM_STRIPES, job->j0, job->j1, &ja, &jb);
 
-    double sx = 0, sx2 = 0;
-    // sum of non-highpass filtered field
-    double sx_raw = 0;                            
+    job->empty_smooth[stripe] = boxcarFilterRows(job->input_buffer, ctx->mask,
+        job->w, job->i0, job->j0, job->i1, job->j1, job->r_smooth, ja, jb,
+        ctx->ic, &ctx->filter_scratch[worker]);
+
+    job->empty_hp[stripe] = 0;
+    if (job->high_pass_filter) {
+        job->empty_hp[stripe] = boxcarFilterRows(job->input_buffer, ctx->mask,
+            job->w, job->i0, job->j0, job->i1, job->j1, 
+            job->r_high_pass_filter, ja, jb, ctx->ic2,
+            &ctx->filter_scratch[worker]);
+    }
+}
+
+/* Stripe task for findBlobs(): the one pass over the filtered image (in double)
+** after filtering. Subtracts the high-pass filtered image (if we are high-pass
+** filtering), sums the pixels of a stripe for the mean and noise of the image,
+** writes the result to the (float) image the blobs are found in, and fills the
+** rows of the stripe in the output image (all but the border, which needs the
+** mean).
+** Input: The stripe, the worker running it, and the blob job.
+** Output: None (void).
+*/
+void statsStripe(int stripe, int worker, void * arg) {
+    struct blob_job * job = arg;
+    const double * ic = job->ctx->ic, * ic2 = job->ctx->ic2;
+    const unsigned char * mask = job->ctx->mask;
+    float * icf = job->ctx->icf;
+    int w = job->w, b = job->b;
+    int i0 = job->i0, j0 = job->j0, i1 = job->i1, j1 = job->j1;
+    char * output_buffer = job->filter_return_image ? job->output_buffer : NULL;
+    int pixel_offset = job->high_pass_filter ? 50 : 0;
+    double sx = 0, sx2 = 0, sx_raw = 0;
     int num_pix = 0;
+    int ja, jb;
 
-    // lowpass filter the image - reduce noise.
-    boxcarFilterImage(input_buffer, i0, j0, i1, j1, all_blob_params.r_smooth, 
-                      ic);
+    stripeRows(stripe, NUM_STRIPES, j0, j1, &ja, &jb);
 
-    // only high-pass filter full frames
-    if (all_blob_params.high_pass_filter) {       
-        b += all_blob_params.r_high_pass_filter;
-
-        boxcarFilterImage(input_buffer, i0, j0, i1, j1, 
-                          all_blob_params.r_high_pass_filter, ic2);
-
-        for (int j = j0+b; j < j1-b; j++) {
-            for (int i = i0+b; i < i1-b; i++) {
-                int idx = i + j*w;
-                sx_raw += ic[idx]*mask[idx];
-                ic[idx] -= ic2[idx];
-                sx += ic[idx]*mask[idx];
-                sx2 += ic[idx]*ic[idx]*mask[idx];
-                num_pix += mask[idx];
-            }
+    if (job->output_buffer && !job->filter_return_image) {
+        for (int j = ja; j < jb; j++) {
+            memcpy(job->output_buffer + i0 + j*w, job->input_buffer + i0 + j*w,
+                   i1 - i0);
         }
-    } else {
-        for (int j = j0+b; j < j1-b; j++) {
-            for (int i = i0+b; i < i1-b; i++) {
-                int idx = i + j*w;
-                sx += ic[idx]*mask[idx];
-                sx2 += ic[idx]*ic[idx]*mask[idx];
-                num_pix += mask[idx];
-            }
-        }
-        sx_raw = sx;
     }
 
-    double mean = sx/num_pix;
-    double mean_raw = sx_raw/num_pix;
-    double sigma = sqrt((sx2 - sx*sx/num_pix)/num_pix);
-    if (verbose) {
-        printf("\n+---------------------------------------------------------+\n");
-        printf("|\t\tBlob-finding calculations\t\t  |\n");
-        printf("|---------------------------------------------------------|\n");
-        printf("|\tMean\t = %8f\t\t\t\t  |\n", mean);
-        printf("|\tSigma\t = %8f\t\t\t\t  |\n", sigma);
-        printf("|\tRaw mean = %8f\t\t\t\t  |\n", mean_raw);
-        printf("+---------------------------------------------------------+\n");
+    // the peak scan also looks at the row above and the column left of the
+    // region the statistics cover, which are not high-pass filtered
+    if (b > 0 && j0 + b - 1 >= ja && j0 + b - 1 < jb) {
+        for (int i = i0 + b - 1; i < i1 - b; i++) {
+            icf[i + (j0 + b - 1)*w] = ic[i + (j0 + b - 1)*w];
+        }
     }
+    if (ja < j0 + b) ja = j0 + b;
+    if (jb > j1 - b) jb = j1 - b;
 
-    // fill output buffer if the variable is defined 
-    if (output_buffer) {
-        int pixel_offset = 0;
+    for (int j = ja; j < jb; j++) {
+        const double * icr = ic + j*w, * ic2r = ic2 + j*w;
+        const unsigned char * m = mask + j*w;
+        float * icfr = icf + j*w;
+        int ia = i0 + b, ib = i1 - b;
 
-        if (all_blob_params.high_pass_filter) pixel_offset = 50;
+        if (b > 0) {
+            icfr[ia - 1] = icr[ia - 1];
+        }
 
-        if (all_blob_params.filter_return_image) {
-            if (verbose) {
-                printf("\nFiltering returned image...\n");
+        // one loop for each case, so that neither has a branch per pixel
+        if (job->high_pass_filter) {
+            for (int i = ia; i < ib; i++) {
+                double v = icr[i] - ic2r[i];
+                sx_raw += icr[i]*m[i];
+                sx += v*m[i];
+                sx2 += v*v*m[i];
+                num_pix += m[i];
+                icfr[i] = v;
             }
-
-            for (int j = j0 + 1; j < j1 - 1; j++) {
-                for (int i = i0 + 1; i < i1 - 1; i++) {
-                  output_buffer[i + j*w] = ic[i + j*w]+pixel_offset;
-                }
+        } else {
+            for (int i = ia; i < ib; i++) {
+                double v = icr[i];
+                sx += v*m[i];
+                sx2 += v*v*m[i];
+                num_pix += m[i];
+                icfr[i] = v;
             }
+        }
 
-            for (int j = 0; j < b; j++) {
-                for (int i = i0; i < i1; i++) {
-                  output_buffer[i + (j + j0)*w] = 
-                  output_buffer[i + (j1 - j - 1)*w] = mean + pixel_offset;
-                }
+        // the row is still in the cache. The filtered values are means of
+        // bytes (less another mean) and never within float precision of a
+        // whole number, so they truncate to the same byte as the doubles did.
+        // The output image has no filtered values on the outermost pixels.
+        if (output_buffer && j >= j0 + 1 && j < j1 - 1) {
+            if (ia < i0 + 1) ia = i0 + 1;
+            if (ib > i1 - 1) ib = i1 - 1;
+            for (int i = ia; i < ib; i++) {
+                output_buffer[i + j*w] = icfr[i] + pixel_offset;
             }
+        }
+    }
 
-            for (int j = j0; j < j1; j++) {
-                for (int i = 0; i < b; i++) {
-                  output_buffer[i + i0 + j*w] = 
-                  output_buffer[i1 - i - 1 + j*w] = mean + pixel_offset;
-                }
-            }
-        } else {
-            if (verbose) {
-                printf("\n> Not filtering the returned image...\n\n");
-            }
+    job->sx[stripe] = sx;
+    job->sx2[stripe] = sx2;
+    job->sx_raw[stripe] = sx_raw;
+    job->num_pix[stripe] = num_pix;
+}
 
-            for (int j = j0; j < j1; j++) {
-                for (int i = i0; i < i1; i++) {
-                  int idx = i + j*w;
-                  output_buffer[idx] = input_buffer[idx];
-                }
+/* Stripe task for findBlobs(): fills the border of the output image with the 
+** mean and collects the stripe's blob candidates (pixels above the threshold
+** that are local maxima or saturated) in the order they are scanned.
+** Input: The stripe, the worker running it, and the blob job.
+** Output: None (void).
+*/
+void scanStripe(int stripe, int worker, void * arg) {
+    struct blob_job * job = arg;
+    struct blob_context * ctx = job->ctx;
+    struct blob_candidates * cand = &ctx->candidates[stripe];
+    const float * icf = ctx->icf;
+    int w = job->w, b = job->b;
+    int i0 = job->i0, j0 = job->j0, i1 = job->i1, j1 = job->j1;
+    int ja, jb;
+
+    stripeRows(stripe, NUM_STRIPES, j0, j1, &ja, &jb);
+
+    // the rest of the output image was filled with the statistics
+    if (job->output_buffer && job->filter_return_image) {
+        char * output_buffer = job->output_buffer;
+        char border = job->mean + (job->high_pass_filter ? 50 : 0);
+
+        for (int j = ja; j < jb; j++) {
+            if (j < j0 + b || j >= j1 - b) {
+                memset(output_buffer + i0 + j*w, border, i1 - i0);
+            } else if (b > 0) {
+                memset(output_buffer + i0 + j*w, border, b);
+                memset(output_buffer + i1 - b + j*w, border, b);
             }
         }
     }
 
-    // find the blobs 
-    double ic0;
-    int blob_count = 0;
-    for (int j = j0 + b; j < j1-b-1; j++) {
-        for (int i = i0 + b; i < i1-b-1; i++) {
+    // find the blob candidates (never on the outermost pixels, which have no
+    // neighbours to compare with)
+    if (ja < j0 + b) ja = j0 + b;
+    if (ja < j0 + 1) ja = j0 + 1;
+    if (jb > j1 - b - 1) jb = j1 - b - 1;
+    int ia = (b > 0) ? i0 + b : i0 + 1;
+    // the largest float not above the threshold, so comparing the float pixels
+    // with it is the same as comparing them with the threshold
+    float threshold = job->threshold;
+    if (threshold > job->threshold) {
+        threshold = nextafterf(threshold, -INFINITY);
+    }
+
+    cand->count = 0;
+    for (int j = ja; j < jb; j++) {
+        // the rows above, at and below the one being scanned
+        const float * up = icf + (j - 1)*w, * row = icf + j*w;
+        const float * down = icf + (j + 1)*w;
+        // with the tiled background, only the pixels above the lowest
+        // threshold of the row have theirs looked up
+        float lowest = job->tiled ? backgroundRow(&ctx->background, j, worker)
+                                  : threshold;
+
+        for (int i = ia; i < i1-b-1; i++) {
+            float ic0 = row[i];
             // if pixel exceeds threshold
-            if ((double) ic[i + j*w] > mean + all_blob_params.n_sigma*sigma) {
-                ic0 = ic[i + j*w];
+            if (ic0 > lowest &&
+                (!job->tiled ||
+                 ic0 > backgroundThreshold(&ctx->background, i, worker))) {
                 // if pixel is a local maximum or saturated
-                if (((ic0 >= ic[i-1 + (j-1)*w]) &&
-                     (ic0 >= ic[i   + (j-1)*w]) &&
-                     (ic0 >= ic[i+1 + (j-1)*w]) &&
-                     (ic0 >= ic[i-1 + (j  )*w]) &&
-                     (ic0 >  ic[i+1 + (j  )*w]) &&
-                     (ic0 >  ic[i-1 + (j+1)*w]) &&
-                     (ic0 >  ic[i   + (j+1)*w]) &&
-                     (ic0 >  ic[i+1 + (j+1)*w])) ||
+                if (((ic0 >= up[i-1]) && (ic0 >= up[i]) && (ic0 >= up[i+1]) &&
+                     (ic0 >= row[i-1]) && (ic0 > row[i+1]) &&
+                     (ic0 > down[i-1]) && (ic0 > down[i]) &&
+                     (ic0 > down[i+1])) ||
                      (ic0 > 254)) {
-                      
-                    int unique = 1;
-
-                    // realloc array if necessary (when the camera looks at a 
-                    // really bright image, this slows everything down severely)
-                    if (blob_count >= num_blobs_alloc) {
-                        num_blobs_alloc += 500;
-                        *star_x = realloc(*star_x, sizeof(double)*num_blobs_alloc);
-                        *star_y = realloc(*star_y, sizeof(double)*num_blobs_alloc);
-                        *star_mags = realloc(*star_mags, sizeof(double)*num_blobs_alloc);
-                    }
-
-                    (*star_x)[blob_count] = i;
-                    (*star_y)[blob_count] = j;
-                    (*star_mags)[blob_count] = 100*ic[i + j*CAMERA_WIDTH];
-
-                    // FIXME: not sure why this is necessary..
-                    if ((*star_mags)[blob_count] < 0) {
-                        (*star_mags)[blob_count] = UINT32_MAX;
+                    // grows rarely (and only for very bright images), since
+                    // the arrays are kept for the next image
+                    if (cand->count >= cand->alloc) {
+                        cand->alloc = (cand->alloc == 0) ? 1024 : 2*cand->alloc;
+                        cand->x = realloc(cand->x, sizeof(int)*cand->alloc);
+                        cand->y = realloc(cand->y, sizeof(int)*cand->alloc);
+                        cand->mags = realloc(cand->mags, 
+                                             sizeof(double)*cand->alloc);
                     }
 
-                    // if we already found a blob within SPACING and this one is
-                    // bigger, replace it.
-                    int spacing = all_blob_params.unique_star_spacing;
-                    if ((*star_mags)[blob_count] > 25400) {
-                        spacing = spacing * 4;
-                    }
-                    for (int ib = 0; ib < blob_count; ib++) {
-                        if ((abs((*star_x)[blob_count]-(*star_x)[ib]) < spacing) &&
-                            (abs((*star_y)[blob_count]-(*star_y)[ib]) < spacing)) {
-                            unique = 0;
-                            // keep the brighter one
-                            if ((*star_mags)[blob_count] > (*star_mags)[ib]) {
-                                (*star_x)[ib] = (*star_x)[blob_count];
-                                (*star_y)[ib] = (*star_y)[blob_count];
-                                (*star_mags)[ib] = (*star_mags)[blob_count];
-                            }
-                        }
-                    }
-                    // if we didn't find a close one, it is unique.
-                    if (unique) {
-                        blob_count++;
-                    }
+                    cand->x[cand->count] = i;
+                    cand->y[cand->count] = j;
+                    cand->mags[cand->count] = 100*ic0;
+                    cand->count++;
                 }
             }
         }
     }
-    // this loop flips vertical position of blobs back to their normal location
-    for (int ibb = 0; ibb < blob_count; ibb++) {
-        (*star_y)[ibb] = CAMERA_HEIGHT - (*star_y)[ibb];
-    }
+}
 
-    // merge sort
-    part(*star_mags, 0, blob_count - 1, *star_x, *star_y); 
-    if (verbose) {
-        printf("(*) Number of blobs found in image: %i\n\n", blob_count);
+/* Helper functions for the min-heap of blob magnitudes that mergeBlobCandidates()
+** uses to find the dimmest blob kept so far.
+*/
+void swapHeapBlobs(struct blob_context * ctx, int a, int b) {
+    int * blob_heap = ctx->blob_heap, * blob_heap_pos = ctx->blob_heap_pos;
+    int blob = blob_heap[a];
+    blob_heap[a] = blob_heap[b];
+    blob_heap[b] = blob;
+    blob_heap_pos[blob_heap[a]] = a;
+    blob_heap_pos[blob_heap[b]] = b;
+}
+
+void siftBlobUp(struct blob_context * ctx, double * mags, int pos) {
+    int * blob_heap = ctx->blob_heap;
+
+    while (pos > 0 && mags[blob_heap[pos]] < mags[blob_heap[(pos - 1)/2]]) {
+        swapHeapBlobs(ctx, pos, (pos - 1)/2);
+        pos = (pos - 1)/2;
+    }
+}
+
+void siftBlobDown(struct blob_context * ctx, double * mags, int pos,
+                  int count) {
+    int * blob_heap = ctx->blob_heap;
+
+    while (1) {
+        int smallest = pos;
+        int l = 2*pos + 1, r = 2*pos + 2;
+        if (l < count && mags[blob_heap[l]] < mags[blob_heap[smallest]]) {
+            smallest = l;
+        }
+        if (r < count && mags[blob_heap[r]] < mags[blob_heap[smallest]]) {
+            smallest = r;
+        }
+        if (smallest == pos) {
+            return;
+        }
+        swapHeapBlobs(ctx, pos, smallest);
+        pos = smallest;
+    }
+}
+
+/* Helper functions to add a blob to (or remove it from) its grid cell. */
+void addGridBlob(struct blob_context * ctx, int blob, int cell) {
+    int * blob_next = ctx->blob_next, * blob_prev = ctx->blob_prev;
+    int * grid_head = ctx->grid_head;
+
+    ctx->blob_cell[blob] = cell;
+    blob_prev[blob] = -1;
+    blob_next[blob] = grid_head[cell];
+    if (grid_head[cell] >= 0) {
+        blob_prev[grid_head[cell]] = blob;
+    }
+    grid_head[cell] = blob;
+}
+
+void removeGridBlob(struct blob_context * ctx, int blob) {
+    int * blob_next = ctx->blob_next, * blob_prev = ctx->blob_prev;
+
+    if (blob_prev[blob] >= 0) {
+        blob_next[blob_prev[blob]] = blob_next[blob];
+    } else {
+        ctx->grid_head[ctx->blob_cell[blob]] = blob_next[blob];
+    }
+    if (blob_next[blob] >= 0) {
+        blob_prev[blob_next[blob]] = blob_prev[blob];
+    }
+}
+
+/* Function to turn the blob candidates of every stripe into the blobs of the
+** image. A candidate within unique_star_spacing (4 times that for saturated
+** candidates) of a blob already found is not a new blob, but replaces that
+** blob if it is brighter. Blobs are kept in a grid of unique_star_spacing 
+** cells, so each candidate is only compared with the blobs in the cells around
+** it. At most MAX_BLOBS blobs are kept: once there are that many, a new blob
+** replaces the dimmest one if it is brighter than it.
+** Input: The blob context (whose blob arrays the blobs go in), the image
+** dimensions (w & h), and unique_star_spacing.
+** Output: The number of blobs (0 if the grid cannot be allocated).
+*/
+int mergeBlobCandidates(struct blob_context * ctx, int w, int h,
+                        int unique_star_spacing) {
+    double * star_x = ctx->star_x, * star_y = ctx->star_y;
+    double * star_mags = ctx->star_mags;
+    int * blob_heap = ctx->blob_heap, * blob_heap_pos = ctx->blob_heap_pos;
+    int cell_size = unique_star_spacing;
+    int blob_count = 0;
+    int grid_w = 0, grid_h = 0;
+
+    if (cell_size > 0) {
+        grid_w = w/cell_size + 1;
+        grid_h = h/cell_size + 1;
+        if (grid_w*grid_h > ctx->grid_alloc) {
+            int * grid_head = realloc(ctx->grid_head,
+                                      sizeof(int)*grid_w*grid_h);
+            // (the old grid is kept, so the image just has no blobs)
+            if (grid_head == NULL) {
+                fprintf(stderr, "Error allocating the blob grid: %s.\n",
+                        strerror(errno));
+                return 0;
+            }
+            ctx->grid_head = grid_head;
+            ctx->grid_alloc = grid_w*grid_h;
+        }
+        memset(ctx->grid_head, -1, sizeof(int)*grid_w*grid_h);
+    }
+
+    for (int s = 0; s < NUM_STRIPES; s++) {
+        struct blob_candidates * cand = &ctx->candidates[s];
+
+        for (int c = 0; c < cand->count; c++) {
+            int x = cand->x[c], y = cand->y[c];
+            double mag = cand->mags[c];
+            int unique = 1;
+
+            // FIXME: not sure why this is necessary..
+            if (mag < 0) {
+                mag = UINT32_MAX;
+            }
+
+            // if we already found a blob within SPACING and this one is
+            // bigger, replace it.
+            int spacing = unique_star_spacing;
+            if (mag > 25400) {
+                spacing = spacing * 4;
+            }
+
+            if (cell_size > 0 && spacing > 0) {
+                int cx = x/cell_size, cy = y/cell_size;
+                // cells that can hold a blob less than spacing away
+                int reach = (spacing - 1)/cell_size + 1;
+
+                for (int gy = cy - reach; gy <= cy + reach; gy++) {
+                    if (gy < 0 || gy >= grid_h) continue;
+                    for (int gx = cx - reach; gx <= cx + reach; gx++) {
+                        if (gx < 0 || gx >= grid_w) continue;
+                        int next;
+                        for (int ib = ctx->grid_head[gx + gy*grid_w];
+                             ib >= 0; ib = next) {
+                            next = ctx->blob_next[ib];
+                            if ((abs(x - (int) star_x[ib]) < spacing) &&
+                                (abs(y - (int) star_y[ib]) < spacing)) {
+                                unique = 0;
+                                // keep the brighter one
+                                if (mag > star_mags[ib]) {
+                                    star_x[ib] = x;
+                                    star_y[ib] = y;
+                                    star_mags[ib] = mag;
+                                    siftBlobDown(ctx, star_mags,
+                                                 blob_heap_pos[ib],
+                                                 blob_count);
+                                    removeGridBlob(ctx, ib);
+                                    addGridBlob(ctx, ib, cx + cy*grid_w);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+
+            // if we didn't find a close one, it is unique.
+            if (!unique) {
+                continue;
+            }
+
+            int blob;
+            if (blob_count < MAX_BLOBS) {
+                blob = blob_count;
+                star_x[blob] = x;
+                star_y[blob] = y;
+                star_mags[blob] = mag;
+                blob_heap[blob_count] = blob;
+                blob_heap_pos[blob] = blob_count;
+                blob_count++;
+                siftBlobUp(ctx, star_mags, blob_count - 1);
+            } else if (mag > star_mags[blob_heap[0]]) {
+                // drop the dimmest blob to make room
+                blob = blob_heap[0];
+                if (cell_size > 0) {
+                    removeGridBlob(ctx, blob);
+                }
+                star_x[blob] = x;
+                star_y[blob] = y;
+                star_mags[blob] = mag;
+                siftBlobDown(ctx, star_mags, 0, blob_count);
+            } else {
+                continue;
+            }
+
+            if (cell_size > 0) {
+                addGridBlob(ctx, blob, x/cell_size + (y/cell_size)*grid_w);
+            }
+        }
     }
 
     return blob_count;
 }
 
-/* Function for sorting implementation.
-** Input: 
-** Output:
+/* Stripe task for findBlobs(): refines the positions and fluxes of a share of
+** the blobs (the blobs, not the image rows, are split between the stripes).
+** Input: The stripe, the worker running it, and the centroid job.
+** Output: None (void).
 */
-void merge(double * A, int p, int q, int r, double * X, double * Y){
-    int n1 = q - p + 1, n2 = r - q;
-    int lin = n1 + 1, rin = n2 + 1;
-    double LM[lin], LX[lin], LY[lin], RM[rin], RX[rin], RY[rin];
-    int i, j, k;
-    LM[n1] = 0;
-    RM[n2] = 0;
-
-    for (i = 0; i < n1; i++) {
-        LM[i] = A[p+i];
-        LX[i] = X[p+i];
-        LY[i] = Y[p+i];
-    }
-
-    for (j = 0; j < n2; j++) {
-        RM[j] = A[q+j+1];
-        RX[j] = X[q+j+1];
-        RY[j] = Y[q+j+1];
-    }
-
-    i = 0; j = 0;
-    for (k = p; k <= r; k++) {
-        if (LM[i] >= RM[j] ){
-            A[k] = LM[i];
-            X[k] = LX[i];
-            Y[k] = LY[i];
-            i++;
+void centroidStripe(int stripe, int worker, void * arg) {
+    struct centroid_job * job = arg;
+    int first, last;
+
+    stripeRows(stripe, NUM_STRIPES, 0, job->blob_count, &first, &last);
+    for (int k = first; k < last; k++) {
+        centroidBlob(job->input_buffer, job->ctx->mask, job->w, job->h,
+                     &job->star_x[k], &job->star_y[k], &job->star_mags[k]);
+    }
+}
+
+/* Function to set up the blob context of a camera (its working space is
+** allocated by the first findBlobs() it is given to).
+** Input: The blob context, the size of the camera's sensor, and the paths of
+** its static hot pixel list and sidecar.
+** Output: None (void).
+*/
+void initBlobContext(struct blob_context * ctx, int width, int height,
+                     const char * hp_list, const char * hp_sidecar) {
+    memset(ctx, 0, sizeof(struct blob_context));
+    ctx->width = width;
+    ctx->height = height;
+    ctx->hfd = NAN;
+    initHotPixelMap(&ctx->hot_pixels, width, height, hp_list, hp_sidecar);
+}
+
+/* Function to free the working space, hot pixel map and background model of a
+** blob context (once nothing is finding blobs with it).
+** Input: The blob context.
+** Output: None (void).
+*/
+void freeBlobContext(struct blob_context * ctx) {
+    free(ctx->mask);
+    free(ctx->packed_image);
+    free(ctx->ic);
+    free(ctx->ic2);
+    free(ctx->icf);
+    free(ctx->grid_head);
+    ctx->mask = NULL;
+    ctx->packed_image = NULL;
+    ctx->ic = ctx->ic2 = NULL;
+    ctx->icf = NULL;
+    ctx->grid_head = NULL;
+    ctx->grid_alloc = 0;
+
+    freeHotPixelMap(&ctx->hot_pixels);
+    ctx->hot_pixels_loaded = 0;
+    freeBackground(&ctx->background);
+
+    for (int i = 0; i < MAX_WORKERS; i++) {
+        freeBoxcarScratch(&ctx->filter_scratch[i]);
+    }
+
+    for (int s = 0; s < NUM_STRIPES; s++) {
+        free(ctx->candidates[s].x);
+        free(ctx->candidates[s].y);
+        free(ctx->candidates[s].mags);
+        memset(&ctx->candidates[s], 0, sizeof(struct blob_candidates));
+    }
+}
+
+/* Function to find the blobs in an image.
+** Inputs: The blob context of the camera that took it, the original image
+** prior to processing (input_biffer), its readout geometry (any AOI up to the
+** whole sensor, with rows any distance apart), the blob-finding parameters to
+** use for it (which it does not change), and an array for the bytes of the
+** image after processing (masking, filtering, et cetera), which has no space
+** between rows.
+** Output: the number of blobs detected in the image. Their x coordinates, y
+** coordinates, and magnitudes (pixel values) are left in the context.
+*/
+int findBlobs(struct blob_context * ctx, char * input_buffer,
+              const struct camera_geometry * geometry,
+              const struct blob_params * params, char * output_buffer) {
+    int w = geometry->width, h = geometry->height;
+
+    ctx->blob_count = 0;
+    if (w*h > ctx->width*ctx->height) {
+        printf("An image of %d x %d px does not fit the blob-finding space of "
+               "a %d x %d px\nsensor.\n", w, h, ctx->width, ctx->height);
+        return 0;
+    }
+
+    // allocate the proper amount of storage space to start (for the whole
+    // sensor, so any AOI fits)
+    if (ctx->ic == NULL) {
+        int pixels = ctx->width*ctx->height;
+        ctx->mask = calloc(pixels, 1);
+        ctx->ic = calloc(pixels, sizeof(double));
+        ctx->ic2 = calloc(pixels, sizeof(double));
+        ctx->icf = calloc(pixels, sizeof(float));
+        if (ctx->mask == NULL || ctx->ic == NULL || ctx->ic2 == NULL ||
+            ctx->icf == NULL) {
+            fprintf(stderr, "Error allocating blob-finding space: %s.\n",
+                    strerror(errno));
+            freeBlobContext(ctx);
+            return 0;
+        }
+    }
+
+    // everything after this reads the image with its rows w apart, so pack
+    // the rows of an AOI narrower than the buffer it was read out into
+    if (geometry->stride != w) {
+        if (ctx->packed_image == NULL &&
+            (ctx->packed_image = malloc(ctx->width*ctx->height)) == NULL) {
+            fprintf(stderr, "Error allocating packed image: %s.\n",
+                    strerror(errno));
+            return 0;
+        }
+        for (int j = 0; j < h; j++) {
+            memcpy(ctx->packed_image + j*w, input_buffer + j*geometry->stride,
+                   w);
+        }
+        input_buffer = ctx->packed_image;
+    }
+    unsigned char * mask = ctx->mask;
+  
+    // we use half-width internally, but the API gives us full width.
+    int x_size = w/2;
+    int y_size = h/2;
+
+    int j0, j1, i0, i1;
+    // extra image border
+    int b = 0;
+
+    j0 = i0 = 0;
+    j1 = h;
+    i1 = w;
+    
+    b = params->centroid_search_border;
+
+    // if we want to make a new hot pixel mask
+    if (params->make_static_hp_mask) {
+        makeHotPixelMap(&ctx->hot_pixels, input_buffer, geometry,
+                        params->make_static_hp_mask);
+    }
+
+    // time each step of the blob-finding for the performance telemetry
+    struct timespec lap;
+    clock_gettime(CLOCK_MONOTONIC, &lap);
+
+    makeMask(ctx, input_buffer, geometry, params, i0, j0, i1, j1);
+    perfLap(PERF_MASK, &lap);
+
+    struct blob_job job;
+    job.ctx = ctx;
+    job.input_buffer = input_buffer;
+    job.output_buffer = output_buffer;
+    job.w = w;
+    job.i0 = i0;
+    job.j0 = j0;
+    job.i1 = i1;
+    job.j1 = j1;
+    job.r_smooth = params->r_smooth;
+    job.high_pass_filter = params->high_pass_filter;
+    job.r_high_pass_filter = params->r_high_pass_filter;
+    job.filter_return_image = params->filter_return_image;
+
+    // lowpass filter the image - reduce noise (and highpass filter it, if we
+    // are doing that)
+    runStripes(filterStripe, &job, NUM_STRIPES);
+
+    int empty_smooth = 0, empty_hp = 0;
+    for (int s = 0; s < NUM_STRIPES; s++) {
+        empty_smooth += job.empty_smooth[s];
+        empty_hp += job.empty_hp[s];
+    }
+
+    // pixels whose filter box was fully masked take the value before them 
+    if (empty_smooth) {
+        fillBoxcarGaps(w, i0, j0, i1, j1, job.r_smooth, ctx->ic);
+    }
+
+    if (job.high_pass_filter && empty_hp) {
+        fillBoxcarGaps(w, i0, j0, i1, j1, job.r_high_pass_filter,
+                       ctx->ic2);
+    }
+    perfLap(PERF_FILTER, &lap);
+
+    if (boxcar_check) {
+        // the workers are done with their scratch space, so the first one's
+        // is free for filtering the image again here
+        checkBoxcarFilter(input_buffer, mask, w, i0, j0, i1, j1, 
+                          job.r_smooth, ctx->ic, &ctx->filter_scratch[0]);
+        if (job.high_pass_filter) {
+            checkBoxcarFilter(input_buffer, mask, w, i0, j0, i1, j1, 
+                              job.r_high_pass_filter, ctx->ic2,
+                              &ctx->filter_scratch[0]);
+        }
+        // the check is not part of the filtering (or of the statistics)
+        clock_gettime(CLOCK_MONOTONIC, &lap);
+    }
+
+    // only high-pass filter full frames
+    if (job.high_pass_filter) {       
+        b += job.r_high_pass_filter;
+    }
+    job.b = b;
+
+    runStripes(statsStripe, &job, NUM_STRIPES);
+
+    // sum the stripes in order, so the statistics do not depend on how many
+    // threads there are
+    double sx = 0, sx2 = 0;
+    // sum of non-highpass filtered field
+    double sx_raw = 0;                            
+    int num_pix = 0;
+    for (int s = 0; s < NUM_STRIPES; s++) {
+        sx += job.sx[s];
+        sx2 += job.sx2[s];
+        sx_raw += job.sx_raw[s];
+        num_pix += job.num_pix[s];
+    }
+
+    if (!job.high_pass_filter) {
+        sx_raw = sx;
+    }
+
+    double mean = sx/num_pix;
+    double mean_raw = sx_raw/num_pix;
+    double sigma = sqrt((sx2 - sx*sx/num_pix)/num_pix);
+    ctx->level = mean_raw;
+
+    // the local background and noise where the gradients across the image (the
+    // moon, twilight) matter more than the noise
+    job.tiled = (params->background_mode == BACKGROUND_TILED &&
+                 updateBackground(&ctx->background, ctx->icf, mask, w, i0 + b,
+                                  j0 + b, i1 - b, j1 - b,
+                                  params->background_tile, params->n_sigma,
+                                  mean, sigma) == 1);
+    perfLap(PERF_STATS, &lap);
+    if (verbose) {
+        printf("\n+---------------------------------------------------------+\n");
+        printf("|\t\tBlob-finding calculations\t\t  |\n");
+        printf("|---------------------------------------------------------|\n");
+        printf("|\tMean\t = %8f\t\t\t\t  |\n", mean);
+        printf("|\tSigma\t = %8f\t\t\t\t  |\n", sigma);
+        printf("|\tRaw mean = %8f\t\t\t\t  |\n", mean_raw);
+        printf("+---------------------------------------------------------+\n");
+    }
+
+    if (verbose && output_buffer) {
+        if (job.filter_return_image) {
+            printf("\nFiltering returned image...\n");
         } else {
-            A[k] = RM[j];
-            X[k] = RX[j];
-            Y[k] = RY[j];
-            j++;
+            printf("\n> Not filtering the returned image...\n\n");
+        }
+    }
+
+    job.mean = mean;
+    job.threshold = mean + params->n_sigma*sigma;
+    clock_gettime(CLOCK_MONOTONIC, &lap);
+    // fill output buffer and find the blob candidates of every stripe
+    runStripes(scanStripe, &job, NUM_STRIPES);
+
+    // apply the spacing rule to the candidates in the order the whole image 
+    // would have been scanned in, so blobs on either side of a stripe boundary
+    // are merged exactly as if there were only one stripe
+    int blob_count = mergeBlobCandidates(ctx, w, h,
+                                         params->unique_star_spacing);
+    perfLap(PERF_PEAKS, &lap);
+
+    // refine the blob positions and fluxes from the raw image
+    clock_gettime(CLOCK_MONOTONIC, &ctx->centroid_start);
+    if (centroid_mode != CENTROID_NONE && blob_count > 0) {
+        struct centroid_job cjob;
+        cjob.ctx = ctx;
+        cjob.input_buffer = input_buffer;
+        cjob.w = w;
+        cjob.h = h;
+        cjob.star_x = ctx->star_x;
+        cjob.star_y = ctx->star_y;
+        cjob.star_mags = ctx->star_mags;
+        cjob.blob_count = blob_count;
+        runStripes(centroidStripe, &cjob, NUM_STRIPES);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ctx->centroid_end);
+    recordPerf(PERF_CENTROID, msecBetween(&ctx->centroid_start,
+                                          &ctx->centroid_end));
+    lap = ctx->centroid_end;
+
+    // this loop flips vertical position of blobs back to their normal location
+    for (int ibb = 0; ibb < blob_count; ibb++) {
+        ctx->star_y[ibb] = h - ctx->star_y[ibb];
+    }
+
+    // brightest blobs first, which is the order the solver wants them in
+    sortBlobs(ctx, ctx->star_mags, ctx->star_x, ctx->star_y, blob_count);
+    ctx->blob_count = blob_count;
+    // the focus metric only looks at a few small windows around the
+    // brightest of them, so it costs next to nothing on top of the sort
+    ctx->hfd = imageHalfFluxDiameter(input_buffer, mask, w, h, ctx->star_x,
+                                     ctx->star_y, blob_count, &ctx->hfd_count);
+    perfLap(PERF_SORT, &lap);
+    if (verbose) {
+        printf("(*) Number of blobs found in image: %i\n\n", blob_count);
+    }
+
+    return blob_count;
+}
+
+/* Function to tell if one blob goes after another in the sorted blob list:
+** dimmer blobs go after brighter ones, and of two equally bright blobs the one
+** found later goes after the other.
+** Input: The blob magnitudes and the two blobs.
+** Output: If blob a goes after blob b (or not).
+*/
+int blobAfter(double * mags, int a, int b) {
+    return (mags[a] < mags[b]) || (mags[a] == mags[b] && a > b);
+}
+
+/* Helper function for sortBlobs() to sift a blob down its heap, which has the
+** blob going last in the sorted list at the top.
+*/
+void siftSortedBlob(double * mags, int * order, int pos, int count) {
+    while (1) {
+        int last = pos;
+        int l = 2*pos + 1, r = 2*pos + 2;
+        if (l < count && blobAfter(mags, order[l], order[last])) {
+            last = l;
+        }
+        if (r < count && blobAfter(mags, order[r], order[last])) {
+            last = r;
         }
+        if (last == pos) {
+            return;
+        }
+        int blob = order[pos];
+        order[pos] = order[last];
+        order[last] = blob;
+        pos = last;
     }
 }
 
-/* Recursive part of sorting.
-** Input:
-** Output:
+/* Function to sort the blobs from brightest to dimmest. This is a heap sort 
+** (in place, with nothing on the stack that grows with the number of blobs), 
+** which keeps equally bright blobs in the order they were found, as the 
+** merge sort it replaced did.
+** Input: The blob context (for its working space), the blob magnitudes, x and
+** y coordinates, and the number of blobs (at most MAX_BLOBS).
+** Output: None (void).
 */
-void part(double * A, int p, int r, double * X, double * Y) {
-    if (p < r) {
-        int q = (p + r)/2;
-        part(A, p, q, X, Y);
-        part(A, q + 1, r, X, Y);
-        merge(A, p, q, r, X, Y);
+void sortBlobs(struct blob_context * ctx, double * mags, double * x, double * y,
+               int count) {
+    int * order = ctx->sort_order;
+    double * scratch = ctx->sort_scratch;
+
+    for (int b = 0; b < count; b++) {
+        order[b] = b;
+    }
+    for (int pos = count/2 - 1; pos >= 0; pos--) {
+        siftSortedBlob(mags, order, pos, count);
+    }
+    // move the blob going last to the end of the heap, then shrink the heap
+    for (int n = count - 1; n > 0; n--) {
+        int blob = order[0];
+        order[0] = order[n];
+        order[n] = blob;
+        siftSortedBlob(mags, order, 0, n);
+    }
+
+    // put the blobs in that order
+    double * coords[3] = {mags, x, y};
+    for (int c = 0; c < 3; c++) {
+        for (int b = 0; b < count; b++) {
+            scratch[b] = coords[c][order[b]];
+        }
+        memcpy(coords[c], scratch, sizeof(double)*count);
     }
 }
 
@@ -1036,268 +1794,407 @@ int loadDummyPicture(wchar_t * filename, char ** buffer) {
     ImageFileParams.ppcImageMem = NULL;
 }
 
-/* Function to make table of stars from image for displaying in Kst (mostly for 
-** testing).
-** Inputs: The name of blob table file, array of blob magnitudes, array of blob 
-** x coordinates, array of blob y coordinates, and number of blobs.
-** Output: A flag indicating successful writing of the blob table file.
+/* Function to publish a frame for Kst and other local readers: its filtered
+** image, blobs and solution go in the live shared memory.
+** Input: The frame, and whether it was taken for auto-focusing.
+** Output: None (void).
 */
-int makeTable(char * filename, double * star_mags, double * star_x, 
-              double * star_y, int blob_count) {
-    FILE * fp;
+void publishFrame(struct frame * frame, int auto_focusing) {
+    struct live_solution live_solution = {0};
+
+    // an auto-focusing image is not solved
+    if (!auto_focusing && solution.source != SOLUTION_NONE) {
+        live_solution.solved = 1;
+        live_solution.source = solution.source;
+        live_solution.matches = solution.matches;
+        live_solution.rms = solution.rms;
+        live_solution.ra = all_astro_params.ra;
+        live_solution.dec = all_astro_params.dec;
+        live_solution.fr = all_astro_params.fr;
+        live_solution.ps = all_astro_params.ps;
+        live_solution.ir = all_astro_params.ir;
+        live_solution.alt = all_astro_params.alt;
+        live_solution.az = all_astro_params.az;
+    }
+    live_solution.frames_since_solve = solution.frames_since_solve;
+
+    publishLive(frame->output, frame->geometry.width, frame->geometry.height,
+                frame->geometry.factor, frame->geometry.x, frame->geometry.y,
+                auto_focusing, frame->star_mags, frame->star_x, frame->star_y,
+                frame->blob_count, &live_solution, frame->seconds);
+}
 
-    if ((fp = fopen(filename, "w")) == NULL) {
-    	fprintf(stderr, "Could not open blob-writing table file: %s.\n", 
+/* Function to allocate the buffers a pipeline frame needs.
+** Input: The frame.
+** Output: A flag indicating successful allocation of the frame or not.
+*/
+int allocFrame(struct frame * frame) {
+    // the filtered image (the archiver copies it, so plain memory will do)
+    frame->output = malloc(CAMERA_WIDTH*CAMERA_HEIGHT);
+    if (frame->output == NULL) {
+        fprintf(stderr, "Error allocating frame output memory: %s.\n",
                 strerror(errno));
-    	return -1;
+        return -1;
     }
 
-    for (int i = 0; i < blob_count; i++) {
-        fprintf(fp, "%f,%f,%f\n", star_mags[i], star_x[i], star_y[i]);
+    frame->star_x = malloc(sizeof(double)*MAX_BLOBS);
+    frame->star_y = malloc(sizeof(double)*MAX_BLOBS);
+    frame->star_mags = malloc(sizeof(double)*MAX_BLOBS);
+    if (frame->star_x == NULL || frame->star_y == NULL || 
+        frame->star_mags == NULL) {
+        fprintf(stderr, "Error allocating frame blob arrays: %s.\n", 
+                strerror(errno));
+        return -1;
     }
+    frame->blobs_alloc = MAX_BLOBS;
 
-    // close both files and return
-    fflush(fp);
-    fclose(fp);
     return 1;
 }
 
-/* Function to take observing images and solve for pointing using Astrometry.
-** Main function for the Astrometry thread in commands.c.
-** Input: None.
-** Output: A flag indicating successful round of image + solution by the camera 
-** (e.g. if the camera can't open the observing file, the function will 
-** automatically return with -1).
+/* Function to free the buffers of a pipeline frame.
+** Input: The frame.
+** Output: None (void).
 */
-int doCameraAndAstrometry() {
-    // these must be static since this function is called perpetually in 
-    // updateAstrometry thread
-    static double * star_x = NULL, * star_y = NULL, * star_mags = NULL;
-    static char * output_buffer = NULL;
-    static int first_time = 1, af_photo = 0;
-    static FILE * af_file = NULL;
-    static FILE * fptr = NULL;
-    static int num_focus_pos;
-    static int * blob_mags;
-    int blob_count;
-    char handleChar[4], datafile[100], buff[100], date[256], af_filename[256];
-    wchar_t filename[200] = L"";
-    struct timespec camera_tp_beginning, camera_tp_end; 
-    time_t seconds = time(NULL);
-    struct tm * tm_info;
-  
-    // uncomment line below for testing the values of each field in the global 
-    // structure for blob_params
-    if (verbose) {
-        verifyBlobParams();
+void freeFrame(struct frame * frame) {
+    if (frame->output != NULL) {
+        free(frame->output);
+        frame->output = NULL;
     }
 
-    tm_info = gmtime(&seconds);
-    all_astro_params.rawtime = seconds;
-    // if it is a leap year, adjust tm_info accordingly before it is passed to 
-    // calculations in lostInSpace
-    if (isLeapYear(tm_info->tm_year)) {
-        // if we are on Feb 29
-        if (tm_info->tm_yday == 59) {  
-            // 366 days in a leap year      
-            tm_info->tm_yday++;  
-            // we are still in February 59 days after January 1st (Feb 29)            
-            tm_info->tm_mon -= 1;
-            tm_info->tm_mday = 29;
-        } else if (tm_info->tm_yday > 59) {
-            tm_info->tm_yday++;           
-        }
+    if (frame->star_x != NULL) {
+        free(frame->star_x);
     }
 
-    // data file to pass to lostInSpace
-    sprintf(handleChar,"%i",camera_handle); // store camera_handle as char
-    strftime(datafile, sizeof(datafile), 
-            "/home/blast/Desktop/blastcam/data_%b-%d_", tm_info);
-    strcat(datafile,strcat(handleChar,".txt")); // concatenate handle #
-    
-    // set file descriptor for observing file to NULL in case of previous bad
-    // shutdown or termination of Astrometry
-    if (fptr != NULL) {
-        fclose(fptr);
-        fptr = NULL;
+    if (frame->star_y != NULL) {
+        free(frame->star_y);
     }
-    
-    if ((fptr = fopen(datafile, "a")) == NULL) {
-        fprintf(stderr, "Could not open obs. file: %s.\n", strerror(errno));
-        return -1;
+
+    if (frame->star_mags != NULL) {
+        free(frame->star_mags);
     }
 
-    if (first_time) {
-        output_buffer = calloc(1, CAMERA_WIDTH*CAMERA_HEIGHT);
-        if (output_buffer == NULL) {
-            fprintf(stderr, "Error allocating output buffer: %s.\n", 
-                    strerror(errno));
-            return -1;
-        }
+    frame->star_x = frame->star_y = frame->star_mags = NULL;
+    frame->blobs_alloc = 0;
+}
 
+/* Function to give a frame's image memory back to the camera ring once its
+** blobs are found (or the frame is released without them).
+** Input: The frame.
+** Output: None (void).
+*/
+void unlockFrameImage(struct frame * frame) {
+    if (frame->image == NULL) {
+        return;
+    }
+
+    if (is_UnlockSeqBuf(camera_handle, IS_IGNORE_PARAMETER, frame->image) 
+        != IS_SUCCESS) {
+        cam_error = printCameraError();
+        printf("Error unlocking image memory: %s.\n", cam_error);
+    }
+    frame->image = NULL;
+}
+
+/* Function to start an observing session in the observing log with a note of
+** the camera settings.
+** Input: The frame that starts the session.
+** Output: None (void).
+*/
+void logSessionNote(struct frame * frame) {
+    char buff[100];
+    char * note = NULL;
+    size_t note_size = 0;
+    FILE * fptr;
+
+    if ((fptr = open_memstream(&note, &note_size)) == NULL) {
+        fprintf(stderr, "Error making observing session note: %s.\n", 
+                strerror(errno));
+        return;
+    }
+
+    // get frame rate again
+    is_SetFrameRate(camera_handle, IS_GET_FRAMERATE, (void *) &actual_fps);
+
+    // write observing information to the note
+    strftime(buff, sizeof(buff), "%B %d Observing Session - beginning "
+                                 "%H:%M:%S GMT", &frame->tm_info); 
+    fprintf(fptr, "********************* %s *********************\n", buff);
+    fprintf(fptr, "Camera model: %s\n", sensorInfo.strSensorName);
+    fprintf(fptr, "----------------------------------------------------\n");
+    fprintf(fptr, "Exposure: %f milliseconds\n", curr_exposure);
+    fprintf(fptr, "Pixel clock: %i\n", curr_pc);
+    fprintf(fptr, "Frame rate achieved (desired is 10): %f\n", actual_fps);
+    fprintf(fptr, "Trigger delay (microseconds): %i\n", curr_trig_delay);
+    fprintf(fptr, "Current trigger mode setting: %i\n", curr_ext_trig);
+    fprintf(fptr, "Current trigger timeout: %i\n", curr_timeout);
+    fprintf(fptr, "Auto shutter: %.1f\n", curr_shutter);
+    fprintf(fptr, "Auto frame rate (should be disabled): %.1f\n", auto_fr);
+    fprintf(fptr, "----------------------------------------------------\n");
+    fprintf(fptr, "Sensor ID/type: %u\n", sensorInfo.SensorID);
+    fprintf(fptr, "Sensor color mode (from is_GetSensorInfo and "
+                  "is_SetColorMode): %i | %i\n", 
+            sensorInfo.nColorMode, curr_color_mode);
+    fprintf(fptr, "Maximum image width and height: %i, %i\n", 
+                   sensorInfo.nMaxWidth, sensorInfo.nMaxHeight);
+    fprintf(fptr, "Pixel size (micrometers): %.2f\n", 
+                  ((double) sensorInfo.wPixelSize)/100.0);
+    fprintf(fptr, "Gain settings: %i for master gain, %i for red gain, %i "
+                  "for green gain, and %i for blue gain.\n", 
+                  curr_master_gain, curr_red_gain, curr_green_gain, 
+                  curr_blue_gain);
+    fprintf(fptr, "Auto gain (should be disabled): %i\n", (int) curr_ag);
+    fprintf(fptr, "Gain boost (should be disabled): %i\n", curr_gain_boost);
+    fprintf(fptr, "Hardware gamma (should be disabled): %i\n", curr_gamma);
+    fprintf(fptr, "----------------------------------------------------\n");
+    fprintf(fptr, "Auto black level (should be off): %i\n", bl_mode);
+    fprintf(fptr, "Black level offset (desired is 50): %i\n", bl_offset);
+
+    fclose(fptr);
+
+    setObsLogNote(note);
+    free(note);
+}
+
+/* Function to get to the start of the auto-focusing range and set up the auto-
+** focusing file. Only called while no other frames are in the pipeline.
+** Input: The time the auto-focusing process is starting at.
+** Output: A flag indicating successful set-up of auto-focusing or not.
+*/
+int startAutoFocus(struct tm * tm_info) {
+    num_focus_pos = 0;
+    send_data = 0;
+    resetAdaptiveFocus();
+
+    // check that end focus position is at least 25 less than max focus
+    // position
+    pthread_mutex_lock(&camera_params_lock);
+    if (all_camera_params.max_focus_pos - all_camera_params.end_focus_pos 
+        < 25) {
+        printf("Adjusting end focus position to be 25 less than max focus "
+               "position.");
+        all_camera_params.end_focus_pos = all_camera_params.max_focus_pos 
+                                          - 25;
+    }
+
+    // check that beginning focus position is at least 25 above min focus
+    // position
+    if (all_camera_params.start_focus_pos - all_camera_params.min_focus_pos
+        < 25) {
+        printf("Adjusting beginning focus position to be 25 more than min "
+               "focus position.");
+        all_camera_params.start_focus_pos = all_camera_params.min_focus_pos
+                                            + 25;
+    }
+
+    // the whole run goes by the settings it started with, even if a client
+    // changes them meanwhile
+    auto_focus_params = all_camera_params;
+    pthread_mutex_unlock(&camera_params_lock);
+
+    // check that our blob magnitude array is big enough for number of
+    // photos we take per auto-focusing position
+    if (auto_focus_params.photos_per_focus != default_focus_photos) {
+        printf("Reallocating blob_mags array to allow for different # of "
+               "auto-focusing pictures.\n");
+        default_focus_photos = auto_focus_params.photos_per_focus;
+        free(blob_mags);
+        blob_mags = NULL;
+    }
+
+    if (blob_mags == NULL) {
         blob_mags = calloc(default_focus_photos, sizeof(int));
         if (blob_mags == NULL) {
-            fprintf(stderr, "Error allocating array for blob mags: %s.\n", 
+            fprintf(stderr, "Error allocating array for blob mags: %s.\n",
                     strerror(errno));
             return -1;
         }
-
-        // get frame rate again
-        is_SetFrameRate(camera_handle, IS_GET_FRAMERATE, (void *) &actual_fps);
-
-        // write observing information to data file
-        strftime(buff, sizeof(buff), "%B %d Observing Session - beginning "
-                                     "%H:%M:%S GMT", tm_info); 
-        fprintf(fptr, "********************* %s *********************\n", buff);
-        fprintf(fptr, "Camera model: %s\n", sensorInfo.strSensorName);
-        fprintf(fptr, "----------------------------------------------------\n");
-        fprintf(fptr, "Exposure: %f milliseconds\n", curr_exposure);
-        fprintf(fptr, "Pixel clock: %i\n", curr_pc);
-        fprintf(fptr, "Frame rate achieved (desired is 10): %f\n", actual_fps);
-        fprintf(fptr, "Trigger delay (microseconds): %i\n", curr_trig_delay);
-        fprintf(fptr, "Current trigger mode setting: %i\n", curr_ext_trig);
-        fprintf(fptr, "Current trigger timeout: %i\n", curr_timeout);
-        fprintf(fptr, "Auto shutter: %.1f\n", curr_shutter);
-        fprintf(fptr, "Auto frame rate (should be disabled): %.1f\n", auto_fr);
-        fprintf(fptr, "----------------------------------------------------\n");
-        fprintf(fptr, "Sensor ID/type: %u\n", sensorInfo.SensorID);
-        fprintf(fptr, "Sensor color mode (from is_GetSensorInfo and "
-                      "is_SetColorMode): %i | %i\n", 
-                sensorInfo.nColorMode, curr_color_mode);
-        fprintf(fptr, "Maximum image width and height: %i, %i\n", 
-                       sensorInfo.nMaxWidth, sensorInfo.nMaxHeight);
-        fprintf(fptr, "Pixel size (micrometers): %.2f\n", 
-                      ((double) sensorInfo.wPixelSize)/100.0);
-        fprintf(fptr, "Gain settings: %i for master gain, %i for red gain, %i "
-                      "for green gain, and %i for blue gain.\n", 
-                      curr_master_gain, curr_red_gain, curr_green_gain, 
-                      curr_blue_gain);
-        fprintf(fptr, "Auto gain (should be disabled): %i\n", (int) curr_ag);
-        fprintf(fptr, "Gain boost (should be disabled): %i\n", curr_gain_boost);
-        fprintf(fptr, "Hardware gamma (should be disabled): %i\n", curr_gamma);
-        fprintf(fptr, "----------------------------------------------------\n");
-        fprintf(fptr, "Auto black level (should be off): %i\n", bl_mode);
-        fprintf(fptr, "Black level offset (desired is 50): %i\n", bl_offset);
-
-        //write header to data file
-        if (fprintf(fptr, "\nC time|GMT|Blob #|Observed RA (deg)|Astrometry RA (deg)|"
-                          "Observed DEC (deg)| Astrometry DEC (deg)|FR (deg)|PS|"
-                          "ALT (deg)|AZ (deg)|IR (deg)|Astrom. solve time "
-                          "(msec)|Camera time (msec)") < 0) {
-            fprintf(stderr, "Error writing header to observing file: %s.\n", 
-                    strerror(errno));
-        }
-
-        fflush(fptr);
-        first_time = 0;
     }
 
-    // if we are at the start of auto-focusing (either when camera first runs or 
-    // user re-enters auto-focusing mode)
-    if (all_camera_params.begin_auto_focus && all_camera_params.focus_mode) {
-        num_focus_pos = 0;
-        send_data = 0;
+    // get to beginning of auto-focusing range
+    if (beginAutoFocus() < 1) {
+        printf("Error beginning auto-focusing process. Skipping to taking "
+               "observing images...\n");
 
-        // check that our blob magnitude array is big enough for number of
-        // photos we take per auto-focusing position
-        if (all_camera_params.photos_per_focus != default_focus_photos) {
-            printf("Reallocating blob_mags array to allow for different # of "
-                   "auto-focusing pictures.\n");
-            default_focus_photos = all_camera_params.photos_per_focus;
-            blob_mags = realloc(blob_mags, sizeof(int) * default_focus_photos);
+        // return to default focus position
+        if (defaultFocusPosition() < 1) {
+            printf("Error moving to default focus position.\n");
+            closeCamera();
+            return -1;
         }
 
-        // check that end focus position is at least 25 less than max focus
-        // position
-        if (all_camera_params.max_focus_pos - all_camera_params.end_focus_pos 
-            < 25) {
-            printf("Adjusting end focus position to be 25 less than max focus "
-                   "position.");
-            all_camera_params.end_focus_pos = all_camera_params.max_focus_pos 
-                                              - 25;
-        }
+        // abort auto-focusing process
+        pthread_mutex_lock(&camera_params_lock);
+        all_camera_params.focus_mode = 0;
+        pthread_mutex_unlock(&camera_params_lock);
+    }
 
-        // check that beginning focus position is at least 25 above min focus
-        // position
-        if (all_camera_params.start_focus_pos - all_camera_params.min_focus_pos
-            < 25) {
-            printf("Adjusting beginning focus position to be 25 more than min "
-                   "focus position.");
-            all_camera_params.start_focus_pos = all_camera_params.min_focus_pos
-                                                + 25;
-        }
+    if (af_file != NULL) {
+        fclose(af_file);
+        af_file = NULL;
+    }
 
-        // get to beginning of auto-focusing range
-        if (beginAutoFocus() < 1) {
-            printf("Error beginning auto-focusing process. Skipping to taking "
-                   "observing images...\n");
+    // clear previous contents of auto-focusing file (open in write mode)
+    strftime(af_filename, sizeof(af_filename), "/home/blast/Desktop/"
+                                               "blastcam/auto_focus_"
+                                               "starting_%Y-%m-%d_%H:%M:"
+                                               "%S.txt", 
+             tm_info);
+    if (verbose) {
+        printf("Opening auto-focusing text file: %s\n", af_filename);
+    }
 
-            // return to default focus position
-            if (defaultFocusPosition() < 1) {
-                printf("Error moving to default focus position.\n");
-                closeCamera();
-                return -1;
-            }
+    if ((af_file = fopen(af_filename, "w")) == NULL) {
+        fprintf(stderr, "Could not open auto-focusing file: %s.\n", 
+                strerror(errno));
+        return -1;
+    }
 
-            // abort auto-focusing process
-            all_camera_params.focus_mode = 0;
-        }
-        
-        usleep(1000000); 
+    pthread_mutex_lock(&camera_params_lock);
+    all_camera_params.begin_auto_focus = 0;
+    pthread_mutex_unlock(&camera_params_lock);
 
-        if (af_file != NULL) {
-            fclose(af_file);
-            af_file = NULL;
-        }
+    return 1;
+}
 
-        // clear previous contents of auto-focusing file (open in write mode)
-        strftime(af_filename, sizeof(af_filename), "/home/blast/Desktop/"
-                                                   "blastcam/auto_focus_"
-                                                   "starting_%Y-%m-%d_%H:%M:"
-                                                   "%S.txt", 
-                 tm_info);
-        if (verbose) {
-            printf("Opening auto-focusing text file: %s\n", af_filename);
-        }
+/* Function to mark an exposure as started or finished.
+** Input: (bool) If an exposure is under way.
+** Output: None (void).
+*/
+void setTakingImage(int taking) {
+    pthread_mutex_lock(&image_lock);
+    taking_image = taking;
+    if (!taking) {
+        pthread_cond_broadcast(&image_taken);
+    }
+    pthread_mutex_unlock(&image_lock);
+}
 
-        if ((af_file = fopen(af_filename, "w")) == NULL) {
-    	    fprintf(stderr, "Could not open auto-focusing file: %s.\n", 
-                    strerror(errno));
-    	    return -1;
-    	}
+/* Function to wait until no exposure is under way, e.g. before moving the
+** lens.
+** Input: None.
+** Output: None (void).
+*/
+void waitWhileTakingImage() {
+    pthread_mutex_lock(&image_lock);
+    while (taking_image) {
+        pthread_cond_wait(&image_taken, &image_lock);
+    }
+    pthread_mutex_unlock(&image_lock);
+}
 
-        all_camera_params.begin_auto_focus = 0;
+/* Function for the capture stage of the pipeline: takes an observing image and
+** attaches its (locked) ring buffer to the frame.
+** Input: The frame to fill.
+** Output: A flag indicating successful capture of the image or not.
+*/
+int captureFrame(struct frame * frame) {
+    static int capture_started = 0;
+    struct tm * tm_info;
+    struct timespec lap;
+    int starting_auto_focus, lens_moved;
 
-        // turn dynamic hot pixels off to avoid removing blobs during focusing
-        prev_dynamic_hp = all_blob_params.dynamic_hot_pixels;
-        if (verbose) {
-            printf("Turning dynamic hot pixel finder off for auto-focusing.\n");
+    frame->seconds = time(NULL);
+    tm_info = &frame->tm_info;
+    gmtime_r(&frame->seconds, tm_info);
+    // if it is a leap year, adjust tm_info accordingly before it is passed to 
+    // calculations in lostInSpace
+    if (isLeapYear(tm_info->tm_year)) {
+        // if we are on Feb 29
+        if (tm_info->tm_yday == 59) {  
+            // 366 days in a leap year      
+            tm_info->tm_yday++;  
+            // we are still in February 59 days after January 1st (Feb 29)            
+            tm_info->tm_mon -= 1;
+            tm_info->tm_mday = 29;
+        } else if (tm_info->tm_yday > 59) {
+            tm_info->tm_yday++;           
         }
-        all_blob_params.dynamic_hot_pixels = 0;
-        
-        // link the auto-focusing txt file to Kst for plotting
-        unlink("/home/blast/Desktop/blastcam/latest_auto_focus_data.txt");
-        symlink(af_filename, 
-                "/home/blast/Desktop/blastcam/latest_auto_focus_data.txt");
     }
 
+    // if we are at the start of auto-focusing (either when camera first runs or 
+    // user re-enters auto-focusing mode)
+    pthread_mutex_lock(&camera_params_lock);
+    starting_auto_focus = all_camera_params.begin_auto_focus &&
+                          all_camera_params.focus_mode;
+    pthread_mutex_unlock(&camera_params_lock);
+    if (starting_auto_focus && startAutoFocus(tm_info) < 1) {
+        return -1;
+    }
+    pthread_mutex_lock(&camera_params_lock);
+    frame->auto_focus = all_camera_params.focus_mode;
+    pthread_mutex_unlock(&camera_params_lock);
+
     // take an image
     if (verbose) {
          printf("\n> Taking a new image...\n\n");
     }
 
-    taking_image = 1;
-    if (is_FreezeVideo(camera_handle, IS_WAIT) != IS_SUCCESS) {
-       const char * last_error_str = printCameraError();
-       printf("Failed to capture new image: %s\n", last_error_str);
-    } 
-    taking_image = 0;
+    if (switchGeometry(continuous_capture && capture_started) < 1) {
+        return -1;
+    }
+    frame->geometry = camera_geometry;
 
-    // get the image from memory
+    if (continuous_capture && !capture_started) {
+        if (startContinuousCapture() < 1) {
+            return -1;
+        }
+        capture_started = 1;
+    }
+
+    // an auto-focusing image has to be taken where the lens was sent, but 
+    // otherwise the lens thread moves the lens without holding up the images
+    lens_moved = !frame->auto_focus || waitForLens() == 1;
+
+    // everything the frame is processed with is set as of its exposure (the
+    // camera and lens settings too, which the other threads change)
+    snapshotParams(&frame->params);
+    snapshotCameraParams(&frame->camera);
+    if (!lens_moved) {
+        printf("The lens did not finish moving to focus %d.\n",
+               frame->camera.focus_position);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &frame->capture_start);
+    lap = frame->capture_start;
+    setTakingImage(1);
+    if (continuous_capture) {
+        // the exposure in progress may have started before the lens moved to 
+        // this focus position, so skip it
+        if (frame->auto_focus && waitForNextImage() < 1) {
+            setTakingImage(0);
+            return -1;
+        }
+
+        if (waitForNextImage() < 1) {
+            setTakingImage(0);
+            return -1;
+        }
+    } else if (is_FreezeVideo(camera_handle, IS_WAIT) != IS_SUCCESS) {
+        // the active buffer may still be locked by a frame in flight, so it
+        // is not taken again
+        const char * last_error_str = printCameraError();
+        printf("Failed to capture new image: %s\n", last_error_str);
+        setTakingImage(0);
+        return -1;
+    }
+    setTakingImage(0);
+    perfLap(PERF_EXPOSURE, &lap);
+
+    // get the image from memory (the last buffer the driver finished)
     if (is_GetActSeqBuf(camera_handle, &buffer_num, &waiting_mem, &memory) 
         != IS_SUCCESS) {
         cam_error = printCameraError();
         printf("Error retrieving the active image memory: %s.\n", cam_error);
+        return -1;
+    }
+
+    // lock the buffer so the driver does not capture into it again until every
+    // consumer of this frame has released it
+    if (is_LockSeqBuf(camera_handle, IS_IGNORE_PARAMETER, memory) 
+        != IS_SUCCESS) {
+        cam_error = printCameraError();
+        printf("Error locking the active image memory: %s.\n", cam_error);
+        return -1;
     }
 
     // testing pictures that have already been taken 
@@ -1313,270 +2210,453 @@ int doCameraAndAstrometry() {
     //     return -1;
     // }
 
-    // find the blobs in the image
-    blob_count = findBlobs(memory, CAMERA_WIDTH, CAMERA_HEIGHT, &star_x, 
-                           &star_y, &star_mags, output_buffer);
+    // hand the image off to the pipeline by pointer (no copy)
+    frame->image = memory;
+    perfLap(PERF_READOUT, &lap);
+    clock_gettime(CLOCK_MONOTONIC, &frame->capture_end);
 
-    // make kst display the filtered image 
-    memcpy(memory, output_buffer, CAMERA_WIDTH*CAMERA_HEIGHT); 
+    return 1;
+}
 
-    // pointer for transmitting to user should point to where image is in memory
-    camera_raw = output_buffer;
+/* Function for the blob-finding stage of the pipeline.
+** Input: The captured frame.
+** Output: The number of blobs found in the frame's image.
+*/
+int findFrameBlobs(struct frame * frame) {
+    int blob_count;
 
-    // get current time right after exposure
-    if (clock_gettime(CLOCK_REALTIME, &camera_tp_beginning) == -1) {
-        fprintf(stderr, "Error starting camera timer: %s.\n", strerror(errno));
+    // a static hot pixel map that was asked for is made from this image only
+    frame->params.blob.make_static_hp_mask = atomic_exchange(&hp_map_request,
+                                                             0);
+    // dynamic hot pixels are off while auto-focusing so no blobs are removed
+    if (frame->auto_focus) {
+        frame->params.blob.dynamic_hot_pixels = 0;
     }
 
-    // now have to distinguish between auto-focusing actions and solving
-    if (all_camera_params.focus_mode && !all_camera_params.begin_auto_focus) {
-        int brightest_blob, max_flux, focus_step;
-        int brightest_blob_x, brightest_blob_y;
-        char focus_str_cmd[10];
-        char time_str[100];
+    // uncomment line below for testing the values of each field in the global 
+    // structure for blob_params
+    if (verbose) {
+        verifyBlobParams(&frame->params.blob);
+    }
 
-        if (verbose) {
-            printf("\n>> Still auto-focusing!\n");
-        }
+    clock_gettime(CLOCK_MONOTONIC, &frame->blobs_start);
 
-        // find the brightest blob per picture
-        brightest_blob = -1;
-        for (int blob = 0; blob < blob_count; blob++) {
-            if (star_mags[blob] > brightest_blob) {
-                brightest_blob = star_mags[blob];
-                brightest_blob_x = (int) star_x[blob];
-                brightest_blob_y = (int) star_y[blob];
-            }
+    // when stacking, the blobs of the exposure on its own only register it
+    // with the stack, and the frame gets the blobs (and the filtered image)
+    // of the stacked image
+    int stacking = stack_frames > 1 && !frame->auto_focus;
+    struct blob_context * ctx = &camera_blobs;
+    if (!stacking) {
+        resetFrameStack(&camera_stack);
+    }
+
+    // find the blobs in the image (only this stage finds blobs with the
+    // camera's contexts, so their blob arrays are reused for every frame and
+    // copied into the frame)
+    blob_count = findBlobs(&camera_blobs, frame->image, &frame->geometry,
+                           &frame->params.blob, frame->output);
+
+    if (stacking && camera_blobs.mask != NULL &&
+        stackFrame(&camera_stack, frame->image, &frame->geometry,
+                   camera_blobs.mask, camera_blobs.level, camera_blobs.star_x,
+                   camera_blobs.star_y, blob_count) > 0) {
+        // the static hot pixel map is only made from single exposures
+        struct blob_params params = frame->params.blob;
+        struct camera_geometry geometry = frame->geometry;
+        params.make_static_hp_mask = 0;
+        geometry.stride = geometry.width;
+
+        ctx = &stack_blobs;
+        blob_count = findBlobs(ctx, camera_stack.image, &geometry, &params,
+                               frame->output);
+    }
+
+    frame->centroid_start = ctx->centroid_start;
+    frame->centroid_end = ctx->centroid_end;
+    frame->hfd = ctx->hfd;
+    frame->hfd_blobs = ctx->hfd_count;
+
+    memcpy(frame->star_x, ctx->star_x, sizeof(double)*blob_count);
+    memcpy(frame->star_y, ctx->star_y, sizeof(double)*blob_count);
+    memcpy(frame->star_mags, ctx->star_mags, sizeof(double)*blob_count);
+    frame->blob_count = blob_count;
+
+    clock_gettime(CLOCK_MONOTONIC, &frame->blobs_end);
+
+    return blob_count;
+}
+
+/* Function to free the blob-finding buffers once the blob-finding stage has 
+** drained (we are shutting down).
+** Input: None.
+** Output: None (void).
+*/
+void freeBlobBuffers() {
+    if (verbose) {
+        printf("\n> Freeing blob-finding variables in camera.c...\n");
+    }
+
+    freeBlobContext(&camera_blobs);
+    freeBlobContext(&stack_blobs);
+    freeFrameStack(&camera_stack);
+}
+
+/* Function to move the lens to the best focus auto-focusing found, kept in
+** the range of the lens.
+** Input: The best focus.
+** Output: None (void).
+*/
+void moveToBestFocus(int best_focus) {
+    char focus_str_cmd[LENS_COMMAND_SIZE];
+    struct camera_params params;
+
+    // if the calculated auto focus position is outside the possible range, 
+    // set it to corresponding nearest focus
+    snapshotCameraParams(&params);
+    if (best_focus > params.max_focus_pos) {
+        printf("Auto focus is greater than max possible focus, so just use "
+               "that.\n");
+        best_focus = params.max_focus_pos;
+    } else if (best_focus < params.min_focus_pos) {
+        printf("Auto focus is less than min possible focus, so just use "
+               "that.\n");
+        // this outcome is highly unlikely but just in case
+        best_focus = params.min_focus_pos;
+    }
+
+    snprintf(focus_str_cmd, sizeof(focus_str_cmd), "mf %i\r",
+             best_focus - params.focus_position);
+    shiftFocus(focus_str_cmd);
+}
+
+/* Function to wrap up auto-focusing once the lens is sent to the best focus.
+** The auto-focusing file is linked for Kst only now that it is complete.
+** Input: None.
+** Output: None (void).
+*/
+void finishAutoFocus() {
+    if (af_file != NULL) {
+        fclose(af_file);
+        af_file = NULL;
+
+        // link the auto-focusing txt file to Kst for plotting
+        unlink("/home/blast/Desktop/blastcam/latest_auto_focus_data.txt");
+        symlink(af_filename,
+                "/home/blast/Desktop/blastcam/latest_auto_focus_data.txt");
+    }
+    resetAdaptiveFocus();
+}
+
+/* Function for processing one picture of the auto-focusing sequence, moving 
+** the lens to the next focus position once we have enough pictures.
+** Input: The frame.
+** Output: None (void). Fills in the name to save the image under (without the
+** extension).
+*/
+void autoFocusFrame(struct frame * frame, char * name) {
+    int brightest_blob, max_flux, focus_step, next_focus;
+    int brightest_blob_x, brightest_blob_y;
+    char focus_str_cmd[LENS_COMMAND_SIZE];
+    char time_str[100];
+    double * star_x = frame->star_x, * star_y = frame->star_y;
+    double * star_mags = frame->star_mags;
+
+    if (verbose) {
+        printf("\n>> Still auto-focusing!\n");
+    }
+
+    // find the brightest blob per picture
+    brightest_blob = -1;
+    for (int blob = 0; blob < frame->blob_count; blob++) {
+        if (star_mags[blob] > brightest_blob) {
+            brightest_blob = star_mags[blob];
+            brightest_blob_x = (int) star_x[blob];
+            brightest_blob_y = (int) star_y[blob];
+        }
+    }
+    printf("Brightest blob for photo %d at focus %d has value %d.\n", 
+           af_photo + 1, frame->camera.focus_position, brightest_blob);
+    if (auto_focus_params.focus_metric == FOCUS_METRIC_HFD) {
+        // smaller stars score higher, so the fits look for a peak either way;
+        // photos with too few stars to measure are left out of the average
+        if (frame->hfd_blobs >= HFD_MIN_BLOBS) {
+            blob_mags[af_photo] = (int) round(HFD_SCORE/frame->hfd);
+            printf("Median half-flux diameter of %d blobs is %.2f px.\n",
+                   frame->hfd_blobs, frame->hfd);
+        } else {
+            blob_mags[af_photo] = -1;
+            printf("Too few blobs (%d) to measure the half-flux diameter.\n",
+                   frame->hfd_blobs);
         }
-        blob_mags[af_photo++] = brightest_blob;
-        printf("Brightest blob for photo %d at focus %d has value %d.\n", 
-               af_photo, all_camera_params.focus_position, brightest_blob);
-
-        strftime(time_str, sizeof(time_str), "%Y-%m-%d_%H:%M:%S", tm_info);
-        sprintf(date, "/home/blast/Desktop/blastcam/BMPs/auto_focus_at_%d_"
-                      "brightest_blob_%d_at_x%d_y%d_%s.bmp", 
-                all_camera_params.focus_position, brightest_blob, 
-                brightest_blob_x, brightest_blob_y, time_str);
+    } else {
+        blob_mags[af_photo] = brightest_blob;
+    }
+    af_photo++;
+
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d_%H:%M:%S", &frame->tm_info);
+    sprintf(name, ARCHIVE_DIR "auto_focus_at_%d_brightest_blob_%d_at_x%d_"
+                  "y%d_%s", 
+            frame->camera.focus_position, brightest_blob,
+            brightest_blob_x, brightest_blob_y, time_str);
+    if (verbose) {
+        printf("Saving auto-focusing image as: %s\n", name);
+    }
+
+    if (af_photo >= auto_focus_params.photos_per_focus) {
         if (verbose) {
-            printf("Saving auto-focusing image as: %s\n", date);
+            printf("> Processing auto-focus images for focus %d -> do not "
+                   "take an image...\n", frame->camera.focus_position);
         }
-        swprintf(filename, 200, L"%s", date);
 
-        if (af_photo >= all_camera_params.photos_per_focus) {
-            if (verbose) {
-                printf("> Processing auto-focus images for focus %d -> do not "
-                       "take an image...\n", all_camera_params.focus_position);
+        max_flux = -1;
+        if (auto_focus_params.focus_metric == FOCUS_METRIC_HFD) {
+            // average score of the photos that could be measured (0 if none)
+            int sum = 0, num_scored = 0;
+            for (int i = 0; i < auto_focus_params.photos_per_focus; i++) {
+                if (blob_mags[i] >= 0) {
+                    sum += blob_mags[i];
+                    num_scored++;
+                }
             }
-
+            max_flux = (num_scored > 0) ? (sum + num_scored/2)/num_scored : 0;
+            printf("(*) Focus score of %d photos for focus %d is %d.\n",
+                   num_scored, frame->camera.focus_position, max_flux);
+        } else {
             // find brightest of three brightest blobs for this batch of images
-            max_flux = -1;
-            for (int i = 0; i < all_camera_params.photos_per_focus; i++) {
+            for (int i = 0; i < auto_focus_params.photos_per_focus; i++) {
                 if (blob_mags[i] > max_flux) {
                     max_flux = blob_mags[i];
                 }
             }
-           
-            all_camera_params.flux = max_flux;
-            printf("(*) Brighest blob among %d photos for focus %d is %d.\n", 
-                   all_camera_params.photos_per_focus, 
-                   all_camera_params.focus_position,
+            printf("(*) Brighest blob among %d photos for focus %d is %d.\n",
+                   auto_focus_params.photos_per_focus,
+                   frame->camera.focus_position,
                    max_flux);
+        }
+       
+        pthread_mutex_lock(&camera_params_lock);
+        all_camera_params.flux = max_flux;
+        pthread_mutex_unlock(&camera_params_lock);
 
+        if (af_file != NULL) {
             fprintf(af_file, "%3d\t%5d\n", max_flux,
-                    all_camera_params.focus_position);
+                    frame->camera.focus_position);
             fflush(af_file);
+        }
 
-            send_data = 1;
-
-            // if clients are listening and we want to guarantee data is sent to
-            // them before continuing with auto-focusing, wait until data_sent
-            // confirmation. If there are no clients, no need to slow down auto-
-            // focusing
-            if (num_clients > 0) {
-                while (!telemetry_sent) {
-                    if (verbose) {
-                        printf("> Waiting for data to send to client...\n");
-                    }
+        // we want to guarantee this focus step's data is sent to any clients 
+        // before continuing with auto-focusing, so wait until it is. If there 
+        // are no clients, there is no need to slow down auto-focusing
+        waitForBroadcast(broadcastTelemetry(frame));
 
-                    usleep(100000);
-                }
-            }
+        send_data = 0;
 
-            send_data = 0;
+        // since we are moving to next focus, re-start photo counter and get
+        // rid of previous blob magnitudes
+        af_photo = 0;
+        for (int i = 0; i < auto_focus_params.photos_per_focus; i++) {
+            blob_mags[i] = 0;
+        }
 
-            // since we are moving to next focus, re-start photo counter and get
-            // rid of previous blob magnitudes
-            af_photo = 0;
-            for (int i = 0; i < all_camera_params.photos_per_focus; i++) {
-                blob_mags[i] = 0;
+        if (auto_focus_params.focus_search == FOCUS_ADAPTIVE) {
+            // the curve so far decides where to go next, or that its peak 
+            // is known well enough to go there and stop
+            num_focus_pos++;
+            if (nextAdaptiveFocus(frame->camera.focus_position, max_flux,
+                                  &next_focus) == 1) {
+                snprintf(focus_str_cmd, sizeof(focus_str_cmd), "mf %i\r",
+                         next_focus - frame->camera.focus_position);
+                if (!cancelling_auto_focus) {
+                    shiftFocus(focus_str_cmd);
+                }
+            } else {
+                pthread_mutex_lock(&camera_params_lock);
+                all_camera_params.focus_mode = 0;
+                pthread_mutex_unlock(&camera_params_lock);
+                printf("(*) Best focus is %d, found with %d focus positions.\n",
+                       next_focus, num_focus_pos);
+                moveToBestFocus(next_focus);
+                finishAutoFocus();
             }
-
+        } else if (frame->camera.focus_position >=
+                   auto_focus_params.end_focus_pos) {
             // We have moved to the end (or past) the end focus position, so
             // calculate best focus and exit
-            if (all_camera_params.focus_position >= 
-                all_camera_params.end_focus_pos) {
-                int best_focus; 
-                all_camera_params.focus_mode = 0;
-                // at very last focus position
-                num_focus_pos++;
-
-                best_focus = calculateOptimalFocus(num_focus_pos, af_filename);
-                if (best_focus == -1000) {
-                    // if we can't find optimal focus from auto-focusing data, 
-                    // just go to the default
-                    defaultFocusPosition();
-                } else {
-                    // if the calculated auto focus position is outside the
-                    // possible range, set it to corresponding nearest focus
-                    if (best_focus > all_camera_params.max_focus_pos) {
-                        printf("Auto focus is greater than max possible focus, "
-                               "so just use that.\n");
-                        best_focus = all_camera_params.max_focus_pos;
-                    } else if (best_focus < all_camera_params.min_focus_pos) {
-                        printf("Auto focus is less than min possible focus, "
-                               "so just use that.\n");
-                        // this outcome is highly unlikely but just in case
-                        best_focus = all_camera_params.min_focus_pos;
-                    }
-
-                    sprintf(focus_str_cmd, "mf %i\r", 
-                            best_focus - all_camera_params.focus_position);
-                    shiftFocus(focus_str_cmd);
-                }
-
-                fclose(af_file);
-                af_file = NULL;
+            int best_focus; 
+            pthread_mutex_lock(&camera_params_lock);
+            all_camera_params.focus_mode = 0;
+            pthread_mutex_unlock(&camera_params_lock);
+            // at very last focus position
+            num_focus_pos++;
+
+            best_focus = calculateOptimalFocus(num_focus_pos, af_filename);
+            if (best_focus == -1000) {
+                // if we can't find optimal focus from auto-focusing data, 
+                // just go to the default
+                defaultFocusPosition();
+            } else {
+                moveToBestFocus(best_focus);
+            }
+            finishAutoFocus();
+        } else {
+            // Move to the next focus position if we still have positions to
+            // cover
+            focus_step = min(auto_focus_params.focus_step,
+                         auto_focus_params.end_focus_pos -
+                         frame->camera.focus_position);
+            snprintf(focus_str_cmd, sizeof(focus_str_cmd), "mf %i\r",
+                     focus_step);
+            if (!cancelling_auto_focus) {
+                shiftFocus(focus_str_cmd);
+            }
+            num_focus_pos++;
+        }
+    }
+}
 
-                // turn dynamic hot pixels back to whatever user had specified
-                if (verbose) {
-                    printf("> Auto-focusing finished, so restoring dynamic hot "
-                           "pixels to previous value...\n");
-                }
+/* Function for the solving stage of the pipeline: solves for pointing using 
+** Astrometry (or takes the next auto-focusing step), archives the image, and 
+** logs the solution and the per-stage timing of the frame.
+** Input: The frame, with its blobs already found.
+** Output: A flag indicating successful round of image + solution by the camera 
+** (e.g. if the auto-focusing buffers can't be allocated, the function will 
+** automatically return with -1).
+*/
+int solveFrame(struct frame * frame) {
+    static int first_time = 1;
+    char buff[100], name[256];
+    int auto_focusing;
+    struct tm * tm_info = &frame->tm_info;
+
+    clock_gettime(CLOCK_MONOTONIC, &frame->solve_start);
+    all_astro_params.rawtime = frame->seconds;
+    // only this stage uses (and writes) all_astro_params, so it takes the
+    // solver and site settings the frame was taken with
+    all_astro_params.timelimit = frame->params.timelimit;
+    all_astro_params.logodds = frame->params.logodds;
+    all_astro_params.latitude = frame->params.latitude;
+    all_astro_params.longitude = frame->params.longitude;
+    all_astro_params.hm = frame->params.hm;
 
-                all_blob_params.dynamic_hot_pixels = prev_dynamic_hp;
-                if (verbose) {
-                    printf("Now all_blob_params.dynamic_hot_pixels = %d\n", 
-                           all_blob_params.dynamic_hot_pixels);
-                }
-            } else {
-                // Move to the next focus position if we still have positions to
-                // cover
-                focus_step = min(all_camera_params.focus_step, 
-                             all_camera_params.end_focus_pos - 
-                             all_camera_params.focus_position);
-                sprintf(focus_str_cmd, "mf %i\r", focus_step);
-                if (!cancelling_auto_focus) {
-                    shiftFocus(focus_str_cmd);
-                    usleep(100000);
-                }
-                num_focus_pos++;
+    if (first_time) {
+        if (blob_mags == NULL) {
+            blob_mags = calloc(default_focus_photos, sizeof(int));
+            if (blob_mags == NULL) {
+                fprintf(stderr, "Error allocating array for blob mags: %s.\n", 
+                        strerror(errno));
+                return -1;
             }
         }
+
+        logSessionNote(frame);
+        first_time = 0;
+    }
+
+    // now have to distinguish between auto-focusing actions and solving
+    pthread_mutex_lock(&camera_params_lock);
+    auto_focusing = frame->auto_focus && all_camera_params.focus_mode && 
+                    !all_camera_params.begin_auto_focus;
+    pthread_mutex_unlock(&camera_params_lock);
+    if (auto_focusing) {
+        autoFocusFrame(frame, name);
+        // the stars move with the focus, and the image after is not matched
+        // with this one
+        forgetBlobs(&previous_blobs);
     } else {
-        double start, end, camera_time;
+        struct obs_record record = {0};
         send_data = 1;
 
         if (verbose) {
             printf(">> No longer auto-focusing!\n");
         }
 
-        strftime(date, sizeof(date), "/home/blast/Desktop/blastcam/BMPs/"
-                                     "saved_image_%Y-%m-%d_%H:%M:%S.bmp", 
-                                     tm_info);
-        swprintf(filename, 200, L"%s", date);
+        strftime(name, sizeof(name), ARCHIVE_DIR "saved_image_%Y-%m-%d_"
+                                     "%H:%M:%S", tm_info);
 
-        // write blob and time information to data file
         strftime(buff, sizeof(buff), "%b %d %H:%M:%S", tm_info); 
         printf("\nTime going into Astrometry.net: %s\n", buff);
 
-        if (fprintf(fptr, "\r%li|%s|", seconds, buff) < 0) {
-            fprintf(stderr, "Unable to write time and blob count to observing "
-                            "file: %s.\n", strerror(errno));
-        }
-        fflush(fptr);
-
         // solve astrometry
         if (verbose) {
             printf("\n> Trying to solve astrometry...\n");
         }
 
-        if (lostInSpace(star_x, star_y, star_mags, blob_count, tm_info, 
-                        datafile) != 1) {
+        // between full solves, move the last solution with the stars if
+        // they match the previous image's well enough (the observing log
+        // has only Astrometry's solutions)
+        struct image_motion motion;
+        if (propagate_frames > 0 &&
+            solution.frames_since_solve < propagate_frames &&
+            matchBlobs(&previous_blobs, frame->star_x, frame->star_y,
+                       frame->blob_count, &frame->geometry, &motion) == 1 &&
+            propagateSolution(&motion, &frame->geometry, tm_info,
+                              &record) == 1) {
+            if (verbose) {
+                printf("(*) Skipped Astrometry for the propagated solution.\n");
+            }
+        } else if (lostInSpace(frame->star_x, frame->star_y, frame->star_mags,
+                               frame->blob_count, &frame->geometry, tm_info,
+                               &record) != 1) {
             printf("\n(*) Could not solve Astrometry.\n");
         }
+        record.source = solution.source;
+        rememberBlobs(&previous_blobs, frame->star_x, frame->star_y,
+                      frame->blob_count, &frame->geometry);
 
         // get current time right after solving
-        if (clock_gettime(CLOCK_REALTIME, &camera_tp_end) == -1) {
-            fprintf(stderr, "Error ending timer: %s.\n", strerror(errno));
-        }
+        clock_gettime(CLOCK_MONOTONIC, &frame->solve_end);
+        recordPerf(PERF_FRAME, msecBetween(&frame->capture_start, 
+                                           &frame->solve_end));
 
-        // calculate time it took camera program to run in nanoseconds
-	    start = (double) (camera_tp_beginning.tv_sec*1e9) + 
-                (double) camera_tp_beginning.tv_nsec;
-	    end = (double) (camera_tp_end.tv_sec*1e9) + 
-              (double) camera_tp_end.tv_nsec;
-        camera_time = end - start;
+        // calculate time from the end of blob-finding to the solution
+        record.camera_time = msecBetween(&frame->blobs_end, &frame->solve_end);
 	    printf("(*) Camera completed one round in %f msec.\n", 
-               camera_time*1e-6);
+               record.camera_time);
+
+        // log the solution with how long each stage of the pipeline took for 
+        // this frame
+        record.seconds = frame->seconds;
+        record.blob_count = frame->blob_count;
+        record.capture_time = msecBetween(&frame->capture_start, 
+                                          &frame->capture_end);
+        record.blob_time = msecBetween(&frame->blobs_start, &frame->blobs_end);
+        record.centroid_time = msecBetween(&frame->centroid_start, 
+                                           &frame->centroid_end);
+        record.solve_time = msecBetween(&frame->solve_start, &frame->solve_end);
+        record.blob_queue_depth = frame->blob_queue_depth;
+        record.solve_queue_depth = frame->solve_queue_depth;
+        logObservation(&record, tm_info);
+    }
+
+    // hand the image to the archiver, which saves it for future reference
+    // (every auto-focusing image, and the others as decimated)
+    archiveFrame(frame, name, auto_focusing);
+
+    // show it live (livekst writes the blob table and image Kst reads)
+    publishFrame(frame, auto_focusing);
 
-        // write this time to the data file
-        if (fprintf(fptr, "|%f", camera_time*1e-6) < 0) {
-            fprintf(stderr, "Unable to write Astrometry solution time to "
-                            "observing file: %s.\n", strerror(errno));
-        }
-        fflush(fptr);
-        fclose(fptr);
-        fptr = NULL;
-    }
+    return 1;
+}
 
-    // save image for future reference
-    ImageFileParams.pwchFileName = filename;
-    if (is_ImageFile(camera_handle, IS_IMAGE_FILE_CMD_SAVE, 
-                    (void *) &ImageFileParams, sizeof(ImageFileParams)) == -1) {
-        const char * last_error_str = printCameraError();
-        printf("Failed to save image: %s\n", last_error_str);
+/* Function to free the auto-focusing buffers once the solving stage has 
+** drained (we are shutting down).
+** Input: None.
+** Output: None (void).
+*/
+void freeSolveBuffers() {
+    if (verbose) {
+        printf("\n> Freeing allocated variables in camera.c...\n");
     }
 
-    wprintf(L"Saving to \"%s\"\n", filename);
-    // unlink whatever the latest saved image was linked to before
-    unlink("/home/blast/Desktop/blastcam/BMPs/latest_saved_image.bmp");
-    // sym link current date to latest image for live Kst updates
-    symlink(date, "/home/blast/Desktop/blastcam/BMPs/latest_saved_image.bmp");
-
-    // make a table of blobs for Kst
-    if (makeTable("makeTable.txt", star_mags, star_x, star_y, blob_count) != 1) {
-        printf("Error (above) writing blob table for Kst.\n");
+    if (blob_mags != NULL) {
+        free(blob_mags);
+        blob_mags = NULL;
     }
 
-    // free alloc'd variables when we are shutting down
-    if (shutting_down) {
-        if (verbose) {
-            printf("\n> Freeing allocated variables in camera.c...\n");
-        }
-
-        if (output_buffer != NULL) {
-            free(output_buffer);
-        }
-        
-        if (mask != NULL) {
-            free(mask);
-        }
-        
-        if (blob_mags != NULL) {
-            free(blob_mags);
-        }
+    freeBlobReference(&previous_blobs);
 
-        if (star_x != NULL) {
-            free(star_x);
-        }
-        
-        if (star_y != NULL) {
-            free(star_y);
-        }
-        
-        if (star_mags != NULL) {
-            free(star_mags);
-        }
+    if (af_file != NULL) {
+        fclose(af_file);
+        af_file = NULL;
     }
-    return 1;
 }
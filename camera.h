@@ -8,6 +8,13 @@
 // pixel scale search range bounds -> 6.0 to 6.5 for SO, 6.0 to 7.0 for BLAST
 #define MIN_PS         6.0       // [arcsec/px]
 #define MAX_PS         7.0		 // [arcsec/px]
+// most blobs kept from one image (the brightest ones)
+#define MAX_BLOBS      2000
+// readout geometry limits: the largest binning or subsampling factor, the
+// smallest AOI, and the steps the AOI corner and width go in [px]
+#define MAX_READOUT_FACTOR 4
+#define MIN_AOI_SIZE   64
+#define AOI_STEP       8
 #define STATIC_HP_MASK "/home/blast/Desktop/blastcam/static_hp_mask.txt"
 #define dut1           -0.102300
 
@@ -15,8 +22,12 @@ extern HIDS camera_handle;
 extern int shutting_down;
 extern int send_data;
 extern int taking_image;
+extern int num_camera_buffers;
+extern int continuous_capture;
+struct camera_geometry;
+extern struct camera_geometry camera_geometry;
 
-/* Blob-finding parameters */
+/* Blob-finding parameters (their size is part of the telemetry layout) */
 #pragma pack(push, 1)
 struct blob_params {
     int spike_limit;            // where dynamic hot pixel will designate as hp
@@ -30,24 +41,45 @@ struct blob_params {
     int unique_star_spacing;    // min. pixel spacing between stars [px]
     int make_static_hp_mask;    // re-make static hp map with current image
     int use_static_hp_mask;     // flag to use the current static hot pixel map
+    int background_mode;        // BACKGROUND_GLOBAL or BACKGROUND_TILED
+    int background_tile;        // tile size of the tiled background [px]
 };
 #pragma pack(pop)
 
 extern struct blob_params all_blob_params;
 
 int setCameraParams();
+int checkGeometry(struct camera_geometry * geometry);
+int requestGeometry(struct camera_geometry * geometry);
+int applyGeometry(struct camera_geometry * geometry);
 void setSaveImage();
 int loadCamera();
 int initCamera();
-int doCameraAndAstrometry();
+struct frame;
+int allocFrame(struct frame * frame);
+void freeFrame(struct frame * frame);
+void unlockFrameImage(struct frame * frame);
+void setTakingImage(int taking);
+void waitWhileTakingImage();
+int captureFrame(struct frame * frame);
+int findFrameBlobs(struct frame * frame);
+int solveFrame(struct frame * frame);
+void freeBlobBuffers();
+void freeSolveBuffers();
 void clean();
 void closeCamera();
 const char * printCameraError();
 int isLeapYear(int year);
-void verifyBlobParams();
-int makeTable(char * filename, double * star_mags, double * star_x, 
-              double * star_y, int blob_count);
-int findBlobs(char * input_buffer, int w, int h, double ** star_x, 
-              double ** star_y, double ** star_mags, char * output_buffer);
+void verifyBlobParams(const struct blob_params * params);
+void publishFrame(struct frame * frame, int auto_focusing);
+struct blob_context;
+void initBlobContext(struct blob_context * ctx, int width, int height,
+                     const char * hp_list, const char * hp_sidecar);
+void freeBlobContext(struct blob_context * ctx);
+int findBlobs(struct blob_context * ctx, char * input_buffer,
+              const struct camera_geometry * geometry,
+              const struct blob_params * params, char * output_buffer);
+void sortBlobs(struct blob_context * ctx, double * mags, double * x, double * y,
+               int count);
 
 #endif 
\ No newline at end of file
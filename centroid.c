@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "centroid.h"
+
+// how blob positions are refined (set with --centroid)
+int centroid_mode = CENTROID_MOMENT;
+
+/* Function to get the centroiding mode with the given name.
+** Input: The name (none, moment, or gauss).
+** Output: The mode, or -1 if there is no mode with that name.
+*/
+int parseCentroidMode(char * name) {
+    if (strcmp(name, "none") == 0) {
+        return CENTROID_NONE;
+    } else if (strcmp(name, "moment") == 0) {
+        return CENTROID_MOMENT;
+    } else if (strcmp(name, "gauss") == 0) {
+        return CENTROID_GAUSSIAN;
+    }
+
+    return -1;
+}
+
+/* Function to get the name of a centroiding mode.
+** Input: The mode.
+** Output: The name.
+*/
+const char * centroidModeName(int mode) {
+    switch (mode) {
+        case CENTROID_NONE:
+            return "none";
+        case CENTROID_MOMENT:
+            return "moment";
+        case CENTROID_GAUSSIAN:
+            return "gauss";
+    }
+
+    return "unknown";
+}
+
+/* Helper function for the Gaussian fit: the offset of the peak of a Gaussian
+** through three neighbouring samples of a profile from the middle sample.
+** Input: The three samples (all must be positive).
+** Output: The offset [px], or NAN if the samples do not peak in the middle.
+*/
+double gaussianPeakOffset(double left, double mid, double right) {
+    double l = log(left), m = log(mid), r = log(right);
+    double curvature = l - 2*m + r;
+
+    if (curvature >= 0) {
+        return NAN;
+    }
+
+    double offset = (l - r)/(2*curvature);
+    if (fabs(offset) > 1) {
+        return NAN;
+    }
+
+    return offset;
+}
+
+/* Function to refine the position of one blob from the raw image. The window
+** of CENTROID_RADIUS pixels around the peak has the mean of its edge pixels
+** taken off as background; masked (hot) pixels are left out.
+** Input: The raw image bytes (ib), the mask, the image dimensions (w & h), and
+** the blob's position and flux. The raw bytes are read as unsigned, which the
+** camera gives us.
+** Output: None (void). The position becomes the centroid and the flux the
+** background-subtracted sum over the window. Both are left as they were if
+** the window has no flux above the background.
+*/
+void centroidBlob(char * ib, unsigned char * mask, int w, int h, double * x,
+                  double * y, double * flux) {
+    enum { SIZE = 2*CENTROID_RADIUS + 1 };
+    double profile_x[SIZE] = {0}, profile_y[SIZE] = {0};
+    unsigned char * pixels = (unsigned char *) ib;
+    int px = (int) *x, py = (int) *y;
+    int i_lo = px - CENTROID_RADIUS, i_hi = px + CENTROID_RADIUS;
+    int j_lo = py - CENTROID_RADIUS, j_hi = py + CENTROID_RADIUS;
+    double edge = 0, sum = 0, sum_i = 0, sum_j = 0;
+    int num_edge = 0;
+
+    if (i_lo < 0) i_lo = 0;
+    if (j_lo < 0) j_lo = 0;
+    if (i_hi > w - 1) i_hi = w - 1;
+    if (j_hi > h - 1) j_hi = h - 1;
+
+    // background from the edge of the window
+    for (int j = j_lo; j <= j_hi; j++) {
+        for (int i = i_lo; i <= i_hi; i++) {
+            int on_edge = (i == i_lo || i == i_hi || j == j_lo || j == j_hi);
+            if (on_edge && mask[i + j*w]) {
+                edge += pixels[i + j*w];
+                num_edge++;
+            }
+        }
+    }
+
+    double background = (num_edge > 0) ? edge/num_edge : 0;
+
+    for (int j = j_lo; j <= j_hi; j++) {
+        for (int i = i_lo; i <= i_hi; i++) {
+            if (!mask[i + j*w]) {
+                continue;
+            }
+
+            double v = pixels[i + j*w] - background;
+            if (v <= 0) {
+                continue;
+            }
+
+            sum += v;
+            sum_i += v*i;
+            sum_j += v*j;
+            profile_x[i - px + CENTROID_RADIUS] += v;
+            profile_y[j - py + CENTROID_RADIUS] += v;
+        }
+    }
+
+    if (sum <= 0) {
+        return;
+    }
+
+    double cx = sum_i/sum, cy = sum_j/sum;
+
+    if (centroid_mode == CENTROID_GAUSSIAN) {
+        // fit around the brightest column and row of the window, falling back
+        // on the moments where the profile is too flat or too close to the edge
+        int kx = 0, ky = 0;
+        for (int k = 1; k < SIZE; k++) {
+            if (profile_x[k] > profile_x[kx]) kx = k;
+            if (profile_y[k] > profile_y[ky]) ky = k;
+        }
+
+        if (kx > 0 && kx < SIZE - 1 && profile_x[kx - 1] > 0 &&
+            profile_x[kx + 1] > 0) {
+            double offset = gaussianPeakOffset(profile_x[kx - 1], profile_x[kx],
+                                               profile_x[kx + 1]);
+            if (!isnan(offset)) {
+                cx = px - CENTROID_RADIUS + kx + offset;
+            }
+        }
+
+        if (ky > 0 && ky < SIZE - 1 && profile_y[ky - 1] > 0 &&
+            profile_y[ky + 1] > 0) {
+            double offset = gaussianPeakOffset(profile_y[ky - 1], profile_y[ky],
+                                               profile_y[ky + 1]);
+            if (!isnan(offset)) {
+                cy = py - CENTROID_RADIUS + ky + offset;
+            }
+        }
+    }
+
+    *x = cx;
+    *y = cy;
+    *flux = sum;
+}
+
+/* Function to measure the half-flux diameter of one blob from the raw image:
+** twice the flux-weighted mean distance of the window's pixels from their
+** centroid, which grows with defocus however bright the star is. The window
+** of HFD_RADIUS pixels around the peak has the mean of its edge pixels taken
+** off as background; masked (hot) pixels are left out.
+** Input: The raw image bytes (ib), the mask, the image dimensions (w & h), and
+** the blob's position (in the rows of the raw image).
+** Output: The diameter [px], or NAN if the blob is saturated, its window does
+** not fit in the image, or it has no flux above the background.
+*/
+double blobHalfFluxDiameter(char * ib, unsigned char * mask, int w, int h,
+                            double x, double y) {
+    enum { SIZE = 2*HFD_RADIUS + 1 };
+    double values[SIZE][SIZE];
+    unsigned char * pixels = (unsigned char *) ib;
+    int px = (int) round(x), py = (int) round(y);
+    double edge = 0, sum = 0, sum_i = 0, sum_j = 0, sum_r = 0;
+    int num_edge = 0;
+
+    if (px - HFD_RADIUS < 0 || py - HFD_RADIUS < 0 ||
+        px + HFD_RADIUS > w - 1 || py + HFD_RADIUS > h - 1) {
+        return NAN;
+    }
+
+    // background from the edge of the window; a saturated core has lost the
+    // flux the diameter depends on, so those blobs are not measured at all
+    for (int j = -HFD_RADIUS; j <= HFD_RADIUS; j++) {
+        for (int i = -HFD_RADIUS; i <= HFD_RADIUS; i++) {
+            int k = px + i + (py + j)*w;
+            int on_edge = (abs(i) == HFD_RADIUS || abs(j) == HFD_RADIUS);
+
+            int core = (abs(i) <= 1 && abs(j) <= 1);
+
+            if (core && pixels[k] >= SATURATED_PIXEL) {
+                return NAN;
+            }
+            if (on_edge && mask[k]) {
+                edge += pixels[k];
+                num_edge++;
+            }
+        }
+    }
+
+    double background = (num_edge > 0) ? edge/num_edge : 0;
+
+    for (int j = -HFD_RADIUS; j <= HFD_RADIUS; j++) {
+        for (int i = -HFD_RADIUS; i <= HFD_RADIUS; i++) {
+            int k = px + i + (py + j)*w;
+            double v = mask[k] ? pixels[k] - background : 0;
+
+            values[j + HFD_RADIUS][i + HFD_RADIUS] = (v > 0) ? v : 0;
+            if (v > 0) {
+                sum += v;
+                sum_i += v*i;
+                sum_j += v*j;
+            }
+        }
+    }
+
+    if (sum <= 0) {
+        return NAN;
+    }
+
+    double cx = sum_i/sum, cy = sum_j/sum;
+
+    for (int j = -HFD_RADIUS; j <= HFD_RADIUS; j++) {
+        for (int i = -HFD_RADIUS; i <= HFD_RADIUS; i++) {
+            sum_r += values[j + HFD_RADIUS][i + HFD_RADIUS]*hypot(i - cx,
+                                                                  j - cy);
+        }
+    }
+
+    return 2*sum_r/sum;
+}
+
+/* Helper function for qsort() to put diameters in increasing order.
+** Input: The two diameters.
+** Output: Negative, zero or positive as the first is smaller, the same or
+** larger.
+*/
+int compareDiameters(const void * a, const void * b) {
+    double da = *(const double *) a, db = *(const double *) b;
+
+    return (da > db) - (da < db);
+}
+
+/* Function to measure the focus of a whole image: the median half-flux
+** diameter of its brightest blobs that can be measured.
+** Input: The raw image bytes (ib), the mask, the image dimensions (w & h),
+** the blob positions (with y counted up from the bottom of the image, as
+** findBlobs() returns them), brightest first, and the number of blobs.
+** Output: The median diameter [px], or NAN if fewer than HFD_MIN_BLOBS blobs
+** could be measured. The number measured goes into used.
+*/
+double imageHalfFluxDiameter(char * ib, unsigned char * mask, int w, int h,
+                             double * x, double * y, int count, int * used) {
+    double diameters[HFD_BLOBS];
+    int n = 0;
+
+    for (int k = 0; k < count && n < HFD_BLOBS; k++) {
+        double d = blobHalfFluxDiameter(ib, mask, w, h, x[k], h - y[k]);
+        if (!isnan(d)) {
+            diameters[n++] = d;
+        }
+    }
+
+    *used = n;
+    if (n < HFD_MIN_BLOBS) {
+        return NAN;
+    }
+
+    qsort(diameters, n, sizeof(double), compareDiameters);
+
+    return (n % 2) ? diameters[n/2] : (diameters[n/2 - 1] + diameters[n/2])/2;
+}
@@ -0,0 +1,30 @@
+#ifndef CENTROID_H
+#define CENTROID_H
+
+// ways of refining blob positions (centroid_mode)
+#define CENTROID_NONE      0     // keep the integer pixel of the peak
+#define CENTROID_MOMENT    1     // intensity-weighted mean position
+#define CENTROID_GAUSSIAN  2     // Gaussian fit to the x and y profiles
+// half-width of the window around each peak [px]
+#define CENTROID_RADIUS    3
+// half-width of the window the half-flux diameter of a blob is measured in
+// [px], and how many of the brightest blobs the focus of an image is the
+// median of (at most, and at least for it to count)
+#define HFD_RADIUS         7
+#define HFD_BLOBS          20
+#define HFD_MIN_BLOBS      3
+// raw pixel value of a saturated pixel
+#define SATURATED_PIXEL    255
+
+extern int centroid_mode;
+
+int parseCentroidMode(char * name);
+const char * centroidModeName(int mode);
+void centroidBlob(char * ib, unsigned char * mask, int w, int h, double * x,
+                  double * y, double * flux);
+double blobHalfFluxDiameter(char * ib, unsigned char * mask, int w, int h,
+                            double x, double y);
+double imageHalfFluxDiameter(char * ib, unsigned char * mask, int w, int h,
+                             double * x, double * y, int count, int * used);
+
+#endif
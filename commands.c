@@ -11,6 +11,7 @@
 #include <time.h>  
 #include <math.h>  
 #include <pthread.h>      
+#include <stdatomic.h>
 #include <signal.h>         
 #include <ueye.h>
 #include <getopt.h>           
@@ -19,15 +20,38 @@
 #include "astrometry.h"
 #include "lens_adapter.h"
 #include "commands.h"
+#include "params.h"
+#include "pipeline.h"
+#include "boxcar.h"
+#include "workers.h"
+#include "centroid.h"
+#include "broadcast.h"
+#include "archive.h"
+#include "obslog.h"
+#include "perf.h"
+#include "hotpix.h"
+#include "background.h"
+#include "propagate.h"
+#include "stack.h"
+
+// layouts of the telemetry and the commands, sent in their message headers.
+// Both only ever grow at the end (the blocks in the telemetry keep their size
+// too), and the version goes up with every change.
+#define TELEMETRY_VERSION  2
+#define COMMANDS_VERSION   1
 
 #pragma pack(push, 1)
-/* Telemetry and camera settings structure */
+/* Telemetry and camera settings structure (append only) */
 struct telemetry {
     struct astrometry astrom;
     struct camera_params cam_settings; 
     struct blob_params current_blob_params;
+    struct perf_stats perf;     // where the time of recent frames went
+    struct camera_geometry geometry; // readout of the image sent with this
+    struct solution_status solution; // where the pointing in astrom came from
+    struct startup_status startup; // whether the camera is ready yet
 };
-/* User commands structure */
+/* User commands structure (append only, with 0 leaving a setting unchanged) */
 struct commands {
     double logodds;         // controls Astrometry false positives
     double latitude;        // user's latitude (radians)
@@ -47,13 +71,18 @@ struct commands {
     int make_hp;            // flag to make new static hp mask (20 = re-make)
     int use_hp;             // flag to use current static hp mask
     float blob_params[9];   // rest of blob-finding parameters
-};
-/* Struct for passing arguments to client thread(s) from main thread */
-struct args {
-    uintptr_t user_socket;
-    socklen_t user_length;
-    struct sockaddr_in user_address;
-    char * user_IP;
+    int stream;             // what to send after the telemetry (STREAM_*)
+    int stream_arg;         // preview binning or number of cutouts (0 = default)
+    int background_mode;    // BACKGROUND_GLOBAL or BACKGROUND_TILED (0 =
+                            // unchanged)
+    int background_tile;    // tile size of the tiled background (0 = unchanged)
+    int readout_factor;     // binning or subsampling factor (0 = unchanged)
+    int readout_subsample;  // (bool) subsample rather than bin
+    int aoi[4];             // AOI corner (x, y) and size after binning [px]
+                            // (a size of 0 goes to the edge of the sensor)
+    int focus_search;       // FOCUS_SWEEP or FOCUS_ADAPTIVE (0 = unchanged)
+    int focus_metric;       // FOCUS_METRIC_PEAK or FOCUS_METRIC_HFD (0 =
+                            // unchanged)
 };
 #pragma pack(pop)
 
@@ -65,26 +94,53 @@ static const struct option long_options[] = {
     { "verbose",   no_argument,       NULL, 'v' },
     { "help",      no_argument,       NULL, 'h' },
     { "camhandle", required_argument, NULL, 'c' },
+    { "threads",   required_argument, NULL, 't' },
     { "serial",    required_argument, NULL, 's' },
     { "port",      required_argument, NULL, 'p' },
+    { "buffers",   required_argument, NULL, 'b' },
+    { "continuous", no_argument,      NULL,  6  },
+    { "boxcar-check", no_argument,    NULL,  7  },
+    { "centroid",  required_argument, NULL,  8  },
+    { "track",     no_argument,       NULL,  9  },
+    { "track-radius", required_argument, NULL, 10 },
+    { "track-failures", required_argument, NULL, 11 },
+    { "solvers",   required_argument, NULL, 12 },
+    { "archive",   required_argument, NULL, 13 },
+    { "save-every", required_argument, NULL, 14 },
+    { "disk-budget", required_argument, NULL, 15 },
+    { "log-format", required_argument, NULL, 16 },
+    { "hp-track-frames", required_argument, NULL, 17 },
+    { "solve-blobs", required_argument, NULL, 18 },
+    { "binning",   required_argument, NULL, 19 },
+    { "subsampling", required_argument, NULL, 20 },
+    { "aoi",       required_argument, NULL, 21 },
+    { "focus-search", required_argument, NULL, 22 },
+    { "focus-metric", required_argument, NULL, 23 },
+    { "propagate", required_argument, NULL, 24 },
+    { "stack",     required_argument, NULL, 25 },
     { NULL,        no_argument,       NULL,  0  },
 };
 
 struct commands all_cmds = {0};
 struct telemetry all_data = {0};
-int num_clients = 0;
-int telemetry_sent = 0;
 // flag for cancelling auto-focus mid-process
 int cancelling_auto_focus = 0;
 // assume non-verbose output
 int verbose = 0;
-void * camera_raw = NULL;
-// if 1, then commanding is in use; if 0, then not
-int command_lock = 0;
+// commands received from clients, waiting to be executed in order, and the 
+// addresses of the clients that sent them (protected by queued_lock)
+struct commands queued_cmds[MAX_QUEUED_COMMANDS];
+char queued_ips[MAX_QUEUED_COMMANDS][INET_ADDRSTRLEN];
+int queued_head = 0, queued_count = 0, queued_closed = 0;
+pthread_mutex_t queued_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queued_ready = PTHREAD_COND_INITIALIZER;
 // if 0, then camera is not closing, so keep solving astrometry       
 int shutting_down = 0;
 // return values for terminating the threads
 int astro_thread_ret, client_thread_ret;
+// what starting Astrometry and the lens returned, and how the start went
+int astrometry_init_ret = -1, lens_init_ret = -1;
+struct startup_status startup = {0};
 
 /* Helper function to display the Star Camera terminal header.
 ** Input: None.
@@ -112,9 +168,73 @@ void displayUsage() {
            "to 254, the known string descriptor for the serial port, and "
            "the\n\tport to establish a socket on.\n\nOPTIONS:\n\t-c, "
            "--camhandle\n\t\tCamera handle for the camera this program will "
-           "control.\n\t\tRequired.\n\n\t-s, --serial\n\t\tLens descriptor. "
+           "control.\n\t\tRequired.\n\n\t-t, --threads\n\t\tNumber of "
+           "threads that find the blobs in each image\n\t\t(1 to 16, default "
+           "is 4).\n\n\t-s, --serial\n\t\tLens descriptor. "
            "Required.\n\n\t-p, --port\n\t\tPort to bind this camera server "
-           "socket to. Required.\n\n\t-v, --verbose\n\t\tIncrease output "
+           "socket to. Required.\n\n\t-b, --buffers\n\t\tNumber of camera "
+           "image buffers in the capture ring\n\t\t(2 to 16, default is 6)."
+           "\n\n\t--continuous\n\t\tLet the sensor run freely instead of "
+           "triggering every\n\t\texposure.\n\n\t--boxcar-check\n\t\tCheck "
+           "every filtered image against the reference\n\t\t(O(r) per pixel) "
+           "boxcar filter and report any pixel\n\t\tthat differs.\n\n\t"
+           "--centroid\n\t\tHow blob positions are refined from the raw "
+           "image:\n\t\tnone, moment (the default), or gauss.\n\n\t--track\n"
+           "\t\tOnce an image solves, solve the next ones only around that "
+           "\n\t\tsolution (its pixel scale and parity, and the index files "
+           "\n\t\tcovering it).\n\n\t--track-radius\n\t\tHow far the "
+           "pointing may move between images when\n\t\ttracking (deg, default"
+           " is 1).\n\n\t--track-failures\n\t\tFailed tracking solves in a "
+           "row before going back to\n\t\tfull solves (default is 3).\n\n\t"
+           "--solvers\n\t\tNumber of solvers the index files are split "
+           "between, each\n\t\ton its own thread (1 to 16, default is 1)."
+           "\n\n\t--archive\n\t\tHow images are saved: fits (the default, "
+           "with the solution\n\t\tand telemetry in the header), bmp, or "
+           "none.\n\n\t--save-every\n\t\tSave one in this many images, "
+           "as well as every auto-\n\t\tfocusing image (default is 1)."
+           "\n\n\t--disk-budget\n\t\tStop saving images once this many "
+           "MB have been saved\n\t\t(default is no limit; saving always "
+           "stops short of\n\t\tthe last 1024 MB on the disk)."
+           "\n\n\t--log-format\n\t\tHow the daily observing log is "
+           "written: binary (the\n\t\tdefault, data_<day>_<handle>.bin, "
+           "read with ./readlog)\n\t\tor csv (data_<day>_<handle>.csv)."
+           "\n\n\t--hp-track-frames\n\t\tAdd a pixel to the static hot "
+           "pixel map once it has\n\t\tbeen hot in this many frames more "
+           "than not, and take\n\t\tit out when that falls back to 0 "
+           "(1-255; 0 turns\n\t\tthis off; default is 100)."
+           "\n\n\t--solve-blobs\n\t\tGive the solver only this many of "
+           "the brightest blobs\n\t\t(default is all of them). Solves "
+           "first try the\n\t\tbrightest %d, then %d, then all it is "
+           "given."
+           "\n\n\t--binning\n\t\tBin the sensor 2x2 or 4x4 (2 or 4; "
+           "default is 1).\n\n\t--subsampling\n\t\tRead out every 2nd "
+           "or 4th pixel each way instead of\n\t\tbinning (2 or 4)."
+           "\n\n\t--aoi\n\t\tRead out only x,y,width,height of the "
+           "sensor (pixels after\n\t\tbinning, in steps of %d; a width or "
+           "height of 0 goes to\n\t\tthe edge). Default is the whole "
+           "sensor."
+           "\n\n\t--focus-search\n\t\tHow auto-focusing chooses focus "
+           "positions: sweep (the\n\t\tdefault, every focus step from "
+           "the start to the end) or\n\t\tadaptive (%d positions across "
+           "the range, then up to %d\n\t\tmore around the peak of the "
+           "fitted curve until it is\n\t\tknown to within a focus step)."
+           "\n\n\t--focus-metric\n\t\tWhat auto-focusing rates a focus "
+           "position by: hfd (the\n\t\tdefault, the median half-flux "
+           "diameter of the brightest\n\t\tunsaturated blobs) or peak "
+           "(the brightest blob)."
+           "\n\n\t--propagate\n\t\tBetween full solves, move the last "
+           "solution with the\n\t\tstars for up to this many images, as "
+           "long as at least\n\t\t%d of their blobs match the previous "
+           "image's to within\n\t\t%.1f px rms (default is 0, solve every "
+           "image). The\n\t\ttelemetry says which solutions were "
+           "propagated."
+           "\n\n\t--stack\n\t\tFind blobs in the sum of the last this "
+           "many exposures\n\t\t(up to %d), each shifted onto the first "
+           "by its blobs,\n\t\tfor the faint stars of a long exposure "
+           "without its\n\t\tsmear (default is 1, every exposure on its "
+           "own)."
+           "\n\n\t-v, "
+           "--verbose\n\t\tIncrease output "
            "verbosity.\n\n\t--network\n\t\tShow the Star Camera computer IP "
            "address and the size of the\n\t\ttelemetry package.\n\n\t--number"
            "\n\t\tSee the current number of cameras connected to the computer."
@@ -123,7 +243,9 @@ void displayUsage() {
            "While 0 to 65535 is\n\t\tthe range for valid TCP ports, you should "
            "specify one of the\n\t\tfollowing three, depending on which "
            "camera you're using:\n\n\t\t(1)\t8000\n\t\t(2)\t8001\n\t\t(3)"
-           "\t8002\n\n");
+           "\t8002\n\n", SOLVE_STAGE_1, SOLVE_STAGE_2, AOI_STEP, 
+           AF_COARSE_POSITIONS, AF_MAX_REFINE, PROPAGATE_MIN_MATCHES,
+           PROPAGATE_MAX_RMS, STACK_MAX_FRAMES);
 }
 
 /* Helper function for testing reception of user commands.
@@ -160,6 +282,16 @@ void verifyUserCommands() {
             all_cmds.blob_params[4], all_cmds.blob_params[5],
             all_cmds.blob_params[6], all_cmds.blob_params[7], 
             all_cmds.blob_params[8]);
+    printf("|\tStream: %d, argument: %d\t\t\t\t  |\n", all_cmds.stream,
+           all_cmds.stream_arg);
+    printf("|\tBackground mode: %d, tile: %d\t\t\t  |\n", 
+           all_cmds.background_mode, all_cmds.background_tile);
+    printf("|\tReadout: %s %d, AOI %d x %d at (%d, %d)\t  |\n",
+           all_cmds.readout_subsample ? "subsampled" : "binned",
+           all_cmds.readout_factor, all_cmds.aoi[2], all_cmds.aoi[3],
+           all_cmds.aoi[0], all_cmds.aoi[1]);
+    printf("|\tFocus search: %d\t\t\t\t\t  |\n", all_cmds.focus_search);
+    printf("|\tFocus metric: %d\t\t\t\t\t  |\n", all_cmds.focus_metric);
     printf("+---------------------------------------------------------+\n\n");
 }
 
@@ -186,18 +318,52 @@ void verifyTelemetryData() {
     printf("+---------------------------------------------------------+\n\n");
 }
 
+/* Function for the thread that initializes Astrometry (loading its index
+** files, the slowest part of starting up) while the camera starts.
+** Input: None.
+** Output: None (void).
+*/
+void * startAstrometry() {
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    astrometry_init_ret = initAstrometry();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    startup.astrometry_time = msecBetween(&start, &end);
+
+    return NULL;
+}
+
+/* Function for the thread that initializes the lens adapter (moving the lens
+** to its default focus, unless it is already there) while the camera starts.
+** Input: The path to the file descriptor for the lens.
+** Output: None (void).
+*/
+void * startLensAdapter(void * path) {
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    lens_init_ret = initLensAdapter((char *) path);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    startup.lens_time = msecBetween(&start, &end);
+
+    return NULL;
+}
+
 /* Function devoted to taking pictures and solving astrometry while camera is 
-** not in a state of shutting down.
+** not in a state of shutting down. The capture, blob-finding, and solving 
+** stages each run on their own thread (see pipeline.c), so the next exposure 
+** is taken while the previous one is still being solved.
 ** Input: None.
 ** Output: None (void). 
 */
 void * updateAstrometry() {
     // solve astrometry perpetually when the camera is not shutting down
-    while (!shutting_down) {
-        if (doCameraAndAstrometry() < 1) {
-            printf("Did not solve or timeout of Astrometry properly, or did not"
-                   " auto-focus properly.\n");
-        }
+    if (startPipeline() < 1) {
+        printf("Could not start the capture and solving pipeline.\n");
+        shutting_down = 1;
+    } else {
+        joinPipeline();
     }
 
     // when we are shutting down or exiting, close Astrometry engine and solver
@@ -208,195 +374,265 @@ void * updateAstrometry() {
     pthread_exit(&astro_thread_ret);
 }
 
-/* Function for accepting newly connected clients and sending telemetry and 
-** receiving their commands.
-** Input: An args struct containing the client information.
+/* Function for the broadcaster to queue the commands a client sent, to be
+** executed on the command thread (the broadcaster never waits on them), and 
+** to update what the client is subscribed to.
+** Input: The commands, the address of the client that sent them, and its 
+** subscription.
 ** Output: None (void).
 */
-void * processClient(void * for_client_thread) {
-    // get the socket information for this user
-    int socket = ((struct args *) for_client_thread)->user_socket;
-    int length = ((struct args *) for_client_thread)->user_length;
-    struct sockaddr_in address = ((struct args *) 
-                                   for_client_thread)->user_address;
-    char * ip_addr = ((struct args *) for_client_thread)->user_IP;
-    int recv_status;
-
-    // send data to this client perpetually and receive potential commands if 
-    // user sends them
-    while (1) {
-        recv_status = recvfrom(socket, &all_cmds, sizeof(struct commands), 0, 
-                              (struct sockaddr *) &address, &length); 
-        if (recv_status == -1) {
-            printf("User %s did not send any commands. Send telemetry and "
-                   "camera settings back anyway.\n", ip_addr);
-        } else {
-            // if another client sends commands at the same time, wait until 
-            // they are done
-            while (command_lock) {
-                if (verbose) {
-                    printf("Multiple users issuing commands. Waiting for lock"
-                           " to be opened...\n");
-                }
-                usleep(100000);
-            }
-            // now it's this client's turn to execute commands (lock)
-            command_lock = 1;
-            printf("> User %s sent commands. Executing...\n", ip_addr);
-            if (verbose) {
-                verifyUserCommands();
-            }
-
-            // some constants for solving Astrometry
-            all_astro_params.logodds = all_cmds.logodds;
-            all_astro_params.latitude = all_cmds.latitude;
-            all_astro_params.longitude = all_cmds.longitude;
-            all_astro_params.hm = all_cmds.height;
-            all_astro_params.timelimit = all_cmds.timelimit;
-
-            // update blob-finding parameters (see camera.h for documentation)
-            all_blob_params.make_static_hp_mask = all_cmds.make_hp;            
-            all_blob_params.use_static_hp_mask = all_cmds.use_hp;                 
-
-            if (all_cmds.blob_params[0] >= 0) {
-                all_blob_params.spike_limit = all_cmds.blob_params[0];        
-            } 
-            
-            all_blob_params.dynamic_hot_pixels = all_cmds.blob_params[1];    
-        
-            if (all_cmds.blob_params[2] >= 0) {
-                all_blob_params.r_smooth = all_cmds.blob_params[2];      
-            }
-
-            all_blob_params.high_pass_filter = all_cmds.blob_params[3];   
-            
-            if (all_cmds.blob_params[4] >= 0) {
-                all_blob_params.r_high_pass_filter = all_cmds.blob_params[4]; 
-            } 
-            
-            if (all_cmds.blob_params[5] >= 0) {
-                all_blob_params.centroid_search_border = all_cmds.blob_params[5];
-            } 
-
-            all_blob_params.filter_return_image = all_cmds.blob_params[6];  
-
-            if (all_cmds.blob_params[7] >= 0) {
-                all_blob_params.n_sigma = all_cmds.blob_params[7];     
-            } 
-            
-            if (all_cmds.blob_params[8] >= 0) {
-                all_blob_params.unique_star_spacing = all_cmds.blob_params[8];
-            } 
-
-            if (!all_cmds.focus_mode && all_camera_params.focus_mode) {
-                printf("\n> Cancelling auto-focus process!\n");
-                cancelling_auto_focus = 1;
-            } else {
-                // need to reset cancellation flag to 0 if we are not auto-
-                // focusing at all, we are remaining in auto-focusing, or we are
-                // entering auto-focusing
-                cancelling_auto_focus = 0;
-            }
-
-            // performing auto-focusing will restrict some of the other cmds, so
-            // check that before other lens commands & hardware adjustments
-            if (all_cmds.focus_mode) {
-                all_camera_params.begin_auto_focus = 1;
-            }
-            all_camera_params.focus_mode = all_cmds.focus_mode;
-            all_camera_params.start_focus_pos = all_cmds.start_focus_pos;
-            all_camera_params.end_focus_pos = all_cmds.end_focus_pos;
-            all_camera_params.focus_step = all_cmds.focus_step;
-            all_camera_params.photos_per_focus = all_cmds.photos_per_focus;
-
-            if (!all_camera_params.focus_mode && !cancelling_auto_focus) {
-                // if user adjusted exposure, set exposure to their value
-                if (ceil(all_cmds.exposure) != 
-                    ceil(all_camera_params.exposure_time)) {
-                    // update value in camera params struct as well
-                    all_camera_params.exposure_time = all_cmds.exposure;
-                    all_camera_params.change_exposure_bool = 1;
-                }
+void queueCommands(void * cmds, char * ip_addr, 
+                   struct subscription * subscription) {
+    // the stream this client wants takes effect from the next message on
+    subscription->stream = ((struct commands *) cmds)->stream;
+    subscription->arg = ((struct commands *) cmds)->stream_arg;
+    normalizeSubscription(subscription);
+
+    pthread_mutex_lock(&queued_lock);
+    if (queued_count == MAX_QUEUED_COMMANDS) {
+        pthread_mutex_unlock(&queued_lock);
+        printf("Too many commands waiting, so ignoring the ones from user "
+               "%s.\n", ip_addr);
+        return;
+    }
 
-                // contradictory commands between setting focus to inf and 
-                // adjusting it to a different position are handled in 
-                // adjustCameraHardware()
-                all_camera_params.focus_inf = all_cmds.set_focus_inf;
-                // if user wants to change focus, change focus in camera params
-                if (all_cmds.focus_pos != -1) {
-                    all_camera_params.focus_position = all_cmds.focus_pos; 
-                } 
+    int tail = (queued_head + queued_count) % MAX_QUEUED_COMMANDS;
+    memcpy(&queued_cmds[tail], cmds, sizeof(struct commands));
+    strncpy(queued_ips[tail], ip_addr, INET_ADDRSTRLEN - 1);
+    queued_ips[tail][INET_ADDRSTRLEN - 1] = '\0';
+    queued_count++;
+    pthread_cond_signal(&queued_ready);
+    pthread_mutex_unlock(&queued_lock);
+}
 
-                // update camera params struct with user commands
-                all_camera_params.max_aperture = all_cmds.set_max_aperture;
-                all_camera_params.aperture_steps = all_cmds.aperture_steps;
+/* Function to execute the commands in all_cmds.
+** Input: The address of the client that sent them.
+** Output: None (void).
+*/
+void executeCommands(char * ip_addr) {
+    printf("> User %s sent commands. Executing...\n", ip_addr);
+    if (verbose) {
+        verifyUserCommands();
+    }
 
-                // if we are taking an image right now, need to wait to execute
-                // any lens commands
-                while (taking_image) {
-                    usleep(100000);
-                }
+    // the settings frames are processed with are changed on a copy of the
+    // ones last published (this thread is the only one that publishes), which
+    // is then published for the frames from the next one on
+    struct frame_params params;
+    snapshotParams(&params);
+
+    // some constants for solving Astrometry
+    params.logodds = all_cmds.logodds;
+    params.latitude = all_cmds.latitude;
+    params.longitude = all_cmds.longitude;
+    params.hm = all_cmds.height;
+    params.timelimit = all_cmds.timelimit;
+
+    // update blob-finding parameters (see camera.h for documentation)
+    // a new static hot pixel map is made from one image, not every one
+    if (all_cmds.make_hp) {
+        atomic_store(&hp_map_request, all_cmds.make_hp);
+    }
+    params.blob.use_static_hp_mask = all_cmds.use_hp;
 
-                // perform changes to camera settings in lens_adapter.c (focus, 
-                // aperture, and exposure deal with camera hardware)
-                if (adjustCameraHardware() < 1) {
-                    printf("Error executing at least one user command.\n");
-                }
-            } else {
-                printf("In or entering auto-focusing mode, or cancelling "
-                       "current auto-focus process, so ignore lens " 
-                       "commands.\n");
-            }
-
-            // allow other clients to execute commands (unlock)
-            command_lock = 0; 
+    if (all_cmds.blob_params[0] >= 0) {
+        params.blob.spike_limit = all_cmds.blob_params[0];
+    } 
+    
+    params.blob.dynamic_hot_pixels = all_cmds.blob_params[1];
+
+    if (all_cmds.blob_params[2] >= 0) {
+        params.blob.r_smooth = all_cmds.blob_params[2];
+    }
+
+    params.blob.high_pass_filter = all_cmds.blob_params[3];
+    
+    if (all_cmds.blob_params[4] >= 0) {
+        params.blob.r_high_pass_filter = all_cmds.blob_params[4];
+    } 
+    
+    if (all_cmds.blob_params[5] >= 0) {
+        params.blob.centroid_search_border = all_cmds.blob_params[5];
+    } 
+
+    params.blob.filter_return_image = all_cmds.blob_params[6];
+
+    if (all_cmds.blob_params[7] >= 0) {
+        params.blob.n_sigma = all_cmds.blob_params[7];
+    } 
+    
+    if (all_cmds.blob_params[8] >= 0) {
+        params.blob.unique_star_spacing = all_cmds.blob_params[8];
+    } 
+
+    if (all_cmds.background_mode == BACKGROUND_GLOBAL ||
+        all_cmds.background_mode == BACKGROUND_TILED) {
+        params.blob.background_mode = all_cmds.background_mode;
+    }
+
+    if (all_cmds.background_tile >= MIN_BACKGROUND_TILE &&
+        all_cmds.background_tile <= MAX_BACKGROUND_TILE) {
+        params.blob.background_tile = all_cmds.background_tile;
+    }
+
+    publishParams(&params);
+
+    // a new readout geometry is used from the next image on
+    if (all_cmds.readout_factor != 0) {
+        struct camera_geometry geometry = {0};
+        geometry.factor = all_cmds.readout_factor;
+        geometry.subsample = all_cmds.readout_subsample;
+        geometry.x = all_cmds.aoi[0];
+        geometry.y = all_cmds.aoi[1];
+        geometry.width = all_cmds.aoi[2];
+        geometry.height = all_cmds.aoi[3];
+        requestGeometry(&geometry);
+    }
+
+    // the capture and solving threads change the auto-focusing state too
+    pthread_mutex_lock(&camera_params_lock);
+    if (!all_cmds.focus_mode && all_camera_params.focus_mode) {
+        printf("\n> Cancelling auto-focus process!\n");
+        cancelling_auto_focus = 1;
+    } else {
+        // need to reset cancellation flag to 0 if we are not auto-
+        // focusing at all, we are remaining in auto-focusing, or we are
+        // entering auto-focusing
+        cancelling_auto_focus = 0;
+    }
+
+    // performing auto-focusing will restrict some of the other cmds, so
+    // check that before other lens commands & hardware adjustments
+    if (all_cmds.focus_mode) {
+        all_camera_params.begin_auto_focus = 1;
+    }
+    all_camera_params.focus_mode = all_cmds.focus_mode;
+    all_camera_params.start_focus_pos = all_cmds.start_focus_pos;
+    all_camera_params.end_focus_pos = all_cmds.end_focus_pos;
+    all_camera_params.focus_step = all_cmds.focus_step;
+    all_camera_params.photos_per_focus = all_cmds.photos_per_focus;
+    if (all_cmds.focus_search == FOCUS_SWEEP || 
+        all_cmds.focus_search == FOCUS_ADAPTIVE) {
+        all_camera_params.focus_search = all_cmds.focus_search;
+    }
+    if (all_cmds.focus_metric == FOCUS_METRIC_PEAK ||
+        all_cmds.focus_metric == FOCUS_METRIC_HFD) {
+        all_camera_params.focus_metric = all_cmds.focus_metric;
+    }
+
+    if (!all_camera_params.focus_mode && !cancelling_auto_focus) {
+        // if user adjusted exposure, set exposure to their value
+        if (ceil(all_cmds.exposure) != 
+            ceil(all_camera_params.exposure_time)) {
+            // update value in camera params struct as well
+            all_camera_params.exposure_time = all_cmds.exposure;
+            all_camera_params.change_exposure_bool = 1;
         }
-        telemetry_sent = 0;
 
-        while (!send_data) {
-            usleep(100000);
+        // contradictory commands between setting focus to inf and 
+        // adjusting it to a different position are handled in 
+        // adjustCameraHardware()
+        all_camera_params.focus_inf = all_cmds.set_focus_inf;
+
+        // update camera params struct with user commands
+        all_camera_params.max_aperture = all_cmds.set_max_aperture;
+        all_camera_params.aperture_steps = all_cmds.aperture_steps;
+        pthread_mutex_unlock(&camera_params_lock);
+
+        // if we are taking an image right now, need to wait to execute
+        // any lens commands
+        waitWhileTakingImage();
+
+        // perform changes to camera settings in lens_adapter.c (focus, 
+        // aperture, and exposure deal with camera hardware)
+        // (the focus the user wants goes straight there rather than through
+        // all_camera_params, which the lens thread writes with each position
+        // it reads back)
+        if (adjustCameraHardware((all_cmds.focus_pos != -1) ?
+                                 (int) all_cmds.focus_pos : -1) < 1) {
+            printf("Error executing at least one user command.\n");
         }
+    } else {
+        pthread_mutex_unlock(&camera_params_lock);
+        printf("In or entering auto-focusing mode, or cancelling "
+               "current auto-focus process, so ignore lens " 
+               "commands.\n");
+    }
+}
 
-        // compile telemetry and transmit back to use
-        memcpy(&all_data.astrom, &all_astro_params, 
-                sizeof(all_astro_params));
-        memcpy(&all_data.cam_settings, &all_camera_params, 
-                sizeof(all_camera_params));
-        memcpy(&all_data.current_blob_params, &all_blob_params, 
-                sizeof(all_blob_params));
-
-        if (send(socket, &all_data, sizeof(struct telemetry), 
-                 MSG_NOSIGNAL) <= 0) {
-            printf("Client dropped the connection.\n");
-            break;
-        } 
+/* Function for the command thread: executes the commands clients send, one 
+** set at a time, until the queue is closed.
+** Input: None.
+** Output: None (void).
+*/
+void * processCommands() {
+    char ip_addr[INET_ADDRSTRLEN];
 
-        if (send(socket, camera_raw, CAMERA_WIDTH*CAMERA_HEIGHT, 
-                 MSG_NOSIGNAL) <= 0) {
-            printf("Client dropped the connection.\n");
-            break;
+    pthread_mutex_lock(&queued_lock);
+    while (1) {
+        while (queued_count == 0 && !queued_closed) {
+            pthread_cond_wait(&queued_ready, &queued_lock);
         }
 
-        telemetry_sent = 1;
-        
-        if (verbose) {
-            printf("Telemetry and image bytes sent back to user.\n"); 
-            verifyTelemetryData();
+        if (queued_count == 0) {
+            break;
         }
-    }
-    // clean up socket when the connection is done
-    close(socket);
-    num_clients--;
 
-    // in case user exits in middle of two send() calls above, we don't want to
-    // wait forever in auto-focusing
-    telemetry_sent = 1;
+        memcpy(&all_cmds, &queued_cmds[queued_head], sizeof(struct commands));
+        memcpy(ip_addr, queued_ips[queued_head], INET_ADDRSTRLEN);
+        queued_head = (queued_head + 1) % MAX_QUEUED_COMMANDS;
+        queued_count--;
+        pthread_mutex_unlock(&queued_lock);
+
+        executeCommands(ip_addr);
+
+        pthread_mutex_lock(&queued_lock);
+    }
+    pthread_mutex_unlock(&queued_lock);
 
-    // free(for_client_thread);
     client_thread_ret = 1;
     pthread_exit(&client_thread_ret);
 }
 
+/* Function to publish the current telemetry and camera settings, with the 
+** image of a frame, to every client.
+** Input: The frame (or NULL to send a blank image).
+** Output: The generation of the message (see broadcast()), or -1 on error.
+*/
+int broadcastTelemetry(struct frame * frame) {
+    int generation;
+
+    // compile telemetry
+    memcpy(&all_data.astrom, &all_astro_params, sizeof(all_astro_params));
+    snapshotCameraParams(&all_data.cam_settings);
+    all_data.solution = solution;
+    all_data.startup = startup;
+    getPerfStats(&all_data.perf);
+    if (frame != NULL) {
+        // the blob-finding parameters the image was found with
+        all_data.current_blob_params = frame->params.blob;
+        all_data.geometry = frame->geometry;
+    } else {
+        struct frame_params params;
+        snapshotParams(&params);
+        all_data.current_blob_params = params.blob;
+        // the blank image is of the whole sensor
+        all_data.geometry = (struct camera_geometry) {1, 0, 0, 0, CAMERA_WIDTH,
+                                                       CAMERA_HEIGHT,
+                                                       CAMERA_WIDTH};
+    }
+
+    generation = broadcast(frame, &all_data, sizeof(struct telemetry));
+
+    if (verbose && num_clients > 0) {
+        printf("Telemetry and image bytes published to %d user(s).\n", 
+               num_clients);
+        verifyTelemetryData();
+    }
+
+    return generation;
+}
+
 /* Driver function for Star Camera operation.
 ** Input: Number of command-line arguments passed and an array of those argu-
 ** ments.
@@ -415,34 +651,142 @@ int main(int argc, char * argv[]) {
     char * lens_desc = NULL;         // file descriptor for Birger lens adapter
     char * handle = NULL;            // will be passed to camera_handle
     int test_handle, test_port;      // for testing the values of user input
+    int aoi[4] = {0};                // AOI corner and size (0 to the edge)
     int sockfd;                      // to create socket
-    int newsockfd;                   // to accept new connection(s)
     struct sockaddr_in serv_addr;    // server receives on this address
-    struct sockaddr_in client_addr;  // server sends to client on this address
     struct timeval read_timeout;     // timeout options for server socket 
-    int client_addr_len;             // length of client addresses
-    pthread_t client_thread_id;      // thread ID for new clients        
+    pthread_t client_thread_id;      // thread ID for executing user commands
     pthread_t astro_thread_id;       // thread ID for Astrometry thread
-    struct args * client_args;       // arguments to pass to clients
     int * astro_ptr = NULL;          // ptr for returning from Astrometry thread
-    int * client_ptr = NULL;         // ptr for returning from client thread
-    int any_clients = 0;             // if a client every connected during run
+    int * client_ptr = NULL;         // ptr for returning from command thread
+    pthread_t init_thread_ids[2];    // threads starting Astrometry and lens
+    struct timespec main_start, init_start, init_end; // startup timing
     int ret;                         // return status of main()
 
+    clock_gettime(CLOCK_MONOTONIC, &main_start);
+
     // parse command-line options
-    while ((opt = getopt_long(argc, argv, ":c:s:p:vh?", long_options, 
+    while ((opt = getopt_long(argc, argv, ":c:t:s:p:b:vh?", long_options, 
                               &long_index)) != -1) {
         switch (opt) {
             // we will check the essential arguments after
             case 'c':
                 handle = optarg;
                 break;
+            case 't':
+                num_workers = atoi(optarg);
+                break;
             case 's':
                 lens_desc = optarg;
                 break;
             case 'p':
                 port = optarg;
                 break;
+            case 'b':
+                num_camera_buffers = atoi(optarg);
+                break;
+            case 6:
+                continuous_capture = 1;
+                break;
+            case 7:
+                // compare every filtered image against the reference filter
+                boxcar_check = 1;
+                break;
+            case 8:
+                if ((centroid_mode = parseCentroidMode(optarg)) < 0) {
+                    printHeader();
+                    fprintf(stderr, "Invalid centroiding mode '%s'. Choose "
+                                    "none, moment, or gauss.\n", optarg);
+                    return 0;
+                }
+                break;
+            case 9:
+                tracking_mode = 1;
+                break;
+            case 10:
+                track_radius = atof(optarg);
+                break;
+            case 11:
+                track_max_failures = atoi(optarg);
+                break;
+            case 12:
+                num_solvers = atoi(optarg);
+                break;
+            case 13:
+                if ((archive_format = parseArchiveFormat(optarg)) < 0) {
+                    printHeader();
+                    fprintf(stderr, "Invalid archive format '%s'. Choose "
+                                    "fits, bmp, or none.\n", optarg);
+                    return 0;
+                }
+                break;
+            case 14:
+                archive_every = atoi(optarg);
+                break;
+            case 15:
+                archive_budget_mb = atof(optarg);
+                break;
+            case 16:
+                if ((obs_log_format = parseObsLogFormat(optarg)) < 0) {
+                    printHeader();
+                    fprintf(stderr, "Invalid observing log format '%s'. "
+                                    "Choose binary or csv.\n", optarg);
+                    return 0;
+                }
+                break;
+            case 17:
+                hp_track_frames = atoi(optarg);
+                break;
+            case 18:
+                max_solve_blobs = atoi(optarg);
+                break;
+            case 19:
+                camera_geometry.factor = atoi(optarg);
+                camera_geometry.subsample = 0;
+                break;
+            case 20:
+                camera_geometry.factor = atoi(optarg);
+                camera_geometry.subsample = 1;
+                break;
+            case 21:
+                if (sscanf(optarg, "%d,%d,%d,%d", &aoi[0], &aoi[1], &aoi[2],
+                           &aoi[3]) != 4) {
+                    printHeader();
+                    fprintf(stderr, "Invalid AOI '%s'. Give it as x,y,width,"
+                                    "height.\n", optarg);
+                    return 0;
+                }
+                break;
+            case 22:
+                if (strcmp(optarg, "sweep") == 0) {
+                    all_camera_params.focus_search = FOCUS_SWEEP;
+                } else if (strcmp(optarg, "adaptive") == 0) {
+                    all_camera_params.focus_search = FOCUS_ADAPTIVE;
+                } else {
+                    printHeader();
+                    fprintf(stderr, "Invalid focus search '%s'. Choose sweep "
+                                    "or adaptive.\n", optarg);
+                    return 0;
+                }
+                break;
+            case 23:
+                if (strcmp(optarg, "peak") == 0) {
+                    all_camera_params.focus_metric = FOCUS_METRIC_PEAK;
+                } else if (strcmp(optarg, "hfd") == 0) {
+                    all_camera_params.focus_metric = FOCUS_METRIC_HFD;
+                } else {
+                    printHeader();
+                    fprintf(stderr, "Invalid focus metric '%s'. Choose hfd "
+                                    "or peak.\n", optarg);
+                    return 0;
+                }
+                break;
+            case 24:
+                propagate_frames = atoi(optarg);
+                break;
+            case 25:
+                stack_frames = atoi(optarg);
+                break;
             case 'v':
                 // turn on verbose output
                 verbose = 1;
@@ -524,6 +868,68 @@ int main(int argc, char * argv[]) {
         return 0;
     }
 
+    if (track_radius <= 0 || track_max_failures < 1) {
+        printf("Invalid tracking settings. The radius must be positive and at "
+               "least one\nfailure allowed.\n");
+        return 0;
+    }
+
+    if (num_solvers < 1 || num_solvers > MAX_SOLVERS) {
+        printf("Invalid number of solvers. Choose one in the range 1-%d.\n",
+               MAX_SOLVERS);
+        return 0;
+    }
+
+    if (archive_every < 1 || archive_budget_mb < 0) {
+        printf("Invalid archiving settings. Save every image or fewer, with a "
+               "budget of\n0 MB (no limit) or more.\n");
+        return 0;
+    }
+
+    if (hp_track_frames < 0 || hp_track_frames > 255) {
+        printf("Invalid number of hot pixel tracking frames. Choose one in the "
+               "range\n0-255.\n");
+        return 0;
+    }
+
+    camera_geometry.x = aoi[0];
+    camera_geometry.y = aoi[1];
+    camera_geometry.width = aoi[2];
+    camera_geometry.height = aoi[3];
+    if (checkGeometry(&camera_geometry) < 0) {
+        return 0;
+    }
+
+    if (max_solve_blobs < 0) {
+        printf("Invalid solver blob budget. Choose 0 (all the blobs) or "
+               "more.\n");
+        return 0;
+    }
+
+    if (propagate_frames < 0) {
+        printf("Invalid number of propagated images. Choose 0 (always solve) "
+               "or more.\n");
+        return 0;
+    }
+
+    if (stack_frames < 1 || stack_frames > STACK_MAX_FRAMES) {
+        printf("Invalid number of stacked exposures. Choose one in the range "
+               "1-%d.\n", STACK_MAX_FRAMES);
+        return 0;
+    }
+
+    if (num_workers < 1 || num_workers > MAX_WORKERS) {
+        printf("Invalid number of threads. Choose one in the range 1-%d.\n",
+               MAX_WORKERS);
+        return 0;
+    }
+
+    if (num_camera_buffers < 2 || num_camera_buffers > MAX_FRAMES) {
+        printf("Invalid number of camera buffers. Choose one in the range "
+               "2-%d.\n", MAX_FRAMES);
+        return 0;
+    }
+
     if (atoi(port) > 65535 || atoi(port) < 0) {
         printf("Invalid TCP socket port. Choose one in the range 0-65535.\n");
         return 0;
@@ -600,27 +1006,86 @@ int main(int argc, char * argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // the settings frames start with, which only the command thread changes
+    // from here on
+    initParams();
+
+    // accept clients (and queue their commands) while starting up, so they
+    // can see the camera is not ready yet
+    if (startBroadcaster(sockfd, sizeof(struct commands), COMMANDS_VERSION,
+                         TELEMETRY_VERSION, queueCommands) < 1) {
+        printf("Could not start broadcasting telemetry to clients.\n");
+        close(sockfd);
+        exit(EXIT_FAILURE);
+    }
+    broadcastTelemetry(NULL);
+
+    // load Astrometry and move the lens while the camera starts, as none of
+    // them needs the others
+    if (pthread_create(&init_thread_ids[0], NULL, startAstrometry,
+                       NULL) != 0 ||
+        pthread_create(&init_thread_ids[1], NULL, startLensAdapter,
+                       lens_desc) != 0) {
+        fprintf(stderr, "Error creating startup threads: %s.\n",
+                strerror(errno));
+        close(sockfd);
+        exit(EXIT_FAILURE);
+    }
+
     // initialize the camera with input ID
-    if (initCamera() < 0) {
-        printf("Could not initialize camera due to above error. Could be that "
-               "you specified a handle for a camera already in use.\n");
+    clock_gettime(CLOCK_MONOTONIC, &init_start);
+    int camera_ret = initCamera();
+    clock_gettime(CLOCK_MONOTONIC, &init_end);
+    startup.camera_time = msecBetween(&init_start, &init_end);
+    pthread_join(init_thread_ids[0], NULL);
+    pthread_join(init_thread_ids[1], NULL);
+
+    if (camera_ret < 0 || astrometry_init_ret < 0) {
+        if (camera_ret < 0) {
+            printf("Could not initialize camera due to above error. Could be "
+                   "that you specified a handle for a camera already in "
+                   "use.\n");
+        } else {
+            printf("Could not initialize Astrometry due to above error.\n");
+        }
         // if camera was already initialized, close it before exiting
         if (camera_handle > 0) {
             closeCamera();
         }
+        closeLensAdapter();
+        stopBroadcaster();
         close(sockfd);
         exit(EXIT_FAILURE);
     }
 
-    // initialize the lens adapter
-    if (initLensAdapter(lens_desc) < 0) {
+    // the lens adapter is not needed to take images
+    if (lens_init_ret < 0) {
         printf("Could not initialize lens adapter due to above error.\n");
-        // closeCamera();
-        // close(sockfd);
-        // exit(EXIT_FAILURE);
     }
 
-    // create a thread separate from all client thread(s) to solve Astrometry 
+    // the auto-focus the camera starts in (without startAutoFocus()) goes by
+    // the settings as they are now
+    auto_focus_params = all_camera_params;
+
+    clock_gettime(CLOCK_MONOTONIC, &init_end);
+    startup.total_time = msecBetween(&main_start, &init_end);
+    startup.ready = 1;
+    printf("(*) Ready in %.1f msec (camera %.1f msec, lens %.1f msec, "
+           "Astrometry %.1f msec, at the same time).\n", startup.total_time,
+           startup.camera_time, startup.lens_time, startup.astrometry_time);
+    // (the first frame may be a while, auto-focusing)
+    broadcastTelemetry(NULL);
+
+    // create a thread to execute the commands clients send (including the
+    // ones queued while starting up)
+    if (pthread_create(&client_thread_id, NULL, processCommands, NULL) != 0) {
+        fprintf(stderr, "Error creating command thread: %s.\n", 
+                strerror(errno));
+        close(sockfd);
+        exit(EXIT_FAILURE);
+    }
+
+    // create a thread separate from the client thread(s) to solve Astrometry 
     if (pthread_create(&astro_thread_id, NULL, updateAstrometry, NULL) != 0) {
         fprintf(stderr, "Error creating Astrometry thread: %s.\n", 
                 strerror(errno));
@@ -628,58 +1093,19 @@ int main(int argc, char * argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    // loop forever, accepting new clients
-    client_addr_len = sizeof(struct sockaddr_in); 
-    while ((!shutting_down) && (newsockfd = accept(sockfd, (struct sockaddr *) 
-                                                           &client_addr, 
-                                                           &client_addr_len))) {
-        // parent process waiting to accept a new connection
-        printf("\n+---------------------------------------------------------+\n");
-        printf("| Server waiting for new client, %d already connected\t  |\n",
-           num_clients);
-        printf("+---------------------------------------------------------+\n");
-
-        // store length of client that has connected (if any)
-        client_addr_len = sizeof(client_addr);
-        if (newsockfd == -1) {
-            printf("New client did not connect.\n");
-        } else {
-            any_clients = 1;
-
-            // user did connect so process their info for their client thread
-            printf("Client %s connected.\n", inet_ntoa(client_addr.sin_addr)); 
-
-            client_args = (struct args *) malloc(sizeof(struct args));
-            if (client_args == NULL) {
-                fprintf(stderr, "Error creating struct for new client: %s.\n", 
-                        strerror(errno));
-                continue;
-            }
-
-            client_args->user_socket = newsockfd;
-            client_args->user_length = client_addr_len;
-            client_args->user_address = client_addr;
-            client_args->user_IP = inet_ntoa(client_addr.sin_addr);
-
-            // create new thread for this new client
-            if (pthread_create(&client_thread_id, NULL, processClient, 
-                              (void *) client_args) < 0) {
-                fprintf(stderr, "Error creating thread for new client: %s.\n", 
-                        strerror(errno));
-            }
-
-            num_clients++;
-        }
-    }
-    
-    // join threads once the Astrometry thread has closed and terminated
+    // join threads once the Astrometry thread has closed and terminated (the
+    // pipeline stops the broadcaster once the last frame is solved)
     pthread_join(astro_thread_id, (void **) &(astro_ptr));
-    if (any_clients) {
-        pthread_join(client_thread_id, (void **) &(client_ptr));
-        free(client_args);
-    }
+    stopBroadcaster();
+
+    pthread_mutex_lock(&queued_lock);
+    queued_closed = 1;
+    pthread_cond_signal(&queued_ready);
+    pthread_mutex_unlock(&queued_lock);
+    pthread_join(client_thread_id, (void **) &(client_ptr));
 
     closeCamera();
+    closeLensAdapter();
     shutdown(sockfd, SHUT_RDWR);
     close(sockfd);
 
@@ -691,14 +1117,12 @@ int main(int argc, char * argv[]) {
         ret = 0;
     }
 
-    if (any_clients) {
-        if (*client_ptr == 1) {
-            printf("\nSuccessfully exited client thread.\n");
-            ret = 1;
-        } else {
-            printf("\nDid not return successfully from client thread.\n");
-            ret = 0;
-        }
+    if (*client_ptr == 1) {
+        printf("\nSuccessfully exited command thread.\n");
+        ret = 1;
+    } else {
+        printf("\nDid not return successfully from command thread.\n");
+        ret = 0;
     }
 
     return ret;
@@ -1,11 +1,33 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 
-extern int num_clients;
-extern int telemetry_sent;
+// most sets of client commands waiting to be executed
+#define MAX_QUEUED_COMMANDS  8
+
+struct frame;
+struct subscription;
+
+#pragma pack(push, 1)
+/* How far the camera is through starting up, and how long each part took
+** [msec] (the camera, lens and Astrometry start at the same time) */
+struct startup_status {
+    int ready;                  // (bool) all started, and the pipeline next
+    double camera_time;
+    double lens_time;
+    double astrometry_time;     // including loading the index files
+    double total_time;          // from the start of the program until ready
+};
+#pragma pack(pop)
+
+extern struct startup_status startup;
+
 extern int cancelling_auto_focus;
 extern int verbose;
-extern void * camera_raw;
-void * processClient(void * arg);
+void queueCommands(void * cmds, char * ip_addr, 
+                   struct subscription * subscription);
+void * processCommands();
+void * startAstrometry();
+void * startLensAdapter(void * path);
+int broadcastTelemetry(struct frame * frame);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,595 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <ueye.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "camera.h"
+#include "commands.h"
+#include "pipeline.h"
+#include "hotpix.h"
+
+#define HP_PIXELS(hp)  ((hp)->width*(hp)->height)
+#define HP_WORDS(hp)   ((HP_PIXELS(hp) + 63)/64)
+
+/* Kernel for the dynamic hot pixel test of one row: keeps (mask = 1) the
+** pixels that are not spiked above their neighbours, and counts how many frames
+** each pixel has been hot for the tracker.
+** Input: The rows above, at, and below the one being masked (starting at the
+** first pixel to check), the row of the mask and of the tracker counts (NULL if
+** not tracking), the number of pixels, the spike limit, the count at which a
+** pixel joins the tracked map, and where to count the pixels whose count
+** crossed into or out of the tracked map.
+** Output: The number of hot pixels in the row.
+*/
+typedef int (* mask_kernel)(const char * up, const char * row,
+                            const char * down, unsigned char * mask,
+                            unsigned char * counts, int n, int spike, int on,
+                            int * transitions);
+
+// frames more hot than not for a pixel to join the tracked map (0 turns the
+// tracker off)
+int hp_track_frames = 100;
+
+static mask_kernel mask_row = NULL;
+static pthread_once_t mask_once = PTHREAD_ONCE_INIT;
+// bit k of the index becomes byte k (0 or 1) of the entry
+static uint64_t bit_bytes[256];
+
+/* Scalar dynamic hot pixel kernel. v/spike_limit in the old test rounded
+** toward zero, so negative (signed char) pixels are moved up by spike - 1 first
+** and the comparisons against (neighbours + 4)*spike are then exact without
+** dividing: v/spike < min(a, b) if vs < min*spike, and > if vs >= (min + 1)*
+** spike.
+*/
+static int maskRowScalar(const char * up, const char * row, const char * down,
+                         unsigned char * mask, unsigned char * counts, int n,
+                         int spike, int on, int * transitions) {
+    int hot = 0;
+
+    for (int k = 0; k < n; k++) {
+        // pixels left/right, above/below and on the diagonals
+        int a = row[k - 1] + row[k + 1] + up[k] + down[k];
+        int b = up[k - 1] + up[k + 1] + down[k - 1] + down[k + 1];
+        int lo = (((a < b) ? a : b) + 4)*spike;
+        int vs = row[k] + ((row[k] < 0) ? spike - 1 : 0);
+        int is_hot = (vs >= lo + spike);
+
+        mask[k] = (vs < lo);
+        hot += is_hot;
+
+        if (counts != NULL) {
+            if (is_hot) {
+                if (counts[k] < 255) counts[k]++;
+                *transitions += (counts[k] == on);
+            } else if (counts[k] > 0) {
+                counts[k]--;
+                *transitions += (counts[k] == 0);
+            }
+        }
+    }
+
+    return hot;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LOAD8(p) _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *) (p)))
+
+__attribute__((target("avx2")))
+static int maskRowAVX2(const char * up, const char * row, const char * down,
+                       unsigned char * mask, unsigned char * counts, int n,
+                       int spike, int on, int * transitions) {
+    const __m256i four = _mm256_set1_epi32(4);
+    const __m256i s = _mm256_set1_epi32(spike);
+    const __m256i s1 = _mm256_set1_epi32(spike - 1);
+    const __m128i on8 = _mm_set1_epi8((char) on);
+    const __m128i zero8 = _mm_setzero_si128(), one8 = _mm_set1_epi8(1);
+    int hot = 0;
+    int k = 0;
+
+    for (; k + 8 <= n; k += 8) {
+        __m256i a = _mm256_add_epi32(
+            _mm256_add_epi32(LOAD8(row + k - 1), LOAD8(row + k + 1)),
+            _mm256_add_epi32(LOAD8(up + k), LOAD8(down + k)));
+        __m256i b = _mm256_add_epi32(
+            _mm256_add_epi32(LOAD8(up + k - 1), LOAD8(up + k + 1)),
+            _mm256_add_epi32(LOAD8(down + k - 1), LOAD8(down + k + 1)));
+        __m256i lo = _mm256_mullo_epi32(
+            _mm256_add_epi32(_mm256_min_epi32(a, b), four), s);
+        __m256i v = LOAD8(row + k);
+        __m256i vs = _mm256_add_epi32(v, _mm256_and_si256(
+            _mm256_srai_epi32(v, 31), s1));
+
+        int keep = _mm256_movemask_ps(_mm256_castsi256_ps(
+            _mm256_cmpgt_epi32(lo, vs)));
+        int hots = ~_mm256_movemask_ps(_mm256_castsi256_ps(
+            _mm256_cmpgt_epi32(_mm256_add_epi32(lo, s), vs))) & 0xff;
+
+        memcpy(mask + k, &bit_bytes[keep], 8);
+        hot += __builtin_popcount(hots);
+
+        if (counts != NULL) {
+            __m128i c = _mm_loadl_epi64((__m128i *) (counts + k));
+            __m128i inc = _mm_loadl_epi64((__m128i *) &bit_bytes[hots]);
+            __m128i dec = _mm_loadl_epi64(
+                (__m128i *) &bit_bytes[~hots & 0xff]);
+            __m128i nc = _mm_subs_epu8(_mm_adds_epu8(c, inc), dec);
+            _mm_storel_epi64((__m128i *) (counts + k), nc);
+
+            // counts that reached the tracked map, or fell back to 0 from 1
+            __m128i joined = _mm_and_si128(_mm_cmpeq_epi8(nc, on8), inc);
+            __m128i left = _mm_and_si128(_mm_cmpeq_epi8(nc, zero8),
+                                         _mm_cmpeq_epi8(c, one8));
+            *transitions += __builtin_popcount(
+                _mm_movemask_epi8(_mm_or_si128(joined, left)));
+        }
+    }
+
+    return hot + maskRowScalar(up + k, row + k, down + k, mask + k,
+                               (counts != NULL) ? counts + k : NULL, n - k,
+                               spike, on, transitions);
+}
+#endif
+
+/* Helper function to pick the fastest mask kernel this CPU supports.
+** Input: None.
+** Output: None (void).
+*/
+static void chooseMaskKernel() {
+    for (int bits = 0; bits < 256; bits++) {
+        unsigned char bytes[8];
+        for (int k = 0; k < 8; k++) {
+            bytes[k] = (bits >> k) & 1;
+        }
+        memcpy(&bit_bytes[bits], bytes, 8);
+    }
+
+    mask_row = maskRowScalar;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        mask_row = maskRowAVX2;
+    }
+#endif
+}
+
+/* Function to run the dynamic hot pixel test on one row of an image. Safe to
+** run on different rows at once.
+** Input: The map, the image bytes (ib), the mask, the image width (w), the row
+** (j), the pixels to check (i0 to i1 - 1, inside the image border), the spike
+** limit, and where to count the pixels that should join or leave the tracked
+** map.
+** Output: The number of hot pixels in the row.
+*/
+int maskHotPixelRow(struct hot_pixel_map * hp, char * ib, unsigned char * mask,
+                    int w, int j, int i0, int i1, int spike_limit,
+                    int * transitions) {
+    int track = (hp_track_frames > 0 && hp->counts != NULL &&
+                 hp->whole_sensor);
+    char * row = ib + i0 + j*w;
+
+    pthread_once(&mask_once, chooseMaskKernel);
+    if (spike_limit < 1) {
+        // the old test divided by the spike limit and never got this far
+        spike_limit = 1;
+    }
+
+    return mask_row(row - w, row, row + w, mask + i0 + j*w,
+                    track ? hp->counts + i0 + j*w : NULL, i1 - i0,
+                    spike_limit, hp_track_frames, transitions);
+}
+
+/* Function to set up an empty map for a camera (nothing is allocated or read
+** until the map is loaded or made).
+** Input: The map, the size of the sensor, and the paths of its text list and
+** sidecar.
+** Output: None (void).
+*/
+void initHotPixelMap(struct hot_pixel_map * hp, int width, int height,
+                     const char * list_path, const char * sidecar_path) {
+    memset(hp, 0, sizeof(struct hot_pixel_map));
+    hp->list_path = list_path;
+    hp->sidecar_path = sidecar_path;
+    hp->width = width;
+    hp->height = height;
+    hp->geometry = (struct camera_geometry) {1, 0, 0, 0, width, height, width};
+    hp->whole_sensor = 1;
+}
+
+/* Helper function to allocate the maps the first time they are needed.
+** Input: The map.
+** Output: A flag indicating the maps could be allocated or not.
+*/
+static int allocHotPixelMap(struct hot_pixel_map * hp) {
+    if (hp->listed != NULL) {
+        return 1;
+    }
+
+    hp->listed = calloc(HP_WORDS(hp), sizeof(uint64_t));
+    hp->tracked = calloc(HP_WORDS(hp), sizeof(uint64_t));
+    hp->counts = calloc(HP_PIXELS(hp), 1);
+    if (hp->listed == NULL || hp->tracked == NULL || hp->counts == NULL) {
+        fprintf(stderr, "Error allocating hot pixel map: %s.\n",
+                strerror(errno));
+        freeHotPixelMap(hp);
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Helper function to count the pixels in a map.
+** Input: The map, and which of its bitsets to count.
+** Output: The number of pixels set.
+*/
+static int countHotPixels(struct hot_pixel_map * hp, uint64_t * map) {
+    int n = 0;
+
+    for (int w = 0; w < HP_WORDS(hp); w++) {
+        n += __builtin_popcountll(map[w]);
+    }
+
+    return n;
+}
+
+/* Helper function to list (in order) the pixels set in either bitset.
+** Input: The map.
+** Output: None (void).
+*/
+static void rebuildHotPixelIndex(struct hot_pixel_map * hp) {
+    int n = 0;
+
+    free(hp->index);
+    hp->num_index = 0;
+    for (int w = 0; w < HP_WORDS(hp); w++) {
+        n += __builtin_popcountll(hp->listed[w] | hp->tracked[w]);
+    }
+
+    if ((hp->index = malloc((n + 1)*sizeof(int))) == NULL) {
+        fprintf(stderr, "Error allocating hot pixel index: %s.\n",
+                strerror(errno));
+        return;
+    }
+
+    for (int w = 0; w < HP_WORDS(hp); w++) {
+        uint64_t bits = hp->listed[w] | hp->tracked[w];
+        while (bits) {
+            hp->index[hp->num_index++] = w*64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+        }
+    }
+    hp->changed = 0;
+}
+
+/* Helper function to read the listed map from the text list of hot pixels (x,
+** y with y counted from the bottom of the image, as in Kst).
+** Input: The map.
+** Output: The number of hot pixels read, or -1 if there is no list.
+*/
+static int readHotPixelList(struct hot_pixel_map * hp) {
+    FILE * f = fopen(hp->list_path, "r");
+    char * line = NULL;
+    size_t len = 0;
+    int n = 0;
+
+    if (f == NULL) {
+        return -1;
+    }
+
+    memset(hp->listed, 0, HP_WORDS(hp)*sizeof(uint64_t));
+    while (getline(&line, &len, f) != -1) {
+        int x, y;
+        if (sscanf(line, "%d,%d", &x, &y) != 2) {
+            continue;
+        }
+        // map y coordinate to image in memory from Kst blob
+        y = hp->height - y;
+        if (x < 0 || x >= hp->width || y < 0 || y >= hp->height) {
+            continue;
+        }
+        int ind = x + y*hp->width;
+        hp->listed[ind/64] |= (uint64_t) 1 << (ind % 64);
+        n++;
+    }
+
+    fclose(f);
+    free(line);
+
+    return n;
+}
+
+/* Helper function to read the maps from the sidecar, if it is there and was
+** written after the text list.
+** Input: The map.
+** Output: A flag indicating the maps were read or not.
+*/
+static int readHotPixelSidecar(struct hot_pixel_map * hp) {
+    struct hp_sidecar_header header;
+    struct stat sidecar_st, list_st;
+    size_t words = HP_WORDS(hp);
+    FILE * f;
+    int ok;
+
+    if (stat(hp->sidecar_path, &sidecar_st) != 0 ||
+        (stat(hp->list_path, &list_st) == 0 &&
+         list_st.st_mtime > sidecar_st.st_mtime)) {
+        return -1;
+    }
+
+    if ((f = fopen(hp->sidecar_path, "r")) == NULL) {
+        return -1;
+    }
+
+    ok = (fread(&header, sizeof(header), 1, f) == 1 &&
+          memcmp(header.magic, HP_SIDECAR_MAGIC, sizeof(header.magic)) == 0 &&
+          header.version == HP_SIDECAR_VERSION &&
+          header.width == (uint32_t) hp->width &&
+          header.height == (uint32_t) hp->height &&
+          fread(hp->listed, sizeof(uint64_t), words, f) == words &&
+          fread(hp->tracked, sizeof(uint64_t), words, f) == words);
+    fclose(f);
+
+    if (!ok) {
+        fprintf(stderr, "Ignoring %s (not a hot pixel map for this camera).\n",
+                hp->sidecar_path);
+        memset(hp->listed, 0, words*sizeof(uint64_t));
+        memset(hp->tracked, 0, words*sizeof(uint64_t));
+        return -1;
+    }
+
+    // the tracker starts out believing the pixels it found before
+    for (int ind = 0; ind < HP_PIXELS(hp); ind++) {
+        if ((hp->tracked[ind/64] >> (ind % 64)) & 1) {
+            hp->counts[ind] = (hp_track_frames > 0) ? hp_track_frames : 255;
+        }
+    }
+
+    return 1;
+}
+
+/* Function to load the static hot pixel map: from the sidecar if it is up to
+** date, otherwise from the text list (and then write the sidecar).
+** Input: The map.
+** Output: A flag indicating the map could be loaded or not (no list at all is
+** an empty map).
+*/
+int loadHotPixelMap(struct hot_pixel_map * hp) {
+    if (allocHotPixelMap(hp) != 1) {
+        return -1;
+    }
+
+    if (readHotPixelSidecar(hp) != 1) {
+        memset(hp->tracked, 0, HP_WORDS(hp)*sizeof(uint64_t));
+        if (readHotPixelList(hp) >= 0) {
+            saveHotPixelMap(hp);
+        }
+    }
+    rebuildHotPixelIndex(hp);
+
+    if (verbose) {
+        printf("Static hot pixel map: %d listed and %d tracked pixels.\n",
+               countHotPixels(hp, hp->listed), countHotPixels(hp, hp->tracked));
+    }
+
+    return 1;
+}
+
+/* Function to write both maps to the sidecar (through a temporary file, so a
+** crash leaves the old one).
+** Input: The map.
+** Output: A flag indicating the sidecar was written or not.
+*/
+int saveHotPixelMap(struct hot_pixel_map * hp) {
+    struct hp_sidecar_header header = {0};
+    size_t words = HP_WORDS(hp);
+    char tmp_path[256];
+    FILE * f;
+    int ok;
+
+    if (hp->listed == NULL) {
+        return -1;
+    }
+
+    memcpy(header.magic, HP_SIDECAR_MAGIC, sizeof(header.magic));
+    header.version = HP_SIDECAR_VERSION;
+    header.width = hp->width;
+    header.height = hp->height;
+    header.listed = countHotPixels(hp, hp->listed);
+    header.tracked = countHotPixels(hp, hp->tracked);
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", hp->sidecar_path);
+    if ((f = fopen(tmp_path, "w")) == NULL) {
+        fprintf(stderr, "Could not write %s: %s.\n", tmp_path,
+                strerror(errno));
+        return -1;
+    }
+
+    ok = (fwrite(&header, sizeof(header), 1, f) == 1 &&
+          fwrite(hp->listed, sizeof(uint64_t), words, f) == words &&
+          fwrite(hp->tracked, sizeof(uint64_t), words, f) == words);
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(tmp_path, hp->sidecar_path) != 0) {
+        fprintf(stderr, "Could not write %s: %s.\n", hp->sidecar_path,
+                strerror(errno));
+        remove(tmp_path);
+        return -1;
+    }
+
+    hp->sidecar_stale = 0;
+    hp->frames_since_save = 0;
+
+    return 1;
+}
+
+/* Function to tell the maps the readout geometry of the images to come.
+** Input: The map and the geometry.
+** Output: None (void).
+*/
+void setHotPixelGeometry(struct hot_pixel_map * hp,
+                         const struct camera_geometry * geometry) {
+    hp->geometry = *geometry;
+    hp->whole_sensor = (geometry->factor == 1 && geometry->x == 0 &&
+                        geometry->y == 0 && geometry->width == hp->width &&
+                        geometry->height == hp->height);
+}
+
+/* Function to make a new listed map from the pixels of an image above a
+** threshold (make_static_hp_mask), writing it to the text list and sidecar.
+** Only an image of the whole sensor (not binned or subsampled) can be used.
+** Input: The map, the image bytes (ib, with no space between rows), its
+** readout geometry, and the threshold.
+** Output: The number of hot pixels, or -1 if the list could not be written.
+*/
+int makeHotPixelMap(struct hot_pixel_map * hp, char * ib,
+                    const struct camera_geometry * geometry, int threshold) {
+    FILE * f;
+    int n = 0;
+
+    setHotPixelGeometry(hp, geometry);
+    if (!hp->whole_sensor) {
+        printf("Not making a static hot pixel map from an image that is not "
+               "of the whole\nsensor.\n");
+        return -1;
+    }
+
+    if (allocHotPixelMap(hp) != 1) {
+        return -1;
+    }
+
+    if ((f = fopen(hp->list_path, "w")) == NULL) {
+        fprintf(stderr, "Could not write %s: %s.\n", hp->list_path,
+                strerror(errno));
+        return -1;
+    }
+
+    memset(hp->listed, 0, HP_WORDS(hp)*sizeof(uint64_t));
+    for (int yp = 0; yp < hp->height; yp++) {
+        for (int xp = 0; xp < hp->width; xp++) {
+            int ind = xp + yp*hp->width;
+            if (ib[ind] > threshold) {
+                hp->listed[ind/64] |= (uint64_t) 1 << (ind % 64);
+                // make this agree with blob coordinates in Kst
+                fprintf(f, "%d,%d\n", xp, hp->height - yp);
+                n++;
+            }
+        }
+    }
+    fclose(f);
+
+    saveHotPixelMap(hp);
+    hp->changed = 1;
+
+    if (verbose) {
+        printf("Made a static hot pixel map of %d pixels (brighter than "
+               "%d).\n", n, threshold);
+    }
+
+    return n;
+}
+
+/* Function to bring the tracked map up to date with the tracker counts of some
+** rows, after maskHotPixelRow() saw counts cross. Not safe to run on different
+** rows at once.
+** Input: The map, the image width (w), the rows to update (ja to jb - 1), and
+** the columns the tracker counted (i0 to i1 - 1).
+** Output: None (void).
+*/
+void updateTrackedHotPixels(struct hot_pixel_map * hp, int w, int ja, int jb,
+                            int i0, int i1) {
+    if (hp->counts == NULL || hp_track_frames <= 0 || !hp->whole_sensor) {
+        return;
+    }
+
+    for (int j = ja; j < jb; j++) {
+        for (int i = i0; i < i1; i++) {
+            int ind = i + j*w;
+            uint64_t bit = (uint64_t) 1 << (ind % 64);
+            uint64_t was = hp->tracked[ind/64] & bit;
+
+            if (hp->counts[ind] >= hp_track_frames && !was) {
+                hp->tracked[ind/64] |= bit;
+            } else if (hp->counts[ind] == 0 && was) {
+                hp->tracked[ind/64] &= ~bit;
+            } else {
+                continue;
+            }
+            hp->changed = hp->sidecar_stale = 1;
+        }
+    }
+}
+
+/* Function to mask the static hot pixels. In a binned image, a pixel is masked
+** if any of the sensor pixels binned into it is hot. In a subsampled one, only
+** the sensor pixels that were read out can be.
+** Input: The map and the mask (of an image with the geometry last given to
+** setHotPixelGeometry()).
+** Output: None (void).
+*/
+void applyHotPixelMap(struct hot_pixel_map * hp, unsigned char * mask) {
+    struct camera_geometry * g = &hp->geometry;
+
+    if (hp->changed) {
+        rebuildHotPixelIndex(hp);
+    }
+
+    if (hp->whole_sensor) {
+        for (int k = 0; k < hp->num_index; k++) {
+            mask[hp->index[k]] = 0;
+        }
+        return;
+    }
+
+    for (int k = 0; k < hp->num_index; k++) {
+        int sx = hp->index[k] % hp->width;
+        int sy = hp->index[k] / hp->width;
+        if (g->subsample && (sx % g->factor || sy % g->factor)) {
+            continue;
+        }
+        int x = sx/g->factor - g->x, y = sy/g->factor - g->y;
+        if (x >= 0 && x < g->width && y >= 0 && y < g->height) {
+            mask[x + y*g->width] = 0;
+        }
+    }
+}
+
+/* Function to call once a frame's mask is made: writes the tracked map out if
+** it has changed (at most once in HP_SAVE_INTERVAL frames).
+** Input: The map.
+** Output: None (void).
+*/
+void finishHotPixelFrame(struct hot_pixel_map * hp) {
+    if (hp->sidecar_stale && ++hp->frames_since_save >= HP_SAVE_INTERVAL) {
+        if (verbose) {
+            printf("Tracked hot pixels: %d.\n",
+                   countHotPixels(hp, hp->tracked));
+        }
+        saveHotPixelMap(hp);
+    }
+}
+
+/* Function to write out the tracked map (if it changed) and free the maps.
+** Input: The map.
+** Output: None (void).
+*/
+void freeHotPixelMap(struct hot_pixel_map * hp) {
+    if (hp->sidecar_stale) {
+        saveHotPixelMap(hp);
+    }
+
+    free(hp->listed);
+    free(hp->tracked);
+    free(hp->counts);
+    free(hp->index);
+    hp->listed = hp->tracked = NULL;
+    hp->counts = NULL;
+    hp->index = NULL;
+    hp->num_index = 0;
+    hp->changed = hp->sidecar_stale = 0;
+}
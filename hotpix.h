@@ -0,0 +1,67 @@
+#ifndef HOTPIX_H
+#define HOTPIX_H
+
+#include <stdint.h>
+
+#include "pipeline.h"
+
+// binary copy of the static hot pixel map (STATIC_HP_MASK is the text list)
+#define STATIC_HP_SIDECAR  "/home/blast/Desktop/blastcam/static_hp_mask.bin"
+#define HP_SIDECAR_MAGIC   "SCHPMASK"
+#define HP_SIDECAR_VERSION 1
+// the tracked map is written out at most once in this many frames
+#define HP_SAVE_INTERVAL   100
+
+#pragma pack(push, 1)
+/* Start of the sidecar, followed by the listed map and then the tracked map
+** (each a bitset of width*height bits, row by row, in 64-bit words) */
+struct hp_sidecar_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;             // [px]
+    uint32_t height;            // [px]
+    uint32_t listed;            // pixels in the listed map
+    uint32_t tracked;           // pixels in the tracked map
+};
+#pragma pack(pop)
+
+/* The static hot pixel map of one camera: the pixels in its text list (or its
+** last make_static_hp_mask dump) and the pixels the tracker has seen hot in
+** hp_track_frames frames more than not, all as pixels of the whole sensor */
+struct hot_pixel_map {
+    const char * list_path;     // text list (x,y with y from the bottom)
+    const char * sidecar_path;  // binary copy of both maps
+    int width, height;          // of the sensor [px]
+    uint64_t * listed, * tracked;
+    unsigned char * counts;     // net frames each pixel has been hot for
+    int * index;                // sorted indices of the static hot pixels
+    int num_index;
+    int changed;                // (bool) the index needs rebuilding
+    int sidecar_stale;          // (bool) the sidecar needs rewriting
+    int frames_since_save;
+    // readout geometry of the image being masked, and whether it is the
+    // whole sensor as it is
+    struct camera_geometry geometry;
+    int whole_sensor;
+};
+
+extern int hp_track_frames;
+
+void initHotPixelMap(struct hot_pixel_map * hp, int width, int height,
+                     const char * list_path, const char * sidecar_path);
+int loadHotPixelMap(struct hot_pixel_map * hp);
+int saveHotPixelMap(struct hot_pixel_map * hp);
+void setHotPixelGeometry(struct hot_pixel_map * hp,
+                         const struct camera_geometry * geometry);
+int makeHotPixelMap(struct hot_pixel_map * hp, char * ib,
+                    const struct camera_geometry * geometry, int threshold);
+void applyHotPixelMap(struct hot_pixel_map * hp, unsigned char * mask);
+int maskHotPixelRow(struct hot_pixel_map * hp, char * ib, unsigned char * mask,
+                    int w, int j, int i0, int i1, int spike_limit,
+                    int * transitions);
+void updateTrackedHotPixels(struct hot_pixel_map * hp, int w, int ja, int jb,
+                            int i0, int i1);
+void finishHotPixelFrame(struct hot_pixel_map * hp);
+void freeHotPixelMap(struct hot_pixel_map * hp);
+
+#endif
@@ -3,7 +3,10 @@
 ** This program is designed so that only two-letter commands need to be input to
 ** execute camera changes.
 ** e.g., cmd_status = runCommand("mi\r", file_descriptor, birger_output);
-** where 'mi' is the command.
+** where 'mi' is the command. Other threads hand commands to the lens thread 
+** instead, which runs them in order without anyone else waiting on the port:
+** e.g., queueLensCommand("mf 20\r"); queueLensCommand("fp\r"); and then, 
+** where the new position is needed, waitForLens();
 ** 
 ** All camera settings are listed in the Canon EF 232 user manual.
 ** https://birger.com/products/lens_controller/manuals/canon_ef232/Canon%20EF-232%20Library%20User%20Manual%201.3.pdf
@@ -61,14 +64,19 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <ueye.h>
 #include <math.h>
 #include <time.h>
+#include <limits.h>
 
 #include "lens_adapter.h"
 #include "camera.h"
 #include "commands.h"
 #include "matrix.h"
+#include "pipeline.h"
 
 /* Camera parameters global structure (defined in lens_adapter.h) */
 struct camera_params all_camera_params = {
@@ -89,13 +97,71 @@ struct camera_params all_camera_params = {
     .focus_step = 5,           // by default, check every fifth focus position
     .photos_per_focus = 3,     // take 3 pictures per focus position by default
     .flux = 0,                 // first auto-focus max flux found will set this
+    .focus_search = FOCUS_SWEEP, // step through the whole range by default
+    .focus_metric = FOCUS_METRIC_HFD, // star sizes rather than one peak
 };
+// the command, lens, capture and solving threads all use all_camera_params,
+// so each holds this to read or write it
+pthread_mutex_t camera_params_lock = PTHREAD_MUTEX_INITIALIZER;
+// the settings of the auto-focus in progress, as of its start (set while the
+// pipeline is idle, so the frames of the run read it without the lock)
+struct camera_params auto_focus_params;
+
+/* A Birger command, how its reply ends, and how long it may take */
+struct lens_command {
+    const char * name;
+    int reply;                  // LENS_REPLY_*
+    int timeout;                // [msec]
+};
+
+// commands not listed here are done at their OK
+struct lens_command lens_commands[] = {
+    { "la", LENS_REPLY_DONE, LENS_LEARN_TIMEOUT },
+    { "mi", LENS_REPLY_DONE, LENS_MOVE_TIMEOUT  },
+    { "mz", LENS_REPLY_DONE, LENS_MOVE_TIMEOUT  },
+    { "mf", LENS_REPLY_DONE, LENS_MOVE_TIMEOUT  },
+    { "fa", LENS_REPLY_DONE, LENS_MOVE_TIMEOUT  },
+    { "in", LENS_REPLY_DONE, LENS_MOVE_TIMEOUT  },
+    { "mo", LENS_REPLY_DONE, LENS_MOVE_TIMEOUT  },
+    { "mc", LENS_REPLY_DONE, LENS_MOVE_TIMEOUT  },
+    { "mn", LENS_REPLY_DONE, LENS_MOVE_TIMEOUT  },
+    { "ma", LENS_REPLY_DONE, LENS_MOVE_TIMEOUT  },
+    { "fp", LENS_REPLY_LINE, LENS_QUERY_TIMEOUT },
+    { "pf", LENS_REPLY_LINE, LENS_QUERY_TIMEOUT },
+    { "pa", LENS_REPLY_LINE, LENS_QUERY_TIMEOUT },
+    { "fd", LENS_REPLY_LINE, LENS_QUERY_TIMEOUT },
+};
+#define NUM_LENS_COMMANDS \
+        ((int) (sizeof(lens_commands)/sizeof(lens_commands[0])))
 
-char * birger_output, * buffer;
+char birger_output[LENS_REPLY_SIZE];
 int file_descriptor, default_focus;
+// bytes read from the adapter that are not part of a reply yet (lens thread)
+char lens_input[LENS_REPLY_SIZE];
+int lens_input_len = 0;
+// commands waiting for the lens thread (protected by lens_lock)
+char lens_queue[LENS_QUEUE_SIZE][LENS_COMMAND_SIZE];
+int lens_head = 0, lens_count = 0;
+// (bools) lens thread is running a command, a command failed since the last
+// waitForLens(), thread was started, and thread has been told to stop
+int lens_busy = 0, lens_failed = 0, lens_running = 0, lens_closed = 0;
+pthread_mutex_t lens_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t lens_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t lens_idle = PTHREAD_COND_INITIALIZER;
+pthread_t lens_thread_id;
 // global variables for solution to quadratic regression for auto-focusing
 double a, b, c;
+// focus positions and their fluxes so far in an adaptive auto-focus, the range
+// it covers, the step of its coarse sweep and of its next refinement, and how
+// many refinement positions it has taken
+int adaptive_focus[MAX_FOCUS_POSITIONS], adaptive_flux[MAX_FOCUS_POSITIONS];
+int adaptive_points = 0, adaptive_first, adaptive_last;
+int adaptive_coarse_step, adaptive_refine_step, adaptive_refinements;
 IMAGE_FILE_PARAMS ImageFileParams;
+// the lens as last seen (kept in LENS_STATE_FILE), and (bool) the aperture was
+// last moved fully open
+struct lens_state lens_state = {0};
+int aperture_opened = 0;
 
 /* Helper function to print a 1D array.
 ** Input: The array to be printed.
@@ -125,6 +191,35 @@ void printFluxFocus(int * flux_arr, int * focus_arr, int num_elements) {
     printf("\n");
 }
 
+/* Helper function to find the flux above which auto-focusing data is fit: 
+** halfway between the dimmest and brightest, so only the top of the curve is.
+** Input: 1D array of flux values and its length.
+** Output: The threshold.
+*/
+double fluxThreshold(int * flux_arr, int len) {
+    double max_flux = -INFINITY;
+    for (int i = 0; i < len; i++) {
+        if (flux_arr[i] > max_flux) {
+            max_flux = flux_arr[i];
+        }
+    }
+
+    double min_flux = INFINITY; 
+    for (int i = 0; i < len; i++) {
+        if (flux_arr[i] < min_flux) {
+            min_flux = flux_arr[i];
+        }
+    }
+
+    double threshold = (max_flux + min_flux)/2.0;
+    if (verbose) {
+        printf("(*) Max flux is %f | min flux is %f\n", max_flux, min_flux);
+        printf("(*) Flux threshold is %f\n\n", threshold);
+    }
+
+    return threshold;
+}
+
 /* Function to perform quadratic regressions during auto-focusing.
 ** Input: 1D arrays of flux and focus values, along with their length.
 ** Output: A flag indicating a successful solution via Gaussian elimination. 
@@ -148,26 +243,7 @@ int quadRegression(int * flux_arr, int * focus_arr, int len) {
     // vector to hold solution values (gaussianElimination will populate this)
     double solution[M]= {0};
 
-    // find flux threshold
-    double max_flux = -INFINITY;
-    for (int i = 0; i < len; i++) {
-        if (flux_arr[i] > max_flux) {
-            max_flux = flux_arr[i];
-        }
-    }
-
-    double min_flux = INFINITY; 
-    for (int i = 0; i < len; i++) {
-        if (flux_arr[i] < min_flux) {
-            min_flux = flux_arr[i];
-        }
-    }
-
-    double threshold = (max_flux + min_flux)/2.0;
-    if (verbose) {
-        printf("(*) Max flux is %f | min flux is %f\n", max_flux, min_flux);
-        printf("(*) Flux threshold is %f\n\n", threshold);
-    }
+    double threshold = fluxThreshold(flux_arr, len);
 
     // calculate the quantities for the normal equations
     double num_elements = 0.0;
@@ -224,6 +300,8 @@ int quadRegression(int * flux_arr, int * focus_arr, int len) {
 */
 int initLensAdapter(char * path) {
     struct termios options;
+    struct lens_state saved = {0};
+    int have_state, learned;
 
     // open file descriptor with given path
     if ((file_descriptor = open(path, O_RDWR | O_NOCTTY)) < 0) {
@@ -301,65 +379,84 @@ int initLensAdapter(char * path) {
         return -1;
     }
 
-    // allocate space for returning values after running Birger commands
-    birger_output = malloc(100);
-    if (birger_output == NULL) {
-        fprintf(stderr, "Error allocating output for Birger commands: %s.\n", 
-                strerror(errno));
-        return -1;
-    }
-
+    // an adapter that still has the focus range it learned last time has not
+    // been power-cycled since, so the lens is as it was left
+    have_state = (loadLensState(&saved) == 1);
+    lens_state = saved;
+    learned = have_state && saved.max_focus_pos > saved.min_focus_pos &&
+              runCommand("fp\r", file_descriptor, birger_output) == 1 &&
+              all_camera_params.min_focus_pos == saved.min_focus_pos &&
+              all_camera_params.max_focus_pos == saved.max_focus_pos;
+
+    // the focus is needed before anything else can run, so set it up here
+    // and leave the rest to the lens thread
     // set focus to 80 below infinity (hard-coded value  determined by testing)
-    if (runCommand("la\r", file_descriptor, birger_output) == -1) {
-        printf("Failed to learn current focus range.\n");
-        return -1;
-    }
-    if (runCommand("mi\r", file_descriptor, birger_output) == -1) {
-        printf("Failed to move focus position to infinity.\n");
-        return -1;
-    }
-    if (runCommand("mf -80\r", file_descriptor, birger_output) == -1) {
-        printf("Failed to move the focus to the desired default position.\n");
-        return -1;
+    if (learned && all_camera_params.focus_position == saved.default_focus) {
+        printf("Focus already at the default position (as last left).\n");
     } else {
-        printf("Focus moved to desired default position.\n");
-    }
+        if (!learned &&
+            runCommand("la\r", file_descriptor, birger_output) == -1) {
+            printf("Failed to learn current focus range.\n");
+            return -1;
+        }
+        if (runCommand("mi\r", file_descriptor, birger_output) == -1) {
+            printf("Failed to move focus position to infinity.\n");
+            return -1;
+        }
+        if (runCommand("mf -80\r", file_descriptor, birger_output) == -1) {
+            printf("Failed to move the focus to the desired default "
+                   "position.\n");
+            return -1;
+        } else {
+            printf("Focus moved to desired default position.\n");
+        }
 
-    printf("Focus at 80 counts below infinity:\n");
-    if (runCommand("fp\r", file_descriptor, birger_output) == -1) {
-        printf("Failed to print the new focus position.\n");
-        return -1;
-    } 
+        printf("Focus at 80 counts below infinity:\n");
+        if (runCommand("fp\r", file_descriptor, birger_output) == -1) {
+            printf("Failed to print the new focus position.\n");
+            return -1;
+        }
+    }
     default_focus = all_camera_params.focus_position;
+    lens_state.default_focus = default_focus;
+    saveLensState();
     printf("(*) Default focus value: %d\n", default_focus);
 
     // update auto-focusing values now that camera params struct is populated
+    // (the camera starts meanwhile, so this is not the only thread using it)
+    pthread_mutex_lock(&camera_params_lock);
     all_camera_params.start_focus_pos = all_camera_params.focus_position - 100;
     all_camera_params.end_focus_pos = all_camera_params.max_focus_pos - 25;
 
     // set aperture parameter to maximum
     all_camera_params.max_aperture = 1;
+    pthread_mutex_unlock(&camera_params_lock);
 
-    // initialize the aperture motor
-    if (runCommand("in\r", file_descriptor, birger_output) == -1) {
-        printf("Failed to initialize the motor.\n");
-        return -1;
+    // where the aperture is (a query, so cheap next to opening it again)
+    if (learned && saved.open_aperture > 0 &&
+        runCommand("pa\r", file_descriptor, birger_output) == -1) {
+        printf("Failed to print the current aperture.\n");
+        learned = 0;
     }
 
-    // run the aperture maximization (fully open) command
-    if (runCommand("mo\r", file_descriptor, birger_output) == -1) {
-        printf("Setting the aperture to maximum fails.\n");
+    if (pthread_create(&lens_thread_id, NULL, driveLens, NULL) != 0) {
+        fprintf(stderr, "Error creating lens thread: %s.\n", strerror(errno));
         return -1;
     }
-
-    // print aperture position
-    if (runCommand("pa\r", file_descriptor, birger_output) == -1) {
-        printf("Failed to print the new aperture position.\n");
+    lens_running = 1;
+
+    // initialize the aperture motor, run the aperture maximization (fully
+    // open) command, and print aperture position, while the camera starts
+    // (unless it is still as fully open as it was left)
+    if (learned && saved.open_aperture > 0 &&
+        all_camera_params.current_aperture == saved.open_aperture) {
+        printf("Aperture already fully open (as last left).\n");
+    } else if (queueLensCommand("in\r") < 1 || queueLensCommand("mo\r") < 1 ||
+               queueLensCommand("pa\r") < 1) {
+        printf("Failed to set the aperture to maximum.\n");
         return -1;
-    } 
+    }
 
-    // free up birger_output variable
-    free(birger_output);
     return file_descriptor;
 }
 
@@ -369,27 +466,30 @@ int initLensAdapter(char * path) {
 ** range or not.
 */
 int beginAutoFocus() {
-    char focus_str_cmd[10];
+    char focus_str_cmd[LENS_COMMAND_SIZE];
+    struct camera_params params;
 
     printf("\n> Beginning the auto-focus process...\n");
     printf("(*) Auto-focusing parameters: start = %d, stop = %d, step = %d.\n", 
-           all_camera_params.start_focus_pos, all_camera_params.end_focus_pos,
-           all_camera_params.focus_step);
-    sprintf(focus_str_cmd, "mf %i\r", all_camera_params.start_focus_pos - 
-                                      all_camera_params.focus_position);
-    if (runCommand(focus_str_cmd, file_descriptor, birger_output) == -1) {
+           auto_focus_params.start_focus_pos, auto_focus_params.end_focus_pos,
+           auto_focus_params.focus_step);
+
+    // the move is relative, so the lens has to be done with earlier ones
+    waitForLens();
+    snapshotCameraParams(&params);
+    snprintf(focus_str_cmd, sizeof(focus_str_cmd), "mf %i\r",
+             auto_focus_params.start_focus_pos - params.focus_position);
+
+    // move, then print focus to get new focus values and re-populate camera 
+    // params struct, and wait since the first image needs the lens there
+    if (queueLensCommand(focus_str_cmd) < 1 || queueLensCommand("fp\r") < 1 ||
+        waitForLens() < 1) {
         printf("Failed to move focus to beginning of auto-focusing range.\n");
         return -1;
     } else {
         printf("Focus moved to beginning of auto-focusing range.\n");
     }
 
-    // print focus to get new focus values and re-populate camera params struct
-    if (runCommand("fp\r", file_descriptor, birger_output) == -1) {
-        printf("Failed to print the new focus position.\n");
-        return -1;
-    } 
-
     return 1;
 }
 
@@ -399,50 +499,44 @@ int beginAutoFocus() {
 ** Output: A flag indicating movement to default focus position or not.
 */
 int defaultFocusPosition() {
-    char focus_str_cmd[10];
+    char focus_str_cmd[LENS_COMMAND_SIZE];
+    struct camera_params params;
 
     printf("> Moving to default focus position..\n");
+    waitForLens();
+    snapshotCameraParams(&params);
     printf("(*) Default focus = %d, all_camera_params.focus_position = %d, "
            "default focus - focus position = %d\n",default_focus, 
-           all_camera_params.focus_position, 
-           default_focus - all_camera_params.focus_position);
-    sprintf(focus_str_cmd, "mf %i\r", 
-            default_focus - all_camera_params.focus_position);
-    if (runCommand(focus_str_cmd, file_descriptor, birger_output) == -1) {
+           params.focus_position, default_focus - params.focus_position);
+    snprintf(focus_str_cmd, sizeof(focus_str_cmd), "mf %i\r",
+             default_focus - params.focus_position);
+
+    // print focus to get new focus values and re-populate camera params struct
+    if (queueLensCommand(focus_str_cmd) < 1 || queueLensCommand("fp\r") < 1) {
         printf("Failed to move the focus to the default position.\n");
         return -1;
     } else if (verbose) {
-        printf("Focus moved to default focus - 80 counts below infinity.\n");
+        printf("Focus moving to default focus - 80 counts below infinity.\n");
     }
 
-    // print focus to get new focus values and re-populate camera params struct
-    if (runCommand("fp\r", file_descriptor, birger_output) == -1) {
-        printf("Failed to print the new focus position.\n");
-        return -1;
-    } 
-
     return 1;
 }
 
-/* Function to shift by specified amount to next focus position.
+/* Function to shift by specified amount to next focus position. The lens 
+** thread makes the move; waitForLens() returns once it is there.
 ** Input: The focus shift command, which includes how much we need to move by.
-** Output: A flag indicating successful movement to the next focus position.
+** Output: A flag indicating the move to the next focus position was queued.
 */
 int shiftFocus(char * cmd) {
-    // shift to next focus position according to step size
-    if (runCommand(cmd, file_descriptor, birger_output) == -1) {
+    // shift to next focus position according to step size, then print the 
+    // focus to get new focus values
+    if (queueLensCommand(cmd) < 1 || queueLensCommand("fp\r") < 1) {
         printf("Failed to move focus to next focus in auto-focusing range.\n");
         return -1;
     } else {
-        printf("Focus moved to next focus position in auto-focusing range.\n");
+        printf("Focus moving to next focus position in auto-focusing range.\n");
     }
 
-    // print the focus to get new focus values
-    if (runCommand("fp\r", file_descriptor, birger_output) == -1) {
-        printf("Failed to print the new focus position.\n");
-        return -1;
-    } 
-
     return 1;
 }
 
@@ -530,56 +624,257 @@ int calculateOptimalFocus(int num_focus, char * auto_focus_file) {
     }
 }
 
+/* Function to fit the focus curve so far and find how well its peak is known.
+** Input: 1D arrays of flux and focus values, their length, and where to store
+** the focus of the peak and its standard error (infinite without enough data
+** for one).
+** Output: A flag indicating the curve has a peak or not.
+*/
+int fitFocusPeak(int * flux_arr, int * focus_arr, int len, double * peak,
+                 double * peak_sigma) {
+    double threshold = fluxThreshold(flux_arr, len);
+    double mean = 0.0, residuals = 0.0, var = 0.0;
+    double sums[5] = {0.0}, flux_sums[3] = {0.0};
+    double fit[M], v[M];
+    int n = 0, lowest = INT_MAX, highest = INT_MIN;
+
+    // fit the top of the curve like quadRegression(), but with the focus 
+    // measured from its mean, which keeps the normal equations well-conditioned
+    for (int i = 0; i < len; i++) {
+        if (flux_arr[i] >= threshold) {
+            mean += focus_arr[i];
+            lowest = min(lowest, focus_arr[i]);
+            highest = max(highest, focus_arr[i]);
+            n++;
+        }
+    }
+    if (n < 3) {
+        return -1;
+    }
+    mean /= n;
+
+    for (int i = 0; i < len; i++) {
+        if (flux_arr[i] >= threshold) {
+            double x = focus_arr[i] - mean, p = 1.0;
+            for (int k = 0; k < 5; k++) {
+                sums[k] += p;
+                if (k < 3) {
+                    flux_sums[k] += p*flux_arr[i];
+                }
+                p *= x;
+            }
+        }
+    }
+
+    double augmatrix[M][N] = {{sums[4], sums[3], sums[2], flux_sums[2]},
+                              {sums[3], sums[2], sums[1], flux_sums[1]},
+                              {sums[2], sums[1], sums[0], flux_sums[0]}};
+    if (gaussianElimination(augmatrix, fit) < 1 || fit[0] >= 0) {
+        return -1;
+    }
+
+    // a curve peaking outside the positions it goes through does not say
+    // where the peak is
+    *peak = mean - fit[1]/(2*fit[0]);
+    if (*peak < lowest || *peak > highest) {
+        return -1;
+    }
+    *peak_sigma = INFINITY;
+    if (n == 3) {
+        return 1;
+    }
+
+    for (int i = 0; i < len; i++) {
+        if (flux_arr[i] >= threshold) {
+            double x = focus_arr[i] - mean;
+            double r = flux_arr[i] - (fit[0]*x*x + fit[1]*x + fit[2]);
+            residuals += r*r;
+        }
+    }
+
+    // the variance of the peak is g^T C g, g being its gradient with respect
+    // to the coefficients and C their covariance: the residual variance times
+    // the inverse of the normal matrix (solved against g rather than inverted)
+    double g[M] = {fit[1]/(2*fit[0]*fit[0]), -1/(2*fit[0]), 0.0};
+    double normal[M][N] = {{sums[4], sums[3], sums[2], g[0]},
+                           {sums[3], sums[2], sums[1], g[1]},
+                           {sums[2], sums[1], sums[0], g[2]}};
+    if (gaussianElimination(normal, v) < 1) {
+        return 1;
+    }
+    for (int k = 0; k < M; k++) {
+        var += g[k]*v[k];
+    }
+    *peak_sigma = sqrt(fmax(var*residuals/(n - 3), 0.0));
+
+    return 1;
+}
+
+/* Function to start a new adaptive auto-focus.
+** Input: None.
+** Output: None (void).
+*/
+void resetAdaptiveFocus() {
+    adaptive_points = 0;
+}
+
+/* Helper function to find how close the nearest focus position taken so far
+** is to a focus.
+** Input: The focus.
+** Output: The distance to the nearest position taken.
+*/
+int nearestAdaptiveFocus(int focus) {
+    int nearest = INT_MAX;
+
+    for (int i = 0; i < adaptive_points; i++) {
+        nearest = min(nearest, abs(adaptive_focus[i] - focus));
+    }
+
+    return nearest;
+}
+
+/* Function to choose the next position of an adaptive auto-focus. It sweeps
+** the range in AF_COARSE_POSITIONS steps, then fits the curve after every 
+** position and takes the next one at its peak (or next to it, once the peak
+** has been taken), until the error of the peak is under focus_step.
+** Input: The focus just taken, its brightest flux, and where to store the 
+** next focus.
+** Output: 1 to take the next focus, 0 when the next focus is the best one.
+*/
+int nextAdaptiveFocus(int focus, int flux, int * next) {
+    int step = max(auto_focus_params.focus_step, 1);
+    int brightest = 0;
+    double peak, peak_sigma;
+
+    // the sweep starts wherever the lens is (the start, unless the user set
+    // the lens elsewhere before turning this on)
+    if (adaptive_points == 0) {
+        adaptive_first = focus;
+        adaptive_last = max(auto_focus_params.end_focus_pos, focus);
+        adaptive_coarse_step = max(step, (adaptive_last - adaptive_first + 
+                                          AF_COARSE_POSITIONS - 2)/
+                                         (AF_COARSE_POSITIONS - 1));
+        adaptive_refine_step = max(step, adaptive_coarse_step/2);
+        adaptive_refinements = 0;
+    }
+    if (adaptive_points < MAX_FOCUS_POSITIONS) {
+        adaptive_focus[adaptive_points] = focus;
+        adaptive_flux[adaptive_points] = flux;
+        adaptive_points++;
+    }
+
+    if (adaptive_refinements == 0 && focus < adaptive_last) {
+        *next = min(focus + adaptive_coarse_step, adaptive_last);
+        return 1;
+    }
+
+    for (int i = 1; i < adaptive_points; i++) {
+        if (adaptive_flux[i] > adaptive_flux[brightest]) {
+            brightest = i;
+        }
+    }
+
+    // without a peak in the curve, look around the brightest position
+    if (fitFocusPeak(adaptive_flux, adaptive_focus, adaptive_points, &peak, 
+                     &peak_sigma) < 1) {
+        peak = adaptive_focus[brightest];
+        peak_sigma = INFINITY;
+        printf("(*) No peak in the focus curve yet after %d positions.\n",
+               adaptive_points);
+    } else {
+        printf("(*) Focus curve peaks at %.1f +/- %.1f after %d positions.\n",
+               peak, peak_sigma, adaptive_points);
+    }
+    peak = fmin(fmax(peak, adaptive_first), adaptive_last);
+
+    if (peak_sigma <= step || adaptive_refinements == AF_MAX_REFINE ||
+        adaptive_points == MAX_FOCUS_POSITIONS) {
+        *next = (int) round(peak);
+        return 0;
+    }
+
+    // take the peak, or if that has been taken, whichever side of it is 
+    // further from the positions taken, closing in every time
+    int target = (int) round(peak);
+    if (nearestAdaptiveFocus(target) > adaptive_refine_step/2) {
+        *next = target;
+    } else {
+        int below = max(target - adaptive_refine_step, adaptive_first);
+        int above = min(target + adaptive_refine_step, adaptive_last);
+        int gap_below = nearestAdaptiveFocus(below);
+        int gap_above = nearestAdaptiveFocus(above);
+
+        if (max(gap_below, gap_above) < (step + 1)/2) {
+            // nothing left to take that is not next to a position taken
+            *next = target;
+            return 0;
+        }
+        *next = (gap_above >= gap_below) ? above : below;
+        adaptive_refine_step = max(step, adaptive_refine_step/2);
+    }
+    adaptive_refinements++;
+
+    return 1;
+}
+
 /* Function to process and execute user commands for camera and lens settings. 
 ** Note: does not include adjustments to the blob-finding parameters and image 
 ** processing; this is done directly in commands.c in client handler function.
-** Input: None.
+** Input: The focus position the user asked for (-1 to leave the focus where it
+** is).
 ** Output: None (void). Executes the commands and re-populates the camera params
 ** struct with the updated values.
 */
-int adjustCameraHardware() {
-    char focus_str_cmd[15]; 
+int adjustCameraHardware(int focus_target) {
+    char focus_str_cmd[LENS_COMMAND_SIZE];
     char aper_str_cmd[15]; 
-    double current_exposure;
+    double current_exposure, exposure;
+    struct camera_params params;
     int focus_shift;
     int ret = 1;
 
+    // the focus shift is relative to where the earlier moves leave the lens, 
+    // so let those finish (the lens thread makes the moves queued here)
+    waitForLens();
+    snapshotCameraParams(&params);
+
     // if user set focus infinity command to true (1), execute this command and 
     // none of the other focus commands that would contradict this one
-    if (all_camera_params.focus_inf == 1) {
-        if (runCommand("mi\r", file_descriptor, birger_output) == -1) {
+    if (params.focus_inf == 1) {
+        if (queueLensCommand("mi\r") < 1) {
             printf("Failed to set focus to infinity.\n");
             ret = -1;
         } else {
-            printf("Focus set to infinity.\n");
+            printf("Setting focus to infinity.\n");
         }
 
-        if (runCommand("fp\r", file_descriptor, birger_output) == -1) {
+        if (queueLensCommand("fp\r") < 1) {
             printf("Failed to print focus after setting to infinity.\n");
             ret = -1;
         } 
     } else {
-        // calculate shift needed to get from current focus to user position
-        focus_shift = all_camera_params.focus_position - 
-                      all_camera_params.prev_focus_pos;
+        // calculate shift needed to get from current focus (as the last
+        // move left it) to user position
+        focus_shift = (focus_target != -1) ?
+                      focus_target - params.focus_position : 0;
         if (verbose) {
             printf("Focus change to fulfill user cmd: %i\n", focus_shift);
         }
 
         if (focus_shift != 0) {
-            sprintf(focus_str_cmd, "mf %i\r", focus_shift);
+            snprintf(focus_str_cmd, sizeof(focus_str_cmd), "mf %i\r",
+                     focus_shift);
 
             // shift the focus 
-            if (runCommand(focus_str_cmd, file_descriptor, birger_output) 
-                == -1) {
+            if (queueLensCommand(focus_str_cmd) < 1) {
                 printf("Failed to move the focus to the desired position.\n");
                 ret = -1;
             } else if (verbose) {
-                printf("Focus moved to desired absolute position.\n");
+                printf("Focus moving to desired absolute position.\n");
             }
 
             // print focus position for confirmation
-            if (runCommand("fp\r", file_descriptor, birger_output) == -1) {
+            if (queueLensCommand("fp\r") < 1) {
                 printf("Failed to print the new focus position.\n");
                 ret = -1;
             }  
@@ -587,32 +882,33 @@ int adjustCameraHardware() {
     }
 
     // if the user wants to set the aperture to the maximum
-    if (all_camera_params.max_aperture == 1) {
+    if (params.max_aperture == 1) {
         // might as well change struct field here since we know what maximum 
         // aperture position is (don't have to get it with pa command)
+        pthread_mutex_lock(&camera_params_lock);
         all_camera_params.current_aperture = 28;
+        pthread_mutex_unlock(&camera_params_lock);
 
-        if (runCommand("mo\r", file_descriptor, birger_output) == -1) {
+        if (queueLensCommand("mo\r") < 1) {
             printf("Setting the aperture to maximum fails.\n");
             ret = -1;
         } else {
-            printf("Set aperture to maximum.\n");
+            printf("Setting aperture to maximum.\n");
         }
     } else {
-        if (all_camera_params.aperture_steps != 0) {
-            sprintf(aper_str_cmd, "mn%i\r", all_camera_params.aperture_steps);
+        if (params.aperture_steps != 0) {
+            sprintf(aper_str_cmd, "mn%i\r", params.aperture_steps);
 
             // perform the aperture command
-            if (runCommand(aper_str_cmd, file_descriptor, birger_output) 
-                == -1) {
+            if (queueLensCommand(aper_str_cmd) < 1) {
                 printf("Failed to adjust the aperture.\n");
                 ret = -1;
             } else {
-                printf("Adjusted the aperture successfully.\n");
+                printf("Adjusting the aperture.\n");
             }
 
             // print new aperture position
-            if (runCommand("pa\r", file_descriptor, birger_output) == -1) {
+            if (queueLensCommand("pa\r") < 1) {
                 printf("Failed to print the new aperture position.\n");
                 ret = -1;
             }
@@ -620,23 +916,29 @@ int adjustCameraHardware() {
             // now that command in aperture has been executed, set aperture 
             // steps field to 0 since it should not move again unless user sends
             // another command
-            all_camera_params.aperture_steps = 0;  
+            pthread_mutex_lock(&camera_params_lock);
+            all_camera_params.aperture_steps = 0;
+            pthread_mutex_unlock(&camera_params_lock);
         }
     }
 
-    if (all_camera_params.change_exposure_bool) {
-        // change boolean to 0 so exposure isn't adjusted again until user sends
-        //  another command
-        all_camera_params.change_exposure_bool = 0;
-
-        // run uEye function to update camera exposure
+    if (params.change_exposure_bool) {
+        // run uEye function to update camera exposure (which leaves the
+        // exposure it could set)
+        exposure = params.exposure_time;
         if (is_Exposure(camera_handle, IS_EXPOSURE_CMD_SET_EXPOSURE, 
-                        (void *) &all_camera_params.exposure_time, 
-                        sizeof(double)) != IS_SUCCESS) {
+                        (void *) &exposure, sizeof(double)) != IS_SUCCESS) {
             printf("Adjusting exposure to user command unsuccessful.\n");
             ret = -1;
         }
 
+        // change boolean to 0 so exposure isn't adjusted again until user sends
+        //  another command
+        pthread_mutex_lock(&camera_params_lock);
+        all_camera_params.change_exposure_bool = 0;
+        all_camera_params.exposure_time = exposure;
+        pthread_mutex_unlock(&camera_params_lock);
+
         // check with current_exposure that exposure has been adjusted to 
         // desired value
         if (is_Exposure(camera_handle, IS_EXPOSURE_CMD_GET_EXPOSURE, 
@@ -651,124 +953,473 @@ int adjustCameraHardware() {
     return ret;
 }
 
-/* Function to execute built-in Birger commands.
-** Input: The string identifier for the command, the file descriptor for lens
-** adapter, and a string to print the Birger output to for verification.
-** Output: Flag indicating successful execution of the command.
+/* Helper function to look up how a Birger command replies.
+** Input: The command.
+** Output: The command's entry in lens_commands, or NULL for one not listed.
 */
-int runCommand(const char * command, int file, char * return_str) {
-    fd_set input, output;
-    int status;
+struct lens_command * lookupLensCommand(const char * command) {
+    for (int i = 0; i < NUM_LENS_COMMANDS; i++) {
+        if (strncmp(command, lens_commands[i].name, 2) == 0) {
+            return &lens_commands[i];
+        }
+    }
 
-    FD_ZERO(&output);
-    FD_SET(file, &output);
+    return NULL;
+}
 
-    if (!FD_ISSET(file, &output)) {
-        fprintf(stderr, "File descriptor %d is not present in set "
-                        "output: %s.\n", file, strerror(errno));
-        return -1;
-    }
+/* Helper function to get the milliseconds left before a deadline.
+** Input: The deadline.
+** Output: Milliseconds until the deadline (negative once it has passed).
+*/
+int msecUntil(struct timespec * deadline) {
+    struct timespec now;
 
-    if (tcflush(file, TCIOFLUSH) < 0) {
-        fprintf(stderr, "Error flushing non-transmitted output data, non-read "
-                        "input data, or both: %s.\n", strerror(errno));
-        return -1;
-    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int) msecBetween(&now, deadline);
+}
 
-    status = write(file, command, strlen(command));
-    if (status < 0) {
-        fprintf(stderr, "Unable to write cmd %s to file descriptor %d: %s.\n", 
-                command, file, strerror(errno));
-        return -1;
+/* Function to write a Birger command to the lens adapter.
+** Input: The command and the file descriptor for the lens adapter.
+** Output: Flag indicating the whole command was written or not.
+*/
+int sendCommand(const char * command, int file) {
+    size_t sent = 0, len = strlen(command);
+
+    while (sent < len) {
+        ssize_t status = write(file, command + sent, len - sent);
+        if (status < 0 && errno != EINTR) {
+            fprintf(stderr, "Unable to write cmd %s to file descriptor %d: "
+                            "%s.\n", command, file, strerror(errno));
+            return -1;
+        }
+        if (status > 0) {
+            sent += status;
+        }
     }
 
-    usleep(1000000);
-
-    FD_ZERO(&input);
-    FD_SET(file, &input);
+    return 1;
+}
 
-    if (!FD_ISSET(file, &input)) {
-        fprintf(stderr, "File descriptor %d is not present in set input: %s.\n",
-                file, strerror(errno));
-        return -1;
+/* Function to read the reply to a Birger command, returning as soon as it is
+** complete: after the OK for commands that only acknowledge, the line after it
+** for queries, and the DONE line for moves (which come once the motor stops).
+** Bytes past the end of the reply are kept for the next command's reply.
+** Input: The command, the file descriptor for the lens adapter, and where to
+** store the reply (LENS_REPLY_SIZE bytes).
+** Output: Flag indicating a complete reply without an error came back in time.
+*/
+int readReply(const char * command, int file, char * reply) {
+    struct lens_command * info = lookupLensCommand(command);
+    int kind = (info != NULL) ? info->reply : LENS_REPLY_OK;
+    int timeout = (info != NULL) ? info->timeout : LENS_QUERY_TIMEOUT;
+    int got_ok = 0, reply_len = 0;
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout/1000;
+    deadline.tv_nsec += (timeout % 1000)*1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
     }
+    reply[0] = '\0';
+
+    for (;;) {
+        char * end;
+
+        // go through the complete lines received so far
+        while ((end = memchr(lens_input, '\n', lens_input_len)) != NULL) {
+            char line[LENS_REPLY_SIZE + 1];
+            int line_len = end - lens_input + 1;
+
+            memcpy(line, lens_input, line_len);
+            line[line_len] = '\0';
+            lens_input_len -= line_len;
+            memmove(lens_input, lens_input + line_len, lens_input_len);
+            if (reply_len + line_len < LENS_REPLY_SIZE) {
+                strcpy(reply + reply_len, line);
+                reply_len += line_len;
+            }
 
-    buffer = malloc(100);
-    if (buffer == NULL) {
-        fprintf(stderr, "Error allocating buffer in runCommand(): %s.\n", 
-                strerror(errno));
-        return -1;
-    }
+            if (strncmp(line, "ERR", 3) == 0) {
+                printf("Read returned error %s.\n", reply);
+                return -1;
+            } else if (!got_ok) {
+                // the adapter echoes the command before acknowledging it
+                got_ok = (strncmp(line, "OK", 2) == 0);
+            } else if (kind == LENS_REPLY_DONE &&
+                       strncmp(line, "DONE", 4) == 0) {
+                return 1;
+            } else if (kind == LENS_REPLY_LINE && line[0] != '\n' &&
+                       strncmp(line, "DONE", 4) != 0) {
+                // (a DONE here is from an earlier move, not the answer)
+                return 1;
+            }
+        }
 
-    buffer[0] = '\0';
-    status = read(file, buffer, 99);
-    if (status <= 0) {
-        fprintf(stderr, "Error reading from file descriptor %d: %s.\n", file, 
-                strerror(errno));
-        return -1;
-    }
+        // a command with nothing after the OK is done once the adapter has
+        // been quiet for a moment
+        int wait = msecUntil(&deadline);
+        if (got_ok && kind == LENS_REPLY_OK && wait > LENS_QUIET_TIME) {
+            wait = LENS_QUIET_TIME;
+        }
 
-    buffer[99] = '\0';
-    buffer[status] = '\0';	
-    if (strstr(buffer, "ERR") != NULL) {
-        printf("Read returned error %s.\n", buffer);
-        return -1;
-    }
-    
-    // copy buffer over to return_str for printing to terminal
-    return_str = malloc(100);
-    if (return_str == NULL) {
-        fprintf(stderr, "Error allocating return string for printing to "
-                        "terminal in runCommand(): %s.\n", strerror(errno));
-        return -1;
+        struct pollfd input = { .fd = file, .events = POLLIN };
+        int ready = (wait > 0) ? poll(&input, 1, wait) : 0;
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        } else if (ready < 0) {
+            fprintf(stderr, "Error waiting on file descriptor %d: %s.\n",
+                    file, strerror(errno));
+            return -1;
+        } else if (ready == 0) {
+            if (got_ok && kind == LENS_REPLY_OK) {
+                return 1;
+            }
+            printf("No complete reply to %.2s from the lens within %d msec "
+                   "(got \"%s\").\n", command, timeout, reply);
+            return -1;
+        }
+
+        if (lens_input_len == LENS_REPLY_SIZE) {
+            // a line longer than any reply; drop it
+            lens_input_len = 0;
+        }
+        ssize_t status = read(file, lens_input + lens_input_len,
+                              LENS_REPLY_SIZE - lens_input_len);
+        if (status < 0 && errno != EINTR && errno != EAGAIN) {
+            fprintf(stderr, "Error reading from file descriptor %d: %s.\n",
+                    file, strerror(errno));
+            return -1;
+        } else if (status > 0) {
+            lens_input_len += status;
+        }
     }
-    return_str[99] = '\0';
-    strcpy(return_str, buffer);
+}
+
+/* Function to update the camera params struct from the reply to a command.
+** Input: The command and its reply.
+** Output: None (void).
+*/
+void useReply(const char * command, char * return_str) {
+    struct camera_params params;
 
     if (strcmp(command, "fp\r") == 0) {
         printf("%s\n", return_str);
 
-        // parse the return_str for new focus range numbers
-        sscanf(return_str, "fp\nOK\nfmin:%d  fmax:%d  current:%i %*s", 
-               &all_camera_params.min_focus_pos, 
-               &all_camera_params.max_focus_pos, 
-               &all_camera_params.focus_position);
+        // parse the return_str for new focus range numbers (the lens thread
+        // is the only one that writes them, so the copy is up to date)
+        snapshotCameraParams(&params);
+        sscanf(return_str, "fp\nOK\nfmin:%d  fmax:%d  current:%i %*s",
+               &params.min_focus_pos, &params.max_focus_pos,
+               &params.focus_position);
         if (verbose) {
-            printf("in camera params, min focus pos is: %i\n", 
-                   all_camera_params.min_focus_pos);
-            printf("in camera params, max focus pos is: %i\n", 
-                   all_camera_params.max_focus_pos);
-            printf("in camera params, curr focus pos is: %i\n", 
-                   all_camera_params.focus_position);
-            printf("in camera params, prev focus pos was: %i\n", 
-                   all_camera_params.prev_focus_pos);
-        }
-
-        // update previous focus position to current one 
-        all_camera_params.prev_focus_pos = all_camera_params.focus_position;
+            printf("in camera params, min focus pos is: %i\n",
+                   params.min_focus_pos);
+            printf("in camera params, max focus pos is: %i\n",
+                   params.max_focus_pos);
+            printf("in camera params, curr focus pos is: %i\n",
+                   params.focus_position);
+            printf("in camera params, prev focus pos was: %i\n",
+                   params.prev_focus_pos);
+        }
+
+        // update previous focus position to current one
+        pthread_mutex_lock(&camera_params_lock);
+        all_camera_params.min_focus_pos = params.min_focus_pos;
+        all_camera_params.max_focus_pos = params.max_focus_pos;
+        all_camera_params.focus_position = params.focus_position;
+        all_camera_params.prev_focus_pos = params.focus_position;
+        pthread_mutex_unlock(&camera_params_lock);
         if (verbose) {
-            printf("in camera params, prev focus pos is now: %i\n", 
-                   all_camera_params.prev_focus_pos);
+            printf("in camera params, prev focus pos is now: %i\n",
+                   params.focus_position);
         }
+
+        lens_state.min_focus_pos = params.min_focus_pos;
+        lens_state.max_focus_pos = params.max_focus_pos;
+        lens_state.focus_position = params.focus_position;
+        saveLensState();
     } else if (strcmp(command, "pa\r") == 0) {
         printf("%s\n", return_str);
 
         // store current aperture from return_str in all_camera_params struct
+        snapshotCameraParams(&params);
         if (strncmp(return_str, "pa\nOK\nDONE", 10) == 0) {
-            sscanf(return_str, "pa\nOK\nDONE%*i,f%d", 
-                   &all_camera_params.current_aperture);
+            sscanf(return_str, "pa\nOK\nDONE%*i,f%d",
+                   &params.current_aperture);
         } else if (strncmp(return_str, "pa\nOK\n", 6) == 0) {
-            sscanf(return_str, "pa\nOK\n%*i,f%d %*s", 
-                   &all_camera_params.current_aperture);
+            sscanf(return_str, "pa\nOK\n%*i,f%d %*s",
+                   &params.current_aperture);
         }
+        pthread_mutex_lock(&camera_params_lock);
+        all_camera_params.current_aperture = params.current_aperture;
+        pthread_mutex_unlock(&camera_params_lock);
 
-        printf("in camera params, curr aper is: %i\n", 
-               all_camera_params.current_aperture);
+        printf("in camera params, curr aper is: %i\n",
+               params.current_aperture);
+
+        lens_state.aperture = params.current_aperture;
+        if (aperture_opened) {
+            lens_state.open_aperture = params.current_aperture;
+        }
+        saveLensState();
     } else if (strncmp(command, "mf", 2) == 0) {
         printf("%s\n", return_str);
+    } else if (strncmp(command, "in", 2) == 0 ||
+               strncmp(command, "mo", 2) == 0) {
+        aperture_opened = 1;
+    } else if (strncmp(command, "ma", 2) == 0 ||
+               strncmp(command, "mc", 2) == 0 ||
+               strncmp(command, "mn", 2) == 0) {
+        aperture_opened = 0;
     }
+}
+
+/* Function to read the lens state a previous run left.
+** Input: Where to store it.
+** Output: A flag indicating a whole state was read or not.
+*/
+int loadLensState(struct lens_state * state) {
+    char comment[LENS_REPLY_SIZE];
+    FILE * fptr;
+    int got;
+
+    if ((fptr = fopen(LENS_STATE_FILE, "r")) == NULL) {
+        return -1;
+    }
+    if (fgets(comment, sizeof(comment), fptr) == NULL) {
+        fclose(fptr);
+        return -1;
+    }
+    got = fscanf(fptr, "focus %d %d %d\ndefault_focus %d\naperture %d %d\n",
+                 &state->min_focus_pos, &state->max_focus_pos,
+                 &state->focus_position, &state->default_focus,
+                 &state->aperture, &state->open_aperture);
+    fclose(fptr);
+
+    return (got == 6) ? 1 : -1;
+}
+
+/* Function to keep the lens state for the next run (replacing the file whole,
+** so a crash never leaves half of one).
+** Input: None.
+** Output: None (void).
+*/
+void saveLensState() {
+    char tmp[sizeof(LENS_STATE_FILE) + 4];
+    FILE * fptr;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", LENS_STATE_FILE);
+    if ((fptr = fopen(tmp, "w")) == NULL) {
+        fprintf(stderr, "Could not open %s: %s.\n", tmp, strerror(errno));
+        return;
+    }
+    fprintf(fptr, "# focus range, focus and default focus [counts]; aperture "
+                  "and fully open\n");
+    fprintf(fptr, "focus %d %d %d\ndefault_focus %d\naperture %d %d\n",
+            lens_state.min_focus_pos, lens_state.max_focus_pos,
+            lens_state.focus_position, lens_state.default_focus,
+            lens_state.aperture, lens_state.open_aperture);
+    if (fclose(fptr) != 0 || rename(tmp, LENS_STATE_FILE) != 0) {
+        fprintf(stderr, "Could not save the lens state to %s: %s.\n",
+                LENS_STATE_FILE, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+/* Function to copy the camera params struct as it is now, for a thread that
+** does not own it.
+** Input: Where to store the copy.
+** Output: None (void).
+*/
+void snapshotCameraParams(struct camera_params * params) {
+    pthread_mutex_lock(&camera_params_lock);
+    *params = all_camera_params;
+    pthread_mutex_unlock(&camera_params_lock);
+}
+
+/* Helper function to throw away anything the adapter sent that no command is
+** waiting for.
+** Input: The file descriptor for the lens adapter.
+** Output: Flag indicating successful flush.
+*/
+int flushLens(int file) {
+    lens_input_len = 0;
+    if (tcflush(file, TCIOFLUSH) < 0) {
+        fprintf(stderr, "Error flushing non-transmitted output data, non-read "
+                        "input data, or both: %s.\n", strerror(errno));
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Function to execute built-in Birger commands.
+** Input: The string identifier for the command, the file descriptor for lens
+** adapter, and a string (LENS_REPLY_SIZE bytes) to print the Birger output to
+** for verification.
+** Output: Flag indicating successful execution of the command.
+*/
+int runCommand(const char * command, int file, char * return_str) {
+    if (flushLens(file) < 1 || sendCommand(command, file) < 1 ||
+        readReply(command, file, return_str) < 1) {
+        return -1;
+    }
+    useReply(command, return_str);
 
-    free(buffer);
-    free(return_str);
     return 1;
-}
\ No newline at end of file
+}
+
+/* Function to execute queries one after another without waiting for each
+** reply before sending the next (the adapter answers them in order).
+** Input: The queries, how many there are, and the file descriptor for the lens
+** adapter.
+** Output: Flag indicating every query was answered without an error.
+*/
+int runQueries(char commands[][LENS_COMMAND_SIZE], int count, int file) {
+    if (flushLens(file) < 1) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (sendCommand(commands[i], file) < 1) {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (readReply(commands[i], file, birger_output) < 1) {
+            return -1;
+        }
+        useReply(commands[i], birger_output);
+    }
+
+    return 1;
+}
+
+/* Helper function to tell whether a command only reads from the lens (so it
+** can be sent right behind another one).
+** Input: The command.
+** Output: 1 if it is a query, 0 otherwise.
+*/
+int isLensQuery(const char * command) {
+    struct lens_command * info = lookupLensCommand(command);
+    return info != NULL && info->reply == LENS_REPLY_LINE;
+}
+
+/* Function for the lens thread: runs the queued Birger commands in order, so
+** no other thread waits on the serial port. A move is finished before the next
+** command is sent; queries in a row are sent together.
+** Input: None.
+** Output: None (void).
+*/
+void * driveLens() {
+    char batch[LENS_PIPELINE_DEPTH][LENS_COMMAND_SIZE];
+    int count, ret;
+
+    for (;;) {
+        pthread_mutex_lock(&lens_lock);
+        while (lens_count == 0 && !lens_closed) {
+            pthread_cond_wait(&lens_ready, &lens_lock);
+        }
+        if (lens_closed) {
+            pthread_mutex_unlock(&lens_lock);
+            break;
+        }
+
+        count = 0;
+        do {
+            strcpy(batch[count++], lens_queue[lens_head]);
+            lens_head = (lens_head + 1) % LENS_QUEUE_SIZE;
+            lens_count--;
+        } while (count < LENS_PIPELINE_DEPTH && lens_count > 0 &&
+                 isLensQuery(batch[0]) &&
+                 isLensQuery(lens_queue[lens_head]));
+        lens_busy = 1;
+        pthread_cond_broadcast(&lens_idle);
+        pthread_mutex_unlock(&lens_lock);
+
+        if (count == 1) {
+            ret = runCommand(batch[0], file_descriptor, birger_output);
+        } else {
+            ret = runQueries(batch, count, file_descriptor);
+        }
+
+        pthread_mutex_lock(&lens_lock);
+        lens_busy = 0;
+        if (ret < 1) {
+            lens_failed = 1;
+        }
+        pthread_cond_broadcast(&lens_idle);
+        pthread_mutex_unlock(&lens_lock);
+    }
+
+    return NULL;
+}
+
+/* Function to hand a Birger command to the lens thread, blocking only while
+** the queue is full.
+** Input: The command (e.g. "mf 20\r").
+** Output: A flag indicating the command was queued or not.
+*/
+int queueLensCommand(const char * command) {
+    if (strlen(command) >= LENS_COMMAND_SIZE) {
+        printf("Lens command %s is too long.\n", command);
+        return -1;
+    }
+
+    pthread_mutex_lock(&lens_lock);
+    while (lens_count == LENS_QUEUE_SIZE && lens_running && !lens_closed) {
+        pthread_cond_wait(&lens_idle, &lens_lock);
+    }
+    if (!lens_running || lens_closed) {
+        pthread_mutex_unlock(&lens_lock);
+        printf("The lens adapter is not running, so not sending %.2s.\n",
+               command);
+        return -1;
+    }
+
+    strcpy(lens_queue[(lens_head + lens_count) % LENS_QUEUE_SIZE], command);
+    lens_count++;
+    pthread_cond_signal(&lens_ready);
+    pthread_mutex_unlock(&lens_lock);
+
+    return 1;
+}
+
+/* Function to block until the lens thread has run every queued command.
+** Input: None.
+** Output: A flag indicating every command since the last wait succeeded.
+*/
+int waitForLens() {
+    int ret;
+
+    pthread_mutex_lock(&lens_lock);
+    while ((lens_count > 0 || lens_busy) && !lens_closed) {
+        pthread_cond_wait(&lens_idle, &lens_lock);
+    }
+    ret = (lens_failed) ? -1 : 1;
+    lens_failed = 0;
+    pthread_mutex_unlock(&lens_lock);
+
+    return ret;
+}
+
+/* Function to stop the lens thread (after the command it is running, if any)
+** and close the lens adapter.
+** Input: None.
+** Output: None (void).
+*/
+void closeLensAdapter() {
+    pthread_mutex_lock(&lens_lock);
+    lens_closed = 1;
+    pthread_cond_broadcast(&lens_ready);
+    pthread_cond_broadcast(&lens_idle);
+    pthread_mutex_unlock(&lens_lock);
+
+    if (lens_running) {
+        pthread_join(lens_thread_id, NULL);
+        lens_running = 0;
+        close(file_descriptor);
+    }
+}
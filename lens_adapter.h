@@ -1,16 +1,70 @@
 #ifndef LENS_ADAPTER_H
 #define LENS_ADAPTER_H
 
-int initLensAdapter(char * path);                                
-int beginAutoFocus();                                               
-int defaultFocusPosition();                                         
-int shiftFocus(char * cmd);                                         
-int calculateOptimalFocus(int num_focus, char * auto_focus_file);                
-int adjustCameraHardware();                            
-int runCommand(const char * command, int file, char * return_str);  
+#include <pthread.h>
+
+// how a Birger command's reply ends
+#define LENS_REPLY_OK       0   // at the OK (then a quiet LENS_QUIET_TIME)
+#define LENS_REPLY_LINE     1   // at the line after the OK (queries)
+#define LENS_REPLY_DONE     2   // at the DONE line once the motor stops (moves)
+// longest command and reply, and most commands waiting for the lens thread
+#define LENS_COMMAND_SIZE   16
+#define LENS_REPLY_SIZE     256
+#define LENS_QUEUE_SIZE     16
+// most queries in a row sent before their replies are read
+#define LENS_PIPELINE_DEPTH 4
+// longest waits for a reply to finish [msec]
+#define LENS_QUERY_TIMEOUT  1000
+#define LENS_MOVE_TIMEOUT   5000
+#define LENS_LEARN_TIMEOUT  20000
+#define LENS_QUIET_TIME     50
+// how auto-focusing picks focus positions (camera_params.focus_search)
+#define FOCUS_SWEEP         1   // every focus_step from the start to the end
+#define FOCUS_ADAPTIVE      2   // a coarse sweep, then positions around the
+                                // peak of the fitted curve until its error
+                                // is under focus_step
+// focus positions of the coarse sweep, and most positions after it
+#define AF_COARSE_POSITIONS 7
+#define AF_MAX_REFINE       6
+#define MAX_FOCUS_POSITIONS (AF_COARSE_POSITIONS + AF_MAX_REFINE)
+// what auto-focusing rates each focus position by (camera_params.focus_metric)
+#define FOCUS_METRIC_PEAK   1   // the brightest blob of the best photo
+#define FOCUS_METRIC_HFD    2   // HFD_SCORE/the median half-flux diameter of
+                                // the brightest blobs, averaged over the photos
+#define HFD_SCORE           10000
+// where the last lens state seen is kept, so that a restart can skip the moves
+// that would leave it as it is (delete it to learn the focus range again)
+#define LENS_STATE_FILE     "/home/blast/Desktop/blastcam/lens_state.txt"
+
+/* The lens as it was last seen (focus positions in counts, apertures as the
+** f-number pa prints) */
+struct lens_state {
+    int min_focus_pos, max_focus_pos; // learned focus range
+    int focus_position;
+    int default_focus;          // 80 counts below infinity
+    int aperture;
+    int open_aperture;          // fully open (0 if unknown)
+};
+
+int initLensAdapter(char * path);
+int beginAutoFocus();
+int defaultFocusPosition();
+int shiftFocus(char * cmd);
+int calculateOptimalFocus(int num_focus, char * auto_focus_file);
+void resetAdaptiveFocus();
+int nextAdaptiveFocus(int focus, int flux, int * next);
+int adjustCameraHardware(int focus_target);
+int runCommand(const char * command, int file, char * return_str);
+void * driveLens();
+int queueLensCommand(const char * command);
+int waitForLens();
+void closeLensAdapter();
+int loadLensState(struct lens_state * state);
+void saveLensState();
 
 #pragma pack(push, 1)
-/* Camera and lens parameter struct, including auto-focusing */
+/* Camera and lens parameter struct, including auto-focusing (its size is part
+** of the telemetry layout) */
 struct camera_params {
     // focus and aperture fields
     int prev_focus_pos;
@@ -32,10 +86,17 @@ struct camera_params {
     int end_focus_pos;          // where to end the auto-focusing process
     int focus_step;             // granularity of auto-focusing checker
     int photos_per_focus;       // number of photos per auto-focusing position
-    int flux;                   // brightness of most recent maximum flux
+    int flux;                   // score of the last focus position (see
+                                // focus_metric)
+    int focus_search;           // FOCUS_SWEEP or FOCUS_ADAPTIVE
+    int focus_metric;           // FOCUS_METRIC_PEAK or FOCUS_METRIC_HFD
 };
 #pragma pack(pop)
 
 extern struct camera_params all_camera_params;
+extern pthread_mutex_t camera_params_lock;
+extern struct camera_params auto_focus_params;
+
+void snapshotCameraParams(struct camera_params * params);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "live.h"
+
+// the shared memory this process publishes frames in (NULL if it does not),
+// its size, and the number of the last frame published
+struct live_header * live_out = NULL;
+size_t live_out_size = 0;
+uint64_t live_frames = 0;
+char live_out_name[64];
+// the shared memory object a reader has mapped (-1 if none)
+int live_in_fd = -1;
+
+/* Helper function to find a slot of the shared memory.
+** Input: The shared memory, and the slot.
+** Output: The slot.
+*/
+static struct live_slot * liveSlot(const struct live_header * live,
+                                   uint64_t index) {
+    return (struct live_slot *) ((char *) live + live->slot_offset +
+                                 index*live->slot_size);
+}
+
+/* Function to make the shared memory the frames are published in (replacing
+** any a previous run left behind, which its readers notice).
+** Input: The camera handle, and the largest image that will be published.
+** Output: A flag indicating the shared memory was made successfully or not.
+*/
+int openLive(int camera_handle, int width, int height) {
+    uint64_t slot_offset = (sizeof(struct live_header) + 63) & ~63ULL;
+    uint64_t slot_size = (sizeof(struct live_slot) + (uint64_t) width*height +
+                          63) & ~63ULL;
+    size_t size = slot_offset + LIVE_SLOTS*slot_size;
+    int fd;
+
+    snprintf(live_out_name, sizeof(live_out_name), LIVE_NAME, camera_handle);
+    shm_unlink(live_out_name);
+    fd = shm_open(live_out_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error creating shared memory %s: %s.\n",
+                live_out_name, strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, size) != 0) {
+        fprintf(stderr, "Error sizing shared memory %s: %s.\n", live_out_name,
+                strerror(errno));
+        close(fd);
+        shm_unlink(live_out_name);
+        return -1;
+    }
+
+    live_out = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (live_out == MAP_FAILED) {
+        fprintf(stderr, "Error mapping shared memory %s: %s.\n", live_out_name,
+                strerror(errno));
+        live_out = NULL;
+        shm_unlink(live_out_name);
+        return -1;
+    }
+    live_out_size = size;
+    live_frames = 0;
+
+    // (the new object is zeroed, so every slot's sequence number is even and
+    // no frame is the latest yet)
+    memcpy(live_out->magic, LIVE_MAGIC, sizeof(live_out->magic));
+    live_out->version = LIVE_VERSION;
+    live_out->num_slots = LIVE_SLOTS;
+    live_out->slot_offset = slot_offset;
+    live_out->slot_size = slot_size;
+    live_out->image_size = (uint32_t) width*height;
+    live_out->max_blobs = LIVE_MAX_BLOBS;
+    live_out->camera_handle = camera_handle;
+    live_out->pid = getpid();
+    atomic_store_explicit(&live_out->latest, 0, memory_order_release);
+
+    return 1;
+}
+
+/* Function to publish a frame: its filtered image, blobs and solution go in
+** the next slot, which then becomes the latest. Only one thread may publish.
+** Input: The filtered image (unpadded), its size, binning factor and AOI
+** corner, whether it was taken for auto-focusing, its blobs (brightest first)
+** and the number of them, its solution, and the time it was taken at.
+** Output: None (void).
+*/
+void publishLive(const char * image, int width, int height, int factor,
+                 int x, int y, int auto_focus, double * mags, double * star_x,
+                 double * star_y, int blob_count,
+                 const struct live_solution * solution, time_t seconds) {
+    uint64_t frame = live_frames + 1;
+    struct live_slot * slot;
+
+    if (live_out == NULL ||
+        (uint64_t) width*height > live_out->image_size) {
+        return;
+    }
+    slot = liveSlot(live_out, frame % live_out->num_slots);
+
+    // readers that catch the slot odd (or see it change) skip it
+    atomic_store_explicit(&slot->seq, 2*frame - 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    if (blob_count > LIVE_MAX_BLOBS) {
+        blob_count = LIVE_MAX_BLOBS;
+    }
+    slot->frame = frame;
+    slot->seconds = seconds;
+    slot->auto_focus = auto_focus;
+    slot->width = width;
+    slot->height = height;
+    slot->factor = factor;
+    slot->x = x;
+    slot->y = y;
+    slot->blob_count = blob_count;
+    slot->solution = *solution;
+    for (int b = 0; b < blob_count; b++) {
+        slot->blobs[b].mag = mags[b];
+        slot->blobs[b].x = star_x[b];
+        slot->blobs[b].y = star_y[b];
+    }
+    memcpy((unsigned char *) (slot + 1), image, (size_t) width*height);
+
+    atomic_store_explicit(&slot->seq, 2*frame, memory_order_release);
+    atomic_store_explicit(&live_out->latest, frame, memory_order_release);
+    live_frames = frame;
+}
+
+/* Function to stop publishing frames, removing the shared memory (readers
+** that still have it mapped keep the frames in it).
+** Input: None.
+** Output: None (void).
+*/
+void closeLive() {
+    if (live_out == NULL) {
+        return;
+    }
+
+    munmap(live_out, live_out_size);
+    shm_unlink(live_out_name);
+    live_out = NULL;
+    live_out_size = 0;
+}
+
+/* Function for a reader to map the shared memory a camera publishes its
+** frames in, read-only.
+** Input: The camera handle, and where to store the size of the mapping.
+** Output: The shared memory, or NULL if the camera is not publishing (or its
+** layout is not this version's).
+*/
+const struct live_header * mapLive(int camera_handle, size_t * size) {
+    const struct live_header * live;
+    struct stat st;
+    char name[64];
+    int fd;
+
+    snprintf(name, sizeof(name), LIVE_NAME, camera_handle);
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(*live)) {
+        close(fd);
+        return NULL;
+    }
+
+    live = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (live == MAP_FAILED) {
+        fprintf(stderr, "Error mapping shared memory %s: %s.\n", name,
+                strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    if (memcmp(live->magic, LIVE_MAGIC, sizeof(live->magic)) != 0 ||
+        live->version != LIVE_VERSION || live->num_slots == 0 ||
+        live->slot_offset + live->num_slots*live->slot_size >
+        (uint64_t) st.st_size) {
+        munmap((void *) live, st.st_size);
+        close(fd);
+        return NULL;
+    }
+
+    // kept open to tell when the camera stops publishing in it
+    live_in_fd = fd;
+    *size = st.st_size;
+
+    return live;
+}
+
+/* Function to tell if the shared memory a reader has mapped was removed (the
+** camera stopped or restarted), so it should be mapped again.
+** Input: None.
+** Output: If it was (or not).
+*/
+int liveStale() {
+    struct stat st;
+
+    return live_in_fd < 0 || fstat(live_in_fd, &st) != 0 || st.st_nlink == 0;
+}
+
+/* Function for a reader to unmap the shared memory.
+** Input: The shared memory, and the size of the mapping.
+** Output: None (void).
+*/
+void unmapLive(const struct live_header * live, size_t size) {
+    munmap((void *) live, size);
+    if (live_in_fd >= 0) {
+        close(live_in_fd);
+        live_in_fd = -1;
+    }
+}
+
+/* Function for a reader to find the latest frame, to read in place. Once read,
+** liveIntact() tells if the writer left the slot alone meanwhile.
+** Input: The shared memory, and where to store the number of the frame.
+** Output: Its slot, or NULL if there is no frame yet (or it is being written
+** over already).
+*/
+const struct live_slot * latestLive(const struct live_header * live,
+                                    uint64_t * frame) {
+    uint64_t latest = atomic_load_explicit(
+        &((struct live_header *) live)->latest, memory_order_acquire);
+    struct live_slot * slot;
+
+    if (latest == 0) {
+        return NULL;
+    }
+    slot = liveSlot(live, latest % live->num_slots);
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != 2*latest) {
+        return NULL;
+    }
+    *frame = latest;
+
+    return slot;
+}
+
+/* Function to tell if a frame a reader has read from its slot was left
+** alone by the writer while it read it.
+** Input: The slot, and the number of the frame.
+** Output: If it was (or not).
+*/
+int liveIntact(const struct live_slot * slot, uint64_t frame) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&((struct live_slot *) slot)->seq,
+                                memory_order_relaxed) == 2*frame;
+}
@@ -0,0 +1,93 @@
+#ifndef LIVE_H
+#define LIVE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/types.h>
+
+// POSIX shared-memory object the latest frames are published in (one per
+// camera, by its handle)
+#define LIVE_NAME       "/blastcam_live_%d"
+// starts the shared memory, and the version of its layout
+#define LIVE_MAGIC      "SCLIVE01"
+#define LIVE_VERSION    1
+// frames kept at once, so a reader has a few frames' time to read one before
+// it is written over
+#define LIVE_SLOTS      4
+// blobs kept of each frame (as many as findBlobs() finds, MAX_BLOBS)
+#define LIVE_MAX_BLOBS  2000
+
+/* Start of the shared memory, followed (at slot_offset) by num_slots slots of
+** slot_size bytes each. Frame n (counting from 1) is in slot n % num_slots. */
+struct live_header {
+    char magic[8];              // LIVE_MAGIC
+    uint32_t version;           // LIVE_VERSION
+    uint32_t num_slots;
+    uint64_t slot_offset;       // bytes from the start to the first slot
+    uint64_t slot_size;         // bytes from one slot to the next
+    uint32_t image_size;        // bytes of image each slot has space for
+    uint32_t max_blobs;         // LIVE_MAX_BLOBS
+    int32_t camera_handle;
+    int32_t pid;                // of the camera process
+    _Atomic uint64_t latest;    // number of the newest whole frame (0 if none)
+};
+
+/* The solution of a frame [deg], except ps [arcsec/px] (zero if unsolved) */
+struct live_solution {
+    int32_t solved;             // (bool) solved or propagated
+    int32_t source;             // SOLUTION_*
+    int32_t matches;            // blobs matched with the previous image, if
+                                // propagated
+    int32_t frames_since_solve; // images since Astrometry last solved one
+    double rms;                 // residual of the matched blobs [px]
+    double ra;                  // observed
+    double dec;                 // observed
+    double fr;
+    double ps;
+    double ir;
+    double alt;
+    double az;
+};
+
+/* One blob of a frame: its magnitude and where it is [px] (y from the
+** bottom, as findBlobs() leaves them) */
+struct live_blob {
+    double mag;
+    double x, y;
+};
+
+/* One frame, followed by image_size bytes of space for its filtered image
+** (width by height, rows from the top, unpadded). The writer makes seq odd
+** while it writes the slot and 2n once frame n is all in, so a reader that
+** sees the same even seq before and after reading has read one whole frame. */
+struct live_slot {
+    _Atomic uint64_t seq;
+    uint64_t frame;             // number of the frame (from 1)
+    int64_t seconds;            // C time the exposure was started at
+    int32_t auto_focus;         // (bool) image was taken for auto-focusing
+    int32_t width, height;      // of the image [px]
+    int32_t factor;             // binning or subsampling factor each way
+    int32_t x, y;               // top left corner of the AOI [px]
+    int32_t blob_count;
+    struct live_solution solution;
+    struct live_blob blobs[LIVE_MAX_BLOBS];
+};
+
+// the image of a slot
+#define LIVE_IMAGE(slot) ((const unsigned char *) ((slot) + 1))
+
+int openLive(int camera_handle, int width, int height);
+void publishLive(const char * image, int width, int height, int factor,
+                 int x, int y, int auto_focus, double * mags, double * star_x,
+                 double * star_y, int blob_count,
+                 const struct live_solution * solution, time_t seconds);
+void closeLive();
+const struct live_header * mapLive(int camera_handle, size_t * size);
+int liveStale();
+void unmapLive(const struct live_header * live, size_t size);
+const struct live_slot * latestLive(const struct live_header * live,
+                                    uint64_t * frame);
+int liveIntact(const struct live_slot * slot, uint64_t frame);
+
+#endif
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "live.h"
+
+#define KST_DIR   "/home/blast/Desktop/blastcam"
+// what the Kst session (live_image_with_blobs.kst) reads, in KST_DIR
+#define KST_TABLE "makeTable.txt"
+#define KST_IMAGE "BMPs/latest_saved_image.bmp"
+
+#pragma pack(push, 1)
+/* Start of an 8-bit BMP, followed by its 256-entry gray palette and its rows
+** (bottom row first, each padded to 4 bytes) */
+struct bmp_header {
+    char magic[2];              // "BM"
+    uint32_t file_size;
+    uint32_t reserved;
+    uint32_t data_offset;
+    // BITMAPINFOHEADER
+    uint32_t info_size;
+    int32_t width, height;
+    uint16_t planes;
+    uint16_t bits;
+    uint32_t compression;
+    uint32_t image_size;
+    int32_t x_ppm, y_ppm;
+    uint32_t colors, important_colors;
+};
+#pragma pack(pop)
+
+// what to write, and how often to look for a new frame [sec]
+char * kst_dir = KST_DIR;
+int write_image = 1;
+int once = 0;
+double interval = 1.0;
+// (bool) asked to stop (by a signal)
+volatile sig_atomic_t stopping = 0;
+
+/* Helper function to display the usage of the adapter.
+** Input: None.
+** Output: None (void).
+*/
+void displayUsage() {
+    printf("\nNAME:\n\tlivekst - write the Star Camera's live frames for Kst."
+           "\n\nUSAGE:\n\t./livekst [--camera N] [--dir DIR] [--interval SEC] "
+           "[--no-image]\n\t          [--once]\n\nDESCRIPTION:\n\tReads the "
+           "latest frame the camera published in shared memory and\n\twrites "
+           "its blob table (" KST_TABLE ") and filtered image\n\t(" KST_IMAGE
+           ") for Kst, replacing each file whole.\n\nOPTIONS:\n\t--camera N"
+           "\n\t\tCamera handle the camera was started with (default 1).\n\n"
+           "\t--dir DIR\n\t\tWhere to write the files (default " KST_DIR ")."
+           "\n\n\t--interval SEC\n\t\tHow often to look for a new frame "
+           "(default 1).\n\n\t--no-image\n\t\tOnly write the blob table.\n\n"
+           "\t--once\n\t\tWrite the latest frame and stop.\n\n");
+}
+
+/* Helper function to stop at the next chance.
+** Input: The signal.
+** Output: None (void).
+*/
+void stopAdapter(int signum) {
+    (void) signum;
+    stopping = 1;
+}
+
+/* Helper function to write a file whole: to a temporary file next to it,
+** which replaces it (so Kst never sees it half written) only if the frame was
+** left alone while it was written.
+** Input: The file's path, the slot and frame to write it from, and the
+** function that writes it.
+** Output: A flag indicating the file was replaced (1), the frame was written
+** over meanwhile (0), or there was an error (-1).
+*/
+int replaceFile(char * path, const struct live_slot * slot, uint64_t frame,
+                int (*write)(FILE *, const struct live_slot *)) {
+    char tmp[512];
+    FILE * fptr;
+    int ret;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fptr = fopen(tmp, "w")) == NULL) {
+        fprintf(stderr, "Could not open %s: %s.\n", tmp, strerror(errno));
+        return -1;
+    }
+    ret = write(fptr, slot);
+    if (fclose(fptr) != 0) {
+        ret = -1;
+    }
+    if (ret != 1) {
+        fprintf(stderr, "Error writing %s: %s.\n", tmp, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    if (!liveIntact(slot, frame)) {
+        unlink(tmp);
+        return 0;
+    }
+    if (rename(tmp, path) != 0) {
+        fprintf(stderr, "Could not replace %s: %s.\n", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Helper function to write the blob table of a frame, one blob (magnitude, x
+** and y) a line.
+** Input: The file, and the slot.
+** Output: A flag indicating the table was written successfully or not.
+*/
+int writeTable(FILE * fptr, const struct live_slot * slot) {
+    int blob_count = slot->blob_count;
+
+    if (blob_count < 0 || blob_count > LIVE_MAX_BLOBS) {
+        blob_count = 0;
+    }
+    for (int i = 0; i < blob_count; i++) {
+        fprintf(fptr, "%f,%f,%f\n", slot->blobs[i].mag, slot->blobs[i].x,
+                slot->blobs[i].y);
+    }
+
+    return ferror(fptr) ? -1 : 1;
+}
+
+/* Helper function to write the filtered image of a frame as an 8-bit gray
+** BMP.
+** Input: The file, and the slot.
+** Output: A flag indicating the image was written successfully or not.
+*/
+int writeImage(FILE * fptr, const struct live_slot * slot) {
+    static const unsigned char padding[4] = {0};
+    struct bmp_header header = {0};
+    int width = slot->width, height = slot->height;
+    int row_size = (width + 3) & ~3;
+    unsigned char palette[256][4];
+
+    if (width <= 0 || height <= 0) {
+        return -1;
+    }
+
+    memcpy(header.magic, "BM", sizeof(header.magic));
+    header.data_offset = sizeof(header) + sizeof(palette);
+    header.image_size = (uint32_t) row_size*height;
+    header.file_size = header.data_offset + header.image_size;
+    header.info_size = 40;
+    header.width = width;
+    header.height = height;
+    header.planes = 1;
+    header.bits = 8;
+    header.colors = 256;
+    for (int i = 0; i < 256; i++) {
+        palette[i][0] = palette[i][1] = palette[i][2] = i;
+        palette[i][3] = 0;
+    }
+    fwrite(&header, sizeof(header), 1, fptr);
+    fwrite(palette, sizeof(palette), 1, fptr);
+
+    // straight from the shared memory, bottom row first
+    for (int row = height - 1; row >= 0; row--) {
+        fwrite(LIVE_IMAGE(slot) + (size_t) row*width, 1, width, fptr);
+        fwrite(padding, 1, row_size - width, fptr);
+    }
+
+    return ferror(fptr) ? -1 : 1;
+}
+
+int main(int argc, char * argv[]) {
+    static const struct option long_options[] = {
+        { "camera",   required_argument, NULL, 'c' },
+        { "dir",      required_argument, NULL, 'd' },
+        { "interval", required_argument, NULL, 'i' },
+        { "no-image", no_argument,       NULL, 'n' },
+        { "once",     no_argument,       NULL, 'o' },
+        { "help",     no_argument,       NULL, 'h' },
+        { NULL,       no_argument,       NULL,  0  },
+    };
+    const struct live_header * live = NULL;
+    size_t live_size = 0;
+    uint64_t last_frame = 0;
+    char table_path[400], image_path[400];
+    int camera = 1, opt;
+
+    while ((opt = getopt_long(argc, argv, "c:d:i:noh", long_options,
+                              NULL)) != -1) {
+        switch (opt) {
+            case 'c':
+                camera = atoi(optarg);
+                break;
+            case 'd':
+                kst_dir = optarg;
+                break;
+            case 'i':
+                interval = atof(optarg);
+                break;
+            case 'n':
+                write_image = 0;
+                break;
+            case 'o':
+                once = 1;
+                break;
+            default:
+                displayUsage();
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+    if (camera < 1 || camera > 254 || interval <= 0) {
+        displayUsage();
+        return 1;
+    }
+
+    snprintf(table_path, sizeof(table_path), "%s/" KST_TABLE, kst_dir);
+    snprintf(image_path, sizeof(image_path), "%s/" KST_IMAGE, kst_dir);
+    signal(SIGINT, stopAdapter);
+    signal(SIGTERM, stopAdapter);
+
+    while (!stopping) {
+        struct timespec wait = {(time_t) interval,
+                                (long) ((interval - (time_t) interval)*1e9)};
+        const struct live_slot * slot;
+        uint64_t frame;
+
+        // (re)map the camera's frames once it is publishing them
+        if (live == NULL || liveStale()) {
+            if (live != NULL) {
+                unmapLive(live, live_size);
+                last_frame = 0;
+            }
+            live = mapLive(camera, &live_size);
+        }
+
+        if (live != NULL &&
+            (slot = latestLive(live, &frame)) != NULL && frame != last_frame) {
+            // a frame written over meanwhile leaves the files as they were
+            if (replaceFile(table_path, slot, frame, writeTable) == 1 &&
+                (!write_image ||
+                 replaceFile(image_path, slot, frame, writeImage) == 1)) {
+                last_frame = frame;
+                if (once) {
+                    break;
+                }
+            }
+        }
+
+        nanosleep(&wait, NULL);
+    }
+
+    if (live != NULL) {
+        unmapLive(live, live_size);
+    }
+
+    return 0;
+}
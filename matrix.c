@@ -22,6 +22,14 @@ int min(int num1, int num2) {
     return (num1 > num2) ? num2 : num1;
 }
 
+/* Helper function to find maximum of two input numbers.
+** Input: The two numbers to be compared.
+** Output: The larger number.
+*/
+int max(int num1, int num2) {
+    return (num1 < num2) ? num2 : num1;
+}
+
 /* Function to print matrices row-wise.
 ** Input: The matrix to be printed to the terminal.
 ** Output: None (void). Prints the matrix to the terminal for verification.
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <ueye.h>
+#include <sofa/sofa.h>
+
+#include "camera.h"
+#include "params.h"
+#include "observer.h"
+
+// the context last computed (by the observer thread, or for a frame it did
+// not suit), protected by observer_lock, and whether the thread is stopping
+struct observer_context observer_cache = {0};
+pthread_mutex_t observer_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t observer_wake = PTHREAD_COND_INITIALIZER;
+pthread_t observer_thread_id;
+int observer_started = 0;
+int observer_stopping = 0;
+
+/* Helper function to compute the astrometry context of a site at a time.
+** Input: The site, the UTC (2-part Julian date), and the context to fill in.
+** Output: A flag indicating the context could be computed or not.
+*/
+static int computeObserverContext(const struct observer_site * site,
+                                  double utc1, double utc2,
+                                  struct observer_context * context) {
+    double eo;
+
+    // no polar motion and no refraction, as the full conversion had
+    if (iauApco13(utc1, utc2, dut1, site->longitude*(M_PI/180.0),
+                  site->latitude*(M_PI/180.0), site->hm, 0.0, 0.0, 0.0, 0.0,
+                  0.0, 0.0, &context->astrom, &eo) != 0) {
+        return -1;
+    }
+
+    context->valid = 1;
+    context->site = *site;
+    context->utc1 = utc1;
+    context->utc2 = utc2;
+
+    return 1;
+}
+
+/* Helper function to tell if two sites are the same.
+** Input: The sites.
+** Output: If they are (or not).
+*/
+static int sameSite(const struct observer_site * a,
+                    const struct observer_site * b) {
+    return a->latitude == b->latitude && a->longitude == b->longitude &&
+           a->hm == b->hm;
+}
+
+/* Helper function to recompute the cached context for the current time and
+** the site the clients last gave.
+** Input: None.
+** Output: None (void).
+*/
+static void refreshObserver() {
+    struct observer_context context;
+    struct observer_site site;
+    struct frame_params params;
+    struct timespec now;
+    struct tm tm_info;
+    double utc1, utc2;
+
+    snapshotParams(&params);
+    site.latitude = params.latitude;
+    site.longitude = params.longitude;
+    site.hm = params.hm;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    gmtime_r(&now.tv_sec, &tm_info);
+    if (iauDtf2d("UTC", tm_info.tm_year + 1900, tm_info.tm_mon + 1,
+                 tm_info.tm_mday, tm_info.tm_hour, tm_info.tm_min,
+                 tm_info.tm_sec + now.tv_nsec*1e-9, &utc1, &utc2) != 0 ||
+        computeObserverContext(&site, utc1, utc2, &context) != 1) {
+        return;
+    }
+
+    pthread_mutex_lock(&observer_lock);
+    observer_cache = context;
+    pthread_mutex_unlock(&observer_lock);
+}
+
+/* Function for the observer thread: keeps the cached context up to date, so
+** the solving stage only has to bring the Earth rotation angle up to date.
+** Input: None.
+** Output: None (void).
+*/
+void * updateObserver() {
+    struct timespec wake;
+
+    pthread_mutex_lock(&observer_lock);
+    while (!observer_stopping) {
+        pthread_mutex_unlock(&observer_lock);
+        refreshObserver();
+        pthread_mutex_lock(&observer_lock);
+
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += OBSERVER_INTERVAL;
+        while (!observer_stopping) {
+            if (pthread_cond_timedwait(&observer_wake, &observer_lock,
+                                       &wake) == ETIMEDOUT) {
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&observer_lock);
+
+    return NULL;
+}
+
+/* Function to start the observer thread.
+** Input: None.
+** Output: A flag indicating the thread started successfully or not.
+*/
+int startObserver() {
+    observer_stopping = 0;
+
+    if (pthread_create(&observer_thread_id, NULL, updateObserver, NULL) != 0) {
+        fprintf(stderr, "Error creating observer thread: %s.\n",
+                strerror(errno));
+        return -1;
+    }
+    observer_started = 1;
+
+    return 1;
+}
+
+/* Function to stop and join the observer thread.
+** Input: None.
+** Output: None (void).
+*/
+void stopObserver() {
+    if (!observer_started) {
+        return;
+    }
+
+    pthread_mutex_lock(&observer_lock);
+    observer_stopping = 1;
+    pthread_cond_signal(&observer_wake);
+    pthread_mutex_unlock(&observer_lock);
+
+    pthread_join(observer_thread_id, NULL);
+    observer_started = 0;
+}
+
+/* Function to find the observed place of a field centre from the cached
+** context (or one computed for it, if the cached one is for another site or
+** too far from its time), with the Earth rotation angle brought up to its
+** time.
+** Input: The ICRS RA and DEC of the field centre [deg], the UTC it was seen at
+** (2-part Julian date), the site, and where to store the observed place.
+** Output: A flag indicating the place could be found or not (a dubious year or
+** an unacceptable date).
+*/
+int observeField(double ra, double dec, double utc1, double utc2,
+                 const struct observer_site * site,
+                 struct observed_place * place) {
+    struct observer_context context;
+    double ut11, ut12, ri, di;
+
+    pthread_mutex_lock(&observer_lock);
+    context = observer_cache;
+    pthread_mutex_unlock(&observer_lock);
+
+    double age = ((utc1 - context.utc1) + (utc2 - context.utc2))*86400.0;
+    if (!context.valid || !sameSite(&context.site, site) ||
+        fabs(age) > OBSERVER_MAX_AGE) {
+        if (computeObserverContext(site, utc1, utc2, &context) != 1) {
+            return -1;
+        }
+        pthread_mutex_lock(&observer_lock);
+        observer_cache = context;
+        pthread_mutex_unlock(&observer_lock);
+    }
+
+    if (iauUtcut1(utc1, utc2, dut1, &ut11, &ut12) != 0) {
+        return -1;
+    }
+    iauAper13(ut11, ut12, &context.astrom);
+
+    iauAtciq(ra*(M_PI/180.0), dec*(M_PI/180.0), 0.0, 0.0, 0.0, 0.0,
+             &context.astrom, &ri, &di);
+    iauAtioq(ri, di, &context.astrom, &place->aob, &place->zob, &place->hob,
+             &place->dob, &place->rob);
+    place->pa = iauHd2pa(place->hob, place->dob, context.astrom.phi);
+
+    return 1;
+}
@@ -0,0 +1,47 @@
+#ifndef OBSERVER_H
+#define OBSERVER_H
+
+#include <pthread.h>
+#include <sofa/sofa.h>
+
+// how often the cached astrometry context is recomputed for the current time
+// [sec], and the oldest (or newest) a frame may find it before it is
+// recomputed for the frame itself [sec]: everything in it but the Earth
+// rotation angle, which is brought up to date for every frame, drifts by less
+// than a milliarcsecond in that time
+#define OBSERVER_INTERVAL  1
+#define OBSERVER_MAX_AGE   10.0
+
+/* Where the camera is observing from */
+struct observer_site {
+    double latitude;            // [deg]
+    double longitude;           // [deg]
+    double hm;                  // height above sea level [m]
+};
+
+/* SOFA's ICRS to observed context for a site at one time (the earth
+** ephemeris, precession-nutation and the rest that change slowly) */
+struct observer_context {
+    int valid;                  // (bool) the context has been computed
+    struct observer_site site;
+    double utc1, utc2;          // UTC it was computed for (2-part Julian date)
+    iauASTROM astrom;
+};
+
+/* Observed place of a field centre */
+struct observed_place {
+    double aob;                 // azimuth (N=0, E=90 deg) [rad]
+    double zob;                 // zenith distance [rad]
+    double hob;                 // hour angle [rad]
+    double dob;                 // declination [rad]
+    double rob;                 // right ascension (CIO-based) [rad]
+    double pa;                  // parallactic angle [rad]
+};
+
+int startObserver();
+void stopObserver();
+int observeField(double ra, double dec, double utc1, double utc2,
+                 const struct observer_site * site,
+                 struct observed_place * place);
+
+#endif
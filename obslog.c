@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "obslog.h"
+
+// buffer the log file holds before going to the disk [bytes]
+#define OBS_LOG_BUFFER  (64*1024)
+
+/* Record waiting to be written, with the day it goes under */
+struct obs_entry {
+    struct obs_record record;
+    struct tm tm_info;
+};
+
+// how the observing log is written (set with --log-format)
+int obs_log_format = OBS_LOG_BINARY;
+// records waiting for the log writer, in order, the session note, and whether
+// the writer is stopping, all protected by obs_log_lock
+struct obs_entry obs_queue[OBS_LOG_QUEUE];
+int obs_queue_head = 0, obs_queue_count = 0;
+int obs_dropped = 0;
+char * obs_note = NULL;
+int obs_log_closed = 0;
+pthread_mutex_t obs_log_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t obs_log_ready = PTHREAD_COND_INITIALIZER;
+pthread_t obs_log_thread_id;
+int obs_log_started = 0;
+int obs_camera_handle = 0;
+// the file being written and its name (only touched by the log writer)
+FILE * obs_file = NULL;
+char obs_path[256] = "";
+char obs_buffer[OBS_LOG_BUFFER];
+
+/* Function to get the observing log format with the given name.
+** Input: The name (binary or csv).
+** Output: The format, or -1 if there is no format with that name.
+*/
+int parseObsLogFormat(char * name) {
+    if (strcmp(name, "binary") == 0) {
+        return OBS_LOG_BINARY;
+    } else if (strcmp(name, "csv") == 0) {
+        return OBS_LOG_CSV;
+    }
+
+    return -1;
+}
+
+/* Function to write the column names of the CSV observing log.
+** Input: The file.
+** Output: None (void).
+*/
+void writeObsCsvHeader(FILE * fptr) {
+    fprintf(fptr, "C time,GMT,Solved,Blob #,Observed RA (deg),Astrometry RA "
+                  "(deg),Observed DEC (deg),Astrometry DEC (deg),FR (deg),PS "
+                  "(arcsec/px),ALT (deg),AZ (deg),IR (deg),Astrom. solve time "
+                  "(msec),Camera time (msec),Capture time (msec),Blob time "
+                  "(msec),Centroid time (msec),Solve stage time (msec),Blob "
+                  "queue depth,Solve queue depth,Source\n");
+}
+
+/* Function to write one record of the observing log as a line of CSV.
+** Input: The file and the record.
+** Output: None (void).
+*/
+void writeObsCsvRecord(FILE * fptr, struct obs_record * record) {
+    char gmt[32];
+    struct tm tm_info;
+    time_t seconds = (time_t) record->seconds;
+
+    gmtime_r(&seconds, &tm_info);
+    strftime(gmt, sizeof(gmt), "%Y-%m-%d %H:%M:%S", &tm_info);
+
+    fprintf(fptr, "%lld,%s,%d,%d,%.10f,%.10f,%.10f,%.10f,%.6f,%.6f,%.10f,%.10f,"
+                  "%.6f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%d,%d,%d\n",
+            (long long) record->seconds, gmt, record->solved,
+            record->blob_count, record->ra_observed, record->ra,
+            record->dec_observed, record->dec, record->fr, record->ps,
+            record->alt, record->az, record->ir, record->astrometry_time,
+            record->camera_time, record->capture_time, record->blob_time,
+            record->centroid_time, record->solve_time,
+            record->blob_queue_depth, record->solve_queue_depth,
+            record->source);
+}
+
+/* Helper function to start a session in the log file: the header and note of
+** a binary log, or the note as comments (and the column names, if the file is
+** new) of a CSV log.
+** Input: The note (or NULL).
+** Output: None (void).
+*/
+void writeObsSession(char * note) {
+    if (obs_log_format == OBS_LOG_BINARY) {
+        struct obs_log_header header = {0};
+
+        memcpy(header.magic, OBS_LOG_MAGIC, sizeof(header.magic));
+        header.version = OBS_LOG_VERSION;
+        header.record_size = sizeof(struct obs_record);
+        header.camera_handle = obs_camera_handle;
+        header.note_size = (note != NULL) ? strlen(note) : 0;
+        fwrite(&header, sizeof(header), 1, obs_file);
+        if (header.note_size > 0) {
+            fwrite(note, 1, header.note_size, obs_file);
+        }
+    } else {
+        int empty = (ftell(obs_file) == 0);
+
+        for (char * line = note; line != NULL && *line != '\0';) {
+            char * end = strchr(line, '\n');
+            int len = (end != NULL) ? end - line : (int) strlen(line);
+
+            fprintf(obs_file, "# %.*s\n", len, line);
+            line = (end != NULL) ? end + 1 : line + len;
+        }
+        if (empty) {
+            writeObsCsvHeader(obs_file);
+        }
+    }
+}
+
+/* Function to make sure the log file for the day of a record is open, closing
+** the previous day's file once the day changes.
+** Input: The day (and time) of the record, and the session note.
+** Output: A flag indicating the file is open or not.
+*/
+int openObsFile(struct tm * tm_info, char * note) {
+    char path[256], day[64];
+
+    strftime(day, sizeof(day), "data_%b-%d_", tm_info);
+    snprintf(path, sizeof(path), OBS_LOG_DIR "%s%d.%s", day, obs_camera_handle,
+             (obs_log_format == OBS_LOG_BINARY) ? "bin" : "csv");
+
+    if (obs_file != NULL && strcmp(path, obs_path) == 0) {
+        return 1;
+    }
+
+    if (obs_file != NULL) {
+        fclose(obs_file);
+        obs_file = NULL;
+    }
+
+    if ((obs_file = fopen(path, "a")) == NULL) {
+        fprintf(stderr, "Could not open observing file %s: %s.\n", path,
+                strerror(errno));
+        return -1;
+    }
+    setvbuf(obs_file, obs_buffer, _IOFBF, sizeof(obs_buffer));
+    strcpy(obs_path, path);
+    printf("Writing observing log to %s\n", path);
+
+    writeObsSession(note);
+    return 1;
+}
+
+/* Function for the log writer thread: writes whatever records are waiting in
+** one go, then flushes the file so it can be read while we run.
+** Input: None.
+** Output: None (void pointer).
+*/
+void * writeObsLog() {
+    struct obs_entry batch[OBS_LOG_QUEUE];
+    char * note = NULL;
+    int reported_dropped = 0;
+
+    for (;;) {
+        int count, dropped;
+
+        pthread_mutex_lock(&obs_log_lock);
+        while (obs_queue_count == 0 && !obs_log_closed) {
+            pthread_cond_wait(&obs_log_ready, &obs_log_lock);
+        }
+        if (obs_queue_count == 0) {
+            pthread_mutex_unlock(&obs_log_lock);
+            break;
+        }
+        count = obs_queue_count;
+        for (int i = 0; i < count; i++) {
+            batch[i] = obs_queue[(obs_queue_head + i) % OBS_LOG_QUEUE];
+        }
+        obs_queue_head = (obs_queue_head + count) % OBS_LOG_QUEUE;
+        obs_queue_count = 0;
+        dropped = obs_dropped;
+        // a new note (a new session) goes at the top of the file it falls in
+        if (obs_note != NULL) {
+            free(note);
+            note = obs_note;
+            obs_note = NULL;
+            if (obs_file != NULL) {
+                writeObsSession(note);
+            }
+        }
+        pthread_mutex_unlock(&obs_log_lock);
+
+        if (dropped > reported_dropped) {
+            fprintf(stderr, "Observing log fell behind; %d records dropped so "
+                            "far.\n", dropped);
+            reported_dropped = dropped;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (openObsFile(&batch[i].tm_info, note) != 1) {
+                continue;
+            }
+
+            if (obs_log_format == OBS_LOG_BINARY) {
+                if (fwrite(&batch[i].record, sizeof(struct obs_record), 1,
+                           obs_file) != 1) {
+                    fprintf(stderr, "Error writing to observing file: %s.\n",
+                            strerror(errno));
+                }
+            } else {
+                writeObsCsvRecord(obs_file, &batch[i].record);
+            }
+        }
+
+        if (obs_file != NULL && fflush(obs_file) != 0) {
+            fprintf(stderr, "Error flushing observing file: %s.\n",
+                    strerror(errno));
+        }
+    }
+
+    if (obs_file != NULL) {
+        fclose(obs_file);
+        obs_file = NULL;
+    }
+    free(note);
+    return NULL;
+}
+
+/* Function to start the log writer thread.
+** Input: The camera handle (part of the file names).
+** Output: A flag indicating the writer started successfully or not.
+*/
+int startObsLog(int camera_handle) {
+    obs_camera_handle = camera_handle;
+    obs_log_closed = 0;
+
+    if (pthread_create(&obs_log_thread_id, NULL, writeObsLog, NULL) != 0) {
+        fprintf(stderr, "Error creating observing log thread: %s.\n",
+                strerror(errno));
+        return -1;
+    }
+    obs_log_started = 1;
+
+    return 1;
+}
+
+/* Function to start a new session in the log, written before the records that
+** are logged after it (and again at the top of every new file).
+** Input: The note describing the session (copied).
+** Output: None (void).
+*/
+void setObsLogNote(char * note) {
+    char * copy = strdup(note);
+
+    if (copy == NULL) {
+        fprintf(stderr, "Error copying observing session note: %s.\n",
+                strerror(errno));
+        return;
+    }
+
+    pthread_mutex_lock(&obs_log_lock);
+    free(obs_note);
+    obs_note = copy;
+    pthread_mutex_unlock(&obs_log_lock);
+}
+
+/* Function to queue a record for the log writer.
+** Input: The record and the day (and time) it goes under.
+** Output: A flag indicating the record was queued (1) or dropped because the
+** writer is behind (0).
+*/
+int logObservation(struct obs_record * record, struct tm * tm_info) {
+    int queued = 0;
+
+    pthread_mutex_lock(&obs_log_lock);
+    if (obs_queue_count < OBS_LOG_QUEUE) {
+        struct obs_entry * entry;
+        entry = &obs_queue[(obs_queue_head + obs_queue_count) % OBS_LOG_QUEUE];
+        entry->record = *record;
+        entry->tm_info = *tm_info;
+        obs_queue_count++;
+        queued = 1;
+        pthread_cond_signal(&obs_log_ready);
+    } else {
+        obs_dropped++;
+    }
+    pthread_mutex_unlock(&obs_log_lock);
+
+    return queued;
+}
+
+/* Function to write out the records still queued and stop the log writer.
+** Input: None.
+** Output: None (void).
+*/
+void stopObsLog() {
+    if (!obs_log_started) {
+        return;
+    }
+
+    pthread_mutex_lock(&obs_log_lock);
+    obs_log_closed = 1;
+    pthread_cond_signal(&obs_log_ready);
+    pthread_mutex_unlock(&obs_log_lock);
+    pthread_join(obs_log_thread_id, NULL);
+    obs_log_started = 0;
+
+    free(obs_note);
+    obs_note = NULL;
+}
@@ -0,0 +1,77 @@
+#ifndef OBSLOG_H
+#define OBSLOG_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// how the observing log is written (set with --log-format)
+#define OBS_LOG_BINARY   0   // obs_log_header and obs_record blocks (.bin)
+#define OBS_LOG_CSV      1   // comma-separated text, one line per image (.csv)
+// starts every session and every new file of a binary log
+#define OBS_LOG_MAGIC    "SCOBSLOG"
+#define OBS_LOG_VERSION  2
+// records that can wait to be written at once; past that, records are dropped
+// rather than holding up the solving stage
+#define OBS_LOG_QUEUE    256
+#define OBS_LOG_DIR      "/home/blast/Desktop/blastcam/"
+
+#pragma pack(push, 1)
+/* Start of a session in a binary log, followed by note_size bytes of text
+** describing the camera settings, then the session's records. A new file
+** (one per day) starts a new session too. */
+struct obs_log_header {
+    char magic[8];              // OBS_LOG_MAGIC
+    uint32_t version;           // OBS_LOG_VERSION
+    uint32_t record_size;       // sizeof(struct obs_record) for this version
+    int32_t camera_handle;
+    uint32_t note_size;
+};
+
+/* One solved (or unsolved) image. Readers know a header from a record by its
+** magic, which no exposure time can match. */
+struct obs_record {
+    int64_t seconds;            // C time the exposure was started at
+    int32_t solved;             // (bool) Astrometry solved the image
+    int32_t blob_count;
+    // solution (zero if unsolved) [deg], except ps [arcsec/px]
+    double ra_observed;
+    double ra;                  // ICRS
+    double dec_observed;
+    double dec;                 // ICRS
+    double fr;
+    double ps;
+    double alt;
+    double az;
+    double ir;
+    // timings [msec]
+    double astrometry_time;     // the solve itself
+    double camera_time;         // end of blob-finding to the solution
+    double capture_time;
+    double blob_time;
+    double centroid_time;
+    double solve_time;          // the whole solving stage
+    // depth of the downstream queue right after the image was handed off
+    int32_t blob_queue_depth;
+    int32_t solve_queue_depth;
+    // where the solution came from (SOLUTION_*): a propagated one fills in
+    // the solution above too, but is not solved (since version 2)
+    int32_t source;
+};
+#pragma pack(pop)
+
+// records of version 1 end before source
+#define OBS_RECORD_V1_SIZE offsetof(struct obs_record, source)
+
+extern int obs_log_format;
+
+int parseObsLogFormat(char * name);
+int startObsLog(int camera_handle);
+void setObsLogNote(char * note);
+int logObservation(struct obs_record * record, struct tm * tm_info);
+void stopObsLog();
+void writeObsCsvHeader(FILE * fptr);
+void writeObsCsvRecord(FILE * fptr, struct obs_record * record);
+
+#endif
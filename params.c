@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <ueye.h>
+
+#include "camera.h"
+#include "astrometry.h"
+#include "params.h"
+
+// the settings as last published: the command thread writes the slot that
+// is not the latest and then makes it the latest, so a frame copying the
+// latest one only has to copy it again if it was published over twice
+struct param_slot param_slots[2];
+atomic_int param_latest = 0;
+// threshold of a static hot pixel map a client asked for that the blob stage
+// has not made yet (0 for none); each request is taken by one image
+atomic_int hp_map_request = 0;
+
+/* Function to publish new settings for the frames started from now on. Only
+** the command thread (or main() before it starts) publishes, and it never
+** waits on the frames reading the settings.
+** Input: The settings.
+** Output: None (void).
+*/
+void publishParams(const struct frame_params * params) {
+    int next = 1 - atomic_load_explicit(&param_latest, memory_order_relaxed);
+    struct param_slot * slot = &param_slots[next];
+    unsigned seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+    // readers that catch the count odd, or changed, copy again
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&slot->params, params, sizeof(struct frame_params));
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+
+    atomic_store_explicit(&param_latest, next, memory_order_release);
+}
+
+/* Function to take a consistent copy of the latest settings.
+** Input: Where to copy them.
+** Output: None (void).
+*/
+void snapshotParams(struct frame_params * params) {
+    unsigned before, after;
+
+    do {
+        int latest = atomic_load_explicit(&param_latest, memory_order_acquire);
+        struct param_slot * slot = &param_slots[latest];
+
+        before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        memcpy(params, &slot->params, sizeof(struct frame_params));
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+}
+
+/* Function to publish the settings the camera starts with (the initial values
+** of all_blob_params and all_astro_params). Called before any frame is taken.
+** Input: None.
+** Output: None (void).
+*/
+void initParams() {
+    struct frame_params params;
+
+    params.blob = all_blob_params;
+    params.blob.make_static_hp_mask = 0;
+    params.timelimit = all_astro_params.timelimit;
+    params.logodds = all_astro_params.logodds;
+    params.latitude = all_astro_params.latitude;
+    params.longitude = all_astro_params.longitude;
+    params.hm = all_astro_params.hm;
+    publishParams(&params);
+}
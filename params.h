@@ -0,0 +1,31 @@
+#ifndef PARAMS_H
+#define PARAMS_H
+
+#include <stdatomic.h>
+
+#include "camera.h"
+
+/* The settings clients change that a frame has to see all of at once: blob
+** finding, and the solver and observing site */
+struct frame_params {
+    struct blob_params blob;
+    double timelimit;           // Astrometry timeout [cycles]
+    double logodds;
+    double latitude;            // [deg]
+    double longitude;           // [deg]
+    double hm;                  // height above sea level [m]
+};
+
+/* One copy of the settings, with a count that is odd while it is written */
+struct param_slot {
+    atomic_uint seq;
+    struct frame_params params;
+};
+
+extern atomic_int hp_map_request;
+
+void publishParams(const struct frame_params * params);
+void snapshotParams(struct frame_params * params);
+void initParams();
+
+#endif
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "perf.h"
+
+/* Last PERF_WINDOW samples of one stage */
+struct perf_window {
+    float samples[PERF_WINDOW];
+    int next;                   // where the next sample goes
+    int count;                  // samples since startup
+};
+
+// every stage is timed from whichever thread runs it, so the windows are all
+// protected by perf_lock
+struct perf_window perf_windows[NUM_PERF_STAGES];
+pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Function to add a sample to the statistics of a stage.
+** Input: The stage (PERF_*) and how long it took [msec].
+** Output: None (void).
+*/
+void recordPerf(int stage, double msec) {
+    struct perf_window * window = &perf_windows[stage];
+
+    pthread_mutex_lock(&perf_lock);
+    window->samples[window->next] = (float) msec;
+    window->next = (window->next + 1) % PERF_WINDOW;
+    window->count++;
+    pthread_mutex_unlock(&perf_lock);
+}
+
+/* Function to time a stage that started at the last lap, and start the next
+** lap, so the stages of a sequence can be timed one after the other.
+** Input: The stage and the start of the lap (CLOCK_MONOTONIC).
+** Output: None (void). The lap starts again now.
+*/
+void perfLap(int stage, struct timespec * lap) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    recordPerf(stage, (now.tv_sec - lap->tv_sec)*1000.0 +
+                      (now.tv_nsec - lap->tv_nsec)/1000000.0);
+    *lap = now;
+}
+
+/* Function to forget every sample so far (between benchmark runs).
+** Input: None.
+** Output: None (void).
+*/
+void resetPerfStats() {
+    pthread_mutex_lock(&perf_lock);
+    memset(perf_windows, 0, sizeof(perf_windows));
+    pthread_mutex_unlock(&perf_lock);
+}
+
+/* Helper function for sorting samples with qsort() */
+int compareSamples(const void * a, const void * b) {
+    float x = *(const float *) a, y = *(const float *) b;
+    return (x > y) - (x < y);
+}
+
+/* Function to work out the rolling statistics of every stage.
+** Input: Where to write them.
+** Output: None (void).
+*/
+void getPerfStats(struct perf_stats * stats) {
+    float samples[PERF_WINDOW];
+
+    memset(stats, 0, sizeof(struct perf_stats));
+    for (int s = 0; s < NUM_PERF_STAGES; s++) {
+        struct stage_stats * stage = &stats->stages[s];
+        double sum = 0;
+        int n;
+
+        pthread_mutex_lock(&perf_lock);
+        n = (perf_windows[s].count < PERF_WINDOW) ? perf_windows[s].count
+                                                  : PERF_WINDOW;
+        memcpy(samples, perf_windows[s].samples, n*sizeof(float));
+        stage->count = perf_windows[s].count;
+        pthread_mutex_unlock(&perf_lock);
+
+        if (n == 0) {
+            continue;
+        }
+
+        qsort(samples, n, sizeof(float), compareSamples);
+        for (int i = 0; i < n; i++) {
+            sum += samples[i];
+        }
+        stage->min = samples[0];
+        stage->max = samples[n - 1];
+        stage->mean = sum/n;
+        stage->p50 = samples[n/2];
+        stage->p99 = samples[(99*(n - 1))/100];
+    }
+}
+
+/* Function to get the name of a stage, for printing the statistics.
+** Input: The stage.
+** Output: The name.
+*/
+const char * perfStageName(int stage) {
+    static const char * names[NUM_PERF_STAGES] = {
+        "exposure", "readout", "mask", "filter", "stats", "peaks", "centroid",
+        "sort", "solve", "altaz", "save", "send", "frame", "stack",
+    };
+
+    return (stage >= 0 && stage < NUM_PERF_STAGES) ? names[stage] : "unknown";
+}
+
+/* Function to print the rolling statistics of every stage that has run.
+** Input: None.
+** Output: None (void).
+*/
+void printPerfStats() {
+    struct perf_stats stats;
+
+    getPerfStats(&stats);
+    printf("\n+---------------------------------------------------------+\n");
+    printf("|  Stage timings (msec)                                   |\n");
+    printf("|  Stage       Count      Min     Mean      p50      p99  |\n");
+    printf("|---------------------------------------------------------|\n");
+    for (int s = 0; s < NUM_PERF_STAGES; s++) {
+        struct stage_stats * stage = &stats.stages[s];
+        if (stage->count == 0) {
+            continue;
+        }
+        printf("|  %-8s %8d %8.2f %8.2f %8.2f %8.2f  |\n",
+               perfStageName(s), stage->count, stage->min, stage->mean,
+               stage->p50, stage->p99);
+    }
+    printf("+---------------------------------------------------------+\n");
+}
@@ -0,0 +1,57 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+#include <time.h>
+
+// stages of a frame that are timed for the performance telemetry
+#define PERF_EXPOSURE     0   // trigger to the image being ready
+#define PERF_READOUT      1   // getting and locking the finished buffer
+#define PERF_MASK         2   // hot pixel mask
+#define PERF_FILTER       3   // boxcar smoothing (and high-pass) passes
+#define PERF_STATS        4   // mean and noise of the filtered image
+#define PERF_PEAKS        5   // threshold scan and merging the candidates
+#define PERF_CENTROID     6
+#define PERF_SORT         7   // blobs brightest first, and the focus metric
+#define PERF_SOLVE        8   // Astrometry
+#define PERF_ALTAZ        9   // SOFA observed place, AltAz and rotation
+#define PERF_SAVE         10  // archiving the image
+#define PERF_SEND         11  // publish to wire, per message and client
+#define PERF_FRAME        12  // start of the exposure to the solution
+#define PERF_STACK        13  // registering and stacking the exposure
+#define NUM_PERF_STAGES   14
+// stage slots in the telemetry, so a new stage takes a spare slot and leaves
+// the size of the telemetry as it is (the spare slots are all 0)
+#define PERF_MAX_STAGES   32
+#if NUM_PERF_STAGES > PERF_MAX_STAGES
+#error "More perf stages than slots for them in the telemetry"
+#endif
+// the statistics of each stage are over its last this many samples
+#define PERF_WINDOW       256
+
+#pragma pack(push, 1)
+/* Rolling statistics of one stage [msec] */
+struct stage_stats {
+    float min;
+    float mean;
+    float p50;
+    float p99;
+    float max;
+    int32_t count;              // samples since startup
+};
+
+/* Where each frame's time goes, sent with the telemetry (stages are indexed
+** by the PERF_* values) */
+struct perf_stats {
+    struct stage_stats stages[PERF_MAX_STAGES];
+};
+#pragma pack(pop)
+
+void recordPerf(int stage, double msec);
+void perfLap(int stage, struct timespec * lap);
+void resetPerfStats();
+void getPerfStats(struct perf_stats * stats);
+const char * perfStageName(int stage);
+void printPerfStats();
+
+#endif
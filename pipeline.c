@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <ueye.h>
+
+#include "camera.h"
+#include "pipeline.h"
+#include "lens_adapter.h"
+#include "commands.h"
+#include "workers.h"
+#include "broadcast.h"
+#include "archive.h"
+#include "obslog.h"
+#include "perf.h"
+#include "observer.h"
+#include "live.h"
+
+struct frame all_frames[MAX_FRAMES];
+// one frame per camera ring buffer
+int num_frames;
+// frames ready to be exposed, waiting for blob-finding, and waiting for solving
+struct frame_queue free_frames, blob_frames, solve_frames;
+pthread_mutex_t frame_refs_lock = PTHREAD_MUTEX_INITIALIZER;
+// frames between the capture and the end of the solving stage
+int frames_in_pipeline = 0;
+pthread_mutex_t in_pipeline_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pipeline_idle = PTHREAD_COND_INITIALIZER;
+pthread_t capture_thread_id, blob_thread_id, solve_thread_id;
+int capture_thread_ret, blob_thread_ret, solve_thread_ret;
+
+/* Function to initialize an empty frame queue.
+** Input: The queue.
+** Output: None (void).
+*/
+void initFrameQueue(struct frame_queue * queue) {
+    queue->head = 0;
+    queue->count = 0;
+    queue->closed = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+}
+
+/* Function to release the synchronization objects of a frame queue.
+** Input: The queue.
+** Output: None (void).
+*/
+void destroyFrameQueue(struct frame_queue * queue) {
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+}
+
+/* Function to hand a frame to the next stage, blocking while the queue is full.
+** Input: The queue, the frame, and where to record the queue depth after the
+** frame was added (may be NULL).
+** Output: None (void).
+*/
+void pushFrameDepth(struct frame_queue * queue, struct frame * frame,
+                    int * depth) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count >= MAX_FRAMES) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+
+    queue->frames[(queue->head + queue->count) % MAX_FRAMES] = frame;
+    queue->count++;
+    // written under the lock so the consumer sees it once it pops the frame
+    if (depth != NULL) {
+        *depth = queue->count;
+    }
+
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* Function to hand a frame to the next stage.
+** Input: The queue and the frame.
+** Output: None (void).
+*/
+void pushFrame(struct frame_queue * queue, struct frame * frame) {
+    pushFrameDepth(queue, frame, NULL);
+}
+
+/* Function to take the oldest frame out of a queue, blocking while it is empty.
+** Input: The queue.
+** Output: The frame, or NULL if the queue has been closed and drained.
+*/
+struct frame * popFrame(struct frame_queue * queue) {
+    struct frame * frame = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+
+    if (queue->count > 0) {
+        frame = queue->frames[queue->head];
+        queue->head = (queue->head + 1) % MAX_FRAMES;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return frame;
+}
+
+/* Function to mark a queue as finished so consumers exit once it is drained.
+** Input: The queue.
+** Output: None (void).
+*/
+void closeFrameQueue(struct frame_queue * queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* Function to get the number of frames currently waiting in a queue.
+** Input: The queue.
+** Output: The number of frames in the queue.
+*/
+int frameQueueDepth(struct frame_queue * queue) {
+    int depth;
+
+    pthread_mutex_lock(&queue->lock);
+    depth = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+
+    return depth;
+}
+
+/* Function for a consumer to release a frame. The last consumer to release it 
+** gives the frame back to the pool (and the image back to the camera ring, if
+** blob-finding has not already).
+** Input: The frame.
+** Output: None (void).
+*/
+void releaseFrame(struct frame * frame) {
+    int refs;
+
+    pthread_mutex_lock(&frame_refs_lock);
+    refs = --frame->refs;
+    pthread_mutex_unlock(&frame_refs_lock);
+
+    if (refs == 0) {
+        unlockFrameImage(frame);
+        pushFrame(&free_frames, frame);
+    }
+}
+
+/* Function to block until every frame that was captured has been solved.
+** Input: None.
+** Output: None (void).
+*/
+void waitForPipelineIdle() {
+    pthread_mutex_lock(&in_pipeline_lock);
+    while (frames_in_pipeline > 0) {
+        pthread_cond_wait(&pipeline_idle, &in_pipeline_lock);
+    }
+    pthread_mutex_unlock(&in_pipeline_lock);
+}
+
+/* Helper function to track how many frames are between capture and the end of 
+** solving.
+** Input: +1 when a frame enters the pipeline, -1 when it leaves it.
+** Output: None (void).
+*/
+void countInPipeline(int change) {
+    pthread_mutex_lock(&in_pipeline_lock);
+    frames_in_pipeline += change;
+    if (frames_in_pipeline == 0) {
+        pthread_cond_broadcast(&pipeline_idle);
+    }
+    pthread_mutex_unlock(&in_pipeline_lock);
+}
+
+/* Helper function to get the time between two timestamps.
+** Input: The start and end timestamps.
+** Output: The elapsed time in milliseconds.
+*/
+double msecBetween(struct timespec * start, struct timespec * end) {
+    return (end->tv_sec - start->tv_sec)*1e3 +
+           (end->tv_nsec - start->tv_nsec)*1e-6;
+}
+
+/* Function for the capture stage: takes exposures as fast as free frames are
+** available and hands them to the blob-finding stage.
+** Input: None.
+** Output: None (void).
+*/
+void * captureImages() {
+    struct frame * frame;
+    int auto_focusing;
+
+    while (!shutting_down) {
+        if ((frame = popFrame(&free_frames)) == NULL) {
+            break;
+        }
+
+        // auto-focusing moves the lens between exposures, so every frame ahead
+        // of this one has to be processed before the next picture is taken
+        pthread_mutex_lock(&camera_params_lock);
+        auto_focusing = all_camera_params.focus_mode ||
+                        all_camera_params.begin_auto_focus;
+        pthread_mutex_unlock(&camera_params_lock);
+        if (auto_focusing) {
+            waitForPipelineIdle();
+        }
+
+        if (shutting_down) {
+            pushFrame(&free_frames, frame);
+            break;
+        }
+
+        if (captureFrame(frame) < 1) {
+            printf("Did not capture an image properly.\n");
+            pushFrame(&free_frames, frame);
+            continue;
+        }
+
+        // the pipeline itself is the first consumer of the frame
+        frame->refs = 1;
+        countInPipeline(1);
+        pushFrameDepth(&blob_frames, frame, &frame->blob_queue_depth);
+    }
+
+    closeFrameQueue(&blob_frames);
+    capture_thread_ret = 1;
+    pthread_exit(&capture_thread_ret);
+}
+
+/* Function for the blob-finding stage.
+** Input: None.
+** Output: None (void).
+*/
+void * findImageBlobs() {
+    struct frame * frame;
+
+    while ((frame = popFrame(&blob_frames)) != NULL) {
+        findFrameBlobs(frame);
+        // nothing needs the raw image after its blobs are found, so its
+        // buffer goes back to the camera ring now rather than after solving
+        unlockFrameImage(frame);
+        pushFrameDepth(&solve_frames, frame, &frame->solve_queue_depth);
+    }
+
+    freeBlobBuffers();
+    closeFrameQueue(&solve_frames);
+    blob_thread_ret = 1;
+    pthread_exit(&blob_thread_ret);
+}
+
+/* Function for the solving stage: auto-focusing or Astrometry, then saving.
+** Input: None.
+** Output: None (void).
+*/
+void * solveImages() {
+    struct frame * frame;
+
+    while ((frame = popFrame(&solve_frames)) != NULL) {
+        if (solveFrame(frame) < 1) {
+            printf("Did not solve or timeout of Astrometry properly, or did not"
+                   " auto-focus properly.\n");
+        }
+
+        // send the solution and image to the clients (auto-focusing sends its
+        // own at the end of each focus step)
+        if (send_data) {
+            broadcastTelemetry(frame);
+        }
+        releaseFrame(frame);
+        countInPipeline(-1);
+    }
+
+    freeSolveBuffers();
+    solve_thread_ret = 1;
+    pthread_exit(&solve_thread_ret);
+}
+
+/* Function to allocate the frames and start the capture, blob-finding, and
+** solving threads.
+** Input: None.
+** Output: A flag indicating the pipeline started successfully or not.
+*/
+int startPipeline() {
+    initFrameQueue(&free_frames);
+    initFrameQueue(&blob_frames);
+    initFrameQueue(&solve_frames);
+
+    num_frames = num_camera_buffers;
+    for (int i = 0; i < num_frames; i++) {
+        memset(&all_frames[i], 0, sizeof(struct frame));
+        if (allocFrame(&all_frames[i]) < 1) {
+            return -1;
+        }
+        pushFrame(&free_frames, &all_frames[i]);
+    }
+
+    // threads that share the blob-finding work with the blob-finding stage
+    if (startWorkers() < 1) {
+        return -1;
+    }
+
+    // saves the images the solving stage hands it, and logs its solutions
+    if (startArchiver() < 1 || startObsLog(camera_handle) < 1) {
+        return -1;
+    }
+
+    // publishes each solved frame for Kst and other local readers (the
+    // camera runs without it if it cannot)
+    if (openLive(camera_handle, CAMERA_WIDTH, CAMERA_HEIGHT) < 1) {
+        printf("(*) Frames will not be published live.\n");
+    }
+
+    // keeps the slowly changing part of the AltAz conversion ready for it
+    if (startObserver() < 1) {
+        return -1;
+    }
+
+    if (pthread_create(&solve_thread_id, NULL, solveImages, NULL) != 0) {
+        fprintf(stderr, "Error creating solving thread: %s.\n",
+                strerror(errno));
+        return -1;
+    }
+
+    if (pthread_create(&blob_thread_id, NULL, findImageBlobs, NULL) != 0) {
+        fprintf(stderr, "Error creating blob-finding thread: %s.\n",
+                strerror(errno));
+        return -1;
+    }
+
+    if (pthread_create(&capture_thread_id, NULL, captureImages, NULL) != 0) {
+        fprintf(stderr, "Error creating capture thread: %s.\n",
+                strerror(errno));
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Function to wait for the pipeline to drain once we are shutting down and
+** release the frames.
+** Input: None.
+** Output: None (void).
+*/
+void joinPipeline() {
+    pthread_join(capture_thread_id, NULL);
+    pthread_join(blob_thread_id, NULL);
+    pthread_join(solve_thread_id, NULL);
+    stopWorkers();
+    stopObserver();
+    // write out the images and records still waiting to be saved
+    stopArchiver();
+    stopObsLog();
+    closeLive();
+    printPerfStats();
+    // disconnect the clients, which lets go of the frames they were sent
+    stopBroadcaster();
+
+    if (verbose) {
+        printf("\n> Freeing pipeline frames...\n");
+    }
+
+    // every frame should be back by now, but never free one that is held
+    for (int i = 0; i < num_frames; i++) {
+        if (all_frames[i].refs == 0) {
+            freeFrame(&all_frames[i]);
+        }
+    }
+
+    destroyFrameQueue(&free_frames);
+    destroyFrameQueue(&blob_frames);
+    destroyFrameQueue(&solve_frames);
+}
@@ -0,0 +1,82 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <time.h>
+#include <pthread.h>
+
+#include "params.h"
+#include "lens_adapter.h"
+
+// most frames (and camera ring buffers) that can be in flight at once
+#define MAX_FRAMES     16
+
+#pragma pack(push, 1)
+/* Readout geometry of an image: the area of interest (AOI) of the sensor, in
+** pixels after binning or subsampling */
+struct camera_geometry {
+    int factor;                 // binning or subsampling factor each way
+    int subsample;              // (bool) subsampled rather than binned
+    int x, y;                   // top left corner of the AOI [px]
+    int width, height;          // size of the AOI [px]
+    int stride;                 // bytes from one row of the image to the next
+};
+#pragma pack(pop)
+
+/* One exposure and everything computed from it as it moves down the pipeline */
+struct frame {
+    char * image;               // raw image (a locked camera ring buffer,
+                                // until its blobs are found)
+    struct camera_geometry geometry; // of the image (the output is unpadded)
+    char * output;              // filtered image
+    double * star_x;            // blob x coordinates [px]
+    double * star_y;            // blob y coordinates [px]
+    double * star_mags;         // blob magnitudes
+    int blobs_alloc;            // allocated length of the blob arrays
+    int blob_count;             // number of blobs found in this image
+    double hfd;                 // median half-flux diameter of its brightest
+                                // blobs [px] (NAN if too few were measured)
+    int hfd_blobs;              // number of blobs the diameter is the median of
+    int auto_focus;             // (bool) image was taken for auto-focusing
+    struct frame_params params; // settings as of the exposure
+    struct camera_params camera; // camera and lens settings, likewise
+    time_t seconds;             // time the exposure was started
+    struct tm tm_info;          // broken-down (leap-year-adjusted) GMT time
+    // stage timestamps (CLOCK_MONOTONIC)
+    struct timespec capture_start, capture_end;
+    struct timespec blobs_start, blobs_end;
+    struct timespec centroid_start, centroid_end;
+    struct timespec solve_start, solve_end;
+    // depth of the downstream queue right after this frame was handed off
+    int blob_queue_depth;
+    int solve_queue_depth;
+    // consumers still using the frame (clients are sent a copy); once this
+    // drops to zero the frame goes back to the pool
+    int refs;
+};
+
+/* Bounded FIFO of frames shared between two pipeline stages */
+struct frame_queue {
+    struct frame * frames[MAX_FRAMES];
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+void initFrameQueue(struct frame_queue * queue);
+void destroyFrameQueue(struct frame_queue * queue);
+void pushFrameDepth(struct frame_queue * queue, struct frame * frame,
+                    int * depth);
+void pushFrame(struct frame_queue * queue, struct frame * frame);
+struct frame * popFrame(struct frame_queue * queue);
+void releaseFrame(struct frame * frame);
+void closeFrameQueue(struct frame_queue * queue);
+int frameQueueDepth(struct frame_queue * queue);
+void waitForPipelineIdle();
+double msecBetween(struct timespec * start, struct timespec * end);
+int startPipeline();
+void joinPipeline();
+
+#endif
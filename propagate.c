@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <ueye.h>
+
+#include "camera.h"
+#include "commands.h"
+#include "pipeline.h"
+#include "propagate.h"
+
+// frames whose solution is propagated from the last solve before Astrometry
+// solves one again (0 turns propagation off)
+int propagate_frames = 0;
+
+/* Helper function to find the grid cell of a position (clamped to the grid).
+** Input: The reference, and the position.
+** Output: The column and row of the cell.
+*/
+static void gridCell(struct blob_reference * ref, double x, double y, int * cx,
+                     int * cy) {
+    *cx = (int) floor(x/PROPAGATE_RADIUS);
+    *cy = (int) floor(y/PROPAGATE_RADIUS);
+    if (*cx < 0) *cx = 0;
+    if (*cy < 0) *cy = 0;
+    if (*cx >= ref->grid_w) *cx = ref->grid_w - 1;
+    if (*cy >= ref->grid_h) *cy = ref->grid_h - 1;
+}
+
+/* Function to keep the brightest blobs of an image to match later images'
+** with.
+** Input: The reference to keep them in, the blob coordinates, brightest first,
+** the number of blobs, and the readout geometry of the image.
+** Output: None (void).
+*/
+void rememberBlobs(struct blob_reference * ref, double * x, double * y,
+                   int count, const struct camera_geometry * geometry) {
+    int grid_w = (int) (geometry->width/PROPAGATE_RADIUS) + 1;
+    int grid_h = (int) (geometry->height/PROPAGATE_RADIUS) + 1;
+
+    ref->count = 0;
+    if (grid_w*grid_h > ref->grid_alloc) {
+        int * head = realloc(ref->head, sizeof(int)*grid_w*grid_h);
+        if (head == NULL) {
+            fprintf(stderr, "Error allocating blob matching grid: %s.\n",
+                    strerror(errno));
+            return;
+        }
+        ref->head = head;
+        ref->grid_alloc = grid_w*grid_h;
+    }
+    ref->grid_w = grid_w;
+    ref->grid_h = grid_h;
+    memset(ref->head, -1, sizeof(int)*grid_w*grid_h);
+
+    if (count > PROPAGATE_BLOBS) {
+        count = PROPAGATE_BLOBS;
+    }
+    for (int b = 0; b < count; b++) {
+        int cx, cy;
+
+        ref->x[b] = x[b];
+        ref->y[b] = y[b];
+        gridCell(ref, x[b], y[b], &cx, &cy);
+        ref->next[b] = ref->head[cx + cy*grid_w];
+        ref->head[cx + cy*grid_w] = b;
+    }
+    ref->count = count;
+    ref->geometry = *geometry;
+}
+
+/* Function to forget the blobs of a reference (the next image cannot be
+** matched with them, e.g. after auto-focusing).
+** Input: The reference.
+** Output: None (void).
+*/
+void forgetBlobs(struct blob_reference * ref) {
+    ref->count = 0;
+}
+
+/* Helper function to find the reference blob nearest a position, within
+** PROPAGATE_RADIUS of it.
+** Input: The reference, and the position (in its image).
+** Output: The blob, or -1 if there is none that close.
+*/
+static int nearestBlob(struct blob_reference * ref, double x, double y) {
+    double best = PROPAGATE_RADIUS*PROPAGATE_RADIUS;
+    int nearest = -1;
+    int cx, cy;
+
+    gridCell(ref, x, y, &cx, &cy);
+    for (int gy = cy - 1; gy <= cy + 1; gy++) {
+        if (gy < 0 || gy >= ref->grid_h) continue;
+        for (int gx = cx - 1; gx <= cx + 1; gx++) {
+            if (gx < 0 || gx >= ref->grid_w) continue;
+            for (int b = ref->head[gx + gy*ref->grid_w]; b >= 0;
+                 b = ref->next[b]) {
+                double d2 = (ref->x[b] - x)*(ref->x[b] - x) +
+                            (ref->y[b] - y)*(ref->y[b] - y);
+                if (d2 <= best) {
+                    best = d2;
+                    nearest = b;
+                }
+            }
+        }
+    }
+
+    return nearest;
+}
+
+/* Helper function to find the shift most pairs of bright blobs agree on: each
+** pair of one of this image's brightest blobs and one of the reference's
+** proposes a shift, and the one the most other pairs are within
+** PROPAGATE_RADIUS of wins.
+** Input: The reference, this image's blob coordinates and number of blobs, and
+** where to store the shift.
+** Output: The number of pairs that agree with it.
+*/
+static int voteShift(struct blob_reference * ref, double * x, double * y,
+                     int count, double * dx, double * dy) {
+    int n = (count < PROPAGATE_VOTE_BLOBS) ? count : PROPAGATE_VOTE_BLOBS;
+    int m = (ref->count < PROPAGATE_VOTE_BLOBS) ? ref->count
+                                                : PROPAGATE_VOTE_BLOBS;
+    int best = 0;
+
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < m; j++) {
+            double sx = x[i] - ref->x[j], sy = y[i] - ref->y[j];
+            int votes = 0;
+
+            for (int k = 0; k < n; k++) {
+                for (int l = 0; l < m; l++) {
+                    if (fabs(x[k] - ref->x[l] - sx) <= PROPAGATE_RADIUS &&
+                        fabs(y[k] - ref->y[l] - sy) <= PROPAGATE_RADIUS) {
+                        votes++;
+                    }
+                }
+            }
+
+            if (votes > best) {
+                best = votes;
+                *dx = sx;
+                *dy = sy;
+            }
+        }
+    }
+
+    return best;
+}
+
+/* Function to find how the stars moved since the reference image: a shift the
+** brightest blobs agree on, then a rotation and shift fitted (in the least
+** squares sense) to the blobs that motion matches, a few times over.
+** Input: The reference, this image's blob coordinates, brightest first, the
+** number of blobs, its readout geometry, and where to store the motion.
+** Output: A flag indicating the motion matches enough blobs closely enough to
+** be trusted or not.
+*/
+int matchBlobs(struct blob_reference * ref, double * x, double * y, int count,
+               const struct camera_geometry * geometry,
+               struct image_motion * motion) {
+    char used[PROPAGATE_BLOBS];
+    double c = 1, s = 0, dx = 0, dy = 0;
+    int matches = 0;
+    double rms = 0;
+
+    if (count > PROPAGATE_BLOBS) {
+        count = PROPAGATE_BLOBS;
+    }
+    // blobs of a different readout are in different coordinates
+    if (ref->count < PROPAGATE_MIN_MATCHES || count < PROPAGATE_MIN_MATCHES ||
+        geometry->factor != ref->geometry.factor ||
+        geometry->subsample != ref->geometry.subsample ||
+        geometry->x != ref->geometry.x || geometry->y != ref->geometry.y ||
+        geometry->width != ref->geometry.width ||
+        geometry->height != ref->geometry.height) {
+        return -1;
+    }
+
+    if (voteShift(ref, x, y, count, &dx, &dy) < PROPAGATE_MIN_MATCHES) {
+        return -1;
+    }
+
+    for (int it = 0; it < PROPAGATE_ITERATIONS; it++) {
+        double pairs_p[PROPAGATE_BLOBS][2], pairs_q[PROPAGATE_BLOBS][2];
+        double pmx = 0, pmy = 0, qmx = 0, qmy = 0, dot = 0, cross = 0;
+
+        // match each blob (brightest first) with the nearest unmatched blob
+        // of the reference, taking the motion out of it
+        memset(used, 0, sizeof(used));
+        matches = 0;
+        for (int i = 0; i < count; i++) {
+            double ux = x[i] - dx, uy = y[i] - dy;
+            int b = nearestBlob(ref, c*ux + s*uy, -s*ux + c*uy);
+            if (b < 0 || used[b]) {
+                continue;
+            }
+            used[b] = 1;
+            pairs_p[matches][0] = ref->x[b];
+            pairs_p[matches][1] = ref->y[b];
+            pairs_q[matches][0] = x[i];
+            pairs_q[matches][1] = y[i];
+            pmx += ref->x[b];
+            pmy += ref->y[b];
+            qmx += x[i];
+            qmy += y[i];
+            matches++;
+        }
+        if (matches < PROPAGATE_MIN_MATCHES) {
+            return -1;
+        }
+
+        // the rotation about the centroids, then the shift between them
+        pmx /= matches;
+        pmy /= matches;
+        qmx /= matches;
+        qmy /= matches;
+        for (int k = 0; k < matches; k++) {
+            double px = pairs_p[k][0] - pmx, py = pairs_p[k][1] - pmy;
+            double qx = pairs_q[k][0] - qmx, qy = pairs_q[k][1] - qmy;
+            dot += px*qx + py*qy;
+            cross += px*qy - py*qx;
+        }
+        double rotation = atan2(cross, dot);
+        c = cos(rotation);
+        s = sin(rotation);
+        dx = qmx - (c*pmx - s*pmy);
+        dy = qmy - (s*pmx + c*pmy);
+
+        rms = 0;
+        for (int k = 0; k < matches; k++) {
+            double ex = c*pairs_p[k][0] - s*pairs_p[k][1] + dx - pairs_q[k][0];
+            double ey = s*pairs_p[k][0] + c*pairs_p[k][1] + dy - pairs_q[k][1];
+            rms += ex*ex + ey*ey;
+        }
+        rms = sqrt(rms/matches);
+        motion->rotation = rotation;
+    }
+
+    motion->dx = dx;
+    motion->dy = dy;
+    motion->matches = matches;
+    motion->rms = rms;
+
+    if (verbose) {
+        printf("(*) Matched %d blobs with the reference image: moved %.2f, "
+               "%.2f px and\n    rotated %.4f deg (rms %.2f px).\n", matches,
+               dx, dy, motion->rotation*(180.0/M_PI), rms);
+    }
+
+    return (rms <= PROPAGATE_MAX_RMS) ? 1 : -1;
+}
+
+/* Function to free the blob matching grid of a reference.
+** Input: The reference.
+** Output: None (void).
+*/
+void freeBlobReference(struct blob_reference * ref) {
+    free(ref->head);
+    ref->head = NULL;
+    ref->grid_alloc = 0;
+    ref->count = 0;
+}
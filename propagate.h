@@ -0,0 +1,52 @@
+#ifndef PROPAGATE_H
+#define PROPAGATE_H
+
+#include "pipeline.h"
+
+// brightest blobs of each image matched with the reference image's, and of
+// those, how many of each vote for the shift between them
+#define PROPAGATE_BLOBS       100
+#define PROPAGATE_VOTE_BLOBS  15
+// blobs this close once the motion is taken out are the same star [px]
+#define PROPAGATE_RADIUS      3.0
+// refinements of the motion from the blobs it matches
+#define PROPAGATE_ITERATIONS  3
+// a match this good or better is trusted to move the last solution
+#define PROPAGATE_MIN_MATCHES 6
+#define PROPAGATE_MAX_RMS     1.0   // [px]
+
+/* Rigid motion of the stars from the reference image to this one: a star at p
+** in the reference image is at R p + (dx, dy) in this one, where R rotates by
+** rotation (in the blob coordinates, y from the bottom) */
+struct image_motion {
+    double rotation;            // [rad]
+    double dx, dy;              // [px]
+    int matches;                // blobs matched
+    double rms;                 // residual of the matched blobs [px]
+};
+
+/* The brightest blobs of an image that later images are matched with (start
+** zeroed) */
+struct blob_reference {
+    // blob coordinates (y from the bottom, as findBlobs() leaves them)
+    double x[PROPAGATE_BLOBS], y[PROPAGATE_BLOBS];
+    int count;
+    struct camera_geometry geometry; // readout of the image
+    // grid of PROPAGATE_RADIUS cells over the image: the first of its blobs in
+    // each cell, and the next blob in the same cell
+    int * head;
+    int grid_alloc, grid_w, grid_h;
+    int next[PROPAGATE_BLOBS];
+};
+
+extern int propagate_frames;
+
+void rememberBlobs(struct blob_reference * ref, double * x, double * y,
+                   int count, const struct camera_geometry * geometry);
+void forgetBlobs(struct blob_reference * ref);
+int matchBlobs(struct blob_reference * ref, double * x, double * y, int count,
+               const struct camera_geometry * geometry,
+               struct image_motion * motion);
+void freeBlobReference(struct blob_reference * ref);
+
+#endif
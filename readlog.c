@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "obslog.h"
+#include "astrometry.h"
+
+/* Running totals for --summary */
+struct log_summary {
+    int sessions;
+    int records;
+    int solved;
+    int propagated;
+    double astrometry_sum, astrometry_max;
+    double camera_sum, camera_max;
+    long long first, last;
+};
+
+// (bool) what to print besides the records
+int show_notes = 0;
+int summary_only = 0;
+
+/* Helper function to display the usage of the reader.
+** Input: None.
+** Output: None (void).
+*/
+void displayUsage() {
+    printf("\nNAME:\n\treadlog - read and export Star Camera observing logs."
+           "\n\nUSAGE:\n\t./readlog [--notes] [--summary] [file.bin ...]\n\n"
+           "DESCRIPTION:\n\tWrites the records of binary observing logs (or "
+           "of standard input) to\n\tstandard output as CSV, in the same "
+           "columns as --log-format csv.\n\nOPTIONS:\n\t--notes\n\t\tAlso "
+           "write each session's note of the camera settings,\n\t\tas "
+           "comment lines.\n\n\t--summary\n\t\tOnly count the sessions and "
+           "records, and how long the\n\t\tsolves took.\n\n");
+}
+
+/* Function to read one binary log, writing out (or summing up) its records.
+** Input: The file, its name, and the running summary.
+** Output: A flag indicating the whole log was read or not.
+*/
+int readLog(FILE * fptr, char * name, struct log_summary * summary) {
+    // records of an unknown (later) version are longer than ours, so they are
+    // read whole and then cut down
+    size_t record_size = 0;
+    char * record_buf = NULL;
+    uint32_t version = 0;
+    char magic[8];
+    size_t got;
+    int truncated = 0;
+
+    while ((got = fread(magic, 1, sizeof(magic), fptr)) > 0) {
+        if (got < sizeof(magic)) {
+            truncated = 1;
+            break;
+        }
+
+        if (memcmp(magic, OBS_LOG_MAGIC, sizeof(magic)) == 0) {
+            struct obs_log_header header;
+            char * note;
+
+            memcpy(header.magic, magic, sizeof(magic));
+            if (fread((char *) &header + sizeof(magic),
+                      sizeof(header) - sizeof(magic), 1, fptr) != 1) {
+                truncated = 1;
+                break;
+            }
+
+            if (header.version < 1 ||
+                header.record_size < ((header.version == 1) ?
+                                      OBS_RECORD_V1_SIZE :
+                                      sizeof(struct obs_record))) {
+                fprintf(stderr, "%s: unsupported log version %u (records of "
+                                "%u bytes).\n", name, header.version,
+                        header.record_size);
+                free(record_buf);
+                return -1;
+            }
+
+            if (header.record_size != record_size) {
+                free(record_buf);
+                record_size = header.record_size;
+                if ((record_buf = malloc(record_size)) == NULL) {
+                    fprintf(stderr, "Error allocating record: %s.\n",
+                            strerror(errno));
+                    return -1;
+                }
+            }
+
+            if ((note = malloc(header.note_size + 1)) == NULL) {
+                fprintf(stderr, "Error allocating session note: %s.\n",
+                        strerror(errno));
+                free(record_buf);
+                return -1;
+            }
+            if (fread(note, 1, header.note_size, fptr) != header.note_size) {
+                free(note);
+                truncated = 1;
+                break;
+            }
+            note[header.note_size] = '\0';
+            version = header.version;
+
+            if (show_notes && !summary_only) {
+                for (char * line = strtok(note, "\n"); line != NULL;
+                     line = strtok(NULL, "\n")) {
+                    printf("# %s\n", line);
+                }
+            }
+            free(note);
+            summary->sessions++;
+            continue;
+        }
+
+        if (record_buf == NULL) {
+            fprintf(stderr, "%s: not an observing log.\n", name);
+            return -1;
+        }
+
+        // the rest of the record
+        memcpy(record_buf, magic, sizeof(magic));
+        if (fread(record_buf + sizeof(magic), 1, record_size - sizeof(magic),
+                  fptr) != record_size - sizeof(magic)) {
+            truncated = 1;
+            break;
+        }
+
+        // (a version 1 record is shorter, and only tells if it was solved)
+        struct obs_record record = {0};
+        memcpy(&record, record_buf, (record_size < sizeof(record)) ?
+                                    record_size : sizeof(record));
+        if (version < 2) {
+            record.source = record.solved ? SOLUTION_SOLVED : SOLUTION_NONE;
+        }
+        if (summary->records == 0) {
+            summary->first = record.seconds;
+        }
+        summary->last = record.seconds;
+        summary->records++;
+        if (record.solved) {
+            summary->solved++;
+            summary->astrometry_sum += record.astrometry_time;
+            if (record.astrometry_time > summary->astrometry_max) {
+                summary->astrometry_max = record.astrometry_time;
+            }
+        }
+        if (record.source == SOLUTION_PROPAGATED) {
+            summary->propagated++;
+        }
+        summary->camera_sum += record.camera_time;
+        if (record.camera_time > summary->camera_max) {
+            summary->camera_max = record.camera_time;
+        }
+
+        if (!summary_only) {
+            writeObsCsvRecord(stdout, &record);
+        }
+    }
+
+    free(record_buf);
+    if (ferror(fptr)) {
+        fprintf(stderr, "Error reading %s: %s.\n", name, strerror(errno));
+        return -1;
+    }
+    if (truncated) {
+        // the camera may still be writing it
+        fprintf(stderr, "%s: ends in the middle of a block.\n", name);
+    }
+
+    return 1;
+}
+
+/* Driver function for the observing log reader.
+** Input: Number of command-line arguments passed and an array of those argu-
+** ments.
+** Output: 0 if every log was read, 1 otherwise.
+*/
+int main(int argc, char * argv[]) {
+    static const struct option long_options[] = {
+        { "notes",   no_argument, NULL, 'n' },
+        { "summary", no_argument, NULL, 's' },
+        { "help",    no_argument, NULL, 'h' },
+        { NULL,      no_argument, NULL,  0  },
+    };
+    struct log_summary summary = {0};
+    int opt, ret = 0;
+
+    while ((opt = getopt_long(argc, argv, "nsh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                show_notes = 1;
+                break;
+            case 's':
+                summary_only = 1;
+                break;
+            default:
+                displayUsage();
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (!summary_only) {
+        writeObsCsvHeader(stdout);
+    }
+
+    if (optind == argc) {
+        ret = (readLog(stdin, "stdin", &summary) == 1) ? 0 : 1;
+    }
+    for (int i = optind; i < argc; i++) {
+        FILE * fptr;
+
+        if ((fptr = fopen(argv[i], "r")) == NULL) {
+            fprintf(stderr, "Could not open %s: %s.\n", argv[i],
+                    strerror(errno));
+            ret = 1;
+            continue;
+        }
+        if (readLog(fptr, argv[i], &summary) != 1) {
+            ret = 1;
+        }
+        fclose(fptr);
+    }
+
+    if (summary_only) {
+        printf("Sessions: %d\nRecords: %d (%lld to %lld)\nSolved: %d\n"
+               "Propagated: %d\n", summary.sessions, summary.records,
+               summary.first, summary.last, summary.solved,
+               summary.propagated);
+        if (summary.solved > 0) {
+            printf("Astrometry solve time: mean %.3f msec, max %.3f msec\n",
+                   summary.astrometry_sum/summary.solved,
+                   summary.astrometry_max);
+        }
+        if (summary.records > 0) {
+            printf("Camera time: mean %.3f msec, max %.3f msec\n",
+                   summary.camera_sum/summary.records, summary.camera_max);
+        }
+    }
+
+    return ret;
+}
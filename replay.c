@@ -0,0 +1,533 @@
+// for strptime() and asprintf()
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <ueye.h>
+
+#include "camera.h"
+#include "astrometry.h"
+#include "pipeline.h"
+#include "workers.h"
+#include "centroid.h"
+#include "archive.h"
+#include "obslog.h"
+#include "perf.h"
+#include "blobs.h"
+
+// most images, swept parameters, and values of one parameter in a replay
+#define MAX_REPLAY_FRAMES  1024
+#define MAX_SWEEPS         8
+#define MAX_SWEEP_VALUES   16
+
+/* A setting the replay can sweep, and where it lives */
+struct sweep_param {
+    const char * name;
+    int * int_value;            // one of these two is set
+    float * float_value;
+};
+
+/* Values to try for one setting */
+struct sweep {
+    struct sweep_param * param;
+    double values[MAX_SWEEP_VALUES];
+    int num_values;
+};
+
+/* One saved image, loaded before any timing starts */
+struct replay_frame {
+    char * image;
+    int offset;                 // of the first pixel of the AOI in the image
+    struct camera_geometry geometry;
+    struct tm tm_info;          // when it was taken (for the AltAz)
+};
+
+// commands.c provides these when running the camera; the replay has no
+// clients and never auto-focuses
+int verbose = 0;
+int cancelling_auto_focus = 0;
+
+struct sweep_param sweep_params[] = {
+    { "threads",                &num_workers,                          NULL },
+    { "spike_limit",            &all_blob_params.spike_limit,          NULL },
+    { "dynamic_hot_pixels",     &all_blob_params.dynamic_hot_pixels,   NULL },
+    { "r_smooth",               &all_blob_params.r_smooth,             NULL },
+    { "high_pass_filter",       &all_blob_params.high_pass_filter,     NULL },
+    { "r_high_pass_filter",     &all_blob_params.r_high_pass_filter,   NULL },
+    { "centroid_search_border", &all_blob_params.centroid_search_border,
+                                                                       NULL },
+    { "n_sigma",                NULL,             &all_blob_params.n_sigma },
+    { "unique_star_spacing",    &all_blob_params.unique_star_spacing,  NULL },
+    { "centroid",               &centroid_mode,                        NULL },
+    { "background_mode",        &all_blob_params.background_mode,      NULL },
+    { "background_tile",        &all_blob_params.background_tile,      NULL },
+    { "solve_blobs",            &max_solve_blobs,                      NULL },
+};
+#define NUM_SWEEP_PARAMS ((int) (sizeof(sweep_params)/sizeof(sweep_params[0])))
+
+// stages reported for every run of the replay
+int report_stages[] = {PERF_MASK, PERF_FILTER, PERF_STATS, PERF_PEAKS,
+                       PERF_CENTROID, PERF_SORT, PERF_SOLVE, PERF_ALTAZ};
+#define NUM_REPORT_STAGES \
+        ((int) (sizeof(report_stages)/sizeof(report_stages[0])))
+
+struct replay_frame replay_frames[MAX_REPLAY_FRAMES];
+int num_replay_frames = 0;
+struct sweep sweeps[MAX_SWEEPS];
+int num_sweeps = 0;
+// area of the (full-resolution) images the replay is limited to, as if it had
+// been the camera's AOI, and whether it was given
+struct camera_geometry replay_aoi = {0};
+int crop_replay = 0;
+// the blob-finding space of the camera the images are replayed as
+struct blob_context replay_blobs;
+
+/* The replay has no clients, so there is nothing to publish */
+int broadcastTelemetry(struct frame * frame) {
+    return -1;
+}
+
+/* Helper function to display the usage of the replay.
+** Input: None.
+** Output: None (void).
+*/
+void displayUsage() {
+    printf("\nNAME:\n\treplay - run saved images through blob-finding and "
+           "solving without\n\tthe camera.\n\nUSAGE:\n\t./replay [options] "
+           "<image or directory> ...\n\nDESCRIPTION:\n\tLoads the FITS and "
+           "BMP images given (or in the directories given),\n\tthen runs "
+           "every one through the mask, filters, peak scan,\n\tcentroiding "
+           "and (unless --no-solve) Astrometry, once for every\n\tcombination"
+           " of the swept settings. Writes one CSV line per\n\tcombination "
+           "to standard output: the settings, frames/s, mean\n\tblob count, "
+           "solve rate, and the mean, p50, and p99 of each stage\n\t(msec, "
+           "over the last %d images of the combination).\n\nOPTIONS:\n\t"
+           "--sweep <setting>=<value>,<value>,...\n\t\tTry each value of a "
+           "setting (can be given up to %d\n\t\ttimes). Settings are threads"
+           " and the blob parameters:\n\t\tspike_limit, dynamic_hot_pixels, "
+           "r_smooth,\n\t\thigh_pass_filter, r_high_pass_filter,\n\t\t"
+           "centroid_search_border, n_sigma, unique_star_spacing,\n\t\t"
+           "background_mode (1 global, 2 tiled), background_tile,\n\t\t"
+           "centroid (none, moment, or gauss), and solve_blobs\n\t\t(the "
+           "most blobs the solver is given, 0 for all).\n\n\t--repeat <count>\n\t\t"
+           "Run the images this many times per combination\n\t\t(default is "
+           "1).\n\n\t--aoi <x>,<y>,<width>,<height>\n\t\tOnly use this "
+           "part of the (full-resolution) images,\n\t\tas the camera's "
+           "--aoi would.\n\n\t--solvers <count>\n\t\tNumber of solvers the index "
+           "files are split between.\n\n\t--no-solve\n\t\tOnly find the "
+           "blobs.\n\n\t-v, --verbose\n\t\tShow the camera program's output "
+           "(on standard error).\n\n", PERF_WINDOW, MAX_SWEEPS);
+}
+
+/* Function to parse a --sweep argument.
+** Input: The argument (setting=value,value,...).
+** Output: A flag indicating the argument was valid or not.
+*/
+int parseSweep(char * arg) {
+    char * values = strchr(arg, '=');
+    struct sweep * sweep = &sweeps[num_sweeps];
+
+    if (values == NULL || num_sweeps == MAX_SWEEPS) {
+        return -1;
+    }
+    *values++ = '\0';
+
+    sweep->param = NULL;
+    for (int p = 0; p < NUM_SWEEP_PARAMS; p++) {
+        if (strcmp(arg, sweep_params[p].name) == 0) {
+            sweep->param = &sweep_params[p];
+        }
+    }
+    if (sweep->param == NULL) {
+        fprintf(stderr, "Unknown setting '%s'.\n", arg);
+        return -1;
+    }
+
+    sweep->num_values = 0;
+    for (char * value = strtok(values, ","); value != NULL;
+         value = strtok(NULL, ",")) {
+        double v;
+
+        if (sweep->num_values == MAX_SWEEP_VALUES) {
+            fprintf(stderr, "Too many values for %s.\n", arg);
+            return -1;
+        }
+
+        if (sweep->param->int_value == &centroid_mode &&
+            parseCentroidMode(value) >= 0) {
+            v = parseCentroidMode(value);
+        } else {
+            char * end;
+            v = strtod(value, &end);
+            if (*end != '\0') {
+                fprintf(stderr, "Invalid value '%s' for %s.\n", value, arg);
+                return -1;
+            }
+        }
+        sweep->values[sweep->num_values++] = v;
+    }
+
+    if (sweep->num_values == 0) {
+        return -1;
+    }
+    num_sweeps++;
+
+    return 1;
+}
+
+/* Helper function to get when an image was taken: from its name, as the
+** archiver names them, or else from when the file was written.
+** Input: The path and where to store the time.
+** Output: None (void).
+*/
+void replayFrameTime(char * path, struct tm * tm_info) {
+    const char * name = strrchr(path, '/');
+    struct stat st;
+
+    name = (name != NULL) ? name + 1 : path;
+    for (const char * p = name; *p != '\0'; p++) {
+        struct tm parsed = {0};
+        if (strptime(p, "%Y-%m-%d_%H:%M:%S", &parsed) != NULL) {
+            *tm_info = parsed;
+            return;
+        }
+    }
+
+    if (stat(path, &st) == 0) {
+        gmtime_r(&st.st_mtime, tm_info);
+    } else {
+        time_t now = time(NULL);
+        gmtime_r(&now, tm_info);
+    }
+}
+
+/* Function to load one image for the replay.
+** Input: The path.
+** Output: A flag indicating the image was loaded or not.
+*/
+int addReplayFrame(char * path) {
+    struct replay_frame * frame = &replay_frames[num_replay_frames];
+
+    if (num_replay_frames == MAX_REPLAY_FRAMES) {
+        fprintf(stderr, "More than %d images; leaving out %s.\n",
+                MAX_REPLAY_FRAMES, path);
+        return -1;
+    }
+
+    if ((frame->image = malloc(CAMERA_WIDTH*CAMERA_HEIGHT)) == NULL) {
+        fprintf(stderr, "Error allocating image: %s.\n", strerror(errno));
+        return -1;
+    }
+
+    if (loadArchivedImage(path, frame->image, &frame->geometry) != 1) {
+        free(frame->image);
+        return -1;
+    }
+
+    // cut out the AOI by starting at its corner and stepping over the rest of
+    // every row, as the camera leaves a wider row in memory
+    frame->offset = 0;
+    if (crop_replay) {
+        if (frame->geometry.factor != 1 ||
+            frame->geometry.width != CAMERA_WIDTH ||
+            frame->geometry.height != CAMERA_HEIGHT) {
+            fprintf(stderr, "%s is not a full-resolution image; leaving it "
+                            "out.\n", path);
+            free(frame->image);
+            return -1;
+        }
+        frame->offset = replay_aoi.y*frame->geometry.stride + replay_aoi.x;
+        frame->geometry.x = replay_aoi.x;
+        frame->geometry.y = replay_aoi.y;
+        frame->geometry.width = replay_aoi.width;
+        frame->geometry.height = replay_aoi.height;
+    }
+    replayFrameTime(path, &frame->tm_info);
+    num_replay_frames++;
+
+    return 1;
+}
+
+/* Helper function for sorting file names with qsort() */
+int compareNames(const void * a, const void * b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Function to load the images in a directory in order of name (which is the
+** order they were taken in), leaving out the latest image links.
+** Input: The directory.
+** Output: A flag indicating the directory could be read or not.
+*/
+int addReplayDirectory(char * dir_path) {
+    char * names[MAX_REPLAY_FRAMES];
+    int num_names = 0;
+    struct dirent * entry;
+    DIR * dir;
+
+    if ((dir = opendir(dir_path)) == NULL) {
+        fprintf(stderr, "Could not open %s: %s.\n", dir_path, strerror(errno));
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL && num_names < MAX_REPLAY_FRAMES) {
+        const char * extension = strrchr(entry->d_name, '.');
+        if (extension == NULL || strncmp(entry->d_name, "latest_", 7) == 0 ||
+            (strcmp(extension, ".fits") != 0 && strcmp(extension, ".fit") != 0
+             && strcmp(extension, ".bmp") != 0)) {
+            continue;
+        }
+        if (asprintf(&names[num_names], "%s/%s", dir_path,
+                     entry->d_name) == -1) {
+            break;
+        }
+        num_names++;
+    }
+    closedir(dir);
+
+    qsort(names, num_names, sizeof(char *), compareNames);
+    for (int i = 0; i < num_names; i++) {
+        addReplayFrame(names[i]);
+        free(names[i]);
+    }
+
+    return 1;
+}
+
+/* Helper function to set a swept setting.
+** Input: The setting and its value.
+** Output: None (void).
+*/
+void applySetting(struct sweep_param * param, double value) {
+    if (param->int_value != NULL) {
+        *param->int_value = (int) value;
+    } else {
+        *param->float_value = (float) value;
+    }
+}
+
+/* Function to write the column names of the report.
+** Input: The report file.
+** Output: None (void).
+*/
+void writeReportHeader(FILE * report) {
+    for (int p = 0; p < NUM_SWEEP_PARAMS; p++) {
+        fprintf(report, "%s,", sweep_params[p].name);
+    }
+    fprintf(report, "frames,seconds,fps,blob_fps,mean_blobs,solved,solve_rate");
+    for (int s = 0; s < NUM_REPORT_STAGES; s++) {
+        const char * name = perfStageName(report_stages[s]);
+        fprintf(report, ",%s_mean,%s_p50,%s_p99", name, name, name);
+    }
+    fprintf(report, "\n");
+}
+
+/* Function to run every image through the pipeline with the current settings
+** and report how it went.
+** Input: The report file, how many times to run the images, and whether to
+** solve them.
+** Output: A flag indicating the run completed or not.
+*/
+int runReplay(FILE * report, int repeat, int solve) {
+    static char output[CAMERA_WIDTH*CAMERA_HEIGHT];
+    struct timespec start, end, blobs_start, blobs_end;
+    struct perf_stats stats;
+    double blob_msec = 0, total_blobs = 0;
+    int frames = 0, solved = 0;
+
+    if (startWorkers() < 1) {
+        return -1;
+    }
+    resetPerfStats();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < repeat; r++) {
+        for (int f = 0; f < num_replay_frames; f++) {
+            struct obs_record record = {0};
+            int blob_count;
+
+            clock_gettime(CLOCK_MONOTONIC, &blobs_start);
+            struct replay_frame * frame = &replay_frames[f];
+            blob_count = findBlobs(&replay_blobs, frame->image + frame->offset,
+                                   &frame->geometry, &all_blob_params, output);
+            clock_gettime(CLOCK_MONOTONIC, &blobs_end);
+            blob_msec += msecBetween(&blobs_start, &blobs_end);
+            total_blobs += blob_count;
+
+            if (solve && lostInSpace(replay_blobs.star_x, replay_blobs.star_y,
+                                     replay_blobs.star_mags, blob_count,
+                                     &frame->geometry, &frame->tm_info,
+                                     &record) == 1) {
+                solved++;
+            }
+            frames++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stopWorkers();
+
+    getPerfStats(&stats);
+    double seconds = msecBetween(&start, &end)/1000.0;
+
+    for (int p = 0; p < NUM_SWEEP_PARAMS; p++) {
+        if (sweep_params[p].int_value != NULL) {
+            fprintf(report, "%d,", *sweep_params[p].int_value);
+        } else {
+            fprintf(report, "%g,", *sweep_params[p].float_value);
+        }
+    }
+    fprintf(report, "%d,%.3f,%.3f,%.3f,%.2f,%d,%.3f", frames, seconds,
+            frames/seconds, frames/(blob_msec/1000.0), total_blobs/frames,
+            solved, solve ? (double) solved/frames : 0.0);
+    for (int s = 0; s < NUM_REPORT_STAGES; s++) {
+        struct stage_stats * stage = &stats.stages[report_stages[s]];
+        fprintf(report, ",%.3f,%.3f,%.3f", stage->mean, stage->p50,
+                stage->p99);
+    }
+    fprintf(report, "\n");
+    fflush(report);
+
+    return 1;
+}
+
+/* Driver function for the replay.
+** Input: Number of command-line arguments passed and an array of those argu-
+** ments.
+** Output: 0 if every combination ran, 1 otherwise.
+*/
+int main(int argc, char * argv[]) {
+    static const struct option long_options[] = {
+        { "sweep",    required_argument, NULL, 's' },
+        { "repeat",   required_argument, NULL, 'r' },
+        { "solvers",  required_argument, NULL, 'k' },
+        { "aoi",      required_argument, NULL, 'a' },
+        { "no-solve", no_argument,       NULL, 'n' },
+        { "verbose",  no_argument,       NULL, 'v' },
+        { "help",     no_argument,       NULL, 'h' },
+        { NULL,       no_argument,       NULL,  0  },
+    };
+    int opt, repeat = 1, solve = 1, ret = 0;
+    int combo[MAX_SWEEPS] = {0};
+    FILE * report;
+
+    while ((opt = getopt_long(argc, argv, "vh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                if (parseSweep(optarg) != 1) {
+                    fprintf(stderr, "Invalid sweep '%s'.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                repeat = atoi(optarg);
+                break;
+            case 'k':
+                num_solvers = atoi(optarg);
+                break;
+            case 'a':
+                if (sscanf(optarg, "%d,%d,%d,%d", &replay_aoi.x,
+                           &replay_aoi.y, &replay_aoi.width,
+                           &replay_aoi.height) != 4) {
+                    fprintf(stderr, "Invalid AOI '%s'.\n", optarg);
+                    return 1;
+                }
+                crop_replay = 1;
+                break;
+            case 'n':
+                solve = 0;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                displayUsage();
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (optind == argc || repeat < 1 || num_solvers < 1 ||
+        num_solvers > MAX_SOLVERS) {
+        displayUsage();
+        return 1;
+    }
+
+    replay_aoi.factor = 1;
+    if (crop_replay && checkGeometry(&replay_aoi) != 1) {
+        return 1;
+    }
+
+    // the report goes to standard output, and everything the camera program
+    // prints goes to standard error (or nowhere)
+    if ((report = fdopen(dup(STDOUT_FILENO), "w")) == NULL) {
+        fprintf(stderr, "Error opening report: %s.\n", strerror(errno));
+        return 1;
+    }
+    if (verbose) {
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    } else if (freopen("/dev/null", "w", stdout) == NULL) {
+        fprintf(stderr, "Error silencing output: %s.\n", strerror(errno));
+    }
+
+    for (int i = optind; i < argc; i++) {
+        struct stat st;
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            addReplayDirectory(argv[i]);
+        } else {
+            addReplayFrame(argv[i]);
+        }
+    }
+
+    if (num_replay_frames == 0) {
+        fprintf(stderr, "No images to replay.\n");
+        return 1;
+    }
+    fprintf(stderr, "Replaying %d image(s).\n", num_replay_frames);
+
+    initBlobContext(&replay_blobs, CAMERA_WIDTH, CAMERA_HEIGHT, STATIC_HP_MASK,
+                    STATIC_HP_SIDECAR);
+    if (solve && initAstrometry() != 1) {
+        fprintf(stderr, "Could not start Astrometry.\n");
+        return 1;
+    }
+
+    // run every combination of the swept values, the last sweep changing
+    // fastest
+    writeReportHeader(report);
+    for (;;) {
+        for (int w = 0; w < num_sweeps; w++) {
+            applySetting(sweeps[w].param, sweeps[w].values[combo[w]]);
+        }
+
+        if (num_workers < 1 || num_workers > MAX_WORKERS) {
+            fprintf(stderr, "Skipping %d threads (choose 1-%d).\n",
+                    num_workers, MAX_WORKERS);
+            ret = 1;
+        } else if (runReplay(report, repeat, solve) != 1) {
+            ret = 1;
+        }
+
+        int w = num_sweeps - 1;
+        while (w >= 0 && ++combo[w] == sweeps[w].num_values) {
+            combo[w--] = 0;
+        }
+        if (w < 0) {
+            break;
+        }
+    }
+
+    if (solve) {
+        closeAstrometry();
+    }
+    freeBlobContext(&replay_blobs);
+    for (int f = 0; f < num_replay_frames; f++) {
+        free(replay_frames[f].image);
+    }
+    fclose(report);
+
+    return ret;
+}
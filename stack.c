@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <ueye.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "camera.h"
+#include "commands.h"
+#include "perf.h"
+#include "stack.h"
+
+// exposures blob-finding runs on the sum of (1 finds blobs in each exposure
+// on its own)
+int stack_frames = 1;
+
+/* Kernel for one row of the stack: adds the unmasked pixels of an exposure to
+** the sums (and counts them), or takes them back out.
+** Input: The sums and counts, the exposure's pixels and mask, the number of
+** pixels, and whether to take the pixels out rather than add them.
+** Output: None (void).
+*/
+typedef void (* stack_kernel)(uint16_t * sum, uint8_t * count,
+                              const unsigned char * image,
+                              const unsigned char * mask, int n, int subtract);
+
+static void stackRowScalar(uint16_t * sum, uint8_t * count,
+                           const unsigned char * image,
+                           const unsigned char * mask, int n, int subtract) {
+    for (int k = 0; k < n; k++) {
+        if (!mask[k]) {
+            continue;
+        }
+        if (subtract) {
+            sum[k] -= image[k];
+            count[k]--;
+        } else {
+            sum[k] += image[k];
+            count[k]++;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void stackRowAVX2(uint16_t * sum, uint8_t * count,
+                         const unsigned char * image,
+                         const unsigned char * mask, int n, int subtract) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    int k = 0;
+
+    for (; k + 32 <= n; k += 32) {
+        __m256i m = _mm256_loadu_si256((__m256i *) (mask + k));
+        // all ones where the pixel is unmasked
+        __m256i keep = _mm256_cmpgt_epi8(m, zero);
+        __m256i v = _mm256_and_si256(
+            _mm256_loadu_si256((__m256i *) (image + k)), keep);
+        __m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v));
+        __m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1));
+        __m256i s0 = _mm256_loadu_si256((__m256i *) (sum + k));
+        __m256i s1 = _mm256_loadu_si256((__m256i *) (sum + k + 16));
+        __m256i c = _mm256_loadu_si256((__m256i *) (count + k));
+
+        keep = _mm256_and_si256(keep, one);
+        if (subtract) {
+            s0 = _mm256_sub_epi16(s0, lo);
+            s1 = _mm256_sub_epi16(s1, hi);
+            c = _mm256_sub_epi8(c, keep);
+        } else {
+            s0 = _mm256_add_epi16(s0, lo);
+            s1 = _mm256_add_epi16(s1, hi);
+            c = _mm256_add_epi8(c, keep);
+        }
+        _mm256_storeu_si256((__m256i *) (sum + k), s0);
+        _mm256_storeu_si256((__m256i *) (sum + k + 16), s1);
+        _mm256_storeu_si256((__m256i *) (count + k), c);
+    }
+
+    stackRowScalar(sum + k, count + k, image + k, mask + k, n - k, subtract);
+}
+#elif defined(__aarch64__)
+static void stackRowNEON(uint16_t * sum, uint8_t * count,
+                         const unsigned char * image,
+                         const unsigned char * mask, int n, int subtract) {
+    const uint8x16_t one = vdupq_n_u8(1);
+    int k = 0;
+
+    for (; k + 16 <= n; k += 16) {
+        uint8x16_t m = vld1q_u8(mask + k);
+        // all ones where the pixel is unmasked
+        uint8x16_t keep = vtstq_u8(m, m);
+        uint8x16_t v = vandq_u8(vld1q_u8(image + k), keep);
+        uint16x8_t s0 = vld1q_u16(sum + k);
+        uint16x8_t s1 = vld1q_u16(sum + k + 8);
+        uint8x16_t c = vld1q_u8(count + k);
+
+        keep = vandq_u8(keep, one);
+        if (subtract) {
+            s0 = vsubw_u8(s0, vget_low_u8(v));
+            s1 = vsubw_u8(s1, vget_high_u8(v));
+            c = vsubq_u8(c, keep);
+        } else {
+            s0 = vaddw_u8(s0, vget_low_u8(v));
+            s1 = vaddw_u8(s1, vget_high_u8(v));
+            c = vaddq_u8(c, keep);
+        }
+        vst1q_u16(sum + k, s0);
+        vst1q_u16(sum + k + 8, s1);
+        vst1q_u8(count + k, c);
+    }
+
+    stackRowScalar(sum + k, count + k, image + k, mask + k, n - k, subtract);
+}
+#endif
+
+/* Helper function to pick the fastest stack kernel this CPU supports.
+** Input: None.
+** Output: The kernel.
+*/
+static stack_kernel chooseStackKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        return stackRowAVX2;
+    }
+#elif defined(__aarch64__)
+    return stackRowNEON;
+#endif
+    return stackRowScalar;
+}
+
+static stack_kernel stack_row = NULL;
+static pthread_once_t stack_once = PTHREAD_ONCE_INIT;
+
+/* Helper function to pick the stack kernel once */
+static void setStackKernel() {
+    stack_row = chooseStackKernel();
+}
+
+/* Function to set up an empty stack for a sensor.
+** Input: The stack, and the size of the sensor.
+** Output: None (void).
+*/
+void initFrameStack(struct frame_stack * stack, int width, int height) {
+    memset(stack, 0, sizeof(struct frame_stack));
+    stack->width = width;
+    stack->height = height;
+}
+
+/* Function to empty a stack (the next exposure is its new anchor).
+** Input: The stack.
+** Output: None (void).
+*/
+void resetFrameStack(struct frame_stack * stack) {
+    stack->frames = 0;
+    stack->next = 0;
+    forgetBlobs(&stack->anchor);
+}
+
+/* Helper function to allocate the sums, the stacked image and the ring the
+** first time they are needed.
+** Input: The stack.
+** Output: A flag indicating they could be allocated or not.
+*/
+static int allocFrameStack(struct frame_stack * stack) {
+    int pixels = stack->width*stack->height;
+
+    if (stack->ring_alloc >= stack_frames) {
+        return 1;
+    }
+
+    if (stack->sum == NULL) {
+        stack->sum = malloc(pixels*sizeof(uint16_t));
+        stack->count = malloc(pixels);
+        stack->image = malloc(pixels);
+        if (stack->sum == NULL || stack->count == NULL ||
+            stack->image == NULL) {
+            fprintf(stderr, "Error allocating frame stack: %s.\n",
+                    strerror(errno));
+            freeFrameStack(stack);
+            return -1;
+        }
+    }
+
+    for (int k = stack->ring_alloc; k < stack_frames; k++) {
+        stack->images[k] = malloc(pixels);
+        stack->masks[k] = malloc(pixels);
+        if (stack->images[k] == NULL || stack->masks[k] == NULL) {
+            fprintf(stderr, "Error allocating frame stack ring: %s.\n",
+                    strerror(errno));
+            free(stack->images[k]);
+            free(stack->masks[k]);
+            stack->images[k] = stack->masks[k] = NULL;
+            return -1;
+        }
+        stack->ring_alloc = k + 1;
+    }
+
+    return 1;
+}
+
+/* Helper function to tell if two readouts are of the same pixels.
+** Input: The readout geometries.
+** Output: If they are (or not).
+*/
+static int sameReadout(const struct camera_geometry * a,
+                       const struct camera_geometry * b) {
+    return a->factor == b->factor && a->subsample == b->subsample &&
+           a->x == b->x && a->y == b->y && a->width == b->width &&
+           a->height == b->height;
+}
+
+/* Helper function to add an exposure in the ring to the sums, or take it back
+** out of them, where it overlaps the anchor.
+** Input: The stack, the ring slot of the exposure, and whether to take it out
+** rather than add it.
+** Output: None (void).
+*/
+static void stackExposure(struct frame_stack * stack, int slot, int subtract) {
+    int w = stack->geometry.width, h = stack->geometry.height;
+    int dx = stack->dx[slot], dy = stack->dy[slot];
+    int i0 = (dx < 0) ? -dx : 0, i1 = (dx > 0) ? w - dx : w;
+    int j0 = (dy < 0) ? -dy : 0, j1 = (dy > 0) ? h - dy : h;
+
+    for (int j = j0; j < j1; j++) {
+        int from = (j + dy)*w + i0 + dx;
+        stack_row(stack->sum + j*w + i0, stack->count + j*w + i0,
+                  stack->images[slot] + from, stack->masks[slot] + from,
+                  i1 - i0, subtract);
+    }
+}
+
+/* Helper function to make the stacked image, in the image coordinates of the
+** last exposure. Each pixel is the sum of n exposures less n times their mean
+** level, over sqrt(n), plus the mean level: the noise stays that of a single
+** exposure (so the blob-finding thresholds in sigmas keep their meaning), and
+** a star comes out sqrt(n) times as far above it.
+** Input: The stack.
+** Output: None (void).
+*/
+static void composeStack(struct frame_stack * stack) {
+    int w = stack->geometry.width, h = stack->geometry.height;
+    int last = (stack->next + stack_frames - 1) % stack_frames;
+    int dx = stack->dx[last], dy = stack->dy[last];
+    double scale[STACK_MAX_FRAMES + 1];
+    double level = 0;
+    unsigned char * out = (unsigned char *) stack->image;
+
+    for (int k = 0; k < stack->frames; k++) {
+        level += stack->means[(last + stack_frames - k) % stack_frames];
+    }
+    level /= stack->frames;
+    unsigned char fill = (unsigned char) fmin(fmax(round(level), 0), 255);
+
+    scale[0] = 0;
+    for (int n = 1; n <= STACK_MAX_FRAMES; n++) {
+        scale[n] = 1.0/sqrt(n);
+    }
+
+    // the last exposure's pixel (i, j) is the anchor's (i - dx, j - dy); the
+    // pixels no exposure covers are the mean level
+    int i0 = (dx > 0) ? dx : 0, i1 = (dx < 0) ? w + dx : w;
+    for (int j = 0; j < h; j++) {
+        int ja = j - dy;
+        if (ja < 0 || ja >= h) {
+            memset(out + j*w, fill, w);
+            continue;
+        }
+        memset(out + j*w, fill, i0);
+        memset(out + j*w + i1, fill, w - i1);
+
+        for (int i = i0; i < i1; i++) {
+            int a = i - dx + ja*w;
+            int n = stack->count[a];
+            double v = level + (stack->sum[a] - n*level)*scale[n];
+            out[i + j*w] = (v <= 0) ? 0 : (v >= 255) ? 255 :
+                           (unsigned char) (v + 0.5);
+        }
+    }
+}
+
+/* Function to add an exposure to the stack: registers it with the anchor by
+** the shift of its blobs from the anchor's, takes the oldest exposure out if
+** the ring is full, and makes the stacked image. An exposure that does not
+** match the anchor (or is of another readout, or rotated too far to register
+** by a shift) starts a new stack.
+** Input: The stack, the exposure, its readout geometry, its mask (from
+** findBlobs()), its mean level, and its blobs (y from the bottom, brightest
+** first) and their number.
+** Output: The number of exposures in the stacked image, or -1 if the stack
+** could not be allocated.
+*/
+int stackFrame(struct frame_stack * stack, char * image,
+               const struct camera_geometry * geometry,
+               const unsigned char * mask, double mean, double * star_x,
+               double * star_y, int blob_count) {
+    int w = geometry->width, h = geometry->height;
+    struct image_motion motion;
+    struct timespec lap;
+    int dx = 0, dy = 0;
+
+    pthread_once(&stack_once, setStackKernel);
+    clock_gettime(CLOCK_MONOTONIC, &lap);
+
+    if (w*h > stack->width*stack->height || allocFrameStack(stack) != 1) {
+        return -1;
+    }
+
+    if (stack->frames > 0 && !sameReadout(geometry, &stack->geometry)) {
+        resetFrameStack(stack);
+    }
+
+    if (stack->frames > 0) {
+        if (matchBlobs(&stack->anchor, star_x, star_y, blob_count, geometry,
+                       &motion) == 1 &&
+            fabs(motion.rotation)*hypot(w, h)/2.0 <= STACK_MAX_SMEAR) {
+            // the shift of the center of the image (the blob y axis is up,
+            // the rows go down)
+            double c = cos(motion.rotation), s = sin(motion.rotation);
+            double cx = w/2.0, cy = h/2.0;
+            dx = (int) lround(c*cx - s*cy + motion.dx - cx);
+            dy = (int) -lround(s*cx + c*cy + motion.dy - cy);
+        } else {
+            if (verbose) {
+                printf("(*) Exposure does not match the stack, starting a new "
+                       "one.\n");
+            }
+            resetFrameStack(stack);
+        }
+    }
+
+    if (stack->frames == 0) {
+        stack->geometry = *geometry;
+        memset(stack->sum, 0, w*h*sizeof(uint16_t));
+        memset(stack->count, 0, w*h);
+        rememberBlobs(&stack->anchor, star_x, star_y, blob_count, geometry);
+    }
+
+    // the oldest exposure makes room for this one
+    if (stack->frames == stack_frames) {
+        stackExposure(stack, stack->next, 1);
+        stack->frames--;
+    }
+
+    int slot = stack->next;
+    for (int j = 0; j < h; j++) {
+        memcpy(stack->images[slot] + j*w, image + j*geometry->stride, w);
+    }
+    memcpy(stack->masks[slot], mask, w*h);
+    stack->dx[slot] = dx;
+    stack->dy[slot] = dy;
+    stack->means[slot] = mean;
+    stackExposure(stack, slot, 0);
+    stack->next = (slot + 1) % stack_frames;
+    stack->frames++;
+
+    composeStack(stack);
+    perfLap(PERF_STACK, &lap);
+
+    if (verbose) {
+        printf("(*) Stacked %d exposure(s), the last %d, %d px from the "
+               "first.\n", stack->frames, dx, dy);
+    }
+
+    return stack->frames;
+}
+
+/* Function to free the sums, the stacked image and the ring of a stack.
+** Input: The stack.
+** Output: None (void).
+*/
+void freeFrameStack(struct frame_stack * stack) {
+    free(stack->sum);
+    free(stack->count);
+    free(stack->image);
+    stack->sum = NULL;
+    stack->count = NULL;
+    stack->image = NULL;
+
+    for (int k = 0; k < stack->ring_alloc; k++) {
+        free(stack->images[k]);
+        free(stack->masks[k]);
+        stack->images[k] = stack->masks[k] = NULL;
+    }
+    stack->ring_alloc = 0;
+    stack->frames = 0;
+    stack->next = 0;
+
+    freeBlobReference(&stack->anchor);
+}
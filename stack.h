@@ -0,0 +1,50 @@
+#ifndef STACK_H
+#define STACK_H
+
+#include <stdint.h>
+
+#include "pipeline.h"
+#include "propagate.h"
+
+// most exposures that can be stacked (the sums of that many 8-bit pixels fit
+// in 16 bits)
+#define STACK_MAX_FRAMES 16
+// an exposure the stack has rotated by more than this at the corners of the
+// image starts a new stack (it is registered by a shift only) [px]
+#define STACK_MAX_SMEAR  1.0
+
+/* The last few exposures, registered with the first (the anchor) by the shift
+** of their blobs from its blobs, and summed. Pixels are in the anchor's image
+** coordinates (rows from the top) unless noted (start zeroed) */
+struct frame_stack {
+    int width, height;          // of the sensor (the largest image) [px]
+    struct camera_geometry geometry; // readout of the stacked exposures
+    int frames;                 // exposures in the ring
+    int next;                   // ring slot of the next exposure
+    // sums of the unmasked pixels of the exposures in the ring, and how many
+    // exposures each sum is of
+    uint16_t * sum;
+    uint8_t * count;
+    // each exposure (packed) and its mask, where it is from the anchor
+    // (columns, rows) [px], and its mean level
+    unsigned char * images[STACK_MAX_FRAMES], * masks[STACK_MAX_FRAMES];
+    int dx[STACK_MAX_FRAMES], dy[STACK_MAX_FRAMES];
+    double means[STACK_MAX_FRAMES];
+    int ring_alloc;             // exposures the ring has space for
+    // the stacked image, in the image coordinates of the last exposure
+    char * image;
+    // the anchor's brightest blobs
+    struct blob_reference anchor;
+};
+
+extern int stack_frames;
+
+void initFrameStack(struct frame_stack * stack, int width, int height);
+void resetFrameStack(struct frame_stack * stack);
+int stackFrame(struct frame_stack * stack, char * image,
+               const struct camera_geometry * geometry,
+               const unsigned char * mask, double mean, double * star_x,
+               double * star_y, int blob_count);
+void freeFrameStack(struct frame_stack * stack);
+
+#endif
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <ueye.h>
+
+#include "stream.h"
+#include "camera.h"
+#include "pipeline.h"
+
+// rows of the compressed image code each pixel's difference from the pixel to
+// its left with a Rice code; after this many ones the zigzagged difference is
+// written out in 8 bits instead
+#define RICE_ESCAPE  15
+
+/* Function to fill in the defaults of a subscription and keep it in bounds.
+** Input: The subscription.
+** Output: None (void).
+*/
+void normalizeSubscription(struct subscription * subscription) {
+    if (subscription->stream < 0 || subscription->stream >= NUM_STREAMS) {
+        subscription->stream = STREAM_FULL;
+    }
+
+    if (subscription->stream == STREAM_PREVIEW) {
+        if (subscription->arg < 2) {
+            subscription->arg = 4;
+        } else if (subscription->arg > MAX_PREVIEW_BIN) {
+            subscription->arg = MAX_PREVIEW_BIN;
+        }
+    } else if (subscription->stream == STREAM_CUTOUTS) {
+        if (subscription->arg < 1) {
+            subscription->arg = 10;
+        } else if (subscription->arg > MAX_CUTOUTS) {
+            subscription->arg = MAX_CUTOUTS;
+        }
+    } else {
+        subscription->arg = 0;
+    }
+}
+
+/* Bit writer for the compressed image */
+struct bit_writer {
+    unsigned char * out;
+    size_t pos;
+    uint64_t acc;
+    int num_bits;
+};
+
+/* Helper function to append the low bits of a value to a bit stream.
+** Input: The writer, the value, and the number of bits (at most 24).
+** Output: None (void).
+*/
+static inline void putBits(struct bit_writer * writer, uint32_t value,
+                           int num_bits) {
+    writer->acc = (writer->acc << num_bits) | value;
+    writer->num_bits += num_bits;
+    while (writer->num_bits >= 8) {
+        writer->num_bits -= 8;
+        writer->out[writer->pos++] = (writer->acc >> writer->num_bits) & 0xff;
+    }
+}
+
+/* Function to losslessly compress an 8-bit image. Every row starts with its
+** Rice parameter k (4 bits), chosen from the mean size of its differences,
+** then each pixel's difference from its left neighbour (the pixel above, for
+** the first column) is zigzagged to z and coded as z >> k ones, a zero, and
+** the low k bits of z; a difference that would take RICE_ESCAPE or more ones
+** is written as RICE_ESCAPE ones and z in 8 bits.
+** Input: The image, its dimensions, and where to write the code (at least
+** 3*width*height + height bytes).
+** Output: The size of the code [bytes].
+*/
+size_t compressImage(unsigned char * image, int width, int height,
+                     unsigned char * out) {
+    struct bit_writer writer = {out, 0, 0, 0};
+    unsigned char z[width];
+
+    for (int j = 0; j < height; j++) {
+        unsigned char * row = image + j*width;
+        uint32_t sum = 0;
+        int k = 0;
+
+        for (int i = 0; i < width; i++) {
+            int prediction = (i > 0) ? row[i - 1] : ((j > 0) ? row[i - width]
+                                                             : 0);
+            int8_t d = (int8_t) (row[i] - prediction);
+            z[i] = (unsigned char) (((uint8_t) d << 1) ^ (d >> 7));
+            sum += z[i];
+        }
+
+        while (k < 7 && ((uint32_t) width << (k + 1)) <= sum) {
+            k++;
+        }
+        putBits(&writer, k, 4);
+
+        for (int i = 0; i < width; i++) {
+            uint32_t q = z[i] >> k;
+            if (q < RICE_ESCAPE) {
+                putBits(&writer, ((1u << q) - 1) << 1, q + 1);
+                putBits(&writer, z[i] & ((1u << k) - 1), k);
+            } else {
+                putBits(&writer, (1u << RICE_ESCAPE) - 1, RICE_ESCAPE);
+                putBits(&writer, z[i], 8);
+            }
+        }
+    }
+
+    if (writer.num_bits > 0) {
+        putBits(&writer, 0, 8 - writer.num_bits);
+    }
+
+    return writer.pos;
+}
+
+/* Function to undo compressImage() (for clients, and for checking the code).
+** Input: The code, its size, the image dimensions, and where to write the
+** image.
+** Output: A flag indicating the code was decoded successfully or was cut off.
+*/
+int decompressImage(unsigned char * in, size_t size, int width, int height,
+                    unsigned char * image) {
+    size_t pos = 0;
+    uint64_t acc = 0;
+    int num_bits = 0;
+
+// take bits off the front of the code, bailing out if there are none left
+#define GET_BITS(value, n) do {                                    \
+        while (num_bits < (int) (n)) {                             \
+            if (pos == size) {                                     \
+                return -1;                                         \
+            }                                                      \
+            acc = (acc << 8) | in[pos++];                          \
+            num_bits += 8;                                         \
+        }                                                          \
+        num_bits -= (int) (n);                                     \
+        (value) = (acc >> num_bits) & ((1u << (n)) - 1);           \
+    } while (0)
+
+    for (int j = 0; j < height; j++) {
+        unsigned char * row = image + j*width;
+        uint32_t k;
+
+        GET_BITS(k, 4);
+        for (int i = 0; i < width; i++) {
+            uint32_t q = 0, bit, z, low;
+            int prediction = (i > 0) ? row[i - 1] : ((j > 0) ? row[i - width]
+                                                             : 0);
+
+            do {
+                GET_BITS(bit, 1);
+                q += bit;
+            } while (bit && q < RICE_ESCAPE);
+
+            if (q == RICE_ESCAPE) {
+                GET_BITS(z, 8);
+            } else {
+                low = 0;
+                if (k > 0) {
+                    GET_BITS(low, k);
+                }
+                z = (q << k) | low;
+            }
+
+            int d = (z >> 1) ^ -(int) (z & 1);
+            row[i] = (unsigned char) (prediction + d);
+        }
+    }
+#undef GET_BITS
+
+    return 1;
+}
+
+/* Function to encode a frame for one kind of subscription.
+** Input: The frame (or NULL), the image to encode (the frame's output, or a
+** blank image), the subscription, and the payload to fill in.
+** Output: A flag indicating the payload was made successfully or not.
+*/
+int encodeStream(struct frame * frame, char * image,
+                 struct subscription * subscription,
+                 struct stream_payload * payload) {
+    unsigned char * pixels = (unsigned char *) image;
+    int blob_count = (frame != NULL) ? frame->blob_count : 0;
+    // the image of a frame is its AOI (the blank image is the whole sensor)
+    int w = (frame != NULL) ? frame->geometry.width : CAMERA_WIDTH;
+    int h = (frame != NULL) ? frame->geometry.height : CAMERA_HEIGHT;
+    struct stream_header header = {0};
+    size_t capacity = sizeof(header);
+    char * body;
+
+    header.stream = subscription->stream;
+    switch (subscription->stream) {
+        case STREAM_BLOBS:
+            header.count = blob_count;
+            capacity += 3*sizeof(double)*blob_count;
+            break;
+        case STREAM_PREVIEW:
+            header.width = w/subscription->arg;
+            header.height = h/subscription->arg;
+            capacity += header.width*header.height;
+            break;
+        case STREAM_CUTOUTS:
+            header.width = CUTOUT_SIZE;
+            header.height = CUTOUT_SIZE;
+            header.count = (blob_count < subscription->arg) ? blob_count :
+                                                              subscription->arg;
+            capacity += header.count*(2*sizeof(int32_t) +
+                                      CUTOUT_SIZE*CUTOUT_SIZE);
+            break;
+        case STREAM_COMPRESSED:
+            header.width = w;
+            header.height = h;
+            capacity += 3*w*h + h;
+            break;
+    }
+
+    payload->subscription = *subscription;
+    if ((payload->data = malloc(capacity)) == NULL) {
+        fprintf(stderr, "Error allocating stream payload: %s.\n",
+                strerror(errno));
+        return -1;
+    }
+    body = payload->data + sizeof(header);
+
+    switch (subscription->stream) {
+        case STREAM_BLOBS:
+            for (int b = 0; b < blob_count; b++) {
+                double blob[3] = {frame->star_x[b], frame->star_y[b],
+                                  frame->star_mags[b]};
+                memcpy(body + b*sizeof(blob), blob, sizeof(blob));
+            }
+            header.size = 3*sizeof(double)*blob_count;
+            break;
+        case STREAM_PREVIEW: {
+            int bin = subscription->arg;
+            for (int pj = 0; pj < header.height; pj++) {
+                for (int pi = 0; pi < header.width; pi++) {
+                    int sum = 0;
+                    for (int j = pj*bin; j < (pj + 1)*bin; j++) {
+                        for (int i = pi*bin; i < (pi + 1)*bin; i++) {
+                            sum += pixels[i + j*w];
+                        }
+                    }
+                    body[pi + pj*header.width] = sum/(bin*bin);
+                }
+            }
+            header.size = header.width*header.height;
+            break;
+        }
+        case STREAM_CUTOUTS: {
+            // the blobs are sorted brightest first
+            char * cutout = body;
+            for (int b = 0; b < header.count; b++) {
+                int32_t corner[2];
+                corner[0] = (int32_t) frame->star_x[b] - CUTOUT_SIZE/2;
+                corner[1] = (int32_t) frame->star_y[b] - CUTOUT_SIZE/2;
+                if (corner[0] < 0) corner[0] = 0;
+                if (corner[1] < 0) corner[1] = 0;
+                if (corner[0] > w - CUTOUT_SIZE) {
+                    corner[0] = w - CUTOUT_SIZE;
+                }
+                if (corner[1] > h - CUTOUT_SIZE) {
+                    corner[1] = h - CUTOUT_SIZE;
+                }
+
+                memcpy(cutout, corner, sizeof(corner));
+                cutout += sizeof(corner);
+                for (int j = 0; j < CUTOUT_SIZE; j++) {
+                    memcpy(cutout, image + corner[0] + (corner[1] + j)*w,
+                           CUTOUT_SIZE);
+                    cutout += CUTOUT_SIZE;
+                }
+            }
+            header.size = cutout - body;
+            break;
+        }
+        case STREAM_COMPRESSED:
+            header.size = compressImage(pixels, w, h, (unsigned char *) body);
+            break;
+    }
+
+    memcpy(payload->data, &header, sizeof(header));
+    payload->size = sizeof(header) + header.size;
+
+    return 1;
+}
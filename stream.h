@@ -0,0 +1,63 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// what a client is sent after the telemetry (the stream field of its commands)
+#define STREAM_FULL        0     // the whole image, as is (no stream header)
+#define STREAM_TELEMETRY   1     // nothing but the stream header
+#define STREAM_BLOBS       2     // the blob list
+#define STREAM_PREVIEW     3     // the image binned by stream_arg (default 4)
+#define STREAM_CUTOUTS     4     // cutouts around the stream_arg brightest
+                                 // blobs (default 10)
+#define STREAM_COMPRESSED  5     // the whole image, losslessly compressed
+#define NUM_STREAMS        6
+// bounds on stream_arg
+#define MAX_PREVIEW_BIN    16
+#define MAX_CUTOUTS        64
+// side of the square cutouts [px]
+#define CUTOUT_SIZE        32
+
+struct frame;
+
+/* What a client has subscribed to */
+struct subscription {
+    int stream;                 // one of the STREAM_* values
+    int arg;                    // binning factor or number of cutouts
+};
+
+#pragma pack(push, 1)
+/* Sent after the telemetry for every stream but STREAM_FULL, followed by size
+** bytes of payload:
+** - STREAM_BLOBS: count blobs as three doubles each (x, y, magnitude)
+** - STREAM_PREVIEW: width x height bytes, each the mean of an arg x arg bin
+** - STREAM_CUTOUTS: count cutouts, each two int32s (left column and top row of
+**   the cutout in the image) and then width x height bytes
+** - STREAM_COMPRESSED: the width x height image coded by compressImage() */
+struct stream_header {
+    int32_t stream;
+    int32_t width;
+    int32_t height;
+    int32_t count;
+    int32_t size;
+};
+#pragma pack(pop)
+
+/* One encoding of a frame, shared by every client with the same subscription */
+struct stream_payload {
+    struct subscription subscription;
+    char * data;                // header and payload
+    size_t size;
+};
+
+void normalizeSubscription(struct subscription * subscription);
+int encodeStream(struct frame * frame, char * image,
+                 struct subscription * subscription,
+                 struct stream_payload * payload);
+size_t compressImage(unsigned char * image, int width, int height,
+                     unsigned char * out);
+int decompressImage(unsigned char * in, size_t size, int width, int height,
+                    unsigned char * image);
+
+#endif
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "workers.h"
+
+// number of threads working on each job, including the one that submits it
+int num_workers = 4;
+
+pthread_t worker_thread_ids[MAX_WORKERS];
+int worker_indices[MAX_WORKERS];
+int workers_started = 0;
+int workers_stopping = 0;
+// the current job, protected by work_lock
+pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+stripe_task work_task = NULL;
+void * work_arg = NULL;
+int work_generation = 0;
+int work_stripes = 0, work_next = 0, work_finished = 0;
+// held by the thread whose job is running, so threads with jobs of their own
+// (the blob-finding of different cameras) take the workers in turn
+pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Helper function to run stripes of the current job until none are left.
+** Input: The index of the worker.
+** Output: None (void).
+*/
+void runJobStripes(int worker) {
+    stripe_task task;
+    void * arg;
+    int stripe;
+
+    pthread_mutex_lock(&work_lock);
+    while (work_next < work_stripes) {
+        stripe = work_next++;
+        task = work_task;
+        arg = work_arg;
+        pthread_mutex_unlock(&work_lock);
+
+        task(stripe, worker, arg);
+
+        pthread_mutex_lock(&work_lock);
+        if (++work_finished == work_stripes) {
+            pthread_cond_signal(&work_done);
+        }
+    }
+    pthread_mutex_unlock(&work_lock);
+}
+
+/* Function for the worker threads: waits for a job and helps run it.
+** Input: The index of the worker.
+** Output: None (void).
+*/
+void * workerThread(void * arg) {
+    int worker = *((int *) arg);
+    int seen = 0;
+
+    pthread_mutex_lock(&work_lock);
+    while (1) {
+        while (work_generation == seen && !workers_stopping) {
+            pthread_cond_wait(&work_ready, &work_lock);
+        }
+
+        if (workers_stopping) {
+            break;
+        }
+
+        seen = work_generation;
+        pthread_mutex_unlock(&work_lock);
+        runJobStripes(worker);
+        pthread_mutex_lock(&work_lock);
+    }
+    pthread_mutex_unlock(&work_lock);
+
+    return NULL;
+}
+
+/* Function to start the worker threads. The thread that submits a job works on
+** it too, so num_workers - 1 threads are started.
+** Input: None.
+** Output: A flag indicating the workers started successfully or not.
+*/
+int startWorkers() {
+    workers_stopping = 0;
+
+    for (int i = 1; i < num_workers; i++) {
+        worker_indices[i] = i;
+        if (pthread_create(&worker_thread_ids[i], NULL, workerThread,
+                           &worker_indices[i]) != 0) {
+            fprintf(stderr, "Error creating worker thread: %s.\n",
+                    strerror(errno));
+            stopWorkers();
+            return -1;
+        }
+        workers_started = i;
+    }
+
+    return 1;
+}
+
+/* Function to stop and join the worker threads.
+** Input: None.
+** Output: None (void).
+*/
+void stopWorkers() {
+    pthread_mutex_lock(&work_lock);
+    workers_stopping = 1;
+    pthread_cond_broadcast(&work_ready);
+    pthread_mutex_unlock(&work_lock);
+
+    for (int i = 1; i <= workers_started; i++) {
+        pthread_join(worker_thread_ids[i], NULL);
+    }
+    workers_started = 0;
+}
+
+/* Function to run a task on every stripe of an image and wait for all of them
+** to finish. Only one job runs at a time: a thread that submits one while
+** another thread's is running waits for it. Tasks must not submit jobs.
+** Input: The task, its argument, and the number of stripes.
+** Output: None (void).
+*/
+void runStripes(stripe_task task, void * arg, int num_stripes) {
+    if (workers_started == 0) {
+        for (int s = 0; s < num_stripes; s++) {
+            task(s, 0, arg);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&submit_lock);
+    pthread_mutex_lock(&work_lock);
+    work_task = task;
+    work_arg = arg;
+    work_stripes = num_stripes;
+    work_next = 0;
+    work_finished = 0;
+    work_generation++;
+    pthread_cond_broadcast(&work_ready);
+    pthread_mutex_unlock(&work_lock);
+
+    runJobStripes(0);
+
+    pthread_mutex_lock(&work_lock);
+    while (work_finished < work_stripes) {
+        pthread_cond_wait(&work_done, &work_lock);
+    }
+    pthread_mutex_unlock(&work_lock);
+    pthread_mutex_unlock(&submit_lock);
+}
+
+/* Helper function to get the rows of a stripe.
+** Input: The stripe, the number of stripes, the rows being striped [j0, j1),
+** and where to store the stripe's rows [ja, jb).
+** Output: None (void).
+*/
+void stripeRows(int stripe, int num_stripes, int j0, int j1, int * ja,
+                int * jb) {
+    *ja = j0 + (stripe*(j1 - j0))/num_stripes;
+    *jb = j0 + ((stripe + 1)*(j1 - j0))/num_stripes;
+}
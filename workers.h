@@ -0,0 +1,22 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+// most threads that can share the image-processing work
+#define MAX_WORKERS    16
+// every image is cut into this many horizontal stripes, however many threads
+// there are, so sums over the stripes are the same for any thread count
+#define NUM_STRIPES    16
+
+extern int num_workers;
+
+/* Work on one stripe: the stripe index, the index of the worker running it
+** (0 to num_workers - 1, for per-thread scratch space), and the job argument */
+typedef void (* stripe_task)(int stripe, int worker, void * arg);
+
+int startWorkers();
+void stopWorkers();
+void runStripes(stripe_task task, void * arg, int num_stripes);
+void stripeRows(int stripe, int num_stripes, int j0, int j1, int * ja,
+                int * jb);
+
+#endif